@@ -0,0 +1,1812 @@
+#define _GNU_SOURCE
+
+#include "tiny2-containers.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+#include <threads.h>
+#endif
+
+#define BENCH_N 1000000
+
+static double bench_now() {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+static void bench_report(const char* name, double start, double end, size_t ops, size_t check) {
+  printf("%-36s %10.2f ns/op  (check %zu)\n", name, (end - start) / (double) ops, check);
+}
+
+static TCVector* bench_strings(size_t n) {
+  TCVector* v = $new(TCVector, n, 0);
+  char buf[32];
+  for (size_t i = 0; i < n; ++i) {
+    snprintf(buf, sizeof(buf), "%zu", i);
+    TCString* s = $str(buf);
+    $(TCVector, v, push_back, (TObject*) s);
+    $unref(s);
+  }
+  return v;
+}
+
+void bench_accessors() {
+  TCVector* v = bench_strings(BENCH_N);
+  size_t sum = 0;
+  double t0, t1;
+
+  t0 = bench_now();
+  for (size_t i = 0; i < v->len; ++i) {
+    TCString* s = (TCString*) $(TCVector, v, get, i);
+    sum += $(TCString, s, size);
+    $unref(s);
+  }
+  t1 = bench_now();
+  bench_report("vector get + string size ($)", t0, t1, v->len, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (size_t i = 0; i < tc_vector_len_fast(v); ++i) {
+    sum += tc_string_len_fast((TCString*) tc_vector_at_borrowed(v, i));
+  }
+  t1 = bench_now();
+  bench_report("vector get + string size (borrowed)", t0, t1, v->len, sum);
+
+  TCList* l = $new(TCList);
+  for (size_t i = 0; i < v->len; ++i) {
+    $(TCList, l, append, v->arr[i]);
+  }
+
+  sum = 0;
+  t0 = bench_now();
+  TCListNode* n = l->head;
+  if (n != NULL) $ref(n);
+  while (n != NULL) {
+    TCString* s = (TCString*) $(TCListNode, n, obj);
+    sum += $(TCString, s, size);
+    $unref(s);
+    TCListNode* next = $(TCListNode, n, next);
+    $unref(n);
+    n = next;
+  }
+  t1 = bench_now();
+  bench_report("list walk ($)", t0, t1, v->len, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (n = l->head; n != NULL; n = tc_list_node_next_borrowed(n)) {
+    sum += tc_string_len_fast((TCString*) tc_list_node_obj_borrowed(n));
+  }
+  t1 = bench_now();
+  bench_report("list walk (borrowed)", t0, t1, v->len, sum);
+
+  $unref(l);
+  $unref(v);
+}
+
+void bench_teardown() {
+  TCVector* src = bench_strings(BENCH_N);
+  double t0, t1;
+
+  TCVector* v = $new(TCVector, BENCH_N, 0);
+  t0 = bench_now();
+  for (size_t i = 0; i < src->len; ++i) {
+    $(TCVector, v, push_back, src->arr[i]);
+  }
+  t1 = bench_now();
+  bench_report("vector fill (push_back)", t0, t1, src->len, v->len);
+
+  t0 = bench_now();
+  for (size_t i = 0; i < v->len; ++i) {
+    $unref(v->arr[i]);
+  }
+  v->len = 0;
+  t1 = bench_now();
+  bench_report("vector release (one by one)", t0, t1, src->len, 0);
+  $unref(v);
+
+  v = $new(TCVector, BENCH_N, 0);
+  t0 = bench_now();
+  $(TCVector, v, push_back_many, src->arr, src->len);
+  t1 = bench_now();
+  bench_report("vector fill (push_back_many)", t0, t1, src->len, v->len);
+
+  t0 = bench_now();
+  $(TCVector, v, clear);
+  t1 = bench_now();
+  bench_report("vector release (clear)", t0, t1, src->len, 0);
+  $unref(v);
+
+  t0 = bench_now();
+  $unref(src);
+  t1 = bench_now();
+  bench_report("vector teardown with last refs", t0, t1, BENCH_N, 0);
+}
+
+void bench_refcount() {
+  TCString* s = $str("shared");
+  size_t sum = 0;
+  double t0, t1;
+
+  t0 = bench_now();
+  for (size_t i = 0; i < BENCH_N; ++i) {
+    $ref(s);
+    sum += tc_string_len_fast(s);
+    $unref(s);
+  }
+  t1 = bench_now();
+  bench_report("$ref/$unref", t0, t1, BENCH_N, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (size_t i = 0; i < BENCH_N; ++i) {
+    tc_ref(s);
+    sum += tc_string_len_fast(s);
+    tc_unref(s);
+  }
+  t1 = bench_now();
+  bench_report("tc_ref/tc_unref", t0, t1, BENCH_N, sum);
+
+  $unref(s);
+}
+
+static bool bench_list_iter(TCList* list, TCListNode* n, void* sum) {
+  *(size_t*) sum += tc_string_len_fast((TCString*) tc_list_node_obj_borrowed(n));
+  return true;
+}
+
+static bool bench_chunk_list_iter(TCChunkList* list, TObject* obj, size_t* sum) {
+  *sum += tc_string_len_fast((TCString*) obj);
+  return true;
+}
+
+void bench_lists() {
+  TCVector* v = bench_strings(BENCH_N);
+  size_t sum = 0;
+  double t0, t1;
+
+  TCList* l = $new(TCList);
+  t0 = bench_now();
+  for (size_t i = 0; i < v->len; ++i) {
+    $(TCList, l, append, v->arr[i]);
+  }
+  t1 = bench_now();
+  bench_report("TCList append", t0, t1, v->len, 0);
+
+  TCChunkList* cl = $new(TCChunkList);
+  t0 = bench_now();
+  for (size_t i = 0; i < v->len; ++i) {
+    $(TCChunkList, cl, append, v->arr[i]);
+  }
+  t1 = bench_now();
+  bench_report("TCChunkList append", t0, t1, v->len, cl->len);
+
+  t0 = bench_now();
+  $(TCList, l, foreach, (TCListIterator) bench_list_iter, (TObject*) &sum);
+  t1 = bench_now();
+  bench_report("TCList foreach", t0, t1, v->len, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  $(TCChunkList, cl, foreach, (TCChunkListIterator) bench_chunk_list_iter, &sum);
+  t1 = bench_now();
+  bench_report("TCChunkList foreach", t0, t1, v->len, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (TCIter it = tc_list_iter_begin(l); !tc_list_iter_done(&it); tc_list_iter_next(&it)) {
+    sum += tc_string_len_fast((TCString*) tc_list_iter_current(&it));
+  }
+  t1 = bench_now();
+  bench_report("TCList TCIter", t0, t1, v->len, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (TCIter it = tc_chunk_list_iter_begin(cl); !tc_chunk_list_iter_done(&it); tc_chunk_list_iter_next(&it)) {
+    sum += tc_string_len_fast((TCString*) tc_chunk_list_iter_current(&it));
+  }
+  t1 = bench_now();
+  bench_report("TCChunkList TCIter", t0, t1, v->len, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (TCChunk* c = cl->head; c != NULL; c = c->next) {
+    for (size_t i = 0; i < c->len; ++i) {
+      sum += tc_string_len_fast((TCString*) c->items[i]);
+    }
+  }
+  t1 = bench_now();
+  bench_report("TCChunkList walk (borrowed)", t0, t1, v->len, sum);
+
+  t0 = bench_now();
+  $unref(l);
+  t1 = bench_now();
+  bench_report("TCList teardown", t0, t1, v->len, 0);
+
+  t0 = bench_now();
+  $unref(cl);
+  t1 = bench_now();
+  bench_report("TCChunkList teardown", t0, t1, v->len, 0);
+
+  $unref(v);
+}
+
+static bool bench_pipe_odd(TObject* o, void* userdata) {
+  return tc_string_len_fast((TCString*) o) % 2 == 1;
+}
+
+static TObject* bench_pipe_self(TObject* o, void* userdata) {
+  return o;
+}
+
+void bench_pipes() {
+  TCVector* v = bench_strings(BENCH_N);
+  double t0, t1;
+
+  t0 = bench_now();
+  TCVector* tmp = $new(TCVector, 0, 0);
+  for (size_t i = 0; i < v->len; ++i) {
+    if (bench_pipe_odd(v->arr[i], NULL)) $(TCVector, tmp, push_back, v->arr[i]);
+  }
+  TCVector* out = $new(TCVector, 0, 0);
+  for (size_t i = 0; i < tmp->len; ++i) {
+    $(TCVector, out, push_back, bench_pipe_self(tmp->arr[i], NULL));
+  }
+  $unref(tmp);
+  t1 = bench_now();
+  bench_report("filter + map via temporary vector", t0, t1, v->len, out->len);
+  $unref(out);
+
+  TCPipe p;
+  out = $new(TCVector, 0, 0);
+  t0 = bench_now();
+  tc_pipe_init(&p, tc_pipe_source_vector(v));
+  tc_pipe_map(tc_pipe_filter(&p, bench_pipe_odd, NULL), bench_pipe_self, NULL, false);
+  tc_pipe_collect_into(&p, out);
+  t1 = bench_now();
+  bench_report("filter + map via TCPipe", t0, t1, v->len, out->len);
+  $unref(out);
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+  out = $new(TCVector, 0, 0);
+  t0 = bench_now();
+  tc_pipe_init(&p, tc_pipe_source_vector(v));
+  tc_pipe_map(tc_pipe_filter(&p, bench_pipe_odd, NULL), bench_pipe_self, NULL, false);
+  tc_pipe_collect_into_parallel(&p, out, 4);
+  t1 = bench_now();
+  bench_report("filter + map via TCPipe, 4 threads", t0, t1, v->len, out->len);
+  $unref(out);
+#endif
+
+  $unref(v);
+}
+
+void bench_cache() {
+  TCVector* v = bench_strings(BENCH_N / 10);
+  const TCCachePolicy policies[2] = { TC_CACHE_LRU, TC_CACHE_SIEVE };
+  const char* names[2] = { "TCCache get, LRU (90% capacity)", "TCCache get, SIEVE (90% capacity)" };
+
+  for (int p = 0; p < 2; ++p) {
+    TCCache* c = $new(TCCache, policies[p], v->len * 9 / 10);
+    for (size_t i = 0; i < v->len; ++i) {
+      $(TCCache, c, put, tc_string_str_fast((TCString*) v->arr[i]), v->arr[i]);
+    }
+
+    size_t x = 1;
+    double t0 = bench_now();
+    for (size_t i = 0; i < BENCH_N; ++i) {
+      x = x * 6364136223846793005ull + 1442695040888963407ull;
+      TCString* key = (TCString*) v->arr[(x >> 33) % v->len];
+      TObject* o = $(TCCache, c, get, tc_string_str_fast(key));
+      if (o != NULL) {
+        $unref(o);
+      } else {
+        $(TCCache, c, put, tc_string_str_fast(key), (TObject*) key);
+      }
+    }
+    double t1 = bench_now();
+    bench_report(names[p], t0, t1, BENCH_N, c->hits);
+
+    $unref(c);
+  }
+
+  $unref(v);
+}
+
+static int bench_cmp_double(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+static void bench_latency_report(const char* name, double* samples, size_t n) {
+  size_t hist[32] = { 0 };
+  for (size_t i = 0; i < n; ++i) {
+    size_t b = 0;
+    while (b < 31 && ((size_t) 1 << (b + 1)) <= (size_t) samples[i]) ++b;
+    ++hist[b];
+  }
+  qsort(samples, n, sizeof(double), bench_cmp_double);
+  printf("%-36s p50 %.0f ns  p99 %.0f ns  p99.9 %.0f ns  max %.0f ns\n", name,
+         samples[n / 2], samples[n * 99 / 100], samples[n * 999 / 1000], samples[n - 1]);
+  printf("%-36s", "  histogram (ns: count)");
+  for (size_t b = 0; b < 32; ++b) {
+    if (hist[b] != 0) printf(" <%zu:%zu", (size_t) 1 << (b + 1), hist[b]);
+  }
+  printf("\n");
+}
+
+void bench_map_latency() {
+  TCVector* v = bench_strings(BENCH_N);
+  double* samples = (double*) malloc(sizeof(double) * v->len);
+
+  for (int incremental = 0; incremental < 2; ++incremental) {
+    TCMap* m = $new(TCMap);
+    m->incremental = incremental;
+    for (size_t i = 0; i < v->len; ++i) {
+      double t0 = bench_now();
+      $(TCMap, m, set, tc_string_str_fast((TCString*) v->arr[i]), v->arr[i]);
+      samples[i] = bench_now() - t0;
+    }
+    bench_latency_report(incremental ? "TCMap insert, incremental rehash" : "TCMap insert, full rehash", samples, v->len);
+    $unref(m);
+  }
+
+  free(samples);
+  $unref(v);
+}
+
+/* Looks up batches of random keys against maps of growing size, one `get`
+ * per key against one `get_many` per batch. The largest table is well past
+ * the last level cache, where nearly every lookup misses. */
+void bench_map_batch() {
+  static const size_t sizes[] = { 10000, 1000000, 4000000 };
+  const size_t batch = 10000;
+  const size_t rounds = 100;
+  const char** keys = (const char**) malloc(sizeof(char*) * batch);
+  TObject** out = (TObject**) malloc(sizeof(TObject*) * batch);
+  char name[64];
+
+  for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); ++z) {
+    TCVector* v = bench_strings(sizes[z]);
+    TCMap* m = $new(TCMap);
+    for (size_t i = 0; i < v->len; i += batch) {
+      for (size_t j = 0; j < batch && i + j < v->len; ++j) keys[j] = tc_string_str_fast((TCString*) v->arr[i + j]);
+      $(TCMap, m, set_many, keys, (TObject* const*) v->arr + i, (v->len - i < batch ? v->len - i : batch));
+    }
+
+    uint64_t rng = 88172645463325252ull;
+    size_t sum = 0;
+    double get_ns = 0, many_ns = 0;
+    for (size_t r = 0; r < rounds; ++r) {
+      for (size_t j = 0; j < batch; ++j) {
+        rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+        keys[j] = tc_string_str_fast((TCString*) v->arr[rng % v->len]);
+      }
+
+      double t0 = bench_now();
+      for (size_t j = 0; j < batch; ++j) {
+        TObject* o = $(TCMap, m, get, keys[j]);
+        sum += tc_string_len_fast((TCString*) o);
+        $unref(o);
+      }
+      double t1 = bench_now();
+      $(TCMap, m, get_many, keys, batch, out);
+      for (size_t j = 0; j < batch; ++j) {
+        sum += tc_string_len_fast((TCString*) out[j]);
+        $unref(out[j]);
+      }
+      double t2 = bench_now();
+      get_ns += t1 - t0;
+      many_ns += t2 - t1;
+    }
+
+    snprintf(name, sizeof(name), "TCMap get, %zu keys", sizes[z]);
+    bench_report(name, 0, get_ns, batch * rounds, sum);
+    snprintf(name, sizeof(name), "TCMap get_many, %zu keys", sizes[z]);
+    bench_report(name, 0, many_ns, batch * rounds, sum);
+
+    $unref(m);
+    $unref(v);
+  }
+
+  free(out);
+  free(keys);
+}
+
+/* Publishing a new version after every update: a deep copy of a TCMap
+ * against a TCPersistentMap `set`, which copies only the key's path. */
+void bench_persistent_map() {
+  const size_t n = 100000;
+  const size_t snapshots = 20;
+  TCVector* v = bench_strings(n);
+  size_t sum = 0;
+  double t0, t1;
+
+  TCMap* m = $new(TCMap);
+  for (size_t i = 0; i < n; ++i) $(TCMap, m, set, tc_string_str_fast((TCString*) v->arr[i]), v->arr[i]);
+  t0 = bench_now();
+  for (size_t r = 0; r < snapshots; ++r) {
+    TCMap* copy = $new(TCMap);
+    for (TCIter it = tc_map_iter_begin(m); !tc_map_iter_done(&it); tc_map_iter_next(&it)) {
+      TCMapPair* p = tc_map_iter_current(&it);
+      $(TCMap, copy, set, p->key, p->value);
+    }
+    $(TCMap, copy, set, "0", v->arr[r]);
+    sum += copy->pairs->len;
+    $unref(copy);
+  }
+  t1 = bench_now();
+  bench_report("TCMap deep copy per update", t0, t1, snapshots, sum);
+  $unref(m);
+
+  TCPersistentMap* empty = $new(TCPersistentMap);
+  t0 = bench_now();
+  TCPersistentMap* pm = $(TCPersistentMap, empty, edit);
+  for (size_t i = 0; i < n; ++i) $(TCPersistentMap, pm, set_mut, tc_string_str_fast((TCString*) v->arr[i]), v->arr[i]);
+  $(TCPersistentMap, pm, freeze);
+  t1 = bench_now();
+  bench_report("TCPersistentMap transient build", t0, t1, n, pm->count);
+  $unref(empty);
+
+  sum = 0;
+  t0 = bench_now();
+  for (size_t i = 0; i < n; ++i) {
+    TCPersistentMap* next = $(TCPersistentMap, pm, set, tc_string_str_fast((TCString*) v->arr[(i * 7919) % n]), v->arr[i]);
+    sum += next->count;
+    $unref(pm);
+    pm = next;
+  }
+  t1 = bench_now();
+  bench_report("TCPersistentMap set per update", t0, t1, n, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (size_t i = 0; i < n; ++i) {
+    TObject* o = $(TCPersistentMap, pm, get, tc_string_str_fast((TCString*) v->arr[(i * 7919) % n]));
+    sum += tc_string_len_fast((TCString*) o);
+    $unref(o);
+  }
+  t1 = bench_now();
+  bench_report("TCPersistentMap get", t0, t1, n, sum);
+
+  $unref(pm);
+  $unref(v);
+}
+
+/* Handing out a read-only copy of a large vector: an eager copy against a
+ * snapshot, including the producer's first write after it. */
+void bench_snapshots() {
+  const size_t rounds = 100;
+  TCVector* v = bench_strings(BENCH_N);
+  size_t sum = 0;
+  double t0, t1;
+
+  t0 = bench_now();
+  for (size_t r = 0; r < rounds; ++r) {
+    TCVector* copy = $new(TCVector, v->len, 0);
+    $(TCVector, copy, push_back_many, v->arr, v->len);
+    sum += copy->len;
+    $unref(copy);
+  }
+  t1 = bench_now();
+  bench_report("TCVector eager copy", t0, t1, rounds, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (size_t r = 0; r < rounds; ++r) {
+    TCVector* snap = $(TCVector, v, snapshot);
+    sum += snap->len;
+    $unref(snap);
+  }
+  t1 = bench_now();
+  bench_report("TCVector snapshot", t0, t1, rounds, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (size_t r = 0; r < rounds; ++r) {
+    TCVector* snap = $(TCVector, v, snapshot);
+    $(TCVector, v, push_back, v->arr[r]);
+    sum += snap->len;
+    $unref(snap);
+  }
+  t1 = bench_now();
+  bench_report("TCVector snapshot + producer write", t0, t1, rounds, sum);
+
+  $unref(v);
+}
+
+/* Startup: rebuilding a dictionary entry by entry against mapping its
+ * serialized form, then looking keys up in each. */
+void bench_serialization() {
+  TCVector* v = bench_strings(BENCH_N);
+  size_t sum = 0;
+  double t0, t1;
+
+  t0 = bench_now();
+  TCMap* m = $new(TCMap);
+  for (size_t i = 0; i < v->len; ++i) {
+    TCString* value = $str(tc_string_str_fast((TCString*) v->arr[v->len - 1 - i]));
+    $(TCMap, m, set, tc_string_str_fast((TCString*) v->arr[i]), (TObject*) value);
+    $unref(value);
+  }
+  t1 = bench_now();
+  bench_report("rebuild TCMap (per entry)", t0, t1, v->len, m->pairs->len);
+
+  t0 = bench_now();
+  bool ok = tc_serialize_file("tc-bench.bin", (TObject*) m);
+  t1 = bench_now();
+  bench_report("serialize TCMap (per entry)", t0, t1, v->len, ok);
+
+  TCMapped mapped;
+  t0 = bench_now();
+  ok = tc_mapped_open(&mapped, "tc-bench.bin", false);
+  t1 = bench_now();
+  bench_report("tc_mapped_open (per entry)", t0, t1, v->len, ok);
+  tc_mapped_close(&mapped);
+
+  t0 = bench_now();
+  ok = tc_mapped_open(&mapped, "tc-bench.bin", true);
+  t1 = bench_now();
+  bench_report("tc_mapped_open, verified (per entry)", t0, t1, v->len, ok);
+
+  t0 = bench_now();
+  for (size_t i = 0; i < v->len; ++i) {
+    TObject* o = $(TCMap, m, get, tc_string_str_fast((TCString*) v->arr[(i * 7919) % v->len]));
+    sum += tc_string_len_fast((TCString*) o);
+    $unref(o);
+  }
+  t1 = bench_now();
+  bench_report("TCMap get", t0, t1, v->len, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (size_t i = 0; i < v->len; ++i) {
+    size_t len;
+    tc_mapped_string(&mapped, tc_mapped_map_get(&mapped, mapped.root, tc_string_str_fast((TCString*) v->arr[(i * 7919) % v->len])), &len);
+    sum += len;
+  }
+  t1 = bench_now();
+  bench_report("tc_mapped_map_get", t0, t1, v->len, sum);
+
+  tc_mapped_close(&mapped);
+  remove("tc-bench.bin");
+  $unref(m);
+  $unref(v);
+}
+
+void bench_frozen_map() {
+  TCVector* v = bench_strings(BENCH_N);
+  size_t sum = 0;
+  double t0, t1;
+
+  TCMap* m = $new(TCMap);
+  for (size_t i = 0; i < v->len; ++i) $(TCMap, m, set, tc_string_str_fast((TCString*) v->arr[i]), v->arr[i]);
+
+  t0 = bench_now();
+  TCFrozenMap* f = $(TCMap, m, freeze);
+  t1 = bench_now();
+  bench_report("TCFrozenMap build (per key)", t0, t1, v->len, f->len);
+  printf("%-36s %10.2f bytes/key (index and keys)\n", "TCFrozenMap size",
+         (double) (sizeof(TCFrozenMapEntry) * f->len + sizeof(uint32_t) * f->n_buckets + f->keys_size) / (double) f->len);
+
+  t0 = bench_now();
+  for (size_t i = 0; i < v->len; ++i) {
+    TObject* o = $(TCMap, m, get, tc_string_str_fast((TCString*) v->arr[(i * 7919) % v->len]));
+    sum += tc_string_len_fast((TCString*) o);
+    $unref(o);
+  }
+  t1 = bench_now();
+  bench_report("TCMap get", t0, t1, v->len, sum);
+
+  sum = 0;
+  t0 = bench_now();
+  for (size_t i = 0; i < v->len; ++i) {
+    TObject* o = $(TCFrozenMap, f, get, tc_string_str_fast((TCString*) v->arr[(i * 7919) % v->len]));
+    sum += tc_string_len_fast((TCString*) o);
+    $unref(o);
+  }
+  t1 = bench_now();
+  bench_report("TCFrozenMap get", t0, t1, v->len, sum);
+
+  $unref(f);
+  $unref(m);
+  $unref(v);
+}
+
+static void bench_journal_clean() {
+  remove("tc-bench-journal.snap");
+  remove("tc-bench-journal.snap.tmp");
+  remove("tc-bench-journal.log");
+  remove("tc-bench-journal.log.new");
+}
+
+/* Sustained updates over a working set of keys, one remove per 8 sets. */
+static void bench_journal_run(const char* name, TCVector* v, size_t ops, size_t commit_every, uint64_t compact_size) {
+  bench_journal_clean();
+  TCMap* m = $new(TCMap);
+  TCJournal* j = NULL;
+  if (commit_every > 0) {
+    j = $new(TCJournal, "tc-bench-journal");
+    $(TCJournal, j, open, (TObject*) m);
+    j->commit_every = commit_every;
+    j->compact_size = compact_size;
+  }
+
+  double t0 = bench_now();
+  for (size_t i = 0; i < ops; ++i) {
+    const char* key = tc_string_str_fast((TCString*) v->arr[(i * 7919) % v->len]);
+    if (i % 8 == 7) {
+      $(TCMap, m, remove, key);
+    } else {
+      $(TCMap, m, set, key, v->arr[i % v->len]);
+    }
+  }
+  if (j != NULL) $(TCJournal, j, commit);
+  double t1 = bench_now();
+  bench_report(name, t0, t1, ops, m->pairs->len + (j != NULL && !j->failed));
+
+  if (j != NULL) $unref(j);
+  $unref(m);
+}
+
+void bench_journal() {
+  TCVector* v = bench_strings(100000);
+
+  bench_journal_run("TCMap set/remove, no journal", v, BENCH_N, 0, 0);
+  bench_journal_run("journaled, commit every 1", v, BENCH_N / 100, 1, 0);
+  bench_journal_run("journaled, commit every 64", v, BENCH_N, 64, 0);
+  bench_journal_run("journaled, commit every 1024", v, BENCH_N, 1024, 0);
+  bench_journal_run("journaled, commit every 16384", v, BENCH_N, 16384, 0);
+  bench_journal_run("journaled, 1024, compact at 8 MB", v, 4 * BENCH_N, 1024, (uint64_t) 8 << 20);
+
+  TCMap* m = $new(TCMap);
+  TCJournal* j = $new(TCJournal, "tc-bench-journal");
+  double t0 = bench_now();
+  bool ok = $(TCJournal, j, open, (TObject*) m);
+  double t1 = bench_now();
+  bench_report("recover snapshot + log (per entry)", t0, t1, m->pairs->len, ok);
+  $unref(j);
+  $unref(m);
+  bench_journal_clean();
+
+  $unref(v);
+}
+
+/* Bytes per element without (shallow) and with (deep) the elements, and
+ * how many times the shallow size is that of a bare pointer array. */
+static void bench_memory_report(const char* name, TObject* c, size_t n) {
+  size_t shallow = tc_memory_usage(c, false);
+  size_t deep = tc_memory_usage(c, true);
+  printf("%-36s %8.1f B/elem  deep %8.1f B/elem  overhead %5.2fx\n", name,
+         (double) shallow / (double) n, (double) deep / (double) n,
+         (double) shallow / (double) (n * sizeof(TObject*)));
+}
+
+void bench_memory() {
+  size_t n = BENCH_N / 10;
+  TCVector* v = bench_strings(n);
+
+  bench_memory_report("TCVector", (TObject*) v, n);
+
+  TCList* l = $new(TCList);
+  TCQueue* q = $new(TCQueue, n);
+  TCChunkList* cl = $new(TCChunkList);
+  TCMap* m = $new(TCMap);
+  TCHash* h = $new(TCHash);
+  TCCache* cache = $new(TCCache, TC_CACHE_LRU, n);
+  TCPersistentMap* empty = $new(TCPersistentMap);
+  TCPersistentMap* pm = $(TCPersistentMap, empty, edit);
+  for (size_t i = 0; i < n; ++i) {
+    TObject* s = v->arr[i];
+    const char* key = tc_string_str_fast((TCString*) s);
+    $(TCList, l, append, s);
+    $(TCQueue, q, push, s);
+    $(TCChunkList, cl, append, s);
+    $(TCMap, m, set, key, s);
+    $(TCHash, h, set, (uint64_t) i, s);
+    $(TCCache, cache, put, key, s);
+    $(TCPersistentMap, pm, set_mut, key, s);
+  }
+  $(TCPersistentMap, pm, freeze);
+  TCFrozenMap* f = $(TCMap, m, freeze);
+
+  bench_memory_report("TCList", (TObject*) l, n);
+  bench_memory_report("TCQueue", (TObject*) q, n);
+  bench_memory_report("TCChunkList", (TObject*) cl, n);
+  bench_memory_report("TCMap", (TObject*) m, n);
+  bench_memory_report("TCHash", (TObject*) h, n);
+  bench_memory_report("TCCache", (TObject*) cache, n);
+  bench_memory_report("TCPersistentMap", (TObject*) pm, n);
+  bench_memory_report("TCFrozenMap", (TObject*) f, n);
+#if defined(TC_THREADSAFE_REFCOUNT)
+  TCConcurrentHash* ch = $new(TCConcurrentHash, 0);
+  for (size_t i = 0; i < n; ++i) {
+    $(TCConcurrentHash, ch, put, tc_string_str_fast((TCString*) v->arr[i]), v->arr[i]);
+  }
+  bench_memory_report("TCConcurrentHash", (TObject*) ch, n);
+  $unref(ch);
+#endif
+
+  $unref(f);
+  $unref(pm);
+  $unref(empty);
+  $unref(cache);
+  $unref(h);
+  $unref(m);
+  $unref(cl);
+  $unref(q);
+  $unref(l);
+  $unref(v);
+}
+
+/* The suite (`tc-bench suite`) times every basic container operation at
+ * sizes from 10 up to 10^7 and writes the results to CSV or JSON for
+ * diffing between builds. Runs are reproducible: keys and random indices
+ * come from fixed seeds, and each measurement starts from a fresh
+ * container. */
+
+#define BENCH_SUITE_SAMPLES 100000
+#define BENCH_SUITE_WORK 100000000
+#define BENCH_SUITE_SAMPLE_CAP (1 << 20)
+#define BENCH_SUITE_KEY_LEN 24
+
+typedef struct BenchSuite {
+  size_t n;
+  uint64_t rng;
+  size_t sum;
+  TObject* value;
+  TCString* piece;
+  TCString* str;
+  TCVector* vec;
+  TCQueue* queue;
+  TCMap* map;
+  TCList* list;
+} BenchSuite;
+
+typedef void (*BenchSuiteFunc)(BenchSuite* s);
+typedef void (*BenchSuiteOp)(BenchSuite* s, size_t i);
+
+/* `linear` marks operations whose cost grows with the container size.
+ * They run a bounded number of times against a container of that size;
+ * the others run once per element, building or draining it, over enough
+ * rounds to collect BENCH_SUITE_SAMPLES samples. */
+typedef struct BenchSuiteCase {
+  const char* name;
+  bool linear;
+  BenchSuiteFunc setup;
+  BenchSuiteOp op;
+} BenchSuiteCase;
+
+typedef struct BenchSuiteResult {
+  const char* name;
+  size_t size;
+  size_t ops;
+  double ns_per_op;
+  double p50;
+  double p99;
+  double p999;
+} BenchSuiteResult;
+
+static char* bench_suite_keys = NULL;
+
+#define BENCH_SUITE_KEY(i) (bench_suite_keys + (i) * BENCH_SUITE_KEY_LEN)
+
+static uint64_t bench_suite_random(BenchSuite* s) {
+  s->rng ^= s->rng << 13;
+  s->rng ^= s->rng >> 7;
+  s->rng ^= s->rng << 17;
+  return s->rng;
+}
+
+static void bench_suite_string(BenchSuite* s) {
+  char* buf = (char*) malloc(s->n + 1);
+  memset(buf, 'x', s->n);
+  buf[s->n] = '\0';
+  s->str = $str(buf);
+  free(buf);
+}
+
+static void bench_suite_vector_empty(BenchSuite* s) {
+  s->vec = $new(TCVector, 0, 0);
+}
+
+static void bench_suite_vector_full(BenchSuite* s) {
+  s->vec = $new(TCVector, s->n, 0);
+  for (size_t i = 0; i < s->n; ++i) {
+    $(TCVector, s->vec, push_back, s->value);
+  }
+}
+
+static void bench_suite_queue_empty(BenchSuite* s) {
+  s->queue = $new(TCQueue, s->n);
+}
+
+static void bench_suite_queue_full(BenchSuite* s) {
+  s->queue = $new(TCQueue, s->n);
+  for (size_t i = 0; i < s->n; ++i) {
+    $(TCQueue, s->queue, push, s->value);
+  }
+}
+
+static void bench_suite_map_empty(BenchSuite* s) {
+  s->map = $new(TCMap);
+}
+
+static void bench_suite_map_full(BenchSuite* s) {
+  s->map = $new(TCMap);
+  for (size_t i = 0; i < s->n; ++i) {
+    $(TCMap, s->map, set, BENCH_SUITE_KEY(i), s->value);
+  }
+}
+
+static void bench_suite_list_empty(BenchSuite* s) {
+  s->list = $new(TCList);
+}
+
+static void bench_suite_list_full(BenchSuite* s) {
+  s->list = $new(TCList);
+  for (size_t i = 0; i < s->n; ++i) {
+    $(TCList, s->list, append, s->value);
+  }
+}
+
+static void bench_suite_teardown(BenchSuite* s) {
+  if (s->str != NULL) $unref(s->str);
+  if (s->vec != NULL) $unref(s->vec);
+  if (s->queue != NULL) $unref(s->queue);
+  if (s->map != NULL) $unref(s->map);
+  if (s->list != NULL) $unref(s->list);
+  s->str = NULL;
+  s->vec = NULL;
+  s->queue = NULL;
+  s->map = NULL;
+  s->list = NULL;
+}
+
+static void bench_suite_string_append(BenchSuite* s, size_t i) {
+  $(TCString, s->str, append, s->piece);
+}
+
+static void bench_suite_string_copy(BenchSuite* s, size_t i) {
+  TCString* c = $(TCString, s->str, copy);
+  s->sum += tc_string_len_fast(c);
+  $unref(c);
+}
+
+static void bench_suite_vector_push(BenchSuite* s, size_t i) {
+  $(TCVector, s->vec, push_back, s->value);
+}
+
+static void bench_suite_vector_pop_back(BenchSuite* s, size_t i) {
+  $unref($(TCVector, s->vec, pop_back));
+}
+
+static void bench_suite_vector_pop_front(BenchSuite* s, size_t i) {
+  $unref($(TCVector, s->vec, pop_front));
+}
+
+static void bench_suite_vector_insert(BenchSuite* s, size_t i) {
+  $(TCVector, s->vec, insert, s->value, s->vec->len / 2);
+}
+
+static void bench_suite_vector_get(BenchSuite* s, size_t i) {
+  TObject* o = $(TCVector, s->vec, get, bench_suite_random(s) % s->n);
+  s->sum += (o != NULL);
+  $unref(o);
+}
+
+static void bench_suite_queue_push(BenchSuite* s, size_t i) {
+  $(TCQueue, s->queue, push, s->value);
+}
+
+static void bench_suite_queue_pop(BenchSuite* s, size_t i) {
+  $unref($(TCQueue, s->queue, pop));
+}
+
+static void bench_suite_map_set(BenchSuite* s, size_t i) {
+  $(TCMap, s->map, set, BENCH_SUITE_KEY(i), s->value);
+}
+
+static void bench_suite_map_get(BenchSuite* s, size_t i) {
+  TObject* o = $(TCMap, s->map, get, BENCH_SUITE_KEY(bench_suite_random(s) % s->n));
+  s->sum += (o != NULL);
+  $unref(o);
+}
+
+static void bench_suite_map_rename(BenchSuite* s, size_t i) {
+  $(TCMap, s->map, rename, BENCH_SUITE_KEY(i), BENCH_SUITE_KEY(s->n + i));
+}
+
+static void bench_suite_map_remove(BenchSuite* s, size_t i) {
+  $(TCMap, s->map, remove, BENCH_SUITE_KEY(i));
+}
+
+static void bench_suite_list_append(BenchSuite* s, size_t i) {
+  $(TCList, s->list, append, s->value);
+}
+
+static void bench_suite_list_remove(BenchSuite* s, size_t i) {
+  $(TCList, s->list, remove, s->list->head);
+}
+
+static bool bench_suite_list_count(TCList* list, TCListNode* n, void* sum) {
+  ++*(size_t*) sum;
+  return true;
+}
+
+static void bench_suite_list_foreach(BenchSuite* s, size_t i) {
+  $(TCList, s->list, foreach, (TCListIterator) bench_suite_list_count, (TObject*) &s->sum);
+}
+
+static const BenchSuiteCase bench_suite_cases[] = {
+  { "TCString append", true, bench_suite_string, bench_suite_string_append },
+  { "TCString copy", true, bench_suite_string, bench_suite_string_copy },
+  { "TCVector push_back", false, bench_suite_vector_empty, bench_suite_vector_push },
+  { "TCVector pop_back", true, bench_suite_vector_full, bench_suite_vector_pop_back },
+  { "TCVector pop_front", false, bench_suite_vector_full, bench_suite_vector_pop_front },
+  { "TCVector insert (middle)", true, bench_suite_vector_full, bench_suite_vector_insert },
+  { "TCVector get (random)", false, bench_suite_vector_full, bench_suite_vector_get },
+  { "TCQueue push", false, bench_suite_queue_empty, bench_suite_queue_push },
+  { "TCQueue pop", false, bench_suite_queue_full, bench_suite_queue_pop },
+  { "TCMap set", false, bench_suite_map_empty, bench_suite_map_set },
+  { "TCMap get (random)", false, bench_suite_map_full, bench_suite_map_get },
+  { "TCMap rename", false, bench_suite_map_full, bench_suite_map_rename },
+  { "TCMap remove", false, bench_suite_map_full, bench_suite_map_remove },
+  { "TCList append", false, bench_suite_list_empty, bench_suite_list_append },
+  { "TCList remove (head)", false, bench_suite_list_full, bench_suite_list_remove },
+  { "TCList foreach (whole list)", true, bench_suite_list_full, bench_suite_list_foreach },
+};
+
+/* Runs `ops` operations in rounds of at most `per_round`, rebuilding the
+ * container before each round. With `samples` set, every `stride`-th
+ * operation is timed on its own; otherwise only the total is. */
+static double bench_suite_pass(const BenchSuiteCase* c, BenchSuite* s, size_t ops, size_t per_round,
+                               double* samples, size_t stride, double overhead) {
+  double total = 0;
+  size_t done = 0;
+  size_t taken = 0;
+  s->rng = 0x9e3779b97f4a7c15ULL;
+  while (done < ops) {
+    size_t round = (ops - done < per_round ? ops - done : per_round);
+    c->setup(s);
+    double t0 = bench_now();
+    if (samples == NULL) {
+      for (size_t i = 0; i < round; ++i) c->op(s, i);
+    } else {
+      for (size_t i = 0; i < round; ++i) {
+        if ((done + i) % stride != 0) {
+          c->op(s, i);
+          continue;
+        }
+        double o0 = bench_now();
+        c->op(s, i);
+        double d = bench_now() - o0 - overhead;
+        samples[taken++] = (d > 0 ? d : 0);
+      }
+    }
+    total += bench_now() - t0;
+    bench_suite_teardown(s);
+    done += round;
+  }
+  return total;
+}
+
+static BenchSuiteResult bench_suite_run(const BenchSuiteCase* c, BenchSuite* s, size_t n, double overhead) {
+  size_t ops;
+  if (c->linear) {
+    ops = BENCH_SUITE_WORK / n;
+    if (ops > BENCH_SUITE_SAMPLES) ops = BENCH_SUITE_SAMPLES;
+    if (ops < 16) ops = 16;
+  } else {
+    ops = (n > BENCH_SUITE_SAMPLES ? n : (BENCH_SUITE_SAMPLES + n - 1) / n * n);
+  }
+  /* At most n operations per fresh container, so draining operations never
+   * run dry and growing ones never more than double it. */
+  size_t per_round = (ops < n ? ops : n);
+
+  BenchSuiteResult r = { c->name, n, ops, 0, 0, 0, 0 };
+  r.ns_per_op = bench_suite_pass(c, s, ops, per_round, NULL, 1, 0) / (double) ops;
+
+  size_t stride = (ops + BENCH_SUITE_SAMPLE_CAP - 1) / BENCH_SUITE_SAMPLE_CAP;
+  size_t count = (ops + stride - 1) / stride;
+  double* samples = (double*) malloc(sizeof(double) * count);
+  bench_suite_pass(c, s, ops, per_round, samples, stride, overhead);
+  qsort(samples, count, sizeof(double), bench_cmp_double);
+  r.p50 = samples[count / 2];
+  r.p99 = samples[count * 99 / 100];
+  r.p999 = samples[count * 999 / 1000];
+  free(samples);
+
+  return r;
+}
+
+/* The cost of reading the clock twice, subtracted from every sample. */
+static double bench_suite_timer_overhead() {
+  double samples[10001];
+  for (size_t i = 0; i < 10001; ++i) {
+    double t0 = bench_now();
+    samples[i] = bench_now() - t0;
+  }
+  qsort(samples, 10001, sizeof(double), bench_cmp_double);
+  return samples[5000];
+}
+
+/* A sysfs knob changed for the run and put back afterwards. */
+typedef struct BenchKnob {
+  char path[128];
+  char saved[64];
+  bool changed;
+} BenchKnob;
+
+static bool bench_knob_set(BenchKnob* k, const char* path, const char* value) {
+  snprintf(k->path, sizeof(k->path), "%s", path);
+  k->changed = false;
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return false;
+  bool read = (fgets(k->saved, sizeof(k->saved), f) != NULL);
+  fclose(f);
+  if (!read) return false;
+  k->saved[strcspn(k->saved, "\n")] = '\0';
+  f = fopen(path, "w");
+  if (f == NULL) return false;
+  k->changed = (fputs(value, f) >= 0);
+  k->changed = (fclose(f) == 0) && k->changed;
+  return k->changed;
+}
+
+static void bench_knob_restore(BenchKnob* k) {
+  if (!k->changed) return;
+  FILE* f = fopen(k->path, "w");
+  if (f != NULL) {
+    fputs(k->saved, f);
+    fclose(f);
+  }
+  k->changed = false;
+}
+
+/* Pins the process to `cpu`, switches its frequency governor to
+ * `performance` and turns off turbo boost, as far as the platform and the
+ * permissions allow. Whatever could not be done is reported and skipped. */
+static void bench_suite_pin(int cpu, BenchKnob knobs[3]) {
+  memset(knobs, 0, sizeof(BenchKnob) * 3);
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    fprintf(stderr, "tc-bench: cannot pin to cpu %d\n", cpu);
+  }
+
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+  if (!bench_knob_set(&knobs[0], path, "performance")) {
+    fprintf(stderr, "tc-bench: cannot set the performance governor, frequency scaling stays on\n");
+  }
+  if (!bench_knob_set(&knobs[1], "/sys/devices/system/cpu/intel_pstate/no_turbo", "1") &&
+      !bench_knob_set(&knobs[2], "/sys/devices/system/cpu/cpufreq/boost", "0")) {
+    fprintf(stderr, "tc-bench: cannot disable turbo boost\n");
+  }
+#else
+  fprintf(stderr, "tc-bench: pinning is not supported on this platform\n");
+#endif
+}
+
+static void bench_suite_write_csv(const char* path, BenchSuiteResult* results, size_t n) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "tc-bench: cannot write %s\n", path);
+    return;
+  }
+  fprintf(f, "benchmark,size,ops,ns_per_op,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+  for (size_t i = 0; i < n; ++i) {
+    BenchSuiteResult* r = &results[i];
+    fprintf(f, "\"%s\",%zu,%zu,%.2f,%.0f,%.0f,%.0f,%.0f\n", r->name, r->size, r->ops,
+            r->ns_per_op, 1e9 / r->ns_per_op, r->p50, r->p99, r->p999);
+  }
+  fclose(f);
+}
+
+static void bench_suite_write_json(const char* path, BenchSuiteResult* results, size_t n,
+                                   int cpu, BenchKnob knobs[3], double overhead) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "tc-bench: cannot write %s\n", path);
+    return;
+  }
+  fprintf(f, "{\n  \"config\": {\"cpu\": %d, \"governor\": %s, \"turbo_disabled\": %s, \"timer_overhead_ns\": %.1f},\n",
+          cpu, knobs[0].changed ? "\"performance\"" : "null",
+          (knobs[1].changed || knobs[2].changed) ? "true" : "false", overhead);
+  fprintf(f, "  \"results\": [\n");
+  for (size_t i = 0; i < n; ++i) {
+    BenchSuiteResult* r = &results[i];
+    fprintf(f, "    {\"benchmark\": \"%s\", \"size\": %zu, \"ops\": %zu, \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f, "
+            "\"p50_ns\": %.0f, \"p99_ns\": %.0f, \"p999_ns\": %.0f}%s\n", r->name, r->size, r->ops,
+            r->ns_per_op, 1e9 / r->ns_per_op, r->p50, r->p99, r->p999, (i + 1 < n ? "," : ""));
+  }
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+}
+
+static int bench_suite_usage() {
+  fprintf(stderr, "usage: tc-bench suite [--min N] [--max N] [--filter TEXT] [--csv FILE] [--json FILE] [--pin CPU]\n");
+  return 2;
+}
+
+int bench_suite(int argc, char** argv) {
+  size_t min = 10;
+  size_t max = 1000000;
+  const char* filter = NULL;
+  const char* csv = NULL;
+  const char* json = NULL;
+  int cpu = -1;
+  for (int i = 0; i < argc; ++i) {
+    if (i + 1 >= argc) return bench_suite_usage();
+    const char* arg = argv[i++];
+    if (strcmp(arg, "--min") == 0) min = strtoull(argv[i], NULL, 10);
+    else if (strcmp(arg, "--max") == 0) max = strtoull(argv[i], NULL, 10);
+    else if (strcmp(arg, "--filter") == 0) filter = argv[i];
+    else if (strcmp(arg, "--csv") == 0) csv = argv[i];
+    else if (strcmp(arg, "--json") == 0) json = argv[i];
+    else if (strcmp(arg, "--pin") == 0) cpu = atoi(argv[i]);
+    else return bench_suite_usage();
+  }
+  if (min == 0 || max < min) return bench_suite_usage();
+
+  BenchKnob knobs[3];
+  memset(knobs, 0, sizeof(knobs));
+  if (cpu >= 0) bench_suite_pin(cpu, knobs);
+
+  /* Renames move key i to key n + i, so there are twice as many keys. */
+  bench_suite_keys = (char*) malloc(max * 2 * BENCH_SUITE_KEY_LEN);
+  for (size_t i = 0; i < max * 2; ++i) {
+    snprintf(BENCH_SUITE_KEY(i), BENCH_SUITE_KEY_LEN, "k%zu", i);
+  }
+
+  BenchSuite s;
+  memset(&s, 0, sizeof(s));
+  s.value = (TObject*) $str("value");
+  s.piece = $str("appended");
+
+  size_t ncases = sizeof(bench_suite_cases) / sizeof(bench_suite_cases[0]);
+  size_t cap = 0, count = 0;
+  BenchSuiteResult* results = NULL;
+  double overhead = bench_suite_timer_overhead();
+  printf("%-36s %9s %14s %10s %10s %10s\n", "benchmark", "size", "ops/sec", "p50 ns", "p99 ns", "p99.9 ns");
+  for (size_t c = 0; c < ncases; ++c) {
+    if (filter != NULL && strstr(bench_suite_cases[c].name, filter) == NULL) continue;
+    for (size_t n = min; n <= max; n *= 10) {
+      if (count == cap) {
+        cap = (cap == 0 ? 64 : cap * 2);
+        results = (BenchSuiteResult*) realloc(results, sizeof(BenchSuiteResult) * cap);
+      }
+      s.n = n;
+      BenchSuiteResult r = bench_suite_run(&bench_suite_cases[c], &s, n, overhead);
+      results[count++] = r;
+      printf("%-36s %9zu %14.0f %10.0f %10.0f %10.0f\n", r.name, r.size, 1e9 / r.ns_per_op, r.p50, r.p99, r.p999);
+      if (n > max / 10) break;
+    }
+  }
+
+  if (csv != NULL) bench_suite_write_csv(csv, results, count);
+  if (json != NULL) bench_suite_write_json(json, results, count, cpu, knobs, overhead);
+
+  for (size_t i = 0; i < 3; ++i) bench_knob_restore(&knobs[i]);
+  free(results);
+  free(bench_suite_keys);
+  $unref(s.piece);
+  $unref(s.value);
+  return 0;
+}
+
+/* Traces are text files of container operations, one per line, so that
+ * applications can record their own load and `tc-bench replay` can run it
+ * against the library with timing. `tc-bench trace-gen` writes synthetic
+ * ones with uniform or Zipfian keys.
+ *
+ *   tc-trace 1             format header, first line
+ *   # text                 comment
+ *   phase NAME             ops below are reported under NAME
+ *   new ID map|hash        create a container
+ *   new ID queue CAPACITY
+ *   set ID KEY [SIZE]      TCMap set, or TCHash set when KEY is a number;
+ *                          the value is a string of SIZE bytes (default 16)
+ *   get ID KEY
+ *   remove ID KEY          TCMap only
+ *   rename ID KEY NEW_KEY  TCMap only
+ *   push ID [SIZE]         TCQueue only
+ *   pop ID                 TCQueue only
+ *
+ * Keys cannot contain whitespace. */
+
+#define BENCH_TRACE_PHASES 16
+
+typedef enum BenchTraceKind {
+  BENCH_TRACE_MAP,
+  BENCH_TRACE_HASH,
+  BENCH_TRACE_QUEUE
+} BenchTraceKind;
+
+typedef enum BenchTraceOpcode {
+  BENCH_TRACE_NEW,
+  BENCH_TRACE_SET,
+  BENCH_TRACE_GET,
+  BENCH_TRACE_REMOVE,
+  BENCH_TRACE_RENAME,
+  BENCH_TRACE_PUSH,
+  BENCH_TRACE_POP,
+  BENCH_TRACE_OPCODES
+} BenchTraceOpcode;
+
+static const char* bench_trace_opcodes[] = { "new", "set", "get", "remove", "rename", "push", "pop" };
+
+typedef struct BenchTraceOp {
+  uint8_t opcode;
+  uint8_t kind;
+  uint8_t phase;
+  uint32_t id;
+  uint64_t hash;
+  size_t size;
+  char* key;
+  char* new_key;
+  TObject* value;
+} BenchTraceOp;
+
+typedef struct BenchTrace {
+  BenchTraceOp* ops;
+  size_t len;
+  size_t alloc;
+  uint32_t containers;
+  char* phases[BENCH_TRACE_PHASES];
+  size_t nphases;
+  /* One shared value string per distinct size, keyed by the size. */
+  TCHash* values;
+} BenchTrace;
+
+static TObject* bench_trace_value(BenchTrace* t, size_t size) {
+  TObject* value = $(TCHash, t->values, get, (uint64_t) size);
+  if (value != NULL) {
+    $unref(value);
+    return value;
+  }
+  char* buf = (char*) malloc(size + 1);
+  memset(buf, 'v', size);
+  buf[size] = '\0';
+  value = (TObject*) $str(buf);
+  free(buf);
+  $(TCHash, t->values, set, (uint64_t) size, value);
+  $unref(value);
+  return value;
+}
+
+static void bench_trace_free(BenchTrace* t) {
+  for (size_t i = 0; i < t->len; ++i) {
+    free(t->ops[i].key);
+    free(t->ops[i].new_key);
+  }
+  for (size_t i = 0; i < t->nphases; ++i) free(t->phases[i]);
+  free(t->ops);
+  if (t->values != NULL) $unref(t->values);
+}
+
+static bool bench_trace_error(const char* path, size_t line, const char* what) {
+  fprintf(stderr, "tc-bench: %s:%zu: %s\n", path, line, what);
+  return false;
+}
+
+static bool bench_trace_parse(BenchTrace* t, const char* path, size_t line, char* text, uint8_t* kinds, size_t nkinds) {
+  char* words[5];
+  size_t n = 0;
+  for (char* w = strtok(text, " \t\r\n"); w != NULL && n < 5; w = strtok(NULL, " \t\r\n")) {
+    words[n++] = w;
+  }
+  if (n == 0 || words[0][0] == '#') return true;
+
+  if (strcmp(words[0], "phase") == 0) {
+    if (n != 2) return bench_trace_error(path, line, "expected `phase NAME`");
+    if (t->nphases == BENCH_TRACE_PHASES) return bench_trace_error(path, line, "too many phases");
+    t->phases[t->nphases++] = strdup(words[1]);
+    return true;
+  }
+
+  BenchTraceOp op;
+  memset(&op, 0, sizeof(op));
+  op.opcode = BENCH_TRACE_OPCODES;
+  for (uint8_t i = 0; i < BENCH_TRACE_OPCODES; ++i) {
+    if (strcmp(words[0], bench_trace_opcodes[i]) == 0) op.opcode = i;
+  }
+  if (op.opcode == BENCH_TRACE_OPCODES) return bench_trace_error(path, line, "unknown operation");
+  if (n < 2) return bench_trace_error(path, line, "missing container id");
+  char* end;
+  unsigned long id = strtoul(words[1], &end, 10);
+  if (*end != '\0' || id >= nkinds) return bench_trace_error(path, line, "bad container id");
+  op.id = (uint32_t) id;
+  op.phase = (uint8_t) (t->nphases > 0 ? t->nphases - 1 : 0);
+
+  if (op.opcode == BENCH_TRACE_NEW) {
+    if (n < 3) return bench_trace_error(path, line, "expected `new ID KIND`");
+    if (strcmp(words[2], "map") == 0) op.kind = BENCH_TRACE_MAP;
+    else if (strcmp(words[2], "hash") == 0) op.kind = BENCH_TRACE_HASH;
+    else if (strcmp(words[2], "queue") == 0 && n == 4) op.kind = BENCH_TRACE_QUEUE;
+    else return bench_trace_error(path, line, "expected `new ID map|hash` or `new ID queue CAPACITY`");
+    if (kinds[id] != 0xff) return bench_trace_error(path, line, "container id is already in use");
+    if (op.kind == BENCH_TRACE_QUEUE) op.size = strtoull(words[3], NULL, 10);
+    kinds[id] = op.kind;
+    if (id >= t->containers) t->containers = (uint32_t) id + 1;
+  } else {
+    if (kinds[id] == 0xff) return bench_trace_error(path, line, "container was not created");
+    op.kind = kinds[id];
+    bool queue_op = (op.opcode == BENCH_TRACE_PUSH || op.opcode == BENCH_TRACE_POP);
+    if (queue_op != (op.kind == BENCH_TRACE_QUEUE) ||
+        ((op.opcode == BENCH_TRACE_REMOVE || op.opcode == BENCH_TRACE_RENAME) && op.kind != BENCH_TRACE_MAP)) {
+      return bench_trace_error(path, line, "operation does not apply to this container");
+    }
+    size_t keys = (op.opcode == BENCH_TRACE_RENAME ? 2 : (queue_op ? 0 : 1));
+    if (n < 2 + keys) return bench_trace_error(path, line, "missing key");
+    if (keys > 0 && op.kind == BENCH_TRACE_HASH) {
+      op.hash = strtoull(words[2], &end, 10);
+      if (*end != '\0') return bench_trace_error(path, line, "TCHash keys must be numbers");
+    } else if (keys > 0) {
+      op.key = strdup(words[2]);
+      if (keys > 1) op.new_key = strdup(words[3]);
+    }
+    if (op.opcode == BENCH_TRACE_SET || op.opcode == BENCH_TRACE_PUSH) {
+      op.size = (n > 2 + keys ? strtoull(words[2 + keys], NULL, 10) : 16);
+      op.value = bench_trace_value(t, op.size);
+    }
+  }
+
+  if (t->len == t->alloc) {
+    t->alloc = (t->alloc == 0 ? 1024 : t->alloc * 2);
+    t->ops = (BenchTraceOp*) realloc(t->ops, sizeof(BenchTraceOp) * t->alloc);
+  }
+  t->ops[t->len++] = op;
+  return true;
+}
+
+/* Reads the whole trace up front, so that parsing is not timed. Container
+ * ids must be below 65536. */
+static bool bench_trace_load(BenchTrace* t, const char* path) {
+  memset(t, 0, sizeof(BenchTrace));
+  t->values = $new(TCHash);
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return bench_trace_error(path, 0, "cannot open");
+
+  const size_t nkinds = 65536;
+  uint8_t* kinds = (uint8_t*) malloc(nkinds);
+  memset(kinds, 0xff, nkinds);
+  char text[1024];
+  size_t line = 0;
+  bool ok = true;
+  if (fgets(text, sizeof(text), f) == NULL || strncmp(text, "tc-trace 1", 10) != 0) {
+    ok = bench_trace_error(path, 1, "not a tc-trace 1 file");
+  }
+  for (line = 2; ok && fgets(text, sizeof(text), f) != NULL; ++line) {
+    ok = bench_trace_parse(t, path, line, text, kinds, nkinds);
+  }
+  if (t->nphases == 0) t->phases[t->nphases++] = strdup("trace");
+
+  free(kinds);
+  fclose(f);
+  return ok;
+}
+
+static void bench_trace_exec(BenchTraceOp* op, TObject** containers) {
+  TObject* c = containers[op->id];
+  TObject* o = NULL;
+  switch (op->opcode) {
+    case BENCH_TRACE_NEW:
+      if (op->kind == BENCH_TRACE_MAP) c = (TObject*) $new(TCMap);
+      else if (op->kind == BENCH_TRACE_HASH) c = (TObject*) $new(TCHash);
+      else c = (TObject*) $new(TCQueue, op->size);
+      containers[op->id] = c;
+      break;
+    case BENCH_TRACE_SET:
+      if (op->kind == BENCH_TRACE_MAP) $(TCMap, (TCMap*) c, set, op->key, op->value);
+      else $(TCHash, (TCHash*) c, set, op->hash, op->value);
+      break;
+    case BENCH_TRACE_GET:
+      if (op->kind == BENCH_TRACE_MAP) o = $(TCMap, (TCMap*) c, get, op->key);
+      else o = $(TCHash, (TCHash*) c, get, op->hash);
+      break;
+    case BENCH_TRACE_REMOVE:
+      $(TCMap, (TCMap*) c, remove, op->key);
+      break;
+    case BENCH_TRACE_RENAME:
+      $(TCMap, (TCMap*) c, rename, op->key, op->new_key);
+      break;
+    case BENCH_TRACE_PUSH:
+      $(TCQueue, (TCQueue*) c, push, op->value);
+      break;
+    case BENCH_TRACE_POP:
+      o = $(TCQueue, (TCQueue*) c, pop);
+      break;
+  }
+  if (o != NULL) $unref(o);
+}
+
+int bench_replay(int argc, char** argv) {
+  if (argc != 1) {
+    fprintf(stderr, "usage: tc-bench replay TRACE\n");
+    return 2;
+  }
+  BenchTrace t;
+  if (!bench_trace_load(&t, argv[0])) {
+    bench_trace_free(&t);
+    return 1;
+  }
+
+  TObject** containers = (TObject**) calloc(t.containers + 1, sizeof(TObject*));
+  double* samples = (double*) malloc(sizeof(double) * (t.len + 1));
+  double overhead = bench_suite_timer_overhead();
+  double t0 = bench_now();
+  for (size_t i = 0; i < t.len; ++i) {
+    double o0 = bench_now();
+    bench_trace_exec(&t.ops[i], containers);
+    double d = bench_now() - o0 - overhead;
+    samples[i] = (d > 0 ? d : 0);
+  }
+  double t1 = bench_now();
+  for (uint32_t i = 0; i < t.containers; ++i) {
+    if (containers[i] != NULL) $unref(containers[i]);
+  }
+
+  printf("%-36s %10s %10s %10s %10s %10s\n", "phase: operation", "count", "ns/op", "p50 ns", "p99 ns", "p99.9 ns");
+  double* group = (double*) malloc(sizeof(double) * (t.len + 1));
+  for (size_t p = 0; p < t.nphases; ++p) {
+    for (uint8_t code = 0; code < BENCH_TRACE_OPCODES; ++code) {
+      size_t n = 0;
+      double sum = 0;
+      for (size_t i = 0; i < t.len; ++i) {
+        if (t.ops[i].phase != p || t.ops[i].opcode != code) continue;
+        group[n++] = samples[i];
+        sum += samples[i];
+      }
+      if (n == 0) continue;
+      qsort(group, n, sizeof(double), bench_cmp_double);
+      char name[64];
+      snprintf(name, sizeof(name), "%s: %s", t.phases[p], bench_trace_opcodes[code]);
+      printf("%-36s %10zu %10.1f %10.0f %10.0f %10.0f\n", name, n, sum / (double) n,
+             group[n / 2], group[n * 99 / 100], group[n * 999 / 1000]);
+    }
+  }
+  printf("%-36s %10zu ops in %.3f s, %.0f ops/sec\n", "total", t.len, (t1 - t0) / 1e9,
+         (double) t.len / ((t1 - t0) / 1e9));
+
+  free(group);
+  free(samples);
+  free(containers);
+  bench_trace_free(&t);
+  return 0;
+}
+
+/* Zipfian ranks by the method of Gray et al., "Quickly generating
+ * billion-record synthetic databases", as used by YCSB: rank 0 is the most
+ * popular key. */
+typedef struct BenchZipf {
+  size_t n;
+  double theta;
+  double alpha;
+  double zetan;
+  double eta;
+} BenchZipf;
+
+static double bench_random_unit(uint64_t* rng) {
+  *rng ^= *rng << 13;
+  *rng ^= *rng >> 7;
+  *rng ^= *rng << 17;
+  return (double) (*rng >> 11) / 9007199254740992.0;
+}
+
+static void bench_zipf_init(BenchZipf* z, size_t n, double theta) {
+  z->n = n;
+  z->theta = theta;
+  z->zetan = 0;
+  for (size_t i = 1; i <= n; ++i) z->zetan += 1.0 / pow((double) i, theta);
+  double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+  z->alpha = 1.0 / (1.0 - theta);
+  z->eta = (1.0 - pow(2.0 / (double) n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static size_t bench_zipf_next(BenchZipf* z, uint64_t* rng) {
+  double u = bench_random_unit(rng);
+  double uz = u * z->zetan;
+  if (uz < 1.0) return 0;
+  if (uz < 1.0 + pow(0.5, z->theta)) return 1;
+  size_t r = (size_t) ((double) z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+  return (r < z->n ? r : z->n - 1);
+}
+
+static int bench_trace_gen_usage() {
+  fprintf(stderr, "usage: tc-bench trace-gen [--container map|hash|queue] [--dist uniform|zipf] [--theta T]\n"
+                  "                          [--keys N] [--ops N] [--reads FRACTION] [--removes FRACTION]\n"
+                  "                          [--burst N] [--value-size N] [--seed N] [--out FILE]\n");
+  return 2;
+}
+
+/* Writes a load phase that fills the container with every key, then a run
+ * phase of `ops` operations: reads with probability `reads`, removes with
+ * probability `removes` (TCMap only) and sets otherwise. Which keys are
+ * hot is a seeded shuffle, so they are spread over the whole key space.
+ * Queue traces push and then pop bursts of 1 to 2 * `burst` values. */
+int bench_trace_gen(int argc, char** argv) {
+  const char* container = "map";
+  const char* dist = "zipf";
+  const char* out = NULL;
+  double theta = 0.99;
+  double reads = 0.9;
+  double removes = 0.0;
+  size_t keys = 100000;
+  size_t ops = 1000000;
+  size_t burst = 64;
+  size_t value_size = 16;
+  uint64_t seed = 1;
+  for (int i = 0; i < argc; ++i) {
+    if (i + 1 >= argc) return bench_trace_gen_usage();
+    const char* arg = argv[i++];
+    if (strcmp(arg, "--container") == 0) container = argv[i];
+    else if (strcmp(arg, "--dist") == 0) dist = argv[i];
+    else if (strcmp(arg, "--theta") == 0) theta = atof(argv[i]);
+    else if (strcmp(arg, "--keys") == 0) keys = strtoull(argv[i], NULL, 10);
+    else if (strcmp(arg, "--ops") == 0) ops = strtoull(argv[i], NULL, 10);
+    else if (strcmp(arg, "--reads") == 0) reads = atof(argv[i]);
+    else if (strcmp(arg, "--removes") == 0) removes = atof(argv[i]);
+    else if (strcmp(arg, "--burst") == 0) burst = strtoull(argv[i], NULL, 10);
+    else if (strcmp(arg, "--value-size") == 0) value_size = strtoull(argv[i], NULL, 10);
+    else if (strcmp(arg, "--seed") == 0) seed = strtoull(argv[i], NULL, 10);
+    else if (strcmp(arg, "--out") == 0) out = argv[i];
+    else return bench_trace_gen_usage();
+  }
+  bool map = (strcmp(container, "map") == 0);
+  bool hash = (strcmp(container, "hash") == 0);
+  bool queue = (strcmp(container, "queue") == 0);
+  bool zipf = (strcmp(dist, "zipf") == 0);
+  if ((!map && !hash && !queue) || (!zipf && strcmp(dist, "uniform") != 0) || keys < 2 || burst == 0 ||
+      (zipf && (theta <= 0 || theta == 1.0)) || reads < 0 || removes < 0 || reads + removes > 1 ||
+      (removes > 0 && !map)) {
+    return bench_trace_gen_usage();
+  }
+
+  FILE* f = (out != NULL ? fopen(out, "w") : stdout);
+  if (f == NULL) {
+    fprintf(stderr, "tc-bench: cannot write %s\n", out);
+    return 1;
+  }
+  /* Zero is a fixed point of xorshift. */
+  uint64_t rng = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+  fprintf(f, "tc-trace 1\n# tc-bench trace-gen --container %s --dist %s", container, dist);
+  if (zipf) fprintf(f, " --theta %g", theta);
+  fprintf(f, " --keys %zu --ops %zu --reads %g --removes %g --burst %zu --value-size %zu --seed %llu\n",
+          keys, ops, reads, removes, burst, value_size, (unsigned long long) seed);
+
+  if (queue) {
+    fprintf(f, "phase run\nnew 0 queue %zu\n", 2 * burst);
+    for (size_t done = 0; done < ops;) {
+      size_t b = 1 + (size_t) (bench_random_unit(&rng) * (double) (2 * burst));
+      if (b > 2 * burst) b = 2 * burst;
+      for (size_t i = 0; i < b; ++i) fprintf(f, "push 0 %zu\n", value_size);
+      for (size_t i = 0; i < b; ++i) fprintf(f, "pop 0\n");
+      done += 2 * b;
+    }
+  } else {
+    size_t* perm = (size_t*) malloc(sizeof(size_t) * keys);
+    for (size_t i = 0; i < keys; ++i) perm[i] = i;
+    for (size_t i = keys - 1; i > 0; --i) {
+      size_t j = (size_t) (bench_random_unit(&rng) * (double) (i + 1));
+      size_t tmp = perm[i];
+      perm[i] = perm[j];
+      perm[j] = tmp;
+    }
+    BenchZipf z;
+    memset(&z, 0, sizeof(z));
+    if (zipf) bench_zipf_init(&z, keys, theta);
+
+    const char* prefix = (map ? "user" : "");
+    fprintf(f, "phase load\nnew 0 %s\n", container);
+    for (size_t i = 0; i < keys; ++i) fprintf(f, "set 0 %s%zu %zu\n", prefix, i, value_size);
+    fprintf(f, "phase run\n");
+    for (size_t i = 0; i < ops; ++i) {
+      size_t rank = (zipf ? bench_zipf_next(&z, &rng) : (size_t) (bench_random_unit(&rng) * (double) keys));
+      size_t key = perm[rank < keys ? rank : keys - 1];
+      double u = bench_random_unit(&rng);
+      if (u < reads) fprintf(f, "get 0 %s%zu\n", prefix, key);
+      else if (u < reads + removes) fprintf(f, "remove 0 %s%zu\n", prefix, key);
+      else fprintf(f, "set 0 %s%zu %zu\n", prefix, key, value_size);
+    }
+    free(perm);
+  }
+
+  if (out != NULL) fclose(f);
+  return 0;
+}
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+typedef struct BenchShared {
+  TCString* str;
+  size_t iterations;
+  size_t sum;
+} BenchShared;
+
+static int bench_contention_worker(void* arg) {
+  BenchShared* b = (BenchShared*) arg;
+  size_t sum = 0;
+  for (size_t i = 0; i < b->iterations; ++i) {
+    tc_ref(b->str);
+    sum += tc_string_len_fast(b->str);
+    tc_unref(b->str);
+  }
+  b->sum = sum;
+  return 0;
+}
+
+void bench_contention() {
+  TCString* s = $str("shared");
+
+  for (size_t threads = 1; threads <= 16; threads *= 2) {
+    thrd_t tids[16];
+    BenchShared work[16];
+    size_t sum = 0;
+
+    double t0 = bench_now();
+    for (size_t i = 0; i < threads; ++i) {
+      work[i].str = s;
+      work[i].iterations = BENCH_N / threads;
+      thrd_create(&tids[i], bench_contention_worker, &work[i]);
+    }
+    for (size_t i = 0; i < threads; ++i) {
+      thrd_join(tids[i], NULL);
+      sum += work[i].sum;
+    }
+    double t1 = bench_now();
+
+    char name[64];
+    snprintf(name, sizeof(name), "shared TCString, %zu threads", threads);
+    bench_report(name, t0, t1, (BENCH_N / threads) * threads, sum);
+  }
+
+  $unref(s);
+}
+
+typedef struct BenchMix {
+  TCConcurrentHash* h;
+  TCCache* locked;
+  mtx_t* mtx;
+  TCVector* keys;
+  size_t ops;
+  unsigned write_pct;
+  size_t seed;
+  size_t sum;
+} BenchMix;
+
+static void bench_mix_visit(TObject* value, void* userdata) {
+  *(size_t*) userdata += tc_string_len_fast((TCString*) value);
+}
+
+static int bench_mix_worker(void* arg) {
+  BenchMix* b = (BenchMix*) arg;
+  size_t x = b->seed;
+  size_t sum = 0;
+  for (size_t i = 0; i < b->ops; ++i) {
+    x = x * 6364136223846793005ull + 1442695040888963407ull;
+    TCString* key = (TCString*) b->keys->arr[(x >> 33) % b->keys->len];
+    bool write = ((x >> 20) % 100) < b->write_pct;
+    if (b->h != NULL) {
+      if (write) {
+        $(TCConcurrentHash, b->h, put, tc_string_str_fast(key), (TObject*) key);
+      } else {
+        $(TCConcurrentHash, b->h, visit, tc_string_str_fast(key), bench_mix_visit, &sum);
+      }
+    } else {
+      mtx_lock(b->mtx);
+      if (write) {
+        $(TCCache, b->locked, put, tc_string_str_fast(key), (TObject*) key);
+      } else {
+        TObject* o = $(TCCache, b->locked, get, tc_string_str_fast(key));
+        if (o != NULL) {
+          sum += tc_string_len_fast((TCString*) o);
+          tc_unref(o);
+        }
+      }
+      mtx_unlock(b->mtx);
+    }
+  }
+  b->sum = sum;
+  return 0;
+}
+
+void bench_concurrent_hash() {
+  TCVector* keys = bench_strings(BENCH_N / 10);
+  TCConcurrentHash* h = $new(TCConcurrentHash, 0);
+  TCCache* locked = $new(TCCache, TC_CACHE_LRU, keys->len);
+  mtx_t mtx;
+  mtx_init(&mtx, mtx_plain);
+  for (size_t i = 0; i < keys->len; ++i) {
+    $(TCConcurrentHash, h, put, tc_string_str_fast((TCString*) keys->arr[i]), keys->arr[i]);
+    $(TCCache, locked, put, tc_string_str_fast((TCString*) keys->arr[i]), keys->arr[i]);
+  }
+
+  const unsigned mixes[2] = { 5, 50 };
+  for (int m = 0; m < 2; ++m) {
+    for (int impl = 0; impl < 2; ++impl) {
+      for (size_t threads = 1; threads <= 64; threads *= 2) {
+        thrd_t tids[64];
+        BenchMix work[64];
+        size_t sum = 0;
+
+        double t0 = bench_now();
+        for (size_t i = 0; i < threads; ++i) {
+          work[i].h = (impl == 0 ? h : NULL);
+          work[i].locked = locked;
+          work[i].mtx = &mtx;
+          work[i].keys = keys;
+          work[i].ops = BENCH_N / threads;
+          work[i].write_pct = mixes[m];
+          work[i].seed = i + 1;
+          thrd_create(&tids[i], bench_mix_worker, &work[i]);
+        }
+        for (size_t i = 0; i < threads; ++i) {
+          thrd_join(tids[i], NULL);
+          sum += work[i].sum;
+        }
+        double t1 = bench_now();
+
+        char name[64];
+        snprintf(name, sizeof(name), "%s %u/%u, %zu threads", impl == 0 ? "TCConcurrentHash" : "mutex + TCCache", 100 - mixes[m], mixes[m], threads);
+        bench_report(name, t0, t1, (BENCH_N / threads) * threads, sum);
+      }
+    }
+  }
+
+  mtx_destroy(&mtx);
+  $unref(locked);
+  $unref(h);
+  $unref(keys);
+}
+#endif
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+    return bench_suite(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "trace-gen") == 0) {
+    return bench_trace_gen(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "replay") == 0) {
+    return bench_replay(argc - 2, argv + 2);
+  }
+
+  bench_accessors();
+  bench_teardown();
+  bench_refcount();
+  bench_lists();
+  bench_pipes();
+  bench_cache();
+  bench_map_latency();
+  bench_map_batch();
+  bench_persistent_map();
+  bench_snapshots();
+  bench_serialization();
+  bench_frozen_map();
+  bench_journal();
+  bench_memory();
+#if defined(TC_THREADSAFE_REFCOUNT)
+  bench_contention();
+  bench_concurrent_hash();
+#endif
+#if defined(TC_STATS)
+  tc_stats_dump(stdout, NULL);
+#endif
+
+  return 0;
+}
@@ -2,10 +2,15 @@
 
 #include "tiny2-containers.h"
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(TC_THREADSAFE_REFCOUNT)
+#include <threads.h>
+#endif
+
 #if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
 #define strdup _strdup
 #endif
@@ -21,6 +26,16 @@ void test_strings() {
   $(TCString, str, prependc, s2);
   $(TCString, str, prepend, str2);
 
+  TCString* snap = $(TCString, str2, snapshot);
+  assert(snap->str == str2->str && snap->shared != NULL);
+  $(TCString, str2, appendc, "more");
+  assert(strcmp(snap->str, "asdf ") == 0 && strcmp(str2->str, "asdf more") == 0);
+  TCString* snap2 = $(TCString, snap, snapshot);
+  $unref(snap);
+  $(TCString, snap2, prependc, ">");
+  assert(strcmp(snap2->str, ">asdf ") == 0);
+  $unref(snap2);
+
   $unref(str2);
   $unref(str);
   free(s);
@@ -73,6 +88,57 @@ void test_lists() {
   $unref(foo);
 }
 
+int test_lists_cmp(TObject* a, TObject* b, void* userdata) {
+  return (int) ((TCString*) a)->len - (int) ((TCString*) b)->len;
+}
+
+void test_lists_ops() {
+  TCList* l = $new(TCList);
+  for (int i = 127; i >= 0; --i) {
+    char buf[8];
+    snprintf(buf, sizeof(buf), "%d", i);
+    TCString* str = $str(buf);
+    $(TCList, l, append, (TObject*) str);
+    $unref(str);
+  }
+  assert(l->len == 128);
+
+  $(TCList, l, sort, test_lists_cmp, NULL);
+  size_t count = 0;
+  TCListNode* prev = NULL;
+  for (TCListNode* n = l->head; n != NULL; prev = n, n = n->next, ++count) {
+    assert(n->prev == prev);
+    if (prev != NULL) {
+      TCString* a = (TCString*) prev->obj;
+      TCString* b = (TCString*) n->obj;
+      assert(a->len <= b->len);
+      if (a->len == b->len) assert(atoi(a->str) > atoi(b->str));
+    }
+  }
+  assert(count == 128 && l->tail == prev);
+
+  TCListNode* mid = l->head;
+  for (int i = 0; i < 64; ++i) mid = mid->next;
+  TCList* r = $(TCList, l, split_at, mid);
+  assert(l->len == 64 && r->len == 64);
+  assert(l->tail->next == NULL && r->head == mid && mid->list == r);
+
+  TCList* batch = $new(TCList);
+  $(TCList, batch, splice, r, r->head->next, r->head->next->next->next);
+  assert(batch->len == 3 && r->len == 61);
+  $(TCList, batch, concat, r);
+  assert(batch->len == 64 && r->len == 0 && r->head == NULL && r->tail == NULL);
+  $(TCList, l, concat, batch);
+  assert(l->len == 128);
+
+  $(TCList, l, remove, l->head);
+  assert(l->len == 127);
+
+  $unref(batch);
+  $unref(r);
+  $unref(l);
+}
+
 TCVector* get_vector() {
   TCVector* vector = $new(TCVector, 0, 0);
 
@@ -132,6 +198,38 @@ void test_vectors() {
     $unref(o);
   }
   $unref(v4);
+
+
+  TCVector* v5 = get_vector();
+  TCVector* v6 = $new(TCVector, 0, 0);
+  $(TCVector, v6, push_back_many, v5->arr, v5->len);
+  $(TCVector, v6, push_back_many, v5->arr, v5->len);
+  assert(v6->len == 2 * v5->len);
+  $unref(v5);
+  /* Appending a vector to itself reads from the array it grows. */
+  $(TCVector, v6, push_back_many, v6->arr, v6->len);
+  assert(v6->len == 512 && v6->arr[300] == v6->arr[44]);
+  $(TCVector, v6, clear);
+  assert(v6->len == 0);
+  $unref(v6);
+
+
+  TCVector* v7 = get_vector();
+  TCVector* s1 = $(TCVector, v7, snapshot);
+  TCVector* s2 = $(TCVector, s1, snapshot);
+  assert(s1->arr == v7->arr && s2->arr == v7->arr);
+  TObject* first = v7->arr[0];
+  $(TCVector, v7, remove, 0);
+  assert(v7->arr != s1->arr && s1->len == 128 && s1->arr[0] == first);
+  $(TCVector, s2, clear);
+  assert(s2->len == 0 && s1->arr[127] != NULL);
+  $(TCVector, s2, push_back, first);
+  $unref(v7);
+  $(TCVector, s1, push_back, first);
+  assert(s1->shared == NULL && s1->len == 129);
+  $unref(s1);
+  assert(s2->len == 1 && s2->arr[0] == first);
+  $unref(s2);
 }
 
 void test_queues() {
@@ -147,7 +245,26 @@ void test_queues() {
     $unref($(TCQueue, q, pop));
   }
 
+  for (int i = 0; i < 32; ++i) {
+    TObject* o = $new(TObject);
+    $(TCQueue, q, push, o);
+    $unref(o);
+  }
+
   $unref(q);
+
+  TCQueue* small = $new(TCQueue, 1);
+  TObject* o = $new(TObject);
+  bool pushed = $(TCQueue, small, push, o);
+  bool pushed_full = $(TCQueue, small, push, o);
+  assert(pushed && !pushed_full);
+  (void) pushed;
+  (void) pushed_full;
+  $unref($(TCQueue, small, pop));
+  assert($(TCQueue, small, pop) == NULL);
+  assert($(TCQueue, small, peek) == NULL);
+  $unref(o);
+  $unref(small);
 }
 
 void test_maps() {
@@ -181,23 +298,1230 @@ void test_maps() {
 
   $(TCMap, map, remove, "asdf");
 
+  TCString* s8 = $str("long");
+  $(TCMap, map, set, "a key that does not fit into a pooled block", (TObject*) s8);
+  $(TCMap, map, rename, "a key that does not fit into a pooled block", "short");
+  $(TCMap, map, rename, "short", "another key that does not fit into a pooled block");
+  $unref(s8);
+
   $unref(map);
+
+
+  TCVector* v = get_vector();
+  for (int incremental = 0; incremental < 2; ++incremental) {
+    TCMap* m = $new(TCMap);
+    m->incremental = incremental;
+    for (int i = 0; i < v->len; ++i) {
+      TCString* k = (TCString*) v->arr[i];
+      $(TCMap, m, set, k->str, (TObject*) k);
+      for (int j = 0; j <= i; j += 7) {
+        TObject* o = $(TCMap, m, get, ((TCString*) v->arr[j])->str);
+        assert(o == v->arr[j]);
+        $unref(o);
+      }
+    }
+    assert(m->pairs->len == v->len);
+    assert(incremental || m->old_table == NULL);
+
+    $(TCMap, m, set, "5", v->arr[6]);
+    assert(m->pairs->len == v->len);
+    TObject* o = $(TCMap, m, get, "5");
+    assert(o == v->arr[6]);
+    $unref(o);
+
+    $(TCMap, m, rename, "7", "8");
+    assert(m->pairs->len == v->len - 1);
+    o = $(TCMap, m, get, "8");
+    assert(o == v->arr[7]);
+    $unref(o);
+    assert($(TCMap, m, get, "7") == NULL);
+
+    for (int i = 0; i < v->len; i += 2) {
+      $(TCMap, m, remove, ((TCString*) v->arr[i])->str);
+    }
+    assert(m->pairs->len == v->len / 2 - 1);
+    $unref(m);
+  }
+
+  const char* keys[129];
+  TObject* out[129];
+  for (int i = 0; i < v->len; ++i) keys[i] = ((TCString*) v->arr[i])->str;
+  keys[128] = "missing";
+  for (int incremental = 0; incremental < 2; ++incremental) {
+    TCMap* m = $new(TCMap);
+    m->incremental = incremental;
+    $(TCMap, m, set_many, keys, (TObject* const*) v->arr, 100);
+    $(TCMap, m, set_many, keys + 90, (TObject* const*) v->arr + 89, 38);
+    assert(m->pairs->len == v->len);
+
+    $(TCMap, m, get_many, keys, 129, out);
+    for (int i = 0; i < 129; ++i) {
+      if (i == 128) assert(out[i] == NULL);
+      else assert(out[i] == v->arr[i < 90 ? i : i - 1]);
+      if (out[i] != NULL) $unref(out[i]);
+    }
+    $(TCMap, m, get_many, keys, 0, NULL);
+    $unref(m);
+  }
+
+  /* "Aa" and "B@" have the same djb2 hash but are different keys. */
+  TCMap* c = $new(TCMap);
+  $(TCMap, c, set, "Aa", v->arr[1]);
+  $(TCMap, c, set, "B@", v->arr[2]);
+  assert(c->pairs->len == 2);
+  TObject* a = $(TCMap, c, get, "Aa");
+  TObject* b = $(TCMap, c, get, "B@");
+  assert(a == v->arr[1] && b == v->arr[2]);
+  $unref(a);
+  $unref(b);
+  const char* colliding[] = { "B@", "Aa" };
+  $(TCMap, c, get_many, colliding, 2, out);
+  assert(out[0] == v->arr[2] && out[1] == v->arr[1]);
+  $unref(out[0]);
+  $unref(out[1]);
+  $(TCMap, c, remove, "B@");
+  a = $(TCMap, c, get, "Aa");
+  assert(c->pairs->len == 1 && a == v->arr[1] && $(TCMap, c, get, "B@") == NULL);
+  $unref(a);
+  $(TCMap, c, set, "B@", v->arr[2]);
+  $(TCMap, c, rename, "B@", "Aa");
+  a = $(TCMap, c, get, "Aa");
+  assert(c->pairs->len == 1 && a == v->arr[2] && $(TCMap, c, get, "B@") == NULL);
+  $unref(a);
+  $unref(c);
+  $unref(v);
 }
 
 void test_hashes() {
+  TCHash* h1 = $new(TCHash);
+  for (uint64_t i = 0; i < 1024; ++i) {
+    TObject* o = $new(TObject);
+    $(TCHash, h1, set, (i * 7919) % 1024, o);
+    $unref(o);
+  }
+  for (uint64_t i = 0; i < 1024; ++i) {
+    TObject* o = $(TCHash, h1, get, i);
+    assert(o != NULL);
+    $unref(o);
+  }
+  assert($(TCHash, h1, get, 4096) == NULL);
+  $unref(h1);
+
+
+  TCVector* sorted = $new(TCVector, 1024, 0);
+  for (int i = 0; i < 1000; ++i) {
+    char* s = NULL;
+#if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
+    size_t sz = _scprintf("%d", i) + 1;
+    s = (char*)malloc(sz);
+    sprintf_s(s, sz, "%d", i);
+#else
+    asprintf(&s, "%d", i);
+#endif
+    TCString* str = $new(TCString, s);
+    TCMapPair* p = $new(TCMapPair, s, (TObject*) str);
+    p->hash = (uint64_t) i * 2;
+    $(TCVector, sorted, push_back, (TObject*) p);
+    $unref(p);
+    $unref(str);
+    free(s);
+  }
+
+  TCHash* h2 = $new(TCHash);
+  $(TCHash, h2, build_from_sorted, sorted);
+  assert(h2->size == 1000);
+  for (uint64_t i = 0; i < 2000; ++i) {
+    TObject* o = $(TCHash, h2, get, i);
+    assert((o != NULL) == (i % 2 == 0));
+    if (o != NULL) $unref(o);
+  }
+  TObject* o = $new(TObject);
+  $(TCHash, h2, set, 1, o);
+  $unref(o);
+  $unref(sorted);
+  $unref(h2);
+}
+
+void test_pools() {
+  TCPool* pool = $new(TCPool, 24, 16);
+
+  void* blocks[100];
+  for (int i = 0; i < 100; ++i) {
+    blocks[i] = $(TCPool, pool, alloc);
+    memset(blocks[i], i, pool->block_size);
+  }
+  for (int i = 0; i < 100; i += 2) {
+    $(TCPool, pool, free, blocks[i]);
+  }
+  assert(pool->used == 50);
+  for (int i = 0; i < 50; ++i) {
+    $(TCPool, pool, alloc);
+  }
+  $(TCPool, pool, clear);
+  assert(pool->used == 0);
+
+  $unref(pool);
+}
+
+void test_arenas() {
+  TCArena* arena = $new(TCArena, 256);
+  const TCAllocator* old = tc_allocator_set_default(&arena->allocator);
+
+  for (int round = 0; round < 4; ++round) {
+    TCString* str = $str("foo");
+    for (int i = 0; i < 64; ++i) {
+      $(TCString, str, appendc, "bar");
+    }
+    $(TCString, str, prepend, str);
+    assert($(TCString, str, size) == 2 * (3 + 64 * 3));
+
+    TCVector* v = $new(TCVector, 0, 0);
+    for (int i = 0; i < 256; ++i) {
+      $(TCVector, v, push_back, (TObject*) str);
+    }
+    TCQueue* q = $new(TCQueue, 16);
+    $(TCQueue, q, push, (TObject*) str);
+    TCMap* m = $new(TCMap);
+    $(TCMap, m, set, "key", (TObject*) str);
+    $(TCMap, m, set, "a key that does not fit into a pooled block", (TObject*) str);
+
+    $unref(m);
+    $unref(q);
+    $unref(v);
+    $unref(str);
+
+    $(TCArena, arena, reset);
+  }
+
+  const TCAllocator* prev = tc_allocator_set_default(old);
+  assert(prev == &arena->allocator);
+  (void) prev;
+  assert(tc_allocator_get_default() == &tc_malloc_allocator);
+  $unref(arena);
+
+
+  TCString* owned = $str("owned");
+  TCArena* scope = $new(TCArena, 0);
+  scope->allocator.scoped = true;
+  old = tc_allocator_set_default(&scope->allocator);
+
+  TCVector* v = $new(TCVector, 0, 0);
+  TCList* l = $new(TCList);
+  TCMap* m = $new(TCMap);
+  TCString* s = $str("borrowed");
+  assert(v->borrowed && l->borrowed && m->borrowed && s->borrowed);
+  for (int i = 0; i < 128; ++i) {
+    $(TCVector, v, push_back, (TObject*) owned);
+    $(TCList, l, append, (TObject*) owned);
+    $(TCString, s, append, owned);
+  }
+  $(TCMap, m, set, "owned", (TObject*) owned);
+  assert($(TCVector, v, get, 3) == (TObject*) owned);
+  assert($(TCMap, m, get, "owned") == (TObject*) owned);
+  assert($(TCListNode, l->head, obj) == (TObject*) owned);
+  $(TCList, l, remove, l->head);
+  $(TCVector, v, remove, 0);
+  $unref(s);
+  $unref(m);
+  $unref(l);
+  $unref(v);
+
+  tc_allocator_set_default(old);
+  $unref(scope);
+  $unref(owned);
+}
+
+$class_decl(TestTimer)
+
+typedef TestTimer* (*TestTimerConstructor)(TestTimer* self, int id);
+typedef void (*TestTimerInitVTable)(TestTimerVTable* v);
+
+$class(TestTimer, TObject, _parent)
+  $class_property(int, id)
+  $class_property(TCListLink, pending)
+  $class_property(TCListLink, owned)
+$class_end(TestTimer)
+
+$mtable(TestTimer)
+$mtable_end(TestTimer)
+
+$vtable(TestTimer, TObject)
+$vtable_end(TestTimer)
+
+static TestTimer* test_timer_constructor(TestTimer* self, int id);
+static void test_timer_destructor(TestTimer* self);
+static void test_timer_init_vtable(TestTimerVTable* v);
+
+$mtable_define(TestTimer, test_timer_constructor, test_timer_destructor, test_timer_init_vtable)
+$mtable_define_end(TestTimer)
+
+$vtable_define(TestTimer)
+$vtable_define_end(TestTimer)
+
+static TestTimer* test_timer_constructor(TestTimer* self, int id) {
+  $init(TObject, self);
+  $setup(TestTimer, self, test_timer_destructor);
+  $reg(TestTimer, TObject);
+
+  self->id = id;
+  $list_link_init(&self->pending);
+  $list_link_init(&self->owned);
+
+  return self;
+}
+
+static void test_timer_destructor(TestTimer* self) {
+  assert(self->pending.list == NULL && self->owned.list == NULL);
+  $destroy_parent(TObject, self);
+}
+
+static void test_timer_init_vtable(TestTimerVTable* v) {
+  $vtable_init(v, TestTimer, TObject);
+}
+
+bool test_intrusive_lists_iter(TCIntrusiveList* list, TestTimer* t, int* sum) {
+  *sum += t->id;
+  if (t->id % 2 == 0) $(TCIntrusiveList, list, remove, (TObject*) t);
+  return true;
+}
+
+void test_intrusive_lists() {
+  TCIntrusiveList* pending = $new(TCIntrusiveList, offsetof(TestTimer, pending));
+  TCIntrusiveList* owned = $new(TCIntrusiveList, offsetof(TestTimer, owned));
+
+  for (int i = 0; i < 256; ++i) {
+    TestTimer* t = $new(TestTimer, i);
+    $(TCIntrusiveList, pending, append, (TObject*) t);
+    $(TCIntrusiveList, owned, prepend, (TObject*) t);
+    $unref(t);
+  }
+  assert(pending->len == 256 && owned->len == 256);
+  assert($list_entry(pending->head, TestTimer, pending)->id == 0);
+  assert($list_entry(owned->head, TestTimer, owned)->id == 255);
+
+  int sum = 0;
+  $(TCIntrusiveList, pending, foreach, (TCIntrusiveListIterator) test_intrusive_lists_iter, &sum);
+  assert(sum == 255 * 256 / 2);
+  assert(pending->len == 128);
+
+  TestTimer* t = (TestTimer*) tc_intrusive_list_obj(owned, owned->tail);
+  assert(t->id == 0 && !$(TCIntrusiveList, pending, contains, (TObject*) t));
+  $ref(t);
+  bool first = $(TCIntrusiveList, owned, remove, (TObject*) t);
+  bool second = $(TCIntrusiveList, owned, remove, (TObject*) t);
+  assert(first && !second);
+  (void) first;
+  (void) second;
+  $unref(t);
+
+  $unref(owned);
+  $unref(pending);
+}
+
+bool test_chunk_lists_odd(TCChunkList* list, TCString* s, void* userdata) {
+  return (s->str[s->len - 1] - '0') % 2 == 1;
+}
+
+bool test_chunk_lists_count(TCChunkList* list, TObject* o, size_t* count) {
+  ++*count;
+  return true;
+}
+
+void test_chunk_lists() {
+  TCChunkList* l = $new(TCChunkList);
+  TCVector* v = get_vector();
+
+  for (int i = 0; i < v->len; ++i) {
+    $(TCChunkList, l, append, v->arr[i]);
+    $(TCChunkList, l, prepend, v->arr[i]);
+  }
+  assert(l->len == 2 * v->len);
+  assert(l->head->items[0] == v->arr[v->len - 1]);
+  assert(l->tail->items[l->tail->len - 1] == v->arr[v->len - 1]);
+
+  TCChunk* c = l->head;
+  while (c != NULL && c->len > 0) {
+    c = $(TCChunkList, l, remove, c, 0);
+    if (l->len == v->len) break;
+  }
+  assert(l->len == v->len);
+
+  size_t removed = $(TCChunkList, l, remove_if, (TCChunkListIterator) test_chunk_lists_odd, NULL);
+  assert(removed == v->len / 2 && l->len == v->len / 2);
+  (void) removed;
+
+  size_t count = 0;
+  $(TCChunkList, l, foreach, (TCChunkListIterator) test_chunk_lists_count, &count);
+  assert(count == l->len);
+
+  $unref(v);
+  $unref(l);
+}
+
+void test_iterators() {
+  TCVector* v = get_vector();
+  TCList* l = $new(TCList);
+  TCQueue* q = $new(TCQueue, 100);
+  TCMap* m = $new(TCMap);
+  TCHash* h = $new(TCHash);
+  TCChunkList* cl = $new(TCChunkList);
+
+  for (int i = 0; i < v->len; ++i) {
+    TObject* o = v->arr[i];
+    $(TCList, l, append, o);
+    $(TCChunkList, cl, append, o);
+    $(TCHash, h, set, (uint64_t) (v->len - i), o);
+    $(TCMap, m, set, ((TCString*) o)->str, o);
+    if (i < 50) {
+      $(TCQueue, q, push, o);
+    } else {
+      $unref($(TCQueue, q, pop));
+      $(TCQueue, q, push, o);
+    }
+  }
+
+  size_t i = 0;
+  for (TCIter it = tc_vector_iter_begin(v); !tc_vector_iter_done(&it); tc_vector_iter_next(&it), ++i) {
+    assert(tc_vector_iter_current(&it) == v->arr[i]);
+  }
+  assert(i == v->len);
+
+  i = 0;
+  for (TCIter it = tc_list_iter_begin(l); !tc_list_iter_done(&it); tc_list_iter_next(&it), ++i) {
+    assert(tc_list_iter_current(&it) == v->arr[i]);
+  }
+  assert(i == v->len);
+
+  i = 0;
+  for (TCIter it = tc_chunk_list_iter_begin(cl); !tc_chunk_list_iter_done(&it); tc_chunk_list_iter_next(&it), ++i) {
+    assert(tc_chunk_list_iter_current(&it) == v->arr[i]);
+  }
+  assert(i == v->len);
+
+  i = 0;
+  for (TCIter it = tc_queue_iter_begin(q); !tc_queue_iter_done(&it); tc_queue_iter_next(&it), ++i) {
+    assert(tc_queue_iter_current(&it) == v->arr[v->len - 50 + i]);
+  }
+  assert(i == 50);
+
+  i = 0;
+  for (TCIter it = tc_map_iter_begin(m); !tc_map_iter_done(&it); tc_map_iter_next(&it), ++i) {
+    assert(tc_map_iter_current(&it)->value == v->arr[i]);
+  }
+  assert(i == v->len);
+
+  i = 0;
+  for (TCIter it = tc_hash_iter_begin(h); !tc_hash_iter_done(&it); tc_hash_iter_next(&it), ++i) {
+    assert(tc_hash_iter_current(&it)->hash == i + 1);
+    assert(tc_hash_iter_current(&it)->value == v->arr[v->len - 1 - i]);
+  }
+  assert(i == v->len);
+
+  $unref(cl);
+  $unref(h);
+  $unref(m);
+  $unref(q);
+  $unref(l);
+  $unref(v);
+}
+
+bool test_pipes_even(TObject* o, void* userdata) {
+  TCString* s = (TCString*) o;
+  return (s->str[s->len - 1] - '0') % 2 == 0;
+}
 
+TObject* test_pipes_suffix(TObject* o, void* userdata) {
+  TCString* s = $new(TCString, ((TCString*) o)->str);
+  $(TCString, s, appendc, (const char*) userdata);
+  return (TObject*) s;
 }
 
+TObject* test_pipes_first(TObject* a, TObject* b, void* userdata) {
+  return a;
+}
+
+void test_pipes_len(void* acc, TObject* o) {
+  *(size_t*) acc += ((TCString*) o)->len;
+}
+
+void test_pipes() {
+  TCVector* v = get_vector();
+  TCVector* out = $new(TCVector, 0, 0);
+  TCPipe p;
+
+  tc_pipe_init(&p, tc_pipe_source_vector(v));
+  tc_pipe_filter(&p, test_pipes_even, NULL);
+  tc_pipe_map(&p, test_pipes_suffix, "!", true);
+  size_t n = tc_pipe_collect_into(&p, out);
+  assert(n == 64 && out->len == 64);
+  assert(strcmp(((TCString*) out->arr[1])->str, "2!") == 0);
+
+  tc_pipe_init(&p, tc_pipe_source_vector(v));
+  tc_pipe_chain(&p, tc_pipe_source_vector(out));
+  tc_pipe_skip(&p, 100);
+  tc_pipe_take(&p, 50);
+  size_t len = 0;
+  tc_pipe_reduce(&p, test_pipes_len, &len);
+  assert(len == 28 * 3 + 5 * 2 + 17 * 3);
+
+  tc_pipe_init(&p, tc_pipe_source_vector(out));
+  tc_pipe_zip(&p, tc_pipe_source_vector(v), test_pipes_first, NULL, false);
+  n = tc_pipe_count(&p);
+  assert(n == out->len);
+
+  TObject* o = NULL;
+  tc_pipe_init(&p, tc_pipe_source_vector(v));
+  tc_pipe_map(&p, test_pipes_suffix, "?", true);
+  bool got = tc_pipe_next(&p, &o);
+  assert(got && strcmp(((TCString*) o)->str, "0?") == 0);
+  (void) got;
+  tc_pipe_end(&p);
+
+  TCVector* par = $new(TCVector, 0, 0);
+  tc_pipe_init(&p, tc_pipe_source_vector(v));
+  tc_pipe_filter(&p, test_pipes_even, NULL);
+  n = tc_pipe_collect_into_parallel(&p, par, 4);
+  assert(n == 64);
+  for (size_t i = 0; i < par->len; ++i) {
+    assert(par->arr[i] == v->arr[2 * i]);
+  }
+  (void) n;
+
+  $unref(par);
+  $unref(out);
+  $unref(v);
+}
+
+size_t test_caches_cost(TObject* value, void* userdata) {
+  return ((TCString*) value)->len;
+}
+
+void test_caches_evict(TCCache* cache, const char* key, TObject* value, size_t* evicted) {
+  ++*evicted;
+}
+
+void test_caches() {
+  TCVector* v = get_vector();
+  char key[16];
+
+  TCCache* lru = $new(TCCache, TC_CACHE_LRU, 16);
+  for (int i = 0; i < 32; ++i) {
+    snprintf(key, sizeof(key), "k%d", i);
+    $(TCCache, lru, put, key, v->arr[i]);
+    TObject* o = $(TCCache, lru, get, "k0");
+    if (o != NULL) $unref(o);
+  }
+  assert(lru->size == 16 && lru->evictions == 16);
+  assert(lru->hits == 32 && lru->misses == 0);
+  TObject* o = $(TCCache, lru, get, "k1");
+  assert(o == NULL && lru->misses == 1);
+  o = $(TCCache, lru, get, "k31");
+  assert(o == v->arr[31]);
+  $unref(o);
+  $(TCCache, lru, put, "k31", v->arr[0]);
+  o = $(TCCache, lru, get, "k31");
+  assert(o == v->arr[0] && lru->size == 16);
+  $unref(o);
+  bool removed = $(TCCache, lru, remove, "k31");
+  assert(removed && lru->size == 15);
+  (void) removed;
+  $unref(lru);
+
+  size_t evicted = 0;
+  TCCache* sieve = $new(TCCache, TC_CACHE_SIEVE, 64);
+  sieve->cost = test_caches_cost;
+  sieve->on_evict = (TCCacheEvict) test_caches_evict;
+  sieve->evict_userdata = &evicted;
+  for (int i = 0; i < v->len; ++i) {
+    snprintf(key, sizeof(key), "k%d", i);
+    $(TCCache, sieve, put, key, v->arr[i]);
+    o = $(TCCache, sieve, get, "k5");
+    if (o != NULL) $unref(o);
+    assert(sieve->used <= sieve->capacity);
+  }
+  assert(evicted == sieve->evictions && evicted > 0);
+  o = $(TCCache, sieve, get, "k5");
+  assert(o == v->arr[5]);
+  $unref(o);
+  /* A value too big for the cache does not leave the old one behind. */
+  TCString* big = $str("a value that costs more than the sixty-four bytes this cache holds");
+  size_t size = sieve->size;
+  bool put = $(TCCache, sieve, put, "k5", (TObject*) big);
+  assert(!put && sieve->size == size - 1 && $(TCCache, sieve, get, "k5") == NULL);
+  (void) put;
+  (void) size;
+  $unref(big);
+  $(TCCache, sieve, clear);
+  assert(sieve->size == 0 && sieve->used == 0 && sieve->head == NULL);
+  $unref(sieve);
+
+  $unref(v);
+}
+
+bool test_persistent_maps_count(TCPersistentMap* map, const char* key, TObject* value, size_t* n) {
+  ++*n;
+  return true;
+}
+
+void test_persistent_maps() {
+  TCVector* v = get_vector();
+  char key[16];
+
+  TCPersistentMap* empty = $new(TCPersistentMap);
+  TCPersistentMap* t = $(TCPersistentMap, empty, edit);
+  $unref(empty);
+  for (int i = 0; i < 2000; ++i) {
+    snprintf(key, sizeof(key), "k%d", i);
+    $(TCPersistentMap, t, set_mut, key, v->arr[i % v->len]);
+  }
+  $(TCPersistentMap, t, set_mut, "k7", v->arr[0]);
+  bool removed = $(TCPersistentMap, t, remove_mut, "k8");
+  bool removed_again = $(TCPersistentMap, t, remove_mut, "k8");
+  assert(removed && !removed_again);
+  (void) removed;
+  (void) removed_again;
+  $(TCPersistentMap, t, freeze);
+  TCPersistentMap* m1 = t;
+  assert(m1->count == 1999);
+
+  /* "Aa" and "B@" have the same djb2 hash. */
+  TCPersistentMap* m2 = $(TCPersistentMap, m1, set, "Aa", v->arr[1]);
+  TCPersistentMap* m3 = $(TCPersistentMap, m2, set, "B@", v->arr[2]);
+  TCPersistentMap* m4 = $(TCPersistentMap, m3, remove, "k1");
+  TCPersistentMap* m5 = $(TCPersistentMap, m4, remove, "Aa");
+  assert(m1->count == 1999 && m2->count == 2000 && m3->count == 2001);
+  assert(m4->count == 2000 && m5->count == 1999);
+
+  TObject* o = $(TCPersistentMap, m1, get, "Aa");
+  assert(o == NULL);
+  o = $(TCPersistentMap, m3, get, "Aa");
+  assert(o == v->arr[1]);
+  $unref(o);
+  o = $(TCPersistentMap, m5, get, "Aa");
+  assert(o == NULL);
+  o = $(TCPersistentMap, m5, get, "B@");
+  assert(o == v->arr[2]);
+  $unref(o);
+  o = $(TCPersistentMap, m3, get, "k1");
+  assert(o == v->arr[1]);
+  $unref(o);
+  o = $(TCPersistentMap, m4, get, "k1");
+  assert(o == NULL);
+  o = $(TCPersistentMap, m5, get, "k7");
+  assert(o == v->arr[0]);
+  $unref(o);
+  o = $(TCPersistentMap, m5, get, "k8");
+  assert(o == NULL);
+  for (int i = 100; i < 2000; i += 37) {
+    snprintf(key, sizeof(key), "k%d", i);
+    o = $(TCPersistentMap, m5, get, key);
+    assert(o == v->arr[i % v->len]);
+    $unref(o);
+  }
+
+  size_t n = 0;
+  $(TCPersistentMap, m5, foreach, (TCPersistentMapIterator) test_persistent_maps_count, &n);
+  assert(n == m5->count);
+
+  $unref(m1);
+  $unref(m2);
+  $unref(m4);
+
+  /* Emptying a version down to nothing leaves the others intact. */
+  t = $(TCPersistentMap, m3, edit);
+  for (int i = 0; i < 2000; ++i) {
+    snprintf(key, sizeof(key), "k%d", i);
+    $(TCPersistentMap, t, remove_mut, key);
+  }
+  $(TCPersistentMap, t, remove_mut, "Aa");
+  $(TCPersistentMap, t, remove_mut, "B@");
+  $(TCPersistentMap, t, freeze);
+  assert(t->count == 0 && t->root->len == 0);
+  o = $(TCPersistentMap, m3, get, "k1999");
+  assert(o == v->arr[1999 % v->len]);
+  $unref(o);
+
+  $unref(t);
+  $unref(m3);
+  $unref(m5);
+  $unref(v);
+}
+
+typedef struct TestBuffer {
+  uint8_t* data;
+  size_t len;
+} TestBuffer;
+
+bool test_serialization_sink(void* ctx, const void* data, size_t len) {
+  TestBuffer* b = (TestBuffer*) ctx;
+  b->data = (uint8_t*) realloc(b->data, b->len + len);
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+  return true;
+}
+
+void test_serialization() {
+  TCVector* v = get_vector();
+  TCMap* map = $new(TCMap);
+  for (int i = 0; i < 100; ++i) {
+    $(TCMap, map, set, ((TCString*) v->arr[i])->str, v->arr[i + 1]);
+  }
+  $(TCMap, map, set, "vector", (TObject*) v);
+  $(TCMap, map, set, "nothing", NULL);
+
+  TestBuffer buf = { NULL, 0 };
+  TCWriter* w = (TCWriter*) malloc(sizeof(TCWriter));
+  tc_writer_init(w, test_serialization_sink, &buf);
+  bool ok = tc_writer_finish(w, tc_writer_put(w, (TObject*) map));
+  assert(ok && buf.len % 8 == 0);
+  free(w);
+
+  TCMapped m;
+  ok = tc_mapped_open_memory(&m, buf.data, buf.len, true);
+  assert(ok && tc_mapped_type(&m, m.root) == TC_SERIAL_MAP);
+  assert(tc_mapped_len(&m, m.root) == 102);
+  size_t len = 0;
+  const char* s = tc_mapped_string(&m, tc_mapped_map_get(&m, m.root, "41"), &len);
+  assert(strcmp(s, "42") == 0 && len == 2);
+  assert(tc_mapped_map_get(&m, m.root, "missing") == 0);
+  assert(tc_mapped_map_get(&m, m.root, "nothing") == 0);
+  uint64_t vec = tc_mapped_map_get(&m, m.root, "vector");
+  assert(tc_mapped_type(&m, vec) == TC_SERIAL_VECTOR && tc_mapped_len(&m, vec) == 128);
+  s = tc_mapped_string(&m, tc_mapped_vector_at(&m, vec, 127), NULL);
+  assert(strcmp(s, "127") == 0);
+  uint64_t k;
+  tc_mapped_map_entry(&m, m.root, 100, &k, NULL);
+  assert(strcmp(tc_mapped_string(&m, k, NULL), "vector") == 0);
+
+  TCMap* copy = (TCMap*) tc_mapped_load(&m, m.root);
+  assert(copy->pairs->len == 102);
+  TCVector* cv = (TCVector*) $(TCMap, copy, get, "vector");
+  assert(cv->len == 128 && strcmp(((TCString*) cv->arr[5])->str, "5") == 0);
+  $unref(cv);
+  $unref(copy);
+  tc_mapped_close(&m);
+
+  buf.data[64] ^= 1;
+  bool corrupt = tc_mapped_open_memory(&m, buf.data, buf.len, true);
+  bool unchecked = tc_mapped_open_memory(&m, buf.data, buf.len, false);
+  bool truncated = tc_mapped_open_memory(&m, buf.data, buf.len - 8, false);
+  assert(!corrupt && unchecked && !truncated);
+  buf.data[64] ^= 1;
+  bool misaligned = tc_mapped_open_memory(&m, buf.data + 4, buf.len - 8, false);
+  assert(!misaligned);
+
+  /* Opened without verify, a corrupt file reads as missing data and never
+   * out of bounds, whichever word is damaged. */
+  for (size_t i = 8; i < buf.len; i += 8) {
+    static const uint64_t garbage[] = { UINT64_MAX, 8, 0x100000000ull };
+    uint64_t word;
+    memcpy(&word, buf.data + i, 8);
+    for (size_t g = 0; g < sizeof(garbage) / sizeof(garbage[0]); ++g) {
+      memcpy(buf.data + i, &garbage[g], 8);
+      if (!tc_mapped_open_memory(&m, buf.data, buf.len, false)) continue;
+      TObject* o = tc_mapped_load(&m, m.root);
+      if (o != NULL) $unref(o);
+      tc_mapped_string(&m, tc_mapped_map_get(&m, m.root, "41"), NULL);
+      tc_mapped_map_get(&m, m.root, "missing");
+      tc_mapped_vector_at(&m, tc_mapped_map_get(&m, m.root, "vector"), 127);
+    }
+    memcpy(buf.data + i, &word, 8);
+  }
+
+  /* A probe table with no empty slot: the root map's table follows its
+   * 16-byte record header, probe mask and 102 24-byte entries. */
+  ok = tc_mapped_open_memory(&m, buf.data, buf.len, true);
+  assert(ok);
+  uint64_t mask;
+  memcpy(&mask, buf.data + m.root + 16, 8);
+  uint32_t* table = (uint32_t*) (buf.data + m.root + 24 + 102 * 24);
+  for (uint64_t i = 0; i <= mask; ++i) table[i] = 1;
+  assert(tc_mapped_map_get(&m, m.root, "missing") == 0);
+  table[0] = 103;
+  assert(tc_mapped_map_get(&m, m.root, "missing") == 0);
+  (void) corrupt;
+  (void) unchecked;
+  (void) truncated;
+  (void) misaligned;
+  free(buf.data);
+
+  ok = tc_serialize_file("tc-test.bin", (TObject*) map);
+  assert(ok);
+  ok = tc_mapped_open(&m, "tc-test.bin", true);
+  assert(ok && tc_mapped_len(&m, m.root) == 102);
+  (void) ok;
+  (void) s;
+  (void) k;
+  (void) len;
+  tc_mapped_close(&m);
+  remove("tc-test.bin");
+
+  $unref(map);
+  $unref(v);
+}
+
+void test_frozen_maps() {
+  TCVector* v = get_vector();
+  char key[16];
+
+  TCMap* map = $new(TCMap);
+  for (int i = 0; i < 5000; ++i) {
+    snprintf(key, sizeof(key), "key%d", i);
+    $(TCMap, map, set, key, v->arr[i % v->len]);
+  }
+  TCFrozenMap* f = $(TCMap, map, freeze);
+  assert(f->len == 5000 && f->n_buckets == 5000 / 3 + 1);
+  for (int i = 0; i < 5000; ++i) {
+    snprintf(key, sizeof(key), "key%d", i);
+    TObject* o = $(TCFrozenMap, f, get, key);
+    assert(o == v->arr[i % v->len]);
+    $unref(o);
+  }
+  assert($(TCFrozenMap, f, get, "missing") == NULL);
+  $unref(map);
+
+  TestBuffer buf = { NULL, 0 };
+  TCWriter* w = (TCWriter*) malloc(sizeof(TCWriter));
+  tc_writer_init(w, test_serialization_sink, &buf);
+  bool ok = tc_writer_finish(w, tc_writer_put(w, (TObject*) f));
+  free(w);
+  TCMapped m;
+  ok = ok && tc_mapped_open_memory(&m, buf.data, buf.len, true);
+  assert(ok && tc_mapped_type(&m, m.root) == TC_SERIAL_FROZEN_MAP);
+  assert(tc_mapped_len(&m, m.root) == 5000);
+  const char* s = tc_mapped_string(&m, tc_mapped_map_get(&m, m.root, "key130"), NULL);
+  assert(strcmp(s, "2") == 0);
+  assert(tc_mapped_map_get(&m, m.root, "missing") == 0);
+  uint64_t k, val;
+  tc_mapped_map_entry(&m, m.root, 17, &k, &val);
+  assert(tc_mapped_map_get(&m, m.root, tc_mapped_string(&m, k, NULL)) == val);
+
+  TCFrozenMap* g = (TCFrozenMap*) tc_mapped_load(&m, m.root);
+  assert(g->len == f->len && g->seed == f->seed);
+  TCString* o = (TCString*) $(TCFrozenMap, g, get, "key4999");
+  assert(strcmp(o->str, "7") == 0);
+  $unref(o);
+  $unref(g);
+  tc_mapped_close(&m);
+  free(buf.data);
+  (void) ok;
+  (void) s;
+  (void) k;
+  (void) val;
+
+  TCMap* empty = $new(TCMap);
+  TCFrozenMap* e = $(TCMap, empty, freeze);
+  assert(e->len == 0 && $(TCFrozenMap, e, get, "key1") == NULL);
+  $unref(e);
+  $unref(empty);
+
+  /* "Aa" and "B@" share a djb2 hash, as do "Ab" and "BA"; "BA" is absent. */
+  TCMap* clash = $new(TCMap);
+  $(TCMap, clash, set, "Aa", v->arr[0]);
+  $(TCMap, clash, set, "B@", v->arr[1]);
+  $(TCMap, clash, set, "Ab", v->arr[2]);
+  TCFrozenMap* c = $(TCMap, clash, freeze);
+  TObject* aa = $(TCFrozenMap, c, get, "Aa");
+  TObject* bq = $(TCFrozenMap, c, get, "B@");
+  assert(aa == v->arr[0] && bq == v->arr[1]);
+  assert($(TCFrozenMap, c, get, "BA") == NULL);
+  $unref(aa);
+  $unref(bq);
+  buf.data = NULL;
+  buf.len = 0;
+  w = (TCWriter*) malloc(sizeof(TCWriter));
+  tc_writer_init(w, test_serialization_sink, &buf);
+  ok = tc_writer_finish(w, tc_writer_put(w, (TObject*) c));
+  free(w);
+  ok = ok && tc_mapped_open_memory(&m, buf.data, buf.len, true);
+  assert(ok && tc_mapped_map_get(&m, m.root, "Aa") != 0);
+  assert(tc_mapped_map_get(&m, m.root, "BA") == 0);
+  tc_mapped_close(&m);
+  free(buf.data);
+  $unref(c);
+  $unref(clash);
+
+  $unref(f);
+  $unref(v);
+}
+
+void test_journals_clean() {
+  remove("tc-test-journal.snap");
+  remove("tc-test-journal.snap.tmp");
+  remove("tc-test-journal.log");
+  remove("tc-test-journal.log.new");
+}
+
+void test_journals() {
+  TCVector* v = get_vector();
+  char key[16];
+  test_journals_clean();
+
+  TCMap* map = $new(TCMap);
+  TCJournal* j = $new(TCJournal, "tc-test-journal");
+  bool ok = $(TCJournal, j, open, (TObject*) map);
+  assert(ok && j->lsn == 0 && map->journal == j);
+  j->commit_every = 100;
+  for (int i = 0; i < 3000; ++i) {
+    snprintf(key, sizeof(key), "key%d", i);
+    $(TCMap, map, set, key, v->arr[i % v->len]);
+  }
+  for (int i = 0; i < 3000; i += 3) {
+    snprintf(key, sizeof(key), "key%d", i);
+    $(TCMap, map, remove, key);
+  }
+  $(TCMap, map, remove, "missing");
+  $(TCMap, map, rename, "key1", "key2");
+  $(TCMap, map, set, "vector", (TObject*) v);
+  $(TCMap, map, set, "null", NULL);
+  assert(j->lsn == 4003 && j->committed_lsn == 4000);
+  ok = $(TCJournal, j, commit);
+  assert(ok && j->committed_lsn == 4003);
+  $unref(j);
+  assert(map->journal == NULL);
+  $unref(map);
+
+  /* A record torn by a crash is dropped and cut off. */
+  FILE* f = fopen("tc-test-journal.log", "ab");
+  fwrite("torn", 1, 4, f);
+  fclose(f);
+
+  map = $new(TCMap);
+  j = $new(TCJournal, "tc-test-journal");
+  ok = $(TCJournal, j, open, (TObject*) map);
+  assert(ok && j->lsn == 4003 && map->pairs->len == 2000 - 1 + 2);
+  TCString* s = (TCString*) $(TCMap, map, get, "key2");
+  assert(strcmp(s->str, ((TCString*) v->arr[1 % v->len])->str) == 0);
+  $unref(s);
+  assert($(TCMap, map, get, "key1") == NULL && $(TCMap, map, get, "key3") == NULL);
+  TCVector* w = (TCVector*) $(TCMap, map, get, "vector");
+  assert(w->len == v->len && strcmp(((TCString*) w->arr[3])->str, ((TCString*) v->arr[3])->str) == 0);
+  $unref(w);
+
+  ok = $(TCJournal, j, compact);
+  assert(ok && j->log_size == 0);
+  $(TCMap, map, set, "after", v->arr[0]);
+  $(TCMap, map, rename, "key4", "renamed");
+  /* The remove is replayed by key, not by the hash "Aa" and "B@" share. */
+  $(TCMap, map, set, "Aa", v->arr[0]);
+  $(TCMap, map, set, "B@", v->arr[1]);
+  $(TCMap, map, remove, "Aa");
+  $unref(j);
+  $unref(map);
+
+  map = $new(TCMap);
+  j = $new(TCJournal, "tc-test-journal");
+  ok = $(TCJournal, j, open, (TObject*) map);
+  assert(ok && j->lsn == 4008 && map->pairs->len == 2003);
+  assert($(TCMap, map, get, "Aa") == NULL);
+  s = (TCString*) $(TCMap, map, get, "B@");
+  assert(s != NULL && strcmp(s->str, ((TCString*) v->arr[1])->str) == 0);
+  $unref(s);
+  s = (TCString*) $(TCMap, map, get, "renamed");
+  assert(s != NULL && $(TCMap, map, get, "key4") == NULL);
+  $unref(s);
+  s = (TCString*) $(TCMap, map, get, "after");
+  assert(s != NULL);
+  $unref(s);
+  $unref(j);
+  $unref(map);
+  test_journals_clean();
+
+  TCHash* h = $new(TCHash);
+  j = $new(TCJournal, "tc-test-journal");
+  ok = $(TCJournal, j, open, (TObject*) h);
+  TCVector* sorted = $new(TCVector, 100, 0);
+  for (int i = 0; i < 100; ++i) {
+    TCMapPair* p = $new(TCMapPair, "", v->arr[i % v->len]);
+    p->hash = (uint64_t) i * 3;
+    $(TCVector, sorted, push_back, (TObject*) p);
+    $unref(p);
+  }
+  $(TCHash, h, build_from_sorted, sorted);
+  $(TCHash, h, set, UINT64_MAX, NULL);
+  ok = ok && $(TCJournal, j, compact);
+  $(TCHash, h, set, 1, v->arr[1]);
+  $unref(sorted);
+  $unref(j);
+  $unref(h);
+
+  h = $new(TCHash);
+  j = $new(TCJournal, "tc-test-journal");
+  ok = ok && $(TCJournal, j, open, (TObject*) h);
+  assert(ok && h->size == 102);
+  TCString* o = (TCString*) $(TCHash, h, get, 297);
+  assert(strcmp(o->str, ((TCString*) v->arr[99 % v->len])->str) == 0);
+  $unref(o);
+  $unref(j);
+  $unref(h);
+  test_journals_clean();
+
+  (void) ok;
+  (void) s;
+  $unref(v);
+}
+
+void test_stats() {
+  TCVector* v = $new(TCVector, 4, 4);
+  TCMap* map = $new(TCMap);
+  char key[16];
+
+#if defined(TC_STATS)
+  uint64_t steps = tc_stats_get(NULL)->iter_steps;
+  uint64_t refs = tc_stats_get(NULL)->refs;
+  for (int i = 0; i < 10; ++i) $(TCVector, v, push_back, (TObject*) map);
+  for (TCIter it = tc_vector_iter_begin(v); !tc_vector_iter_done(&it); tc_vector_iter_next(&it)) {}
+  assert(v->stats.allocs == 1 && v->stats.resizes == 2);
+  assert(v->stats.bytes_allocated - v->stats.bytes_freed == sizeof(TObject*) * 12);
+  assert(tc_stats_get(NULL)->iter_steps == steps + 10 && tc_stats_get(NULL)->refs >= refs + 10);
+  $(TCVector, v, clear);
+
+  for (int i = 0; i < 1000; ++i) {
+    snprintf(key, sizeof(key), "key%d", i);
+    $(TCMap, map, set, key, NULL);
+  }
+  $(TCMap, map, remove, "key7");
+  const TCStats* s = tc_stats_get((TObject*) map);
+  uint64_t probes = 0;
+  for (int i = 0; i < TC_STATS_HISTOGRAM; ++i) probes += s->probes[i];
+  assert(s->lookups == 1001 && probes == s->lookups && s->probes[0] > 0);
+  assert(s->resizes > 0 && s->collisions > 0 && s->frees >= s->resizes + 1);
+
+  FILE* f = tmpfile();
+  tc_stats_dump(f, (TObject*) map);
+  char json[512];
+  rewind(f);
+  size_t n = fread(json, 1, sizeof(json) - 1, f);
+  json[n] = '\0';
+  fclose(f);
+  assert(strncmp(json, "{\"type\": \"TCMap\", \"allocs\": ", 28) == 0 && json[n - 2] == '}');
+  assert(tc_stats_get((TObject*) v) == &v->stats);
+  tc_stats_reset((TObject*) map);
+  assert(s->lookups == 0 && s->allocs == 0);
+
+  TCHash* h = $new(TCHash);
+  for (uint64_t i = 0; i < 1024; ++i) $(TCHash, h, set, i, NULL);
+  assert(h->stats.allocs == 1024 && h->stats.lookups == 1024 && h->stats.probes[0] == 1);
+  $unref(h);
+  (void) steps;
+  (void) refs;
+  (void) probes;
+  (void) s;
+#else
+  assert(tc_stats_get(NULL) == NULL && tc_stats_get((TObject*) map) == NULL);
+  (void) key;
+#endif
+
+  $unref(map);
+  $unref(v);
+}
+
+void test_memory_usage() {
+  TCString* s = $str("abc");
+  assert($(TCString, s, memory_usage, true) == sizeof(TCString) + 4);
+
+  TCVector* v = $new(TCVector, 16, 0);
+  assert($(TCVector, v, memory_usage, false) == sizeof(TCVector) + sizeof(TObject*) * 16);
+  for (int i = 0; i < 10; ++i) $(TCVector, v, push_back, (TObject*) s);
+  size_t shallow = $(TCVector, v, memory_usage, false);
+  assert($(TCVector, v, memory_usage, true) == shallow + 10 * (sizeof(TCString) + 4));
+  assert(tc_memory_usage(NULL, true) == 0);
+  TObject* o = $new(TObject);
+  assert(tc_memory_usage(o, true) == sizeof(TObject));
+  $unref(o);
+
+  TCMap* map = $new(TCMap);
+  char key[64];
+  for (int i = 0; i < 100; ++i) {
+    snprintf(key, sizeof(key), "key%d", i);
+    $(TCMap, map, set, key, (TObject*) s);
+  }
+  shallow = $(TCMap, map, memory_usage, false);
+  assert(shallow >= sizeof(TCMap) + 100 * (sizeof(TCMapPair) + sizeof(TCListNode) + sizeof(TCMapSlot)));
+  assert($(TCMap, map, memory_usage, true) == shallow + 100 * (sizeof(TCString) + 4));
+  snprintf(key, sizeof(key), "%s", "a key that does not fit into a pooled block");
+  $(TCMap, map, set, key, NULL);
+  assert($(TCMap, map, memory_usage, false) >= shallow + sizeof(TCMapPair) + strlen(key) + 1);
+
+  /* Nested containers are measured deeply. */
+  TCVector* outer = $new(TCVector, 1, 0);
+  $(TCVector, outer, push_back, (TObject*) map);
+  assert(tc_memory_usage((TObject*) outer, true) == sizeof(TCVector) + sizeof(TObject*) + $(TCMap, map, memory_usage, true));
+  $unref(outer);
+
+  TCHash* h = $new(TCHash);
+  for (uint64_t i = 0; i < 50; ++i) $(TCHash, h, set, i, (TObject*) s);
+  assert($(TCHash, h, memory_usage, false) == sizeof(TCHash) + 50 * sizeof(TCHashRBTree));
+  assert($(TCHash, h, memory_usage, true) == sizeof(TCHash) + 50 * (sizeof(TCHashRBTree) + sizeof(TCString) + 4));
+  $unref(h);
+
+  TCPool* pool = $new(TCPool, 16, 8);
+  assert($(TCPool, pool, memory_usage, false) == sizeof(TCPool));
+  void* b = $(TCPool, pool, alloc);
+  size_t one = $(TCPool, pool, memory_usage, false);
+  assert(one > sizeof(TCPool) + 16 * 8);
+  $(TCPool, pool, free, b);
+  assert($(TCPool, pool, memory_usage, false) == one);
+  $unref(pool);
+
+  TCFrozenMap* f = $(TCMap, map, freeze);
+  assert($(TCFrozenMap, f, memory_usage, true) > $(TCFrozenMap, f, memory_usage, false));
+  $unref(f);
+
+  TCPersistentMap* pm = $new(TCPersistentMap);
+  TCPersistentMap* pm2 = $(TCPersistentMap, pm, set, "key", (TObject*) s);
+  assert($(TCPersistentMap, pm2, memory_usage, false) > $(TCPersistentMap, pm, memory_usage, false));
+  assert($(TCPersistentMap, pm2, memory_usage, true) == $(TCPersistentMap, pm2, memory_usage, false) + sizeof(TCString) + 4);
+  $unref(pm2);
+  $unref(pm);
+
+  TCCache* cache = $new(TCCache, TC_CACHE_LRU, 16);
+  size_t empty = $(TCCache, cache, memory_usage, false);
+  $(TCCache, cache, put, "key", (TObject*) s);
+  assert($(TCCache, cache, memory_usage, true) >= empty + 4 + sizeof(TCString) + 4);
+  $unref(cache);
+
+  TCQueue* q = $new(TCQueue, 8);
+  $(TCQueue, q, push, (TObject*) s);
+  assert($(TCQueue, q, memory_usage, true) == sizeof(TCQueue) + sizeof(TObject*) * 8 + sizeof(TCString) + 4);
+  $unref(q);
+
+  TCChunkList* cl = $new(TCChunkList);
+  TCList* l = $new(TCList);
+  for (int i = 0; i < 3; ++i) {
+    $(TCChunkList, cl, append, (TObject*) s);
+    $(TCList, l, append, (TObject*) s);
+  }
+  assert($(TCChunkList, cl, memory_usage, true) == $(TCChunkList, cl, memory_usage, false) + 3 * (sizeof(TCString) + 4));
+  assert($(TCList, l, memory_usage, false) == sizeof(TCList) + 3 * sizeof(TCListNode));
+  $unref(l);
+  $unref(cl);
+
+  TCArena* arena = $new(TCArena, 1024);
+  $(TCArena, arena, alloc, 10);
+  assert($(TCArena, arena, memory_usage, false) >= sizeof(TCArena) + 1024);
+  $unref(arena);
+
+  (void) shallow;
+  (void) one;
+  (void) empty;
+  $unref(map);
+  $unref(v);
+  $unref(s);
+}
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+TObject* test_concurrent_hashes_make(const char* key, void* userdata) {
+  return (TObject*) $new(TCString, key);
+}
+
+void test_concurrent_hashes_len(TObject* value, void* userdata) {
+  *(size_t*) userdata += tc_string_len_fast((TCString*) value);
+}
+
+typedef struct TestConcurrentWork {
+  TCConcurrentHash* h;
+  TCVector* keys;
+  size_t id;
+} TestConcurrentWork;
+
+int test_concurrent_hashes_worker(void* arg) {
+  TestConcurrentWork* w = (TestConcurrentWork*) arg;
+  size_t sum = 0;
+  for (size_t round = 0; round < 16; ++round) {
+    for (size_t i = w->id; i < w->keys->len; i += 4) {
+      TCString* k = (TCString*) w->keys->arr[i];
+      if (round % 4 == 3) {
+        $(TCConcurrentHash, w->h, remove, k->str);
+      } else {
+        $(TCConcurrentHash, w->h, put, k->str, (TObject*) k);
+      }
+    }
+    for (size_t i = 0; i < w->keys->len; ++i) {
+      $(TCConcurrentHash, w->h, visit, ((TCString*) w->keys->arr[i])->str, test_concurrent_hashes_len, &sum);
+    }
+  }
+  return (int) (sum & 1);
+}
+
+void test_concurrent_hashes() {
+  TCConcurrentHash* h = $new(TCConcurrentHash, 2);
+  TCVector* v = get_vector();
+
+  for (int i = 0; i < v->len; ++i) {
+    TCString* k = (TCString*) v->arr[i];
+    $(TCConcurrentHash, h, put, k->str, (TObject*) k);
+  }
+  assert($(TCConcurrentHash, h, size) == v->len);
+
+  TObject* o = $(TCConcurrentHash, h, get, "42");
+  assert(o == v->arr[42]);
+  $unref(o);
+
+  size_t len = 0;
+  bool found = $(TCConcurrentHash, h, visit, "100", test_concurrent_hashes_len, &len);
+  assert(found && len == 3);
+
+  bool removed = $(TCConcurrentHash, h, remove, "100");
+  found = $(TCConcurrentHash, h, visit, "100", test_concurrent_hashes_len, &len);
+  assert(removed && !found && $(TCConcurrentHash, h, size) == v->len - 1);
+  (void) removed;
+  (void) found;
+
+  o = $(TCConcurrentHash, h, compute_if_absent, "new", test_concurrent_hashes_make, NULL);
+  TObject* o2 = $(TCConcurrentHash, h, compute_if_absent, "new", test_concurrent_hashes_make, NULL);
+  assert(o == o2 && strcmp(((TCString*) o)->str, "new") == 0);
+  $unref(o2);
+  $unref(o);
+  size_t shallow = $(TCConcurrentHash, h, memory_usage, false);
+  assert(shallow > sizeof(TCConcurrentHash) + v->len * strlen("1"));
+  assert($(TCConcurrentHash, h, memory_usage, true) > shallow);
+  (void) shallow;
+
+  TestConcurrentWork work[4];
+  thrd_t tids[4];
+  for (size_t i = 0; i < 4; ++i) {
+    work[i].h = h;
+    work[i].keys = v;
+    work[i].id = i;
+    thrd_create(&tids[i], test_concurrent_hashes_worker, &work[i]);
+  }
+  for (size_t i = 0; i < 4; ++i) {
+    thrd_join(tids[i], NULL);
+  }
+
+  $unref(h);
+  $unref(v);
+}
+#endif
+
 int main() {
   /* old containers */
   test_strings();
   test_lists();
+  test_lists_ops();
   test_vectors();
   test_queues();
   test_maps();
 
   /* new containers */
   test_hashes();
+  test_pools();
+  test_arenas();
+  test_intrusive_lists();
+  test_chunk_lists();
+  test_iterators();
+  test_pipes();
+  test_caches();
+  test_persistent_maps();
+  test_serialization();
+  test_frozen_maps();
+  test_journals();
+  test_stats();
+  test_memory_usage();
+#if defined(TC_THREADSAFE_REFCOUNT)
+  test_concurrent_hashes();
+#endif
 
   /* type stuff */
   to_dump_type_tree();
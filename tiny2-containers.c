@@ -3,12 +3,24 @@
 #include "tiny2-containers.h"
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
-#define strdup _strdup
+#if defined(TC_THREADSAFE_REFCOUNT)
+#include <stdatomic.h>
+#include <threads.h>
+#endif
+
+#if !(defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
 #endif
 
 /*
@@ -23,6 +35,347 @@ uint64_t tc_djb2(const char* str) {
   return hash;
 }
 
+static uint64_t tc_mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+ * TCStats
+ */
+
+#if defined(TC_STATS)
+TCStats tc_stats_global;
+
+#define TC_STATS_ADD(s, field, n) ((s)->field += (n), TC_STATS_GLOBAL_ADD(field, n))
+
+static size_t tc_stats_bucket(uint64_t n) {
+  size_t b = 0;
+  while (n != 0 && b < TC_STATS_HISTOGRAM - 1) {
+    n >>= 1;
+    ++b;
+  }
+  return b;
+}
+#else
+#define TC_STATS_ADD(s, field, n) ((void) 0)
+#endif
+
+#define TC_STATS_ALLOC(s, size) (TC_STATS_ADD(s, allocs, 1), TC_STATS_ADD(s, bytes_allocated, (size)))
+#define TC_STATS_FREE(s, size) (TC_STATS_ADD(s, frees, 1), TC_STATS_ADD(s, bytes_freed, (size)))
+#define TC_STATS_RESIZE(s, old_size, new_size) \
+  (TC_STATS_ADD(s, resizes, 1), TC_STATS_ADD(s, bytes_freed, (old_size)), TC_STATS_ADD(s, bytes_allocated, (new_size)))
+#define TC_STATS_PROBE(s, n) (TC_STATS_ADD(s, lookups, 1), TC_STATS_ADD(s, probes[tc_stats_bucket(n)], 1))
+
+#if defined(TC_STATS)
+static TCStats* tc_stats_of(TObject* container, const char** type) {
+  *type = "global";
+  if (container == NULL) return &tc_stats_global;
+  if ($is(container, TCString)) {
+    *type = "TCString";
+    return &((TCString*) container)->stats;
+  }
+  if ($is(container, TCVector)) {
+    *type = "TCVector";
+    return &((TCVector*) container)->stats;
+  }
+  if ($is(container, TCMap)) {
+    *type = "TCMap";
+    return &((TCMap*) container)->stats;
+  }
+  if ($is(container, TCHash)) {
+    *type = "TCHash";
+    return &((TCHash*) container)->stats;
+  }
+  return NULL;
+}
+#endif
+
+const TCStats* tc_stats_get(TObject* container) {
+#if defined(TC_STATS)
+  const char* type;
+  return tc_stats_of(container, &type);
+#else
+  return NULL;
+#endif
+}
+
+void tc_stats_reset(TObject* container) {
+#if defined(TC_STATS)
+  const char* type;
+  TCStats* s = tc_stats_of(container, &type);
+  if (s != NULL) memset(s, 0, sizeof(*s));
+#endif
+}
+
+void tc_stats_dump(FILE* out, TObject* container) {
+  assert(out != NULL);
+
+#if defined(TC_STATS)
+  const char* type;
+  TCStats* s = tc_stats_of(container, &type);
+  if (s == NULL) {
+    fprintf(out, "null\n");
+    return;
+  }
+  fprintf(out, "{\"type\": \"%s\", \"allocs\": %llu, \"frees\": %llu, "
+          "\"bytes_allocated\": %llu, \"bytes_freed\": %llu, \"resizes\": %llu, "
+          "\"lookups\": %llu, \"probes\": [",
+          type, (unsigned long long) s->allocs, (unsigned long long) s->frees,
+          (unsigned long long) s->bytes_allocated, (unsigned long long) s->bytes_freed,
+          (unsigned long long) s->resizes, (unsigned long long) s->lookups);
+  for (size_t i = 0; i < TC_STATS_HISTOGRAM; ++i) {
+    fprintf(out, "%s%llu", i > 0 ? ", " : "", (unsigned long long) s->probes[i]);
+  }
+  fprintf(out, "], \"collisions\": %llu, \"refs\": %llu, \"unrefs\": %llu, \"iter_steps\": %llu}\n",
+          (unsigned long long) s->collisions, (unsigned long long) s->refs,
+          (unsigned long long) s->unrefs, (unsigned long long) s->iter_steps);
+#else
+  fprintf(out, "null\n");
+#endif
+}
+
+/*
+ * Memory usage
+ */
+
+size_t tc_memory_usage(TObject* obj, bool deep) {
+  if (obj == NULL) return 0;
+  if ($is(obj, TCString)) return $(TCString, obj, memory_usage, deep);
+  if ($is(obj, TCList)) return $(TCList, obj, memory_usage, deep);
+  if ($is(obj, TCVector)) return $(TCVector, obj, memory_usage, deep);
+  if ($is(obj, TCQueue)) return $(TCQueue, obj, memory_usage, deep);
+  if ($is(obj, TCMap)) return $(TCMap, obj, memory_usage, deep);
+  if ($is(obj, TCHash)) return $(TCHash, obj, memory_usage, deep);
+  if ($is(obj, TCPool)) return $(TCPool, obj, memory_usage, deep);
+  if ($is(obj, TCArena)) return $(TCArena, obj, memory_usage, deep);
+  if ($is(obj, TCIntrusiveList)) return $(TCIntrusiveList, obj, memory_usage, deep);
+  if ($is(obj, TCChunkList)) return $(TCChunkList, obj, memory_usage, deep);
+  if ($is(obj, TCCache)) return $(TCCache, obj, memory_usage, deep);
+  if ($is(obj, TCPersistentMap)) return $(TCPersistentMap, obj, memory_usage, deep);
+  if ($is(obj, TCFrozenMap)) return $(TCFrozenMap, obj, memory_usage, deep);
+#if defined(TC_THREADSAFE_REFCOUNT)
+  if ($is(obj, TCConcurrentHash)) return $(TCConcurrentHash, obj, memory_usage, deep);
+#endif
+  return sizeof(TObject);
+}
+
+/*
+ * TCAllocator
+ */
+
+#if defined(_MSC_VER)
+#define TC_THREAD_LOCAL __declspec(thread)
+#else
+#define TC_THREAD_LOCAL _Thread_local
+#endif
+
+#define TC_ALLOC(a, size) ((a)->alloc((a)->ctx, (size)))
+#define TC_REALLOC(a, ptr, old_size, new_size) ((a)->realloc((a)->ctx, (ptr), (old_size), (new_size)))
+#define TC_FREE(a, ptr, size) ((a)->free((a)->ctx, (ptr), (size)))
+
+
+static void* tc_malloc_alloc(void* ctx, size_t size) {
+  return malloc(size);
+}
+
+static void* tc_malloc_realloc(void* ctx, void* ptr, size_t old_size, size_t new_size) {
+  return realloc(ptr, new_size);
+}
+
+static void tc_malloc_free(void* ctx, void* ptr, size_t size) {
+  free(ptr);
+}
+
+const TCAllocator tc_malloc_allocator = {
+  tc_malloc_alloc,
+  tc_malloc_realloc,
+  tc_malloc_free,
+  NULL,
+  false
+};
+
+static TC_THREAD_LOCAL const TCAllocator* tc_default_allocator = NULL;
+
+const TCAllocator* tc_allocator_set_default(const TCAllocator* allocator) {
+  const TCAllocator* old = tc_allocator_get_default();
+  tc_default_allocator = allocator;
+  return old;
+}
+
+const TCAllocator* tc_allocator_get_default(void) {
+  return (tc_default_allocator != NULL ? tc_default_allocator : &tc_malloc_allocator);
+}
+
+/*
+ * Reference counting
+ */
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+static atomic_int tc_refcount_lock = 0;
+static TC_THREAD_LOCAL unsigned tc_refcount_depth = 0;
+
+static void tc_refcount_acquire(void) {
+  if (tc_refcount_depth++ > 0) return;
+
+  unsigned spins = 0;
+  for (;;) {
+    if (atomic_load_explicit(&tc_refcount_lock, memory_order_relaxed) == 0 &&
+        atomic_exchange_explicit(&tc_refcount_lock, 1, memory_order_acquire) == 0) {
+      return;
+    }
+    if (++spins >= 64) {
+      spins = 0;
+      thrd_yield();
+    }
+  }
+}
+
+static void tc_refcount_release(void) {
+  if (--tc_refcount_depth > 0) return;
+
+  atomic_store_explicit(&tc_refcount_lock, 0, memory_order_release);
+}
+#endif
+
+void tc_ref(void* obj) {
+  if (obj == NULL) return;
+  TC_STATS_GLOBAL_ADD(refs, 1);
+#if defined(TC_THREADSAFE_REFCOUNT)
+  tc_refcount_acquire();
+  $ref(obj);
+  tc_refcount_release();
+#else
+  $ref(obj);
+#endif
+}
+
+void tc_unref(void* obj) {
+  if (obj == NULL) return;
+  TC_STATS_GLOBAL_ADD(unrefs, 1);
+#if defined(TC_THREADSAFE_REFCOUNT)
+  tc_refcount_acquire();
+  $unref(obj);
+  tc_refcount_release();
+#else
+  $unref(obj);
+#endif
+}
+
+#if defined(__GNUC__)
+#define TC_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define TC_PREFETCH(p) ((void) 0)
+#endif
+
+#define TC_PREFETCH_DISTANCE 8
+
+void tc_ref_many(TObject* const* objs, size_t n) {
+#if defined(TC_THREADSAFE_REFCOUNT)
+  tc_refcount_acquire();
+#endif
+  for (size_t i = 0; i < n; ++i) {
+    if (i + TC_PREFETCH_DISTANCE < n) TC_PREFETCH(objs[i + TC_PREFETCH_DISTANCE]);
+    if (objs[i] != NULL) $ref(objs[i]);
+  }
+  TC_STATS_GLOBAL_ADD(refs, n);
+#if defined(TC_THREADSAFE_REFCOUNT)
+  tc_refcount_release();
+#endif
+}
+
+void tc_unref_many(TObject* const* objs, size_t n) {
+#if defined(TC_THREADSAFE_REFCOUNT)
+  tc_refcount_acquire();
+#endif
+  for (size_t i = 0; i < n; ++i) {
+    if (i + TC_PREFETCH_DISTANCE < n) TC_PREFETCH(objs[i + TC_PREFETCH_DISTANCE]);
+    if (objs[i] != NULL) $unref(objs[i]);
+  }
+  TC_STATS_GLOBAL_ADD(unrefs, n);
+#if defined(TC_THREADSAFE_REFCOUNT)
+  tc_refcount_release();
+#endif
+}
+
+/* With shared reference counts every $ref goes through the lock; the
+ * caller's own reference already pins self for the duration of a method
+ * call, so the self references are dropped rather than serialized. */
+#if defined(TC_THREADSAFE_REFCOUNT)
+#define TC_REF(o) tc_ref(o)
+#define TC_UNREF(o) tc_unref(o)
+#define TC_SELF_REF(c) ((void) 0)
+#define TC_SELF_UNREF(c) ((void) 0)
+#else
+#define TC_REF(o) (TC_STATS_GLOBAL_ADD(refs, 1), $ref(o))
+#define TC_UNREF(o) (TC_STATS_GLOBAL_ADD(unrefs, 1), $unref(o))
+#define TC_SELF_REF(c) TC_REF(c)
+#define TC_SELF_UNREF(c) TC_UNREF(c)
+#endif
+
+#define TC_OWNED_REF(c, o) do { if (!(c)->borrowed) TC_REF(o); } while (0)
+#define TC_OWNED_UNREF(c, o) do { if (!(c)->borrowed) TC_UNREF(o); } while (0)
+#define TC_OWNED_SELF_REF(c) do { if (!(c)->borrowed) TC_SELF_REF(c); } while (0)
+#define TC_OWNED_SELF_UNREF(c) do { if (!(c)->borrowed) TC_SELF_UNREF(c); } while (0)
+
+static char* tc_strndup(const TCAllocator* a, const char* str, size_t len) {
+  char* r = (char*) TC_ALLOC(a, len + 1);
+  memcpy(r, str, len);
+  r[len] = '\0';
+  return r;
+}
+
+/* A buffer's holders share one count; a buffer with a single holder has
+ * no TCShared at all. */
+typedef struct TCShared {
+#if defined(TC_THREADSAFE_REFCOUNT)
+  atomic_size_t refs;
+#else
+  size_t refs;
+#endif
+} TCShared;
+
+static TCShared* tc_shared_acquire(const TCAllocator* a, TCShared* sh) {
+  if (sh == NULL) {
+    sh = (TCShared*) TC_ALLOC(a, sizeof(TCShared));
+#if defined(TC_THREADSAFE_REFCOUNT)
+    atomic_init(&sh->refs, 2);
+#else
+    sh->refs = 2;
+#endif
+    return sh;
+  }
+#if defined(TC_THREADSAFE_REFCOUNT)
+  atomic_fetch_add_explicit(&sh->refs, 1, memory_order_relaxed);
+#else
+  ++sh->refs;
+#endif
+  return sh;
+}
+
+static bool tc_shared_unique(TCShared* sh) {
+#if defined(TC_THREADSAFE_REFCOUNT)
+  return sh == NULL || atomic_load_explicit(&sh->refs, memory_order_acquire) == 1;
+#else
+  return sh == NULL || sh->refs == 1;
+#endif
+}
+
+/* Drops one holder. Returns true when the caller was the last one and so
+ * must free the buffer itself. */
+static bool tc_shared_release(const TCAllocator* a, TCShared* sh) {
+  if (sh == NULL) return true;
+#if defined(TC_THREADSAFE_REFCOUNT)
+  bool last = atomic_fetch_sub_explicit(&sh->refs, 1, memory_order_acq_rel) == 1;
+#else
+  bool last = --sh->refs == 0;
+#endif
+  if (last) TC_FREE(a, sh, sizeof(TCShared));
+  return last;
+}
+
 /*
  * TCString
  */
@@ -37,6 +390,8 @@ static void tc_string_append(TCString* self, TCString* other);
 static void tc_string_appendc(TCString* self, const char* other);
 static void tc_string_prepend(TCString* self, TCString* other);
 static void tc_string_prependc(TCString* self, const char* other);
+static TCString* tc_string_snapshot(TCString* self);
+static size_t tc_string_memory_usage(TCString* self, bool deep);
 
 $mtable_define(TCString, tc_string_constructor, tc_string_destructor, tc_string_init_vtable)
   $mtable_define_method(TCStringStr, str, tc_string_str)
@@ -46,6 +401,8 @@ $mtable_define(TCString, tc_string_constructor, tc_string_destructor, tc_string_
   $mtable_define_method(TCStringAppendC, appendc, tc_string_appendc)
   $mtable_define_method(TCStringPrepend, prepend, tc_string_prepend)
   $mtable_define_method(TCStringPrependC, prependc, tc_string_prependc)
+  $mtable_define_method(TCStringSnapshot, snapshot, tc_string_snapshot)
+  $mtable_define_method(TCStringMemoryUsage, memory_usage, tc_string_memory_usage)
 $mtable_define_end(TCString)
 
 $vtable_define(TCString)
@@ -56,9 +413,19 @@ static TCString* tc_string_constructor(TCString* self, const char* str) {
   $setup(TCString, self, tc_string_destructor);
   $reg(TCString, TObject);
 
+  self->allocator = tc_allocator_get_default();
+  self->borrowed = self->allocator->scoped;
+  self->shared = NULL;
+#if defined(TC_STATS)
+  memset(&self->stats, 0, sizeof(self->stats));
+#endif
+
   if (str) {
-    self->str = strdup(str);
+    self->len = strlen(str);
+    self->str = tc_strndup(self->allocator, str, self->len);
+    TC_STATS_ALLOC(&self->stats, self->len + 1);
   } else {
+    self->len = 0;
     self->str = NULL;
   }
 
@@ -69,8 +436,9 @@ static void tc_string_destructor(TCString* self) {
   assert(self != NULL);
   assert($is(self, TCString));
 
-  if (self->str != NULL) {
-    free(self->str);
+  if (self->str != NULL && tc_shared_release(self->allocator, self->shared)) {
+    TC_FREE(self->allocator, self->str, self->len + 1);
+    TC_STATS_FREE(&self->stats, self->len + 1);
   }
 
   $destroy_parent(TObject, self);
@@ -90,104 +458,108 @@ static char* tc_string_str(TCString* self) {
 static size_t tc_string_size(TCString* self) {
   assert(self != NULL);
   assert($is(self, TCString));
-  
-  $ref(self);
-  
-  size_t s = strlen(self->str);
-  
-  $unref(self);
 
-  return s;
+  return self->len;
 }
 
 static TCString* tc_string_copy(TCString* self) {
   assert(self != NULL);
   assert($is(self, TCString));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
   
   TCString* s = $new(TCString, self->str);
   
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
   
   return s;
 }
 
-static void tc_concat(char** out, const char* s1, const char* s2) {
-#if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
-  size_t sz = strlen(s1) + strlen(s2) + 1;
-  char* r = (char*)malloc(sz);
-  memset(r, 0, sz);
-  strcat_s(r, sz, s1);
-  strcat_s(r, sz, s2);
-  *out = r;
-#else
-  asprintf(out, "%s%s", s1, s2);
-#endif
+static void tc_string_concat(TCString* self, const char* s1, size_t l1, const char* s2, size_t l2) {
+  char* r = (char*) TC_ALLOC(self->allocator, l1 + l2 + 1);
+  if (l1 > 0) memcpy(r, s1, l1);
+  if (l2 > 0) memcpy(r + l1, s2, l2);
+  r[l1 + l2] = '\0';
+  TC_STATS_ALLOC(&self->stats, l1 + l2 + 1);
+
+  if (self->str != NULL && tc_shared_release(self->allocator, self->shared)) {
+    TC_FREE(self->allocator, self->str, self->len + 1);
+    TC_STATS_FREE(&self->stats, self->len + 1);
+  }
+  self->shared = NULL;
+  self->str = r;
+  self->len = l1 + l2;
 }
 
 static void tc_string_append(TCString* self, TCString* other) {
   assert(self != NULL);
   assert($is(self, TCString));
 
-  $ref(self);
-  $ref(other);
-
-  char* old = self->str;
-
-  tc_concat(&(self->str), old, other->str);
+  TC_OWNED_SELF_REF(self);
+  TC_OWNED_REF(self, other);
 
-  free(old);
+  tc_string_concat(self, self->str, self->len, other->str, other->len);
 
-  $unref(other);
-  $unref(self);
+  TC_OWNED_UNREF(self, other);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static void tc_string_appendc(TCString* self, const char* other) {
   assert(self != NULL);
   assert($is(self, TCString));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  char* old = self->str;
+  tc_string_concat(self, self->str, self->len, other, strlen(other));
 
-  tc_concat(&(self->str), old, other);
-
-  free(old);
-
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static void tc_string_prepend(TCString* self, TCString* other) {
   assert(self != NULL);
   assert($is(self, TCString));
 
-  $ref(self);
-  $ref(other);
-
-  char* old = self->str;
-
-  tc_concat(&(self->str), other->str, old);
+  TC_OWNED_SELF_REF(self);
+  TC_OWNED_REF(self, other);
 
-  free(old);
+  tc_string_concat(self, other->str, other->len, self->str, self->len);
 
-  $unref(other);
-  $unref(self);
+  TC_OWNED_UNREF(self, other);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static void tc_string_prependc(TCString* self, const char* other) {
   assert(self != NULL);
   assert($is(self, TCString));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  char* old = self->str;
+  tc_string_concat(self, other, strlen(other), self->str, self->len);
+
+  TC_OWNED_SELF_UNREF(self);
+}
+
+static TCString* tc_string_snapshot(TCString* self) {
+  assert(self != NULL);
+  assert($is(self, TCString));
 
-  tc_concat(&(self->str), other, old);
+  TCString* s = $new(TCString, NULL);
+  s->allocator = self->allocator;
+  s->borrowed = self->borrowed;
+  if (self->str != NULL) {
+    self->shared = tc_shared_acquire(self->allocator, self->shared);
+    s->shared = self->shared;
+    s->str = self->str;
+    s->len = self->len;
+  }
+  return s;
+}
 
-  free(old);
+static size_t tc_string_memory_usage(TCString* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCString));
 
-  $unref(self);
+  return sizeof(TCString) + (self->str != NULL ? self->len + 1 : 0);
 }
 
 /*
@@ -215,7 +587,8 @@ static TCListNode* tc_list_node_constructor(TCListNode* self, TObject* obj) {
   $setup(TCListNode, self, tc_list_node_destructor);
   $reg(TCListNode, TObject);
 
-  if (obj != NULL) $ref(obj);
+  self->borrowed = false;
+  if (obj != NULL) TC_REF(obj);
   self->obj = obj;
 
   self->prev = NULL;
@@ -227,7 +600,7 @@ static TCListNode* tc_list_node_constructor(TCListNode* self, TObject* obj) {
 static void tc_list_node_destructor(TCListNode* self) {
   assert(self != NULL);
   assert($is(self, TCListNode));
-  if (self->obj != NULL) $unref(self->obj);
+  if (self->obj != NULL) TC_OWNED_UNREF(self, self->obj);
   $destroy_parent(TObject, self);
 }
 
@@ -239,12 +612,12 @@ static TObject* tc_list_node_obj(TCListNode* self) {
   assert(self != NULL);
   assert($is(self, TCListNode));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
   TObject* obj = self->obj;
-  $ref(obj);
+  TC_OWNED_REF(self, obj);
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 
   return obj;
 }
@@ -253,12 +626,12 @@ static TCListNode* tc_list_node_next(TCListNode* self) {
   assert(self != NULL);
   assert($is(self, TCListNode));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  if (self->next) $ref(self->next);
+  if (self->next) TC_OWNED_REF(self, self->next);
   TCListNode* n = self->next;
   
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 
   return n;
 }
@@ -267,12 +640,12 @@ static TCListNode* tc_list_node_prev(TCListNode* self) {
   assert(self != NULL);
   assert($is(self, TCListNode));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
   
-  if (self->prev) $ref(self->prev);
+  if (self->prev) TC_OWNED_REF(self, self->prev);
   TCListNode* n = self->prev;
   
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 
   return n;
 }
@@ -288,12 +661,22 @@ static void tc_list_append(TCList* self, TObject* obj);
 static void tc_list_prepend(TCList* self, TObject* obj);
 static void tc_list_remove(TCList* self, TCListNode* n);
 static void tc_list_foreach(TCList* self, TCListIterator iter, void* userdata);
+static void tc_list_splice(TCList* self, TCList* other, TCListNode* first, TCListNode* last);
+static TCList* tc_list_split_at(TCList* self, TCListNode* n);
+static void tc_list_concat(TCList* self, TCList* other);
+static void tc_list_sort(TCList* self, TCListCompare cmp, void* userdata);
+static size_t tc_list_memory_usage(TCList* self, bool deep);
 
 $mtable_define(TCList, tc_list_constructor, tc_list_destructor, tc_list_init_vtable)
   $mtable_define_method(TCListAppend, append, tc_list_append)
   $mtable_define_method(TCListPrepend, prepend, tc_list_prepend)
   $mtable_define_method(TCListRemove, remove, tc_list_remove)
   $mtable_define_method(TCListForeach, foreach, tc_list_foreach)
+  $mtable_define_method(TCListSplice, splice, tc_list_splice)
+  $mtable_define_method(TCListSplitAt, split_at, tc_list_split_at)
+  $mtable_define_method(TCListConcat, concat, tc_list_concat)
+  $mtable_define_method(TCListSort, sort, tc_list_sort)
+  $mtable_define_method(TCListMemoryUsage, memory_usage, tc_list_memory_usage)
 $mtable_define_end(TCList)
 
 $vtable_define(TCList)
@@ -306,6 +689,8 @@ static TCList* tc_list_constructor(TCList* self) {
 
   self->head = NULL;
   self->tail = NULL;
+  self->len = 0;
+  self->borrowed = tc_allocator_get_default()->scoped;
 
   return self;
 }
@@ -313,14 +698,23 @@ static TCList* tc_list_constructor(TCList* self) {
 static void tc_list_destructor(TCList* self) {
   assert(self != NULL);
   assert($is(self, TCList));
-  TCListNode* next = NULL;
+  TObject* batch[64];
+  size_t len = 0;
   TCListNode* n = self->head;
   while (n != NULL) {
-    next = n->next;
-    TC_LIST_UNLINK_NODE(n);
-    $unref(n);
+    TCListNode* next = n->next;
+    if (next != NULL) TC_PREFETCH(next->next);
+    n->prev = NULL;
+    n->next = NULL;
+    n->list = NULL;
+    batch[len++] = (TObject*) n;
+    if (len == 64) {
+      tc_unref_many(batch, len);
+      len = 0;
+    }
     n = next;
   }
+  tc_unref_many(batch, len);
   $destroy_parent(TObject, self);
 }
 
@@ -328,13 +722,22 @@ static void tc_list_init_vtable(TCListVTable* v) {
   $vtable_init(v, TCList, TObject);
 }
 
+static TCListNode* tc_list_new_node(TCList* self, TObject* obj) {
+  if (!self->borrowed) return $new(TCListNode, obj);
+
+  TCListNode* n = $new(TCListNode, NULL);
+  n->borrowed = true;
+  n->obj = obj;
+  return n;
+}
+
 static void tc_list_append(TCList* self, TObject* obj) {
   assert(self != NULL);
   assert($is(self, TCList));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  TCListNode* n = $new(TCListNode, obj);
+  TCListNode* n = tc_list_new_node(self, obj);
 
   if (self->head == NULL) {
     self->head = n;
@@ -348,17 +751,18 @@ static void tc_list_append(TCList* self, TObject* obj) {
   }
 
   n->list = self;
+  ++self->len;
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static void tc_list_prepend(TCList* self, TObject* obj) {
   assert(self != NULL);
   assert($is(self, TCList));
   
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  TCListNode* n = $new(TCListNode, obj);
+  TCListNode* n = tc_list_new_node(self, obj);
 
   if (self->head == NULL) {
     self->head = n;
@@ -372,17 +776,21 @@ static void tc_list_prepend(TCList* self, TObject* obj) {
   }
 
   n->list = self;
+  ++self->len;
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static void tc_list_remove(TCList* self, TCListNode* n) {
   assert(self != NULL);
   assert($is(self, TCList));
   
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  if (n->list != self) return;
+  if (n->list != self) {
+    TC_OWNED_SELF_UNREF(self);
+    return;
+  }
 
   if (n == self->head && n == self->tail) {
     self->head = NULL;
@@ -395,36 +803,162 @@ static void tc_list_remove(TCList* self, TCListNode* n) {
   if (n == self->tail)
     self->tail = n->prev;
 
-  TCListNode* l = TO_CALL(TCListNode, n, prev);
-  TCListNode* r = TO_CALL(TCListNode, n, next);
+  TCListNode* l = n->prev;
+  TCListNode* r = n->next;
   TC_LIST_UNLINK_NODE(n);
   TC_LIST_LINK_NODES(l, r);
-  if (l != NULL) $unref(l); 
-  if (r != NULL) $unref(r);
+  n->list = NULL;
+  --self->len;
 
-  $unref(n);
+  TC_UNREF(n);
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static void tc_list_foreach(TCList* self, TCListIterator iter, void* userdata) {
   assert(self != NULL);
   assert($is(self, TCList));
   
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
   TCListNode* next = NULL;
   TCListNode* n = self->head;
   bool c = true;
   while (n != NULL && c == true) {
-    $ref(n);
+    TC_OWNED_REF(self, n);
     next = n->next;
     c = iter(self, n, userdata);
-    $unref(n);
+    TC_OWNED_UNREF(self, n);
     n = next;
   }
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
+}
+
+static void tc_list_splice(TCList* self, TCList* other, TCListNode* first, TCListNode* last) {
+  assert(self != NULL);
+  assert($is(self, TCList));
+  assert(other != NULL);
+  assert($is(other, TCList));
+  assert(self->borrowed == other->borrowed);
+
+  if (first == NULL || first->list != other || last == NULL || last->list != other) return;
+
+  TC_OWNED_SELF_REF(self);
+
+  TCListNode* l = first->prev;
+  TCListNode* r = last->next;
+  if (other->head == first) other->head = r;
+  if (other->tail == last) other->tail = l;
+  first->prev = NULL;
+  last->next = NULL;
+  if (l != NULL) l->next = r;
+  if (r != NULL) r->prev = l;
+
+  size_t moved = 0;
+  for (TCListNode* n = first; n != NULL; n = n->next) {
+    n->list = self;
+    ++moved;
+  }
+  other->len -= moved;
+
+  if (self->tail != NULL) {
+    TC_LIST_LINK_NODES(self->tail, first);
+  } else {
+    self->head = first;
+  }
+  self->tail = last;
+  self->len += moved;
+
+  TC_OWNED_SELF_UNREF(self);
+}
+
+static TCList* tc_list_split_at(TCList* self, TCListNode* n) {
+  assert(self != NULL);
+  assert($is(self, TCList));
+
+  TCList* rest = $new(TCList);
+  rest->borrowed = self->borrowed;
+  $(TCList, rest, splice, self, n, self->tail);
+
+  return rest;
+}
+
+static void tc_list_concat(TCList* self, TCList* other) {
+  assert(self != NULL);
+  assert($is(self, TCList));
+  assert(self != other);
+
+  $(TCList, self, splice, other, other->head, other->tail);
+}
+
+static void tc_list_sort(TCList* self, TCListCompare cmp, void* userdata) {
+  assert(self != NULL);
+  assert($is(self, TCList));
+
+  TCListNode* list = self->head;
+  if (list == NULL) return;
+
+  TC_OWNED_SELF_REF(self);
+
+  for (size_t width = 1;; width *= 2) {
+    TCListNode* p = list;
+    TCListNode* tail = NULL;
+    size_t merges = 0;
+    list = NULL;
+
+    while (p != NULL) {
+      ++merges;
+      TCListNode* q = p;
+      size_t psize = 0;
+      while (psize < width && q != NULL) {
+        ++psize;
+        q = q->next;
+      }
+      size_t qsize = width;
+
+      while (psize > 0 || (qsize > 0 && q != NULL)) {
+        TCListNode* e;
+        if (psize == 0 || (qsize > 0 && q != NULL && cmp(q->obj, p->obj, userdata) < 0)) {
+          e = q;
+          q = q->next;
+          --qsize;
+        } else {
+          e = p;
+          p = p->next;
+          --psize;
+        }
+        if (tail != NULL) {
+          tail->next = e;
+        } else {
+          list = e;
+        }
+        e->prev = tail;
+        tail = e;
+      }
+      p = q;
+    }
+    tail->next = NULL;
+
+    if (merges <= 1) {
+      self->head = list;
+      self->tail = tail;
+      break;
+    }
+  }
+
+  TC_OWNED_SELF_UNREF(self);
+}
+
+static size_t tc_list_memory_usage(TCList* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCList));
+
+  size_t n = sizeof(TCList) + sizeof(TCListNode) * self->len;
+  if (deep) {
+    for (TCListNode* node = self->head; node != NULL; node = node->next) n += tc_memory_usage(node->obj, true);
+  }
+  return n;
 }
 
 /*
@@ -435,6 +969,7 @@ static TCVector* tc_vector_constructor(TCVector* self, size_t prealloc, size_t s
 static void tc_vector_destructor(TCVector* self);
 static void tc_vector_init_vtable(TCVectorVTable* v);
 static void tc_vector_push_back(TCVector* self, TObject* obj);
+static void tc_vector_push_back_many(TCVector* self, TObject* const* objs, size_t n);
 static void tc_vector_push_front(TCVector* self, TObject* obj);
 static TObject* tc_vector_pop_back(TCVector* self);
 static TObject* tc_vector_pop_front(TCVector* self);
@@ -442,9 +977,12 @@ static void tc_vector_insert(TCVector* self, TObject* obj, size_t idx);
 static TObject* tc_vector_get(TCVector* self, size_t idx);
 static void tc_vector_remove(TCVector* self, size_t idx);
 static void tc_vector_clear(TCVector* self);
+static TCVector* tc_vector_snapshot(TCVector* self);
+static size_t tc_vector_memory_usage(TCVector* self, bool deep);
 
 $mtable_define(TCVector, tc_vector_constructor, tc_vector_destructor, tc_vector_init_vtable)
   $mtable_define_method(TCVectorPush, push_back, tc_vector_push_back)
+  $mtable_define_method(TCVectorPushMany, push_back_many, tc_vector_push_back_many)
   $mtable_define_method(TCVectorPush, push_front, tc_vector_push_front)
   $mtable_define_method(TCVectorPop, pop_back, tc_vector_pop_back)
   $mtable_define_method(TCVectorPop, pop_front, tc_vector_pop_front)
@@ -452,6 +990,8 @@ $mtable_define(TCVector, tc_vector_constructor, tc_vector_destructor, tc_vector_
   $mtable_define_method(TCVectorGet, get, tc_vector_get)
   $mtable_define_method(TCVectorRemove, remove, tc_vector_remove)
   $mtable_define_method(TCVectorClear, clear, tc_vector_clear)
+  $mtable_define_method(TCVectorSnapshot, snapshot, tc_vector_snapshot)
+  $mtable_define_method(TCVectorMemoryUsage, memory_usage, tc_vector_memory_usage)
 $mtable_define_end(TCVector)
 
 $vtable_define(TCVector)
@@ -466,7 +1006,14 @@ static TCVector* tc_vector_constructor(TCVector* self, size_t prealloc, size_t s
   self->step     = (step     == 0 ? 16 : step);
 
   self->len = 0;
-  self->arr = (TObject**) malloc(sizeof(TObject*) * self->alloc);
+  self->allocator = tc_allocator_get_default();
+  self->borrowed = self->allocator->scoped;
+  self->arr = (TObject**) TC_ALLOC(self->allocator, sizeof(TObject*) * self->alloc);
+  self->shared = NULL;
+#if defined(TC_STATS)
+  memset(&self->stats, 0, sizeof(self->stats));
+#endif
+  TC_STATS_ALLOC(&self->stats, sizeof(TObject*) * self->alloc);
 
   return self;
 }
@@ -474,11 +1021,11 @@ static TCVector* tc_vector_constructor(TCVector* self, size_t prealloc, size_t s
 static void tc_vector_destructor(TCVector* self) {
   assert(self != NULL);
   assert($is(self, TCVector));
-  for (int i = 0; i < self->len; ++i) {
-    if (self->arr[i] != NULL)
-      $unref(self->arr[i]);
+  if (tc_shared_release(self->allocator, self->shared)) {
+    if (!self->borrowed) tc_unref_many(self->arr, self->len);
+    TC_FREE(self->allocator, self->arr, sizeof(TObject*) * self->alloc);
+    TC_STATS_FREE(&self->stats, sizeof(TObject*) * self->alloc);
   }
-  free(self->arr);
   $destroy_parent(TObject, self);
 }
 
@@ -486,42 +1033,95 @@ static void tc_vector_init_vtable(TCVectorVTable* v) {
   $vtable_init(v, TCVector, TObject);
 }
 
+/* Gives self an array of its own before it is changed. The copy is made
+ * before letting go of the shared one, which the other holders may free
+ * as soon as it is released. */
+static void tc_vector_unshare(TCVector* self) {
+  if (self->shared == NULL) return;
+  if (tc_shared_unique(self->shared)) {
+    tc_shared_release(self->allocator, self->shared);
+    self->shared = NULL;
+    return;
+  }
+
+  TObject** arr = (TObject**) TC_ALLOC(self->allocator, sizeof(TObject*) * self->alloc);
+  TC_STATS_ALLOC(&self->stats, sizeof(TObject*) * self->alloc);
+  if (self->len > 0) memcpy(arr, self->arr, sizeof(TObject*) * self->len);
+  if (!self->borrowed) tc_ref_many(arr, self->len);
+  if (tc_shared_release(self->allocator, self->shared)) {
+    if (!self->borrowed) tc_unref_many(self->arr, self->len);
+    TC_FREE(self->allocator, self->arr, sizeof(TObject*) * self->alloc);
+    TC_STATS_FREE(&self->stats, sizeof(TObject*) * self->alloc);
+  }
+  self->shared = NULL;
+  self->arr = arr;
+}
+
 static void tc_vector_push_back(TCVector* self, TObject* obj) {
   assert(self != NULL);
   assert($is(self, TCVector));
   
-  $ref(self);
-  $ref(obj);
+  TC_OWNED_SELF_REF(self);
+  TC_OWNED_REF(self, obj);
+  tc_vector_unshare(self);
   
   if (self->len == self->alloc) {
-    self->arr = realloc(self->arr, sizeof(TObject*) * (self->alloc + self->step));
+    self->arr = TC_REALLOC(self->allocator, self->arr, sizeof(TObject*) * self->alloc, sizeof(TObject*) * (self->alloc + self->step));
+    TC_STATS_RESIZE(&self->stats, sizeof(TObject*) * self->alloc, sizeof(TObject*) * (self->alloc + self->step));
     self->alloc += self->step;
   }
   self->arr[self->len] = obj;
   ++self->len;
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
+}
+
+static void tc_vector_push_back_many(TCVector* self, TObject* const* objs, size_t n) {
+  assert(self != NULL);
+  assert($is(self, TCVector));
+
+  TC_OWNED_SELF_REF(self);
+  tc_vector_unshare(self);
+
+  /* objs may point into arr itself (appending a vector to itself), which
+   * the realloc below can move. */
+  bool aliased = (n > 0 && objs >= self->arr && objs < self->arr + self->len);
+  size_t offset = (aliased ? (size_t) (objs - self->arr) : 0);
+  if (self->len + n > self->alloc) {
+    size_t alloc = self->alloc;
+    while (alloc < self->len + n) alloc += self->step;
+    self->arr = TC_REALLOC(self->allocator, self->arr, sizeof(TObject*) * self->alloc, sizeof(TObject*) * alloc);
+    TC_STATS_RESIZE(&self->stats, sizeof(TObject*) * self->alloc, sizeof(TObject*) * alloc);
+    self->alloc = alloc;
+  }
+  if (aliased) objs = self->arr + offset;
+  if (n > 0) memcpy(self->arr + self->len, objs, sizeof(TObject*) * n);
+  if (!self->borrowed) tc_ref_many(self->arr + self->len, n);
+  self->len += n;
+
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static void tc_vector_push_front(TCVector* self, TObject* obj) {
   assert(self != NULL);
   assert($is(self, TCVector));
   
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
   $(TCVector, self, insert, obj, 0);
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static TObject* tc_vector_pop_back(TCVector* self) {
   assert(self != NULL);
   assert($is(self, TCVector));
   
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
   if (self->len == 0) {
-    $unref(self);
+    TC_OWNED_SELF_UNREF(self);
     return NULL;
   }
+  tc_vector_unshare(self);
   
   TObject* obj = self->arr[0];
   
@@ -532,11 +1132,12 @@ static TObject* tc_vector_pop_back(TCVector* self) {
   --self->len;
 
   if ((self->alloc - self->len) > self->step) {
-    self->arr = realloc(self->arr, sizeof(TObject*) * (self->alloc - self->step));
+    self->arr = TC_REALLOC(self->allocator, self->arr, sizeof(TObject*) * self->alloc, sizeof(TObject*) * (self->alloc - self->step));
+    TC_STATS_RESIZE(&self->stats, sizeof(TObject*) * self->alloc, sizeof(TObject*) * (self->alloc - self->step));
     self->alloc -= self->step;
   }
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 
   return obj;
 }
@@ -545,22 +1146,24 @@ static TObject* tc_vector_pop_front(TCVector* self) {
   assert(self != NULL);
   assert($is(self, TCVector));
   
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
   if (self->len == 0) {
-    $unref(self);
+    TC_OWNED_SELF_UNREF(self);
     return NULL;
   }
+  tc_vector_unshare(self);
 
   TObject* obj = self->arr[self->len-1];
   --self->len;
 
   if ((self->alloc - self->len) > self->step) {
-    self->arr = realloc(self->arr, sizeof(TObject*) * (self->alloc - self->step));
+    self->arr = TC_REALLOC(self->allocator, self->arr, sizeof(TObject*) * self->alloc, sizeof(TObject*) * (self->alloc - self->step));
+    TC_STATS_RESIZE(&self->stats, sizeof(TObject*) * self->alloc, sizeof(TObject*) * (self->alloc - self->step));
     self->alloc -= self->step;
   }
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 
   return obj;
 }
@@ -569,17 +1172,19 @@ static void tc_vector_insert(TCVector* self, TObject* obj, size_t idx) {
   assert(self != NULL);
   assert($is(self, TCVector));
   
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
   if (idx > self->len) {
     $(TCVector, self, push_back, obj);
-    $unref(self);
+    TC_OWNED_SELF_UNREF(self);
     return;
   }
-  $ref(obj);
+  TC_OWNED_REF(self, obj);
+  tc_vector_unshare(self);
 
   if (self->len == self->alloc) {
-    self->arr = realloc(self->arr, sizeof(TObject*) * (self->alloc + self->step));
+    self->arr = TC_REALLOC(self->allocator, self->arr, sizeof(TObject*) * self->alloc, sizeof(TObject*) * (self->alloc + self->step));
+    TC_STATS_RESIZE(&self->stats, sizeof(TObject*) * self->alloc, sizeof(TObject*) * (self->alloc + self->step));
     self->alloc += self->step;
   }
   for (size_t i = self->len; i > idx; --i) {
@@ -588,23 +1193,23 @@ static void tc_vector_insert(TCVector* self, TObject* obj, size_t idx) {
   self->arr[idx] = obj;
   ++self->len;
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static TObject* tc_vector_get(TCVector* self, size_t idx) {
   assert(self != NULL);
   assert($is(self, TCVector));
   
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
   TObject* obj = NULL;
 
   if (idx < self->len) {
-    $ref(self->arr[idx]);
+    TC_OWNED_REF(self, self->arr[idx]);
     obj = self->arr[idx];
   }
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 
   return obj;
 }
@@ -613,34 +1218,68 @@ static void tc_vector_remove(TCVector* self, size_t idx) {
   assert(self != NULL);
   assert($is(self, TCVector));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
   if (idx >= self->len) {
-    $unref(self);
+    TC_OWNED_SELF_UNREF(self);
     return;
   }
-  $unref(self->arr[idx]);
+  tc_vector_unshare(self);
+  TC_OWNED_UNREF(self, self->arr[idx]);
   for (size_t i = idx; i < self->len; ++i) {
     if (i != self->len - 1)
       self->arr[i] = self->arr[i+1];
   }
   --self->len;
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static void tc_vector_clear(TCVector* self) {
   assert(self != NULL);
   assert($is(self, TCVector));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  for (int i = 0; i < self->len; ++i) {
-    if (self->arr[i] != NULL)
-      $unref(self->arr[i]);
+  /* A shared array is left to its other holders rather than copied. */
+  if (tc_shared_release(self->allocator, self->shared)) {
+    if (!self->borrowed) tc_unref_many(self->arr, self->len);
+  } else {
+    self->arr = (TObject**) TC_ALLOC(self->allocator, sizeof(TObject*) * self->alloc);
+    TC_STATS_ALLOC(&self->stats, sizeof(TObject*) * self->alloc);
   }
+  self->shared = NULL;
+  self->len = 0;
+
+  TC_OWNED_SELF_UNREF(self);
+}
+
+static TCVector* tc_vector_snapshot(TCVector* self) {
+  assert(self != NULL);
+  assert($is(self, TCVector));
+
+  TCVector* v = $new(TCVector, 1, self->step);
+  TC_FREE(v->allocator, v->arr, sizeof(TObject*) * v->alloc);
+  TC_STATS_FREE(&v->stats, sizeof(TObject*) * v->alloc);
+  self->shared = tc_shared_acquire(self->allocator, self->shared);
+  v->shared = self->shared;
+  v->allocator = self->allocator;
+  v->borrowed = self->borrowed;
+  v->alloc = self->alloc;
+  v->len = self->len;
+  v->arr = self->arr;
+  return v;
+}
+
+static size_t tc_vector_memory_usage(TCVector* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCVector));
 
-  $unref(self);
+  size_t n = sizeof(TCVector) + sizeof(TObject*) * self->alloc;
+  if (deep) {
+    for (size_t i = 0; i < self->len; ++i) n += tc_memory_usage(self->arr[i], true);
+  }
+  return n;
 }
 
 /*
@@ -653,11 +1292,13 @@ static void tc_queue_init_vtable(TCQueueVTable* v);
 static bool tc_queue_push(TCQueue* self, TObject* obj);
 static TObject* tc_queue_pop(TCQueue* self);
 static TObject* tc_queue_peek(TCQueue* self);
+static size_t tc_queue_memory_usage(TCQueue* self, bool deep);
 
 $mtable_define(TCQueue, tc_queue_constructor, tc_queue_destructor, tc_queue_init_vtable)
   $mtable_define_method(TCQueuePush, push, tc_queue_push)
   $mtable_define_method(TCQueuePop, pop, tc_queue_pop)
   $mtable_define_method(TCQueuePeek, peek, tc_queue_peek)
+  $mtable_define_method(TCQueueMemoryUsage, memory_usage, tc_queue_memory_usage)
 $mtable_define_end(TCQueue)
 
 $vtable_define(TCQueue)
@@ -671,7 +1312,8 @@ static TCQueue* tc_queue_constructor(TCQueue* self, size_t alloc) {
   if (alloc == 0) alloc = 64;
 
   self->alloc = alloc;
-  self->arr = malloc(sizeof(TObject*) * alloc);
+  self->allocator = tc_allocator_get_default();
+  self->arr = (TObject**) TC_ALLOC(self->allocator, sizeof(TObject*) * alloc);
   self->size = 0;
   self->head = 0;
   self->tail = 0;
@@ -683,11 +1325,14 @@ static void tc_queue_destructor(TCQueue* self) {
   assert(self != NULL);
   assert($is(self, TCQueue));
 
-  for (TObject* o = $(TCQueue, self, pop); o != NULL; o = $(TCQueue, self, pop)) {
-    $unref(o);
+  if (self->size > 0) {
+    size_t first = self->alloc - self->head;
+    if (first > self->size) first = self->size;
+    tc_unref_many(self->arr + self->head, first);
+    tc_unref_many(self->arr, self->size - first);
   }
 
-  free(self->arr);
+  TC_FREE(self->allocator, self->arr, sizeof(TObject*) * self->alloc);
 
   $destroy_parent(TObject, self);
 }
@@ -700,21 +1345,22 @@ static bool tc_queue_push(TCQueue* self, TObject* obj) {
   assert(self != NULL);
   assert($is(self, TCQueue));
 
-  $ref(self);
+  TC_SELF_REF(self);
 
   if (self->size >= self->alloc) {
+    TC_SELF_UNREF(self);
     return false;
   }
 
   ++(self->size);
-  $ref(obj);
+  TC_REF(obj);
   self->arr[self->tail] = obj;
   ++(self->tail);
   if (self->tail >= self->alloc) {
     self->tail = 0;
   }
 
-  $unref(self);
+  TC_SELF_UNREF(self);
   return true;
 }
 
@@ -722,9 +1368,10 @@ static TObject* tc_queue_pop(TCQueue* self) {
   assert(self != NULL);
   assert($is(self, TCQueue));
   
-  $ref(self);
+  TC_SELF_REF(self);
 
   if (self->size <= 0) {
+    TC_SELF_UNREF(self);
     return NULL;
   }
 
@@ -735,7 +1382,7 @@ static TObject* tc_queue_pop(TCQueue* self) {
     self->head = 0;
   }
 
-  $unref(self);
+  TC_SELF_UNREF(self);
   return obj;
 }
 
@@ -743,19 +1390,39 @@ static TObject* tc_queue_peek(TCQueue* self) {
   assert(self != NULL);
   assert($is(self, TCQueue));
 
-  $ref(self);
+  TC_SELF_REF(self);
 
   if (self->head == self->tail || self->size <= 0) {
+    TC_SELF_UNREF(self);
     return NULL;
   }
 
   TObject* obj = self->arr[self->head];
-  $ref(obj);
+  TC_REF(obj);
 
-  $unref(self);
+  TC_SELF_UNREF(self);
   return obj;
 }
 
+/* Records mutations for the TCJournal a TCMap or TCHash is attached to. */
+static void tc_journal_log_set(TCJournal* self, const char* key, uint64_t hash, TObject* value);
+static void tc_journal_log_remove(TCJournal* self, uint64_t hash, const char* key);
+static void tc_journal_log_rename(TCJournal* self, const char* old_key, const char* new_key);
+static void tc_journal_log_clear(TCJournal* self);
+
+static size_t tc_queue_memory_usage(TCQueue* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCQueue));
+
+  size_t n = sizeof(TCQueue) + sizeof(TObject*) * self->alloc;
+  if (deep) {
+    for (TCIter it = tc_queue_iter_begin(self); !tc_queue_iter_done(&it); tc_queue_iter_next(&it)) {
+      n += tc_memory_usage(tc_queue_iter_current(&it), true);
+    }
+  }
+  return n;
+}
+
 /*
  * TCMapPair
  */
@@ -776,15 +1443,46 @@ $mtable_define_end(TCMapPair)
 $vtable_define(TCMapPair)
 $vtable_define_end(TCMapPair)
 
+#define TC_MAP_KEY_BLOCK 32
+#define TC_MAP_MIN_BUCKETS 8
+#define TC_MAP_REHASH_STEP 8
+#define TC_MAP_BATCH 64
+
+static void tc_map_pair_free_key(TCMapPair* self) {
+  if (self->key == NULL) return;
+  size_t sz = strlen(self->key) + 1;
+  if (self->pool != NULL && self->pool->block_size >= sz) {
+    $(TCPool, self->pool, free, self->key);
+  } else {
+    TC_FREE(self->allocator, self->key, sz);
+  }
+  self->key = NULL;
+}
+
+static void tc_map_pair_assign_key(TCMapPair* self, const char* key) {
+  size_t sz = strlen(key) + 1;
+  if (self->pool != NULL && self->pool->block_size >= sz) {
+    self->key = (char*) $(TCPool, self->pool, alloc);
+    memcpy(self->key, key, sz);
+  } else {
+    self->key = tc_strndup(self->allocator, key, sz - 1);
+  }
+  self->hash = tc_djb2(self->key);
+}
+
 static TCMapPair* tc_map_pair_constructor(TCMapPair* self, const char* key, TObject* value) {
   $init(TObject, self);
   $setup(TCMapPair, self, tc_map_pair_destructor);
   $reg(TCMapPair, TObject);
 
-  $ref(value);
+  self->pool = NULL;
+  self->allocator = tc_allocator_get_default();
+  self->borrowed = self->allocator->scoped;
+  if (value != NULL) TC_OWNED_REF(self, value);
 
-  self->key = strdup(key);
-  self->hash = tc_djb2(self->key);
+  self->key = NULL;
+  self->hash = 0;
+  if (key != NULL) tc_map_pair_assign_key(self, key);
   self->value = value;
 
   return self;
@@ -794,10 +1492,11 @@ static void tc_map_pair_destructor(TCMapPair* self) {
   assert(self != NULL);
   assert($is(self, TCMapPair));
 
-  $destroy_parent(TObject, self);
+  tc_map_pair_free_key(self);
+  if (self->pool != NULL) TC_UNREF(self->pool);
+  if (self->value != NULL) TC_OWNED_UNREF(self, self->value);
 
-  free(self->key);
-  $unref(self->value);
+  $destroy_parent(TObject, self);
 }
 
 static void tc_map_pair_init_vtable(TCMapPairVTable* v) {
@@ -808,38 +1507,37 @@ static void tc_map_pair_rename(TCMapPair* self, const char* key) {
   assert(self != NULL);
   assert($is(self, TCMapPair));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  free(self->key);
-  self->key = strdup(key);
-  self->hash = tc_djb2(self->key);
+  tc_map_pair_free_key(self);
+  tc_map_pair_assign_key(self, key);
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static void tc_map_pair_set(TCMapPair* self, TObject* value) {
   assert(self != NULL);
   assert($is(self, TCMapPair));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  $unref(self->value);
-  $ref(value);
+  if (self->value != NULL) TC_OWNED_UNREF(self, self->value);
+  if (value != NULL) TC_OWNED_REF(self, value);
   self->value = value;
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static TObject* tc_map_pair_get(TCMapPair* self) {
   assert(self != NULL);
   assert($is(self, TCMapPair));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  $ref(self->value);
+  TC_OWNED_REF(self, self->value);
   TObject* obj = self->value;
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
   return obj;
 }
 
@@ -856,6 +1554,10 @@ static void tc_map_set(TCMap* self, const char* key, TObject* value);
 static void tc_map_rename(TCMap* self, const char* old_key, const char* new_key);
 static void tc_map_remove(TCMap* self, const char* key);
 static void tc_map_remove_by_hash(TCMap* self, uint64_t hash);
+static void tc_map_get_many(TCMap* self, const char* const* keys, size_t n, TObject** out);
+static void tc_map_set_many(TCMap* self, const char* const* keys, TObject* const* values, size_t n);
+static TCFrozenMap* tc_map_freeze(TCMap* self);
+static size_t tc_map_memory_usage(TCMap* self, bool deep);
 
 $mtable_define(TCMap, tc_map_constructor, tc_map_destructor, tc_map_init_vtable)
   $mtable_define_method(TCMapGet, get, tc_map_get)
@@ -864,17 +1566,48 @@ $mtable_define(TCMap, tc_map_constructor, tc_map_destructor, tc_map_init_vtable)
   $mtable_define_method(TCMapRename, rename, tc_map_rename)
   $mtable_define_method(TCMapRemove, remove, tc_map_remove)
   $mtable_define_method(TCMapRemoveByHash, remove_by_hash, tc_map_remove_by_hash)
+  $mtable_define_method(TCMapGetMany, get_many, tc_map_get_many)
+  $mtable_define_method(TCMapSetMany, set_many, tc_map_set_many)
+  $mtable_define_method(TCMapFreeze, freeze, tc_map_freeze)
+  $mtable_define_method(TCMapMemoryUsage, memory_usage, tc_map_memory_usage)
 $mtable_define_end(TCMap)
 
 $vtable_define(TCMap)
 $vtable_define_end(TCMap)
 
-static TCMap* tc_map_constructor(TCMap* self) {
-  $init(TObject, self);
+static TCMapTable* tc_map_table_new(TCMap* self, size_t n, bool zero) {
+  TCMapTable* t = (TCMapTable*) TC_ALLOC(self->allocator, sizeof(TCMapTable) + sizeof(TCMapSlot*) * n);
+  t->mask = n - 1;
+  t->migrated = 0;
+  if (zero) memset(t->buckets, 0, sizeof(TCMapSlot*) * n);
+  TC_STATS_ALLOC(&self->stats, sizeof(TCMapTable) + sizeof(TCMapSlot*) * n);
+  return t;
+}
+
+static void tc_map_table_free(TCMap* self, TCMapTable* t) {
+  if (t == NULL) return;
+  TC_STATS_FREE(&self->stats, sizeof(TCMapTable) + sizeof(TCMapSlot*) * (t->mask + 1));
+  TC_FREE(self->allocator, t, sizeof(TCMapTable) + sizeof(TCMapSlot*) * (t->mask + 1));
+}
+
+static TCMap* tc_map_constructor(TCMap* self) {
+  $init(TObject, self);
   $setup(TCMap, self, tc_map_destructor);
   $reg(TCMap, TObject);
 
+  self->allocator = tc_allocator_get_default();
+  self->borrowed = self->allocator->scoped;
   self->pairs = $new(TCList);
+  self->pairs->borrowed = false;
+  self->keys = $new(TCPool, TC_MAP_KEY_BLOCK, 0);
+  self->slots = $new(TCPool, sizeof(TCMapSlot), 0);
+#if defined(TC_STATS)
+  memset(&self->stats, 0, sizeof(self->stats));
+#endif
+  self->table = tc_map_table_new(self, TC_MAP_MIN_BUCKETS, true);
+  self->old_table = NULL;
+  self->incremental = false;
+  self->journal = NULL;
 
   return self;
 }
@@ -882,139 +1615,329 @@ static TCMap* tc_map_constructor(TCMap* self) {
 static void tc_map_destructor(TCMap* self) {
   assert(self != NULL);
   assert($is(self, TCMap));
-  $unref(self->pairs);
+  tc_map_table_free(self, self->table);
+  tc_map_table_free(self, self->old_table);
+  TC_STATS_ADD(&self->stats, frees, self->pairs->len);
+  TC_STATS_ADD(&self->stats, bytes_freed, (sizeof(TCMapPair) + sizeof(TCMapSlot)) * self->pairs->len);
+  TC_UNREF(self->slots);
+  TC_UNREF(self->pairs);
+  TC_UNREF(self->keys);
 
   $destroy_parent(TObject, self);
 }
 
 static void tc_map_init_vtable(TCMapVTable* v) {
-  $vtable_init(v, TCQueue, TObject);
+  $vtable_init(v, TCMap, TObject);
 }
 
-static TObject* tc_map_get(TCMap* self, const char* key) {
-  assert(self != NULL);
-  assert($is(self, TCMap));
+static void tc_map_migrate(TCMap* self, size_t steps) {
+  TCMapTable* old = self->old_table;
+  TCMapTable* t = self->table;
+  while (steps-- > 0 && old->migrated <= old->mask) {
+    t->buckets[old->migrated] = NULL;
+    t->buckets[old->migrated + old->mask + 1] = NULL;
+    TCMapSlot* s = old->buckets[old->migrated];
+    while (s != NULL) {
+      TCMapSlot* chain = s->chain;
+      TCMapSlot** b = &t->buckets[tc_mix64(s->hash) & t->mask];
+      s->chain = *b;
+      *b = s;
+      s = chain;
+    }
+    old->buckets[old->migrated++] = NULL;
+  }
+  if (old->migrated > old->mask) {
+    tc_map_table_free(self, old);
+    self->old_table = NULL;
+  }
+}
+
+static TCMapSlot** tc_map_bucket(TCMap* self, uint64_t mixed) {
+  TCMapTable* old = self->old_table;
+  if (old != NULL && (mixed & old->mask) >= old->migrated) {
+    return &old->buckets[mixed & old->mask];
+  }
+  return &self->table->buckets[mixed & self->table->mask];
+}
 
-  $ref(self);
+/* Keys with the same djb2 hash share a chain, so a slot only matches a
+ * key when the pair's key is equal too. A NULL key matches by hash alone,
+ * as `get_by_hash` and `remove_by_hash` do. */
+static bool tc_map_slot_matches(TCMapSlot* s, uint64_t hash, const char* key) {
+  return s->hash == hash && (key == NULL || strcmp(((TCMapPair*) s->node->obj)->key, key) == 0);
+}
 
-  uint64_t hash = tc_djb2(key);
-  TObject* obj = $(TCMap, self, get_by_hash, hash);
+static TCMapSlot** tc_map_find_slot(TCMap* self, uint64_t hash, const char* key) {
+  if (self->old_table != NULL) tc_map_migrate(self, TC_MAP_REHASH_STEP);
 
-  $unref(self);
-  return obj;
+  TCMapSlot** s = tc_map_bucket(self, tc_mix64(hash));
+#if defined(TC_STATS)
+  size_t probes = (*s != NULL);
+  while (*s != NULL && !tc_map_slot_matches(*s, hash, key)) {
+    s = &(*s)->chain;
+    probes += (*s != NULL);
+  }
+  TC_STATS_PROBE(&self->stats, probes);
+#else
+  while (*s != NULL && !tc_map_slot_matches(*s, hash, key)) s = &(*s)->chain;
+#endif
+  return s;
 }
 
-typedef struct TCMapIter {
-  uint64_t hash;
-  TCMapPair* pair;
-} TCMapIter;
+static void tc_map_insert_slot(TCMap* self, TCMapSlot* slot) {
+  TCMapTable* t = self->table;
+  if (self->old_table == NULL && self->pairs->len > t->mask + 1) {
+    self->table = tc_map_table_new(self, 2 * (t->mask + 1), false);
+    self->old_table = t;
+    TC_STATS_ADD(&self->stats, resizes, 1);
+    tc_map_migrate(self, self->incremental ? TC_MAP_REHASH_STEP : t->mask + 1);
+  }
 
-static bool tc_map_get_iter(TCList* pairs, TCListNode* pairn, TCMapIter* iter) {
-  TCMapPair* pair = (TCMapPair*) pairn->obj;
-  if (pair->hash == iter->hash) {
-    iter->pair = pair;
-    return false;
-  } else {
-    return true;
+  TCMapSlot** b = tc_map_bucket(self, tc_mix64(slot->hash));
+  if (*b != NULL) TC_STATS_ADD(&self->stats, collisions, 1);
+  slot->chain = *b;
+  *b = slot;
+}
+
+static void tc_map_remove_slot(TCMap* self, uint64_t hash, const char* key) {
+  TCMapSlot** link = tc_map_find_slot(self, hash, key);
+  TCMapSlot* s = *link;
+  if (s != NULL) {
+    if (self->journal != NULL) tc_journal_log_remove(self->journal, hash, key);
+    *link = s->chain;
+    $(TCList, self->pairs, remove, s->node);
+    $(TCPool, self->slots, free, s);
+    TC_STATS_FREE(&self->stats, sizeof(TCMapPair) + sizeof(TCMapSlot));
   }
 }
 
-static TObject* tc_map_get_by_hash(TCMap* self, uint64_t hash) {
+static TObject* tc_map_get(TCMap* self, const char* key) {
   assert(self != NULL);
   assert($is(self, TCMap));
-  
-  $ref(self);
 
-  TCMapIter* iter = (TCMapIter*) malloc(sizeof(TCMapIter));
-  iter->hash = hash;
-  iter->pair = NULL;
-  $(TCList, self->pairs, foreach, (TCListIterator) tc_map_get_iter, (void*) iter);
+  TC_OWNED_SELF_REF(self);
+
+  TCMapSlot* s = *tc_map_find_slot(self, tc_djb2(key), key);
+  TObject* obj = (s != NULL ? ((TCMapPair*) s->node->obj)->value : NULL);
+  if (obj != NULL) TC_OWNED_REF(self, obj);
+
+  TC_OWNED_SELF_UNREF(self);
+  return obj;
+}
 
-  TCMapPair* pair = iter->pair;
+static TObject* tc_map_get_by_hash(TCMap* self, uint64_t hash) {
+  assert(self != NULL);
+  assert($is(self, TCMap));
+  
+  TC_OWNED_SELF_REF(self);
 
-  free(iter);
+  TCMapSlot* s = *tc_map_find_slot(self, hash, NULL);
+  TCMapPair* pair = (s != NULL ? (TCMapPair*) s->node->obj : NULL);
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
   if (pair != NULL) {
-    $ref(pair->value);
+    TC_OWNED_REF(self, pair->value);
     return pair->value;
   } else {
     return NULL;
   }
 }
 
+static void tc_map_set_hashed(TCMap* self, const char* key, uint64_t hash, TObject* value) {
+  if (self->journal != NULL) tc_journal_log_set(self->journal, key, hash, value);
+
+  TCMapSlot* s = *tc_map_find_slot(self, hash, key);
+  if (s != NULL) {
+    $(TCMapPair, (TCMapPair*) s->node->obj, set, value);
+    return;
+  }
+
+  TCMapPair* p = $new(TCMapPair, NULL, NULL);
+  TC_STATS_ALLOC(&self->stats, sizeof(TCMapPair) + sizeof(TCMapSlot));
+  p->allocator = self->allocator;
+  p->borrowed = self->borrowed;
+  if (value != NULL) TC_OWNED_REF(p, value);
+  p->value = value;
+  TC_REF(self->keys);
+  p->pool = self->keys;
+  tc_map_pair_assign_key(p, key);
+  $(TCList, self->pairs, append, (TObject*) p);
+  TC_UNREF(p);
+
+  s = (TCMapSlot*) $(TCPool, self->slots, alloc);
+  s->hash = hash;
+  s->node = self->pairs->tail;
+  tc_map_insert_slot(self, s);
+}
+
 static void tc_map_set(TCMap* self, const char* key, TObject* value) {
   assert(self != NULL);
   assert($is(self, TCMap));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
 
-  TCMapPair* p = $new(TCMapPair, key, value);
-  $(TCList, self->pairs, append, (TObject*) p);
-  $unref(p);
+  tc_map_set_hashed(self, key, tc_djb2(key), value);
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
 static void tc_map_rename(TCMap* self, const char* old_key, const char* new_key) {
   assert(self != NULL);
   assert($is(self, TCMap));
 
-  $ref(self);
+  TC_OWNED_SELF_REF(self);
+
+  uint64_t new_hash = tc_djb2(new_key);
+  TCMapSlot** link = tc_map_find_slot(self, tc_djb2(old_key), old_key);
+  TCMapSlot* s = *link;
+  TCJournal* journal = self->journal;
+  if (s != NULL && strcmp(old_key, new_key) != 0) {
+    if (journal != NULL) tc_journal_log_rename(journal, old_key, new_key);
+    *link = s->chain;
+    /* Replaying the rename removes the key it overwrites. */
+    self->journal = NULL;
+    tc_map_remove_slot(self, new_hash, new_key);
+    self->journal = journal;
+    $(TCMapPair, (TCMapPair*) s->node->obj, rename, new_key);
+    s->hash = new_hash;
+    tc_map_insert_slot(self, s);
+  }
+
+  TC_OWNED_SELF_UNREF(self);
+}
+
+static void tc_map_remove(TCMap* self, const char* key) {
+  assert(self != NULL);
+  assert($is(self, TCMap));
 
-  TCMapIter* iter = (TCMapIter*) malloc(sizeof(TCMapIter));
-  iter->hash = tc_djb2(old_key);
-  iter->pair = NULL;
-  $(TCList, self->pairs, foreach, (TCListIterator) tc_map_get_iter, (void*) iter);
+  TC_OWNED_SELF_REF(self);
 
-  TCMapPair* pair = iter->pair;
-  $ref(pair);
+  tc_map_remove_slot(self, tc_djb2(key), key);
 
-  free(iter);
+  TC_OWNED_SELF_UNREF(self);
+}
 
-  if (pair != NULL) {
-    $(TCMapPair, pair, rename, new_key);
-  }
+static void tc_map_remove_by_hash(TCMap* self, uint64_t hash) {
+  assert(self != NULL);
+  assert($is(self, TCMap));
 
-  $unref(pair);
+  TC_OWNED_SELF_REF(self);
 
-  $unref(self);
+  tc_map_remove_slot(self, hash, NULL);
+
+  TC_OWNED_SELF_UNREF(self);
 }
 
-static bool tc_map_remove_iter(TCList* pairs, TCListNode* pairn, TCMapIter* iter) {
-  TCMapPair* pair = (TCMapPair*) pairn->obj;
-  if (pair->hash == iter->hash) {
-    $(TCList, pairs, remove, pairn);
-    return false;
-  } else {
-    return true;
+/* Hashes keys[0..m) and prefetches the bucket each one lands in. The
+ * migration a lookup would do is done up front for the whole batch, so
+ * the buckets computed here stay valid until the batch inserts. */
+static void tc_map_batch_hash(TCMap* self, const char* const* keys, size_t m, uint64_t* hashes, TCMapSlot*** buckets) {
+  if (self->old_table != NULL) tc_map_migrate(self, TC_MAP_REHASH_STEP * m);
+
+  for (size_t i = 0; i < m; ++i) hashes[i] = tc_djb2(keys[i]);
+  for (size_t i = 0; i < m; ++i) {
+    buckets[i] = tc_map_bucket(self, tc_mix64(hashes[i]));
+    TC_PREFETCH(buckets[i]);
   }
 }
 
-static void tc_map_remove(TCMap* self, const char* key) {
+static void tc_map_get_many(TCMap* self, const char* const* keys, size_t n, TObject** out) {
   assert(self != NULL);
   assert($is(self, TCMap));
+  assert(n == 0 || (keys != NULL && out != NULL));
+
+  TC_OWNED_SELF_REF(self);
+
+  uint64_t hashes[TC_MAP_BATCH];
+  TCMapSlot** buckets[TC_MAP_BATCH];
+  TCMapSlot* slots[TC_MAP_BATCH];
+  for (size_t base = 0; base < n; base += TC_MAP_BATCH) {
+    size_t m = (n - base < TC_MAP_BATCH ? n - base : TC_MAP_BATCH);
+    tc_map_batch_hash(self, keys + base, m, hashes, buckets);
+
+    /* Each pass touches one more level of the chain bucket -> slot ->
+     * node -> pair and prefetches the next, so by the time a level is
+     * read the whole batch has had its loads in flight together. */
+    for (size_t i = 0; i < m; ++i) {
+      slots[i] = *buckets[i];
+      if (slots[i] != NULL) TC_PREFETCH(slots[i]);
+    }
+    for (size_t i = 0; i < m; ++i) {
+      TCMapSlot* s = slots[i];
+      while (s != NULL && s->hash != hashes[i]) s = s->chain;
+      slots[i] = s;
+      if (s != NULL) TC_PREFETCH(s->node);
+    }
+    for (size_t i = 0; i < m; ++i) {
+      if (slots[i] != NULL) TC_PREFETCH(slots[i]->node->obj);
+    }
+    /* A hash match is a different key only on a djb2 collision; the rest
+     * of the chain is then searched without prefetching. */
+    for (size_t i = 0; i < m; ++i) {
+      TCMapSlot* s = slots[i];
+      while (s != NULL && !tc_map_slot_matches(s, hashes[i], keys[base + i])) s = s->chain;
+      slots[i] = s;
+    }
+    for (size_t i = 0; i < m; ++i) {
+      TObject* value = (slots[i] != NULL ? ((TCMapPair*) slots[i]->node->obj)->value : NULL);
+      if (value != NULL) TC_OWNED_REF(self, value);
+      out[base + i] = value;
+    }
+  }
 
-  $ref(self);
+  TC_OWNED_SELF_UNREF(self);
+}
 
-  $(TCMap, self, remove_by_hash, tc_djb2(key));
+static void tc_map_set_many(TCMap* self, const char* const* keys, TObject* const* values, size_t n) {
+  assert(self != NULL);
+  assert($is(self, TCMap));
+  assert(n == 0 || (keys != NULL && values != NULL));
+
+  TC_OWNED_SELF_REF(self);
+
+  uint64_t hashes[TC_MAP_BATCH];
+  TCMapSlot** buckets[TC_MAP_BATCH];
+  for (size_t base = 0; base < n; base += TC_MAP_BATCH) {
+    size_t m = (n - base < TC_MAP_BATCH ? n - base : TC_MAP_BATCH);
+    tc_map_batch_hash(self, keys + base, m, hashes, buckets);
+    for (size_t i = 0; i < m; ++i) {
+      if (*buckets[i] != NULL) TC_PREFETCH(*buckets[i]);
+    }
+    /* Inserting may grow the table, so the keys are resolved again
+     * rather than through the buckets prefetched above. */
+    for (size_t i = 0; i < m; ++i) {
+      tc_map_set_hashed(self, keys[base + i], hashes[i], values[base + i]);
+    }
+  }
 
-  $unref(self);
+  TC_OWNED_SELF_UNREF(self);
 }
 
-static void tc_map_remove_by_hash(TCMap* self, uint64_t hash) {
+static TCFrozenMap* tc_map_freeze(TCMap* self) {
   assert(self != NULL);
   assert($is(self, TCMap));
 
-  $ref(self);
+  return $new(TCFrozenMap, self);
+}
 
-  TCMapIter* iter = (TCMapIter*) malloc(sizeof(TCMapIter));
-  iter->hash = hash;
-  iter->pair = NULL;
-  $(TCList, self->pairs, foreach, (TCListIterator) tc_map_remove_iter, (void*) iter);
-  free(iter);
+static size_t tc_map_memory_usage(TCMap* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCMap));
 
-  $unref(self);
+  size_t n = sizeof(TCMap) + sizeof(TCMapPair) * self->pairs->len;
+  n += $(TCList, self->pairs, memory_usage, false);
+  n += $(TCPool, self->keys, memory_usage, false);
+  n += $(TCPool, self->slots, memory_usage, false);
+  n += sizeof(TCMapTable) + sizeof(TCMapSlot*) * (self->table->mask + 1);
+  if (self->old_table != NULL) n += sizeof(TCMapTable) + sizeof(TCMapSlot*) * (self->old_table->mask + 1);
+  for (TCIter it = tc_map_iter_begin(self); !tc_map_iter_done(&it); tc_map_iter_next(&it)) {
+    TCMapPair* p = tc_map_iter_current(&it);
+    /* Keys too long for a pooled block are allocated on their own. */
+    size_t sz = strlen(p->key) + 1;
+    if (sz > self->keys->block_size) n += sz;
+    if (deep) n += tc_memory_usage(p->value, true);
+  }
+  return n;
 }
 
 /*
@@ -1066,6 +1989,8 @@ static void tc_hash_rb_tree_destructor(TCHashRBTree* self) {
   assert(self != NULL);
   assert($is(self, TCHashRBTree));
 
+  if (self->value != NULL) TC_UNREF(self->value);
+
   $destroy_parent(TObject, self);
 }
 
@@ -1078,12 +2003,12 @@ static TCHashRBTree* tc_hash_rb_tree_parent(TCHashRBTree* self) {
 
   assert($is(self, TCHashRBTree));
 
-  $ref(self);
+  TC_SELF_REF(self);
 
   TCHashRBTree* p = self->top;
-  $ref(p);
+  TC_REF(p);
 
-  $unref(self);
+  TC_SELF_UNREF(self);
 
   return p;
 }
@@ -1093,14 +2018,14 @@ static TCHashRBTree* tc_hash_rb_tree_grandparent(TCHashRBTree* self) {
 
   assert($is(self, TCHashRBTree));
 
-  $ref(self);
+  TC_SELF_REF(self);
 
   TCHashRBTree* n = NULL;
   if (self->top != NULL)
     n = self->top->top;
-  $ref(n);
+  TC_REF(n);
   
-  $unref(self);
+  TC_SELF_UNREF(self);
 
   return n;
 }
@@ -1110,11 +2035,11 @@ static TCHashRBTree* tc_hash_rb_tree_sibling(TCHashRBTree* self) {
 
   assert($is(self, TCHashRBTree));
   
-  $ref(self);
+  TC_SELF_REF(self);
 
   TCHashRBTree* p = $(TCHashRBTree, self, parent);
   if (p == NULL) {
-    $unref(self);
+    TC_SELF_UNREF(self);
     return NULL;
   }
 
@@ -1124,11 +2049,11 @@ static TCHashRBTree* tc_hash_rb_tree_sibling(TCHashRBTree* self) {
   } else {
     n = p->left;
   }
-  $ref(n);
+  TC_REF(n);
 
-  $unref(p);
+  TC_UNREF(p);
   
-  $unref(self);
+  TC_SELF_UNREF(self);
 
   return n;
 }
@@ -1138,7 +2063,7 @@ static TCHashRBTree* tc_hash_rb_tree_uncle(TCHashRBTree* self) {
 
   assert($is(self, TCHashRBTree));
 
-  $ref(self);
+  TC_SELF_REF(self);
 
   TCHashRBTree* g = $(TCHashRBTree, self, grandparent);
   TCHashRBTree* n = NULL;
@@ -1152,10 +2077,10 @@ static TCHashRBTree* tc_hash_rb_tree_uncle(TCHashRBTree* self) {
     n = g->left;
   }
 
-  $ref(n);
+  TC_REF(n);
 
-  $unref(g);
-  $unref(self);
+  TC_UNREF(g);
+  TC_SELF_UNREF(self);
 
   return n;
 }
@@ -1164,25 +2089,25 @@ static void tc_hash_rb_tree_set(TCHashRBTree* self, TObject* value) {
   assert(self != NULL);
   assert($is(self, TCHashRBTree));
 
-  $ref(self);
+  TC_SELF_REF(self);
 
-  $ref(value);
-  $unref(self->value);
+  TC_REF(value);
+  TC_UNREF(self->value);
   self->value = value;
   
-  $unref(self);
+  TC_SELF_UNREF(self);
 }
 
 static TObject* tc_hash_rb_tree_get(TCHashRBTree* self) {
   assert(self != NULL);
   assert($is(self, TCHashRBTree));
 
-  $ref(self);
+  TC_SELF_REF(self);
 
   TObject* o = self->value;
-  $ref(self->value);
+  TC_REF(self->value);
 
-  $unref(self);
+  TC_SELF_UNREF(self);
 
   return o;
 }
@@ -1191,22 +2116,22 @@ static void tc_hash_rb_tree_set_red(TCHashRBTree* self, bool red) {
   assert(self != NULL);
   assert($is(self, TCHashRBTree));
 
-  $ref(self);
+  TC_SELF_REF(self);
 
   self->red = red;
 
-  $unref(self);
+  TC_SELF_UNREF(self);
 }
 
 static bool tc_hash_rb_tree_get_red(TCHashRBTree* self) {
   assert(self != NULL);
   assert($is(self, TCHashRBTree));
 
-  $ref(self);
+  TC_SELF_REF(self);
 
   bool red = self->red;
 
-  $unref(self);
+  TC_SELF_UNREF(self);
 
   return red;
 }
@@ -1218,8 +2143,16 @@ static bool tc_hash_rb_tree_get_red(TCHashRBTree* self) {
 static TCHash* tc_hash_constructor(TCHash* self);
 static void tc_hash_destructor(TCHash* self);
 static void tc_hash_init_vtable(TCHashVTable* v);
+static TObject* tc_hash_get(TCHash* self, uint64_t hash);
+static void tc_hash_set(TCHash* self, uint64_t hash, TObject* value);
+static void tc_hash_build_from_sorted(TCHash* self, TCVector* sorted);
+static size_t tc_hash_memory_usage(TCHash* self, bool deep);
 
 $mtable_define(TCHash, tc_hash_constructor, tc_hash_destructor, tc_hash_init_vtable)
+  $mtable_define_method(TCHashGet, get, tc_hash_get)
+  $mtable_define_method(TCHashSet, set, tc_hash_set)
+  $mtable_define_method(TCHashBuildFromSorted, build_from_sorted, tc_hash_build_from_sorted)
+  $mtable_define_method(TCHashMemoryUsage, memory_usage, tc_hash_memory_usage)
 $mtable_define_end(TCHash)
 
 $vtable_define(TCHash)
@@ -1230,15 +2163,3769 @@ static TCHash* tc_hash_constructor(TCHash* self) {
   $setup(TCHash, self, tc_hash_destructor);
   $reg(TCHash, TObject);
 
+  self->root = NULL;
+  self->size = 0;
+  self->journal = NULL;
+#if defined(TC_STATS)
+  memset(&self->stats, 0, sizeof(self->stats));
+#endif
+
   return self;
 }
 
+static void tc_hash_free_nodes(TCHash* self) {
+  TCHashRBTree* n = self->root;
+  while (n != NULL) {
+    if (n->left != NULL) {
+      n = n->left;
+      continue;
+    }
+    if (n->right != NULL) {
+      n = n->right;
+      continue;
+    }
+    TCHashRBTree* top = n->top;
+    if (top != NULL) {
+      if (top->left == n) {
+        top->left = NULL;
+      } else {
+        top->right = NULL;
+      }
+    }
+    TC_UNREF(n);
+    TC_STATS_FREE(&self->stats, sizeof(TCHashRBTree));
+    n = top;
+  }
+  self->root = NULL;
+  self->size = 0;
+}
+
 static void tc_hash_destructor(TCHash* self) {
   assert($is(self, TCHash));
 
+  tc_hash_free_nodes(self);
+
   $destroy_parent(TObject, self);
 }
 
 static void tc_hash_init_vtable(TCHashVTable* v) {
   $vtable_init(v, TCHash, TObject);
-}
\ No newline at end of file
+}
+
+static TCHashRBTree* tc_hash_find(TCHash* self, uint64_t hash) {
+  TCHashRBTree* n = self->root;
+#if defined(TC_STATS)
+  size_t probes = 0;
+#endif
+  while (n != NULL && n->hash != hash) {
+#if defined(TC_STATS)
+    ++probes;
+#endif
+    n = (hash < n->hash) ? n->left : n->right;
+  }
+  TC_STATS_PROBE(&self->stats, probes + (n != NULL));
+  return n;
+}
+
+static TObject* tc_hash_get(TCHash* self, uint64_t hash) {
+  assert(self != NULL);
+  assert($is(self, TCHash));
+
+  TC_SELF_REF(self);
+
+  TCHashRBTree* n = tc_hash_find(self, hash);
+  TObject* obj = NULL;
+  if (n != NULL) {
+    obj = n->value;
+    if (obj != NULL) TC_REF(obj);
+  }
+
+  TC_SELF_UNREF(self);
+
+  return obj;
+}
+
+static void tc_hash_replace_child(TCHash* self, TCHashRBTree* old, TCHashRBTree* n) {
+  TCHashRBTree* top = old->top;
+  if (top == NULL) {
+    self->root = n;
+  } else if (top->left == old) {
+    top->left = n;
+  } else {
+    top->right = n;
+  }
+  if (n != NULL) n->top = top;
+}
+
+static void tc_hash_rotate_left(TCHash* self, TCHashRBTree* n) {
+  TCHashRBTree* r = n->right;
+  n->right = r->left;
+  if (r->left != NULL) r->left->top = n;
+  tc_hash_replace_child(self, n, r);
+  r->left = n;
+  n->top = r;
+}
+
+static void tc_hash_rotate_right(TCHash* self, TCHashRBTree* n) {
+  TCHashRBTree* l = n->left;
+  n->left = l->right;
+  if (l->right != NULL) l->right->top = n;
+  tc_hash_replace_child(self, n, l);
+  l->right = n;
+  n->top = l;
+}
+
+static void tc_hash_insert_fixup(TCHash* self, TCHashRBTree* n) {
+  while (n->top != NULL && n->top->red) {
+    TCHashRBTree* p = n->top;
+    TCHashRBTree* g = p->top;
+    TCHashRBTree* u = (g->left == p) ? g->right : g->left;
+
+    if (u != NULL && u->red) {
+      p->red = false;
+      u->red = false;
+      g->red = true;
+      n = g;
+      continue;
+    }
+
+    if (p == g->left) {
+      if (n == p->right) {
+        tc_hash_rotate_left(self, p);
+        n = p;
+        p = n->top;
+      }
+      tc_hash_rotate_right(self, g);
+    } else {
+      if (n == p->left) {
+        tc_hash_rotate_right(self, p);
+        n = p;
+        p = n->top;
+      }
+      tc_hash_rotate_left(self, g);
+    }
+    p->red = false;
+    g->red = true;
+    break;
+  }
+  self->root->red = false;
+}
+
+static void tc_hash_set(TCHash* self, uint64_t hash, TObject* value) {
+  assert(self != NULL);
+  assert($is(self, TCHash));
+
+  TC_SELF_REF(self);
+
+  if (self->journal != NULL) tc_journal_log_set(self->journal, NULL, hash, value);
+
+  TCHashRBTree* top = NULL;
+  TCHashRBTree* n = self->root;
+#if defined(TC_STATS)
+  size_t probes = 0;
+#endif
+  while (n != NULL && n->hash != hash) {
+#if defined(TC_STATS)
+    ++probes;
+#endif
+    top = n;
+    n = (hash < n->hash) ? n->left : n->right;
+  }
+  TC_STATS_PROBE(&self->stats, probes + (n != NULL));
+
+  if (n != NULL) {
+    $(TCHashRBTree, n, set, value);
+    TC_SELF_UNREF(self);
+    return;
+  }
+
+  n = $new(TCHashRBTree, hash);
+  TC_STATS_ALLOC(&self->stats, sizeof(TCHashRBTree));
+  if (value != NULL) TC_REF(value);
+  n->value = value;
+  n->red = true;
+  n->top = top;
+  if (top == NULL) {
+    self->root = n;
+  } else if (hash < top->hash) {
+    top->left = n;
+  } else {
+    top->right = n;
+  }
+  ++self->size;
+
+  tc_hash_insert_fixup(self, n);
+
+  TC_SELF_UNREF(self);
+}
+
+static TCHashRBTree* tc_hash_link_sorted(TCHashRBTree** nodes, size_t lo, size_t hi, size_t depth, size_t red_depth) {
+  if (lo >= hi) return NULL;
+
+  size_t mid = lo + (hi - lo) / 2;
+  TCHashRBTree* n = nodes[mid];
+
+  n->red = (depth == red_depth);
+  n->left = tc_hash_link_sorted(nodes, lo, mid, depth + 1, red_depth);
+  n->right = tc_hash_link_sorted(nodes, mid + 1, hi, depth + 1, red_depth);
+  if (n->left != NULL) n->left->top = n;
+  if (n->right != NULL) n->right->top = n;
+
+  return n;
+}
+
+static void tc_hash_build_from_sorted(TCHash* self, TCVector* sorted) {
+  assert(self != NULL);
+  assert($is(self, TCHash));
+  assert(sorted != NULL);
+  assert($is(sorted, TCVector));
+
+  TC_SELF_REF(self);
+  TC_REF(sorted);
+
+  tc_hash_free_nodes(self);
+  if (self->journal != NULL) {
+    tc_journal_log_clear(self->journal);
+    for (size_t i = 0; i < sorted->len; ++i) {
+      TCMapPair* pair = (TCMapPair*) sorted->arr[i];
+      tc_journal_log_set(self->journal, NULL, pair->hash, pair->value);
+    }
+  }
+
+  TCHashRBTree** nodes = (TCHashRBTree**) malloc(sizeof(TCHashRBTree*) * (sorted->len + 1));
+  size_t n = 0;
+
+  for (size_t i = 0; i < sorted->len; ++i) {
+    TCMapPair* pair = (TCMapPair*) sorted->arr[i];
+    assert($is(pair, TCMapPair));
+
+    if (n > 0 && nodes[n-1]->hash == pair->hash) {
+      $(TCHashRBTree, nodes[n-1], set, pair->value);
+      continue;
+    }
+    assert(n == 0 || nodes[n-1]->hash < pair->hash);
+
+    TCHashRBTree* node = $new(TCHashRBTree, pair->hash);
+    TC_STATS_ALLOC(&self->stats, sizeof(TCHashRBTree));
+    if (pair->value != NULL) TC_REF(pair->value);
+    node->value = pair->value;
+    nodes[n++] = node;
+  }
+
+  /* Only the deepest level of a size-balanced tree can be incomplete;
+   * colouring it red keeps every path at the same black height. */
+  size_t red_depth = 0;
+  while (((size_t) 2 << red_depth) <= n) ++red_depth;
+  if (red_depth == 0) red_depth = (size_t) -1;
+
+  self->root = tc_hash_link_sorted(nodes, 0, n, 0, red_depth);
+  if (self->root != NULL) self->root->top = NULL;
+  self->size = n;
+
+  free(nodes);
+
+  TC_UNREF(sorted);
+  TC_SELF_UNREF(self);
+}
+
+static size_t tc_hash_memory_usage(TCHash* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCHash));
+
+  size_t n = sizeof(TCHash) + sizeof(TCHashRBTree) * self->size;
+  if (deep) {
+    for (TCIter it = tc_hash_iter_begin(self); !tc_hash_iter_done(&it); tc_hash_iter_next(&it)) {
+      n += tc_memory_usage(tc_hash_iter_current(&it)->value, true);
+    }
+  }
+  return n;
+}
+
+/*
+ * TCPool
+ */
+
+static TCPool* tc_pool_constructor(TCPool* self, size_t block_size, size_t slab_blocks);
+static void tc_pool_destructor(TCPool* self);
+static void tc_pool_init_vtable(TCPoolVTable* v);
+static void* tc_pool_alloc(TCPool* self);
+static void tc_pool_free(TCPool* self, void* block);
+static void tc_pool_clear(TCPool* self);
+static size_t tc_pool_memory_usage(TCPool* self, bool deep);
+
+$mtable_define(TCPool, tc_pool_constructor, tc_pool_destructor, tc_pool_init_vtable)
+  $mtable_define_method(TCPoolAlloc, alloc, tc_pool_alloc)
+  $mtable_define_method(TCPoolFree, free, tc_pool_free)
+  $mtable_define_method(TCPoolClear, clear, tc_pool_clear)
+  $mtable_define_method(TCPoolMemoryUsage, memory_usage, tc_pool_memory_usage)
+$mtable_define_end(TCPool)
+
+$vtable_define(TCPool)
+$vtable_define_end(TCPool)
+
+typedef union TCPoolSlab {
+  union TCPoolSlab* next;
+  max_align_t _align;
+} TCPoolSlab;
+
+static TCPool* tc_pool_constructor(TCPool* self, size_t block_size, size_t slab_blocks) {
+  $init(TObject, self);
+  $setup(TCPool, self, tc_pool_destructor);
+  $reg(TCPool, TObject);
+
+  if (block_size < sizeof(void*)) block_size = sizeof(void*);
+  block_size = (block_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+  self->block_size  = block_size;
+  self->slab_blocks = (slab_blocks == 0 ? 64 : slab_blocks);
+  self->used        = 0;
+  self->slabs       = NULL;
+  self->free_list   = NULL;
+  self->cursor      = NULL;
+  self->end         = NULL;
+  self->allocator   = tc_allocator_get_default();
+
+  return self;
+}
+
+static void tc_pool_destructor(TCPool* self) {
+  assert(self != NULL);
+  assert($is(self, TCPool));
+
+  tc_pool_clear(self);
+
+  $destroy_parent(TObject, self);
+}
+
+static void tc_pool_init_vtable(TCPoolVTable* v) {
+  $vtable_init(v, TCPool, TObject);
+}
+
+static void* tc_pool_alloc(TCPool* self) {
+  assert(self != NULL);
+  assert($is(self, TCPool));
+
+  void* block = self->free_list;
+  if (block != NULL) {
+    self->free_list = *(void**) block;
+  } else {
+    if (self->cursor == self->end) {
+      TCPoolSlab* slab = (TCPoolSlab*) TC_ALLOC(self->allocator, sizeof(TCPoolSlab) + self->block_size * self->slab_blocks);
+      slab->next = (TCPoolSlab*) self->slabs;
+      self->slabs = slab;
+      self->cursor = (char*) (slab + 1);
+      self->end = self->cursor + self->block_size * self->slab_blocks;
+    }
+    block = self->cursor;
+    self->cursor += self->block_size;
+  }
+  ++self->used;
+
+  return block;
+}
+
+static void tc_pool_free(TCPool* self, void* block) {
+  assert(self != NULL);
+  assert($is(self, TCPool));
+
+  if (block == NULL) return;
+
+  *(void**) block = self->free_list;
+  self->free_list = block;
+  --self->used;
+}
+
+static void tc_pool_clear(TCPool* self) {
+  assert(self != NULL);
+  assert($is(self, TCPool));
+
+  TCPoolSlab* slab = (TCPoolSlab*) self->slabs;
+  while (slab != NULL) {
+    TCPoolSlab* next = slab->next;
+    TC_FREE(self->allocator, slab, sizeof(TCPoolSlab) + self->block_size * self->slab_blocks);
+    slab = next;
+  }
+
+  self->used      = 0;
+  self->slabs     = NULL;
+  self->free_list = NULL;
+  self->cursor    = NULL;
+  self->end       = NULL;
+}
+
+static size_t tc_pool_memory_usage(TCPool* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCPool));
+
+  size_t n = sizeof(TCPool);
+  for (TCPoolSlab* slab = (TCPoolSlab*) self->slabs; slab != NULL; slab = slab->next) {
+    n += sizeof(TCPoolSlab) + self->block_size * self->slab_blocks;
+  }
+  return n;
+}
+
+/*
+ * TCArena
+ */
+
+static TCArena* tc_arena_constructor(TCArena* self, size_t chunk_size);
+static void tc_arena_destructor(TCArena* self);
+static void tc_arena_init_vtable(TCArenaVTable* v);
+static void* tc_arena_alloc(TCArena* self, size_t size);
+static void tc_arena_reset(TCArena* self);
+static size_t tc_arena_memory_usage(TCArena* self, bool deep);
+
+$mtable_define(TCArena, tc_arena_constructor, tc_arena_destructor, tc_arena_init_vtable)
+  $mtable_define_method(TCArenaAlloc, alloc, tc_arena_alloc)
+  $mtable_define_method(TCArenaReset, reset, tc_arena_reset)
+  $mtable_define_method(TCArenaMemoryUsage, memory_usage, tc_arena_memory_usage)
+$mtable_define_end(TCArena)
+
+$vtable_define(TCArena)
+$vtable_define_end(TCArena)
+
+typedef struct TCArenaChunk {
+  struct TCArenaChunk* next;
+  size_t size;
+  max_align_t data[];
+} TCArenaChunk;
+
+#define TC_ARENA_ALIGN(n) (((n) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+static void* tc_arena_allocator_alloc(void* ctx, size_t size) {
+  return tc_arena_alloc((TCArena*) ctx, size);
+}
+
+static void* tc_arena_allocator_realloc(void* ctx, void* ptr, size_t old_size, size_t new_size) {
+  TCArena* self = (TCArena*) ctx;
+
+  if (ptr != NULL && (char*) ptr == self->last && self->last + TC_ARENA_ALIGN(new_size) <= self->end) {
+    self->cursor = self->last + TC_ARENA_ALIGN(new_size);
+    return ptr;
+  }
+
+  void* r = tc_arena_alloc(self, new_size);
+  if (ptr != NULL) memcpy(r, ptr, (old_size < new_size ? old_size : new_size));
+  return r;
+}
+
+static void tc_arena_allocator_free(void* ctx, void* ptr, size_t size) {
+  TCArena* self = (TCArena*) ctx;
+
+  if (ptr != NULL && (char*) ptr == self->last) {
+    self->cursor = self->last;
+    self->last = NULL;
+  }
+}
+
+static TCArena* tc_arena_constructor(TCArena* self, size_t chunk_size) {
+  $init(TObject, self);
+  $setup(TCArena, self, tc_arena_destructor);
+  $reg(TCArena, TObject);
+
+  self->chunk_size = TC_ARENA_ALIGN(chunk_size == 0 ? 65536 : chunk_size);
+  self->chunks     = NULL;
+  self->current    = NULL;
+  self->cursor     = NULL;
+  self->end        = NULL;
+  self->last       = NULL;
+
+  self->allocator.alloc   = tc_arena_allocator_alloc;
+  self->allocator.realloc = tc_arena_allocator_realloc;
+  self->allocator.free    = tc_arena_allocator_free;
+  self->allocator.ctx     = self;
+  self->allocator.scoped  = false;
+
+  return self;
+}
+
+static void tc_arena_destructor(TCArena* self) {
+  assert(self != NULL);
+  assert($is(self, TCArena));
+
+  TCArenaChunk* c = (TCArenaChunk*) self->chunks;
+  while (c != NULL) {
+    TCArenaChunk* next = c->next;
+    free(c);
+    c = next;
+  }
+
+  $destroy_parent(TObject, self);
+}
+
+static void tc_arena_init_vtable(TCArenaVTable* v) {
+  $vtable_init(v, TCArena, TObject);
+}
+
+static void tc_arena_use_chunk(TCArena* self, TCArenaChunk* c) {
+  self->current = c;
+  self->cursor  = (char*) c->data;
+  self->end     = (char*) c->data + c->size;
+}
+
+static void* tc_arena_alloc(TCArena* self, size_t size) {
+  assert(self != NULL);
+  assert($is(self, TCArena));
+
+  size = TC_ARENA_ALIGN(size == 0 ? 1 : size);
+
+  if (self->cursor == NULL || (size_t) (self->end - self->cursor) < size) {
+    TCArenaChunk* cur = (TCArenaChunk*) self->current;
+    TCArenaChunk* next = (cur != NULL ? cur->next : (TCArenaChunk*) self->chunks);
+
+    if (next == NULL || next->size < size) {
+      size_t csize = (size > self->chunk_size ? size : self->chunk_size);
+      TCArenaChunk* c = (TCArenaChunk*) malloc(sizeof(TCArenaChunk) + csize);
+      c->size = csize;
+      c->next = next;
+      if (cur != NULL) {
+        cur->next = c;
+      } else {
+        self->chunks = c;
+      }
+      next = c;
+    }
+
+    tc_arena_use_chunk(self, next);
+  }
+
+  self->last = self->cursor;
+  self->cursor += size;
+
+  return self->last;
+}
+
+static void tc_arena_reset(TCArena* self) {
+  assert(self != NULL);
+  assert($is(self, TCArena));
+
+  self->last = NULL;
+  if (self->chunks != NULL) {
+    tc_arena_use_chunk(self, (TCArenaChunk*) self->chunks);
+  }
+}
+
+static size_t tc_arena_memory_usage(TCArena* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCArena));
+
+  size_t n = sizeof(TCArena);
+  for (TCArenaChunk* c = (TCArenaChunk*) self->chunks; c != NULL; c = c->next) {
+    n += sizeof(TCArenaChunk) + c->size;
+  }
+  return n;
+}
+
+/*
+ * TCIntrusiveList
+ */
+
+static TCIntrusiveList* tc_intrusive_list_constructor(TCIntrusiveList* self, size_t offset);
+static void tc_intrusive_list_destructor(TCIntrusiveList* self);
+static void tc_intrusive_list_init_vtable(TCIntrusiveListVTable* v);
+static void tc_intrusive_list_append(TCIntrusiveList* self, TObject* obj);
+static void tc_intrusive_list_prepend(TCIntrusiveList* self, TObject* obj);
+static bool tc_intrusive_list_remove(TCIntrusiveList* self, TObject* obj);
+static bool tc_intrusive_list_contains(TCIntrusiveList* self, TObject* obj);
+static void tc_intrusive_list_foreach(TCIntrusiveList* self, TCIntrusiveListIterator iter, void* userdata);
+static size_t tc_intrusive_list_memory_usage(TCIntrusiveList* self, bool deep);
+
+$mtable_define(TCIntrusiveList, tc_intrusive_list_constructor, tc_intrusive_list_destructor, tc_intrusive_list_init_vtable)
+  $mtable_define_method(TCIntrusiveListAppend, append, tc_intrusive_list_append)
+  $mtable_define_method(TCIntrusiveListPrepend, prepend, tc_intrusive_list_prepend)
+  $mtable_define_method(TCIntrusiveListRemove, remove, tc_intrusive_list_remove)
+  $mtable_define_method(TCIntrusiveListContains, contains, tc_intrusive_list_contains)
+  $mtable_define_method(TCIntrusiveListForeach, foreach, tc_intrusive_list_foreach)
+  $mtable_define_method(TCIntrusiveListMemoryUsage, memory_usage, tc_intrusive_list_memory_usage)
+$mtable_define_end(TCIntrusiveList)
+
+$vtable_define(TCIntrusiveList)
+$vtable_define_end(TCIntrusiveList)
+
+#define TC_INTRUSIVE_LINK(l, obj) ((TCListLink*) ((char*) (obj) + (l)->offset))
+
+static TCIntrusiveList* tc_intrusive_list_constructor(TCIntrusiveList* self, size_t offset) {
+  $init(TObject, self);
+  $setup(TCIntrusiveList, self, tc_intrusive_list_destructor);
+  $reg(TCIntrusiveList, TObject);
+
+  self->head = NULL;
+  self->tail = NULL;
+  self->offset = offset;
+  self->len = 0;
+  self->borrowed = tc_allocator_get_default()->scoped;
+
+  return self;
+}
+
+static void tc_intrusive_list_destructor(TCIntrusiveList* self) {
+  assert(self != NULL);
+  assert($is(self, TCIntrusiveList));
+
+  TCListLink* l = self->head;
+  while (l != NULL) {
+    TCListLink* next = l->next;
+    TObject* obj = tc_intrusive_list_obj(self, l);
+    TC_LIST_LINK_INIT(l);
+    TC_OWNED_UNREF(self, obj);
+    l = next;
+  }
+
+  $destroy_parent(TObject, self);
+}
+
+static void tc_intrusive_list_init_vtable(TCIntrusiveListVTable* v) {
+  $vtable_init(v, TCIntrusiveList, TObject);
+}
+
+static void tc_intrusive_list_append(TCIntrusiveList* self, TObject* obj) {
+  assert(self != NULL);
+  assert($is(self, TCIntrusiveList));
+
+  TCListLink* l = TC_INTRUSIVE_LINK(self, obj);
+  assert(l->list == NULL);
+
+  TC_OWNED_REF(self, obj);
+
+  l->list = self;
+  l->next = NULL;
+  l->prev = self->tail;
+  if (self->tail != NULL) {
+    self->tail->next = l;
+  } else {
+    self->head = l;
+  }
+  self->tail = l;
+  ++self->len;
+}
+
+static void tc_intrusive_list_prepend(TCIntrusiveList* self, TObject* obj) {
+  assert(self != NULL);
+  assert($is(self, TCIntrusiveList));
+
+  TCListLink* l = TC_INTRUSIVE_LINK(self, obj);
+  assert(l->list == NULL);
+
+  TC_OWNED_REF(self, obj);
+
+  l->list = self;
+  l->prev = NULL;
+  l->next = self->head;
+  if (self->head != NULL) {
+    self->head->prev = l;
+  } else {
+    self->tail = l;
+  }
+  self->head = l;
+  ++self->len;
+}
+
+static bool tc_intrusive_list_remove(TCIntrusiveList* self, TObject* obj) {
+  assert(self != NULL);
+  assert($is(self, TCIntrusiveList));
+
+  TCListLink* l = TC_INTRUSIVE_LINK(self, obj);
+  if (l->list != self) return false;
+
+  if (l->prev != NULL) {
+    l->prev->next = l->next;
+  } else {
+    self->head = l->next;
+  }
+  if (l->next != NULL) {
+    l->next->prev = l->prev;
+  } else {
+    self->tail = l->prev;
+  }
+  TC_LIST_LINK_INIT(l);
+  --self->len;
+
+  TC_OWNED_UNREF(self, obj);
+
+  return true;
+}
+
+static bool tc_intrusive_list_contains(TCIntrusiveList* self, TObject* obj) {
+  assert(self != NULL);
+  assert($is(self, TCIntrusiveList));
+
+  return TC_INTRUSIVE_LINK(self, obj)->list == self;
+}
+
+static void tc_intrusive_list_foreach(TCIntrusiveList* self, TCIntrusiveListIterator iter, void* userdata) {
+  assert(self != NULL);
+  assert($is(self, TCIntrusiveList));
+
+  TCListLink* l = self->head;
+  bool c = true;
+  while (l != NULL && c == true) {
+    TCListLink* next = l->next;
+    c = iter(self, tc_intrusive_list_obj(self, l), userdata);
+    l = next;
+  }
+}
+
+/* The links live inside the elements, so only `deep` counts them. */
+static size_t tc_intrusive_list_memory_usage(TCIntrusiveList* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCIntrusiveList));
+
+  size_t n = sizeof(TCIntrusiveList);
+  if (deep) {
+    for (TCIter it = tc_intrusive_list_iter_begin(self); !tc_intrusive_list_iter_done(&it); tc_intrusive_list_iter_next(&it)) {
+      n += tc_memory_usage(tc_intrusive_list_iter_current(&it), true);
+    }
+  }
+  return n;
+}
+
+/*
+ * TCChunkList
+ */
+
+static TCChunkList* tc_chunk_list_constructor(TCChunkList* self);
+static void tc_chunk_list_destructor(TCChunkList* self);
+static void tc_chunk_list_init_vtable(TCChunkListVTable* v);
+static void tc_chunk_list_append(TCChunkList* self, TObject* obj);
+static void tc_chunk_list_prepend(TCChunkList* self, TObject* obj);
+static TCChunk* tc_chunk_list_remove(TCChunkList* self, TCChunk* chunk, size_t idx);
+static size_t tc_chunk_list_remove_if(TCChunkList* self, TCChunkListIterator pred, void* userdata);
+static void tc_chunk_list_foreach(TCChunkList* self, TCChunkListIterator iter, void* userdata);
+static size_t tc_chunk_list_memory_usage(TCChunkList* self, bool deep);
+
+$mtable_define(TCChunkList, tc_chunk_list_constructor, tc_chunk_list_destructor, tc_chunk_list_init_vtable)
+  $mtable_define_method(TCChunkListAppend, append, tc_chunk_list_append)
+  $mtable_define_method(TCChunkListPrepend, prepend, tc_chunk_list_prepend)
+  $mtable_define_method(TCChunkListRemove, remove, tc_chunk_list_remove)
+  $mtable_define_method(TCChunkListRemoveIf, remove_if, tc_chunk_list_remove_if)
+  $mtable_define_method(TCChunkListForeach, foreach, tc_chunk_list_foreach)
+  $mtable_define_method(TCChunkListMemoryUsage, memory_usage, tc_chunk_list_memory_usage)
+$mtable_define_end(TCChunkList)
+
+$vtable_define(TCChunkList)
+$vtable_define_end(TCChunkList)
+
+static TCChunkList* tc_chunk_list_constructor(TCChunkList* self) {
+  $init(TObject, self);
+  $setup(TCChunkList, self, tc_chunk_list_destructor);
+  $reg(TCChunkList, TObject);
+
+  self->head = NULL;
+  self->tail = NULL;
+  self->len = 0;
+  self->chunks = $new(TCPool, sizeof(TCChunk), 0);
+  self->borrowed = tc_allocator_get_default()->scoped;
+
+  return self;
+}
+
+static void tc_chunk_list_destructor(TCChunkList* self) {
+  assert(self != NULL);
+  assert($is(self, TCChunkList));
+
+  if (!self->borrowed) {
+    for (TCChunk* c = self->head; c != NULL; c = c->next) {
+      tc_unref_many(c->items, c->len);
+    }
+  }
+  $unref(self->chunks);
+
+  $destroy_parent(TObject, self);
+}
+
+static void tc_chunk_list_init_vtable(TCChunkListVTable* v) {
+  $vtable_init(v, TCChunkList, TObject);
+}
+
+static TCChunk* tc_chunk_list_new_chunk(TCChunkList* self, TCChunk* prev, TCChunk* next) {
+  TCChunk* c = (TCChunk*) $(TCPool, self->chunks, alloc);
+  c->len = 0;
+  c->prev = prev;
+  c->next = next;
+  if (prev != NULL) {
+    prev->next = c;
+  } else {
+    self->head = c;
+  }
+  if (next != NULL) {
+    next->prev = c;
+  } else {
+    self->tail = c;
+  }
+  return c;
+}
+
+static void tc_chunk_list_free_chunk(TCChunkList* self, TCChunk* c) {
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+  } else {
+    self->head = c->next;
+  }
+  if (c->next != NULL) {
+    c->next->prev = c->prev;
+  } else {
+    self->tail = c->prev;
+  }
+  $(TCPool, self->chunks, free, c);
+}
+
+static TCChunk* tc_chunk_list_settle(TCChunkList* self, TCChunk* c) {
+  TCChunk* next = c->next;
+  if (c->len == 0) {
+    tc_chunk_list_free_chunk(self, c);
+    return next;
+  }
+  if (next != NULL && c->len < TC_CHUNK_LIST_K / 2 && c->len + next->len <= TC_CHUNK_LIST_K) {
+    memcpy(c->items + c->len, next->items, next->len * sizeof(TObject*));
+    c->len += next->len;
+    tc_chunk_list_free_chunk(self, next);
+  }
+  return c;
+}
+
+static void tc_chunk_list_append(TCChunkList* self, TObject* obj) {
+  assert(self != NULL);
+  assert($is(self, TCChunkList));
+
+  TCChunk* c = self->tail;
+  if (c == NULL || c->len == TC_CHUNK_LIST_K) {
+    c = tc_chunk_list_new_chunk(self, self->tail, NULL);
+  }
+
+  TC_OWNED_REF(self, obj);
+  c->items[c->len++] = obj;
+  ++self->len;
+}
+
+static void tc_chunk_list_prepend(TCChunkList* self, TObject* obj) {
+  assert(self != NULL);
+  assert($is(self, TCChunkList));
+
+  TCChunk* c = self->head;
+  if (c == NULL || c->len == TC_CHUNK_LIST_K) {
+    c = tc_chunk_list_new_chunk(self, NULL, self->head);
+  }
+
+  TC_OWNED_REF(self, obj);
+  memmove(c->items + 1, c->items, c->len * sizeof(TObject*));
+  c->items[0] = obj;
+  ++c->len;
+  ++self->len;
+}
+
+static TCChunk* tc_chunk_list_remove(TCChunkList* self, TCChunk* chunk, size_t idx) {
+  assert(self != NULL);
+  assert($is(self, TCChunkList));
+  assert(chunk != NULL && idx < chunk->len);
+
+  TObject* obj = chunk->items[idx];
+  --chunk->len;
+  memmove(chunk->items + idx, chunk->items + idx + 1, (chunk->len - idx) * sizeof(TObject*));
+  --self->len;
+
+  TCChunk* c = tc_chunk_list_settle(self, chunk);
+  TC_OWNED_UNREF(self, obj);
+
+  return c;
+}
+
+static size_t tc_chunk_list_remove_if(TCChunkList* self, TCChunkListIterator pred, void* userdata) {
+  assert(self != NULL);
+  assert($is(self, TCChunkList));
+
+  TC_OWNED_SELF_REF(self);
+
+  TObject* batch[TC_CHUNK_LIST_K];
+  size_t removed = 0;
+  TCChunk* c = self->head;
+  while (c != NULL) {
+    size_t keep = 0;
+    size_t drop = 0;
+    for (size_t i = 0; i < c->len; ++i) {
+      TObject* o = c->items[i];
+      if (pred(self, o, userdata)) {
+        batch[drop++] = o;
+      } else {
+        c->items[keep++] = o;
+      }
+    }
+    c->len = keep;
+    self->len -= drop;
+    removed += drop;
+
+    TCChunk* next = c->next;
+    if (c->len == 0) tc_chunk_list_free_chunk(self, c);
+    c = next;
+
+    if (!self->borrowed) tc_unref_many(batch, drop);
+  }
+
+  for (c = self->head; c != NULL; c = c->next) {
+    while (c->next != NULL && c->len < TC_CHUNK_LIST_K / 2 && c->len + c->next->len <= TC_CHUNK_LIST_K) {
+      tc_chunk_list_settle(self, c);
+    }
+  }
+
+  TC_OWNED_SELF_UNREF(self);
+
+  return removed;
+}
+
+static void tc_chunk_list_foreach(TCChunkList* self, TCChunkListIterator iter, void* userdata) {
+  assert(self != NULL);
+  assert($is(self, TCChunkList));
+
+  TC_OWNED_SELF_REF(self);
+
+  bool c = true;
+  for (TCChunk* ch = self->head; ch != NULL && c == true; ch = ch->next) {
+    if (ch->next != NULL) TC_PREFETCH(ch->next);
+    for (size_t i = 0; i < ch->len && c == true; ++i) {
+      c = iter(self, ch->items[i], userdata);
+    }
+  }
+
+  TC_OWNED_SELF_UNREF(self);
+}
+
+static size_t tc_chunk_list_memory_usage(TCChunkList* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCChunkList));
+
+  size_t n = sizeof(TCChunkList) + $(TCPool, self->chunks, memory_usage, false);
+  if (deep) {
+    for (TCChunk* c = self->head; c != NULL; c = c->next) {
+      for (size_t i = 0; i < c->len; ++i) n += tc_memory_usage(c->items[i], true);
+    }
+  }
+  return n;
+}
+
+/*
+ * TCPipe
+ */
+
+static TObject* tc_pipe_map_current(const TCIter* it) {
+  return (TObject*) tc_map_iter_current(it);
+}
+
+static TObject* tc_pipe_hash_current(const TCIter* it) {
+  return (TObject*) tc_hash_iter_current(it);
+}
+
+TCPipeSource tc_pipe_source_vector(TCVector* v) {
+  TCPipeSource s = { tc_vector_iter_begin(v), tc_vector_iter_done, tc_vector_iter_next, tc_vector_iter_current };
+  return s;
+}
+
+TCPipeSource tc_pipe_source_list(TCList* l) {
+  TCPipeSource s = { tc_list_iter_begin(l), tc_list_iter_done, tc_list_iter_next, tc_list_iter_current };
+  return s;
+}
+
+TCPipeSource tc_pipe_source_queue(TCQueue* q) {
+  TCPipeSource s = { tc_queue_iter_begin(q), tc_queue_iter_done, tc_queue_iter_next, tc_queue_iter_current };
+  return s;
+}
+
+TCPipeSource tc_pipe_source_map(TCMap* m) {
+  TCPipeSource s = { tc_map_iter_begin(m), tc_map_iter_done, tc_map_iter_next, tc_pipe_map_current };
+  return s;
+}
+
+TCPipeSource tc_pipe_source_hash(TCHash* h) {
+  TCPipeSource s = { tc_hash_iter_begin(h), tc_hash_iter_done, tc_hash_iter_next, tc_pipe_hash_current };
+  return s;
+}
+
+TCPipeSource tc_pipe_source_intrusive_list(TCIntrusiveList* l) {
+  TCPipeSource s = { tc_intrusive_list_iter_begin(l), tc_intrusive_list_iter_done, tc_intrusive_list_iter_next, tc_intrusive_list_iter_current };
+  return s;
+}
+
+TCPipeSource tc_pipe_source_chunk_list(TCChunkList* l) {
+  TCPipeSource s = { tc_chunk_list_iter_begin(l), tc_chunk_list_iter_done, tc_chunk_list_iter_next, tc_chunk_list_iter_current };
+  return s;
+}
+
+TCPipe* tc_pipe_init(TCPipe* p, TCPipeSource src) {
+  assert(p != NULL);
+
+  p->sources[0] = src;
+  p->n_sources = 1;
+  p->cur_source = 0;
+  p->n_stages = 0;
+  p->n_held = 0;
+  p->done = false;
+
+  return p;
+}
+
+TCPipe* tc_pipe_chain(TCPipe* p, TCPipeSource src) {
+  assert(p != NULL);
+  assert(p->n_stages == 0);
+  assert(p->n_sources < TC_PIPE_MAX_SOURCES);
+
+  p->sources[p->n_sources++] = src;
+
+  return p;
+}
+
+static TCPipeStage* tc_pipe_add_stage(TCPipe* p, TCPipeOp op, void* userdata, size_t n, bool owned) {
+  assert(p != NULL);
+  assert(p->n_stages < TC_PIPE_MAX_STAGES);
+
+  TCPipeStage* st = &p->stages[p->n_stages++];
+  st->op = op;
+  st->userdata = userdata;
+  st->n = n;
+  st->owned = owned;
+  return st;
+}
+
+TCPipe* tc_pipe_filter(TCPipe* p, TCPipePred fn, void* userdata) {
+  tc_pipe_add_stage(p, TC_PIPE_FILTER, userdata, 0, false)->fn.pred = fn;
+  return p;
+}
+
+TCPipe* tc_pipe_map(TCPipe* p, TCPipeMap fn, void* userdata, bool owned) {
+  tc_pipe_add_stage(p, TC_PIPE_MAP, userdata, 0, owned)->fn.map = fn;
+  return p;
+}
+
+TCPipe* tc_pipe_take(TCPipe* p, size_t n) {
+  tc_pipe_add_stage(p, TC_PIPE_TAKE, NULL, n, false);
+  if (n == 0) p->done = true;
+  return p;
+}
+
+TCPipe* tc_pipe_skip(TCPipe* p, size_t n) {
+  tc_pipe_add_stage(p, TC_PIPE_SKIP, NULL, n, false);
+  return p;
+}
+
+TCPipe* tc_pipe_zip(TCPipe* p, TCPipeSource other, TCPipeZip fn, void* userdata, bool owned) {
+  TCPipeStage* st = tc_pipe_add_stage(p, TC_PIPE_ZIP, userdata, 0, owned);
+  st->fn.zip = fn;
+  st->other = other;
+  return p;
+}
+
+static void tc_pipe_release(TCPipe* p) {
+  if (p->n_held > 0) {
+    tc_unref_many(p->held, p->n_held);
+    p->n_held = 0;
+  }
+}
+
+bool tc_pipe_next(TCPipe* p, TObject** out) {
+  assert(p != NULL);
+  assert(out != NULL);
+
+  tc_pipe_release(p);
+
+  while (!p->done) {
+    TCPipeSource* src = &p->sources[p->cur_source];
+    if (src->done(&src->it)) {
+      if (++p->cur_source == p->n_sources) p->done = true;
+      continue;
+    }
+    TObject* o = src->current(&src->it);
+    src->next(&src->it);
+
+    bool keep = true;
+    for (size_t i = 0; i < p->n_stages && keep; ++i) {
+      TCPipeStage* st = &p->stages[i];
+      switch (st->op) {
+        case TC_PIPE_FILTER:
+          keep = st->fn.pred(o, st->userdata);
+          break;
+        case TC_PIPE_MAP:
+          o = st->fn.map(o, st->userdata);
+          if (st->owned) p->held[p->n_held++] = o;
+          break;
+        case TC_PIPE_TAKE:
+          if (--st->n == 0) p->done = true;
+          break;
+        case TC_PIPE_SKIP:
+          if (st->n > 0) {
+            --st->n;
+            keep = false;
+          }
+          break;
+        case TC_PIPE_ZIP:
+          if (st->other.done(&st->other.it)) {
+            p->done = true;
+            keep = false;
+          } else {
+            TObject* b = st->other.current(&st->other.it);
+            st->other.next(&st->other.it);
+            o = st->fn.zip(o, b, st->userdata);
+            if (st->owned) p->held[p->n_held++] = o;
+          }
+          break;
+      }
+    }
+
+    if (keep) {
+      *out = o;
+      return true;
+    }
+    tc_pipe_release(p);
+  }
+
+  return false;
+}
+
+void tc_pipe_end(TCPipe* p) {
+  assert(p != NULL);
+
+  tc_pipe_release(p);
+  p->done = true;
+}
+
+size_t tc_pipe_collect_into(TCPipe* p, TCVector* dst) {
+  assert(dst != NULL);
+  assert($is(dst, TCVector));
+
+  size_t n = 0;
+  TObject* o;
+  while (tc_pipe_next(p, &o)) {
+    $(TCVector, dst, push_back, o);
+    ++n;
+  }
+  tc_pipe_end(p);
+
+  return n;
+}
+
+void tc_pipe_reduce(TCPipe* p, TCPipeReduce fn, void* acc) {
+  TObject* o;
+  while (tc_pipe_next(p, &o)) {
+    fn(acc, o);
+  }
+  tc_pipe_end(p);
+}
+
+size_t tc_pipe_count(TCPipe* p) {
+  size_t n = 0;
+  TObject* o;
+  while (tc_pipe_next(p, &o)) {
+    ++n;
+  }
+  tc_pipe_end(p);
+
+  return n;
+}
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+typedef struct TCPipeWorker {
+  TCPipe pipe;
+  TObject** out;
+  size_t len;
+} TCPipeWorker;
+
+static int tc_pipe_worker(void* arg) {
+  TCPipeWorker* w = (TCPipeWorker*) arg;
+  w->out = (TObject**) malloc(sizeof(TObject*) * (w->pipe.sources[0].it.end - w->pipe.sources[0].it.idx));
+  w->len = 0;
+
+  TObject* o;
+  while (tc_pipe_next(&w->pipe, &o)) {
+    tc_ref(o);
+    w->out[w->len++] = o;
+  }
+  tc_pipe_end(&w->pipe);
+
+  return 0;
+}
+#endif
+
+size_t tc_pipe_collect_into_parallel(TCPipe* p, TCVector* dst, size_t threads) {
+  assert(p != NULL);
+  assert(dst != NULL);
+  assert($is(dst, TCVector));
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+  bool splittable = (p->n_sources == 1 && p->cur_source == 0 && p->sources[0].next == tc_vector_iter_next && !p->done);
+  for (size_t i = 0; i < p->n_stages && splittable; ++i) {
+    splittable = (p->stages[i].op == TC_PIPE_FILTER || p->stages[i].op == TC_PIPE_MAP);
+  }
+
+  TCIter it = p->sources[0].it;
+  size_t total = it.end - it.idx;
+  if (splittable && threads > 1 && total >= threads) {
+    TCPipeWorker* workers = (TCPipeWorker*) malloc(sizeof(TCPipeWorker) * threads);
+    thrd_t* tids = (thrd_t*) malloc(sizeof(thrd_t) * threads);
+
+    size_t started = 0;
+    for (size_t i = 0; i < threads; ++i) {
+      workers[i].pipe = *p;
+      workers[i].pipe.n_held = 0;
+      workers[i].pipe.sources[0].it.idx = it.idx + total * i / threads;
+      workers[i].pipe.sources[0].it.end = it.idx + total * (i + 1) / threads;
+      if (thrd_create(&tids[i], tc_pipe_worker, &workers[i]) != thrd_success) {
+        break;
+      }
+      ++started;
+    }
+    for (size_t i = started; i < threads; ++i) {
+      tc_pipe_worker(&workers[i]);
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < threads; ++i) {
+      if (i < started) thrd_join(tids[i], NULL);
+      $(TCVector, dst, push_back_many, workers[i].out, workers[i].len);
+      tc_unref_many(workers[i].out, workers[i].len);
+      free(workers[i].out);
+      n += workers[i].len;
+    }
+
+    free(tids);
+    free(workers);
+    tc_pipe_end(p);
+    return n;
+  }
+#else
+  (void) threads;
+#endif
+
+  return tc_pipe_collect_into(p, dst);
+}
+
+/*
+ * TCCache
+ */
+
+static TCCache* tc_cache_constructor(TCCache* self, TCCachePolicy policy, size_t capacity);
+static void tc_cache_destructor(TCCache* self);
+static void tc_cache_init_vtable(TCCacheVTable* v);
+static TObject* tc_cache_get(TCCache* self, const char* key);
+static bool tc_cache_put(TCCache* self, const char* key, TObject* value);
+static bool tc_cache_remove(TCCache* self, const char* key);
+static void tc_cache_clear(TCCache* self);
+static size_t tc_cache_memory_usage(TCCache* self, bool deep);
+
+$mtable_define(TCCache, tc_cache_constructor, tc_cache_destructor, tc_cache_init_vtable)
+  $mtable_define_method(TCCacheGet, get, tc_cache_get)
+  $mtable_define_method(TCCachePut, put, tc_cache_put)
+  $mtable_define_method(TCCacheRemove, remove, tc_cache_remove)
+  $mtable_define_method(TCCacheClear, clear, tc_cache_clear)
+  $mtable_define_method(TCCacheMemoryUsage, memory_usage, tc_cache_memory_usage)
+$mtable_define_end(TCCache)
+
+$vtable_define(TCCache)
+$vtable_define_end(TCCache)
+
+#define TC_CACHE_MIN_BUCKETS 16
+
+static TCCache* tc_cache_constructor(TCCache* self, TCCachePolicy policy, size_t capacity) {
+  $init(TObject, self);
+  $setup(TCCache, self, tc_cache_destructor);
+  $reg(TCCache, TObject);
+
+  self->policy = policy;
+  self->capacity = capacity;
+  self->used = 0;
+  self->size = 0;
+  self->allocator = tc_allocator_get_default();
+  self->borrowed = self->allocator->scoped;
+  self->n_buckets = TC_CACHE_MIN_BUCKETS;
+  self->shift = 64 - 4;
+  self->buckets = (TCCacheEntry**) TC_ALLOC(self->allocator, sizeof(TCCacheEntry*) * self->n_buckets);
+  memset(self->buckets, 0, sizeof(TCCacheEntry*) * self->n_buckets);
+  self->head = NULL;
+  self->tail = NULL;
+  self->hand = NULL;
+  self->entries = $new(TCPool, sizeof(TCCacheEntry), 0);
+  self->cost = NULL;
+  self->cost_userdata = NULL;
+  self->on_evict = NULL;
+  self->evict_userdata = NULL;
+  self->hits = 0;
+  self->misses = 0;
+  self->evictions = 0;
+
+  return self;
+}
+
+static void tc_cache_destructor(TCCache* self) {
+  assert(self != NULL);
+  assert($is(self, TCCache));
+
+  $(TCCache, self, clear);
+  TC_FREE(self->allocator, self->buckets, sizeof(TCCacheEntry*) * self->n_buckets);
+  TC_UNREF(self->entries);
+
+  $destroy_parent(TObject, self);
+}
+
+static void tc_cache_init_vtable(TCCacheVTable* v) {
+  $vtable_init(v, TCCache, TObject);
+}
+
+static TCCacheEntry** tc_cache_slot(TCCache* self, const char* key, uint64_t hash) {
+  TCCacheEntry** e = &self->buckets[(hash * 0x9E3779B97F4A7C15ull) >> self->shift];
+  while (*e != NULL && ((*e)->hash != hash || strcmp((*e)->key, key) != 0)) {
+    e = &(*e)->chain;
+  }
+  return e;
+}
+
+static void tc_cache_grow(TCCache* self) {
+  size_t n = self->n_buckets * 2;
+  TCCacheEntry** buckets = (TCCacheEntry**) TC_ALLOC(self->allocator, sizeof(TCCacheEntry*) * n);
+  memset(buckets, 0, sizeof(TCCacheEntry*) * n);
+  --self->shift;
+
+  for (size_t i = 0; i < self->n_buckets; ++i) {
+    TCCacheEntry* e = self->buckets[i];
+    while (e != NULL) {
+      TCCacheEntry* chain = e->chain;
+      TCCacheEntry** b = &buckets[(e->hash * 0x9E3779B97F4A7C15ull) >> self->shift];
+      e->chain = *b;
+      *b = e;
+      e = chain;
+    }
+  }
+
+  TC_FREE(self->allocator, self->buckets, sizeof(TCCacheEntry*) * self->n_buckets);
+  self->buckets = buckets;
+  self->n_buckets = n;
+}
+
+static void tc_cache_link_head(TCCache* self, TCCacheEntry* e) {
+  e->prev = NULL;
+  e->next = self->head;
+  if (self->head != NULL) {
+    self->head->prev = e;
+  } else {
+    self->tail = e;
+  }
+  self->head = e;
+}
+
+static void tc_cache_unlink(TCCache* self, TCCacheEntry* e) {
+  if (self->hand == e) self->hand = e->prev;
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    self->head = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    self->tail = e->prev;
+  }
+}
+
+static void tc_cache_drop(TCCache* self, TCCacheEntry** slot, bool evicted) {
+  TCCacheEntry* e = *slot;
+  *slot = e->chain;
+  tc_cache_unlink(self, e);
+  self->used -= e->cost;
+  --self->size;
+
+  if (evicted) {
+    ++self->evictions;
+    if (self->on_evict != NULL) self->on_evict(self, e->key, e->value, self->evict_userdata);
+  }
+
+  TC_FREE(self->allocator, e->key, strlen(e->key) + 1);
+  TC_OWNED_UNREF(self, e->value);
+  $(TCPool, self->entries, free, e);
+}
+
+static void tc_cache_evict(TCCache* self) {
+  TCCacheEntry* v = self->tail;
+  if (self->policy == TC_CACHE_SIEVE) {
+    v = (self->hand != NULL ? self->hand : self->tail);
+    while (v->visited) {
+      v->visited = false;
+      v = (v->prev != NULL ? v->prev : self->tail);
+    }
+    self->hand = v->prev;
+  }
+  tc_cache_drop(self, tc_cache_slot(self, v->key, v->hash), true);
+}
+
+static TObject* tc_cache_get(TCCache* self, const char* key) {
+  assert(self != NULL);
+  assert($is(self, TCCache));
+
+  TCCacheEntry* e = *tc_cache_slot(self, key, tc_djb2(key));
+  if (e == NULL) {
+    ++self->misses;
+    return NULL;
+  }
+  ++self->hits;
+
+  if (self->policy == TC_CACHE_LRU) {
+    if (e != self->head) {
+      tc_cache_unlink(self, e);
+      tc_cache_link_head(self, e);
+    }
+  } else {
+    e->visited = true;
+  }
+
+  TC_OWNED_REF(self, e->value);
+  return e->value;
+}
+
+static bool tc_cache_put(TCCache* self, const char* key, TObject* value) {
+  assert(self != NULL);
+  assert($is(self, TCCache));
+
+  size_t cost = (self->cost != NULL ? self->cost(value, self->cost_userdata) : 1);
+  if (cost > self->capacity) {
+    /* The old value must not outlive a put that replaced it. */
+    $(TCCache, self, remove, key);
+    return false;
+  }
+
+  TC_OWNED_SELF_REF(self);
+
+  uint64_t hash = tc_djb2(key);
+  TCCacheEntry** slot = tc_cache_slot(self, key, hash);
+  TCCacheEntry* e = *slot;
+  if (e != NULL) {
+    TC_OWNED_REF(self, value);
+    TC_OWNED_UNREF(self, e->value);
+    e->value = value;
+    self->used = self->used - e->cost + cost;
+    e->cost = cost;
+    if (self->policy == TC_CACHE_LRU) {
+      tc_cache_unlink(self, e);
+      tc_cache_link_head(self, e);
+    } else {
+      e->visited = true;
+    }
+  } else {
+    while (self->used + cost > self->capacity) {
+      tc_cache_evict(self);
+    }
+    if (self->size >= self->n_buckets) tc_cache_grow(self);
+
+    e = (TCCacheEntry*) $(TCPool, self->entries, alloc);
+    e->hash = hash;
+    e->key = tc_strndup(self->allocator, key, strlen(key));
+    TC_OWNED_REF(self, value);
+    e->value = value;
+    e->cost = cost;
+    e->visited = false;
+    slot = &self->buckets[(hash * 0x9E3779B97F4A7C15ull) >> self->shift];
+    e->chain = *slot;
+    *slot = e;
+    tc_cache_link_head(self, e);
+    self->used += cost;
+    ++self->size;
+  }
+
+  while (self->used > self->capacity) {
+    tc_cache_evict(self);
+  }
+
+  TC_OWNED_SELF_UNREF(self);
+  return true;
+}
+
+static bool tc_cache_remove(TCCache* self, const char* key) {
+  assert(self != NULL);
+  assert($is(self, TCCache));
+
+  TCCacheEntry** slot = tc_cache_slot(self, key, tc_djb2(key));
+  if (*slot == NULL) return false;
+
+  TC_OWNED_SELF_REF(self);
+  tc_cache_drop(self, slot, false);
+  TC_OWNED_SELF_UNREF(self);
+
+  return true;
+}
+
+static void tc_cache_clear(TCCache* self) {
+  assert(self != NULL);
+  assert($is(self, TCCache));
+
+  for (size_t i = 0; i < self->n_buckets; ++i) {
+    while (self->buckets[i] != NULL) {
+      tc_cache_drop(self, &self->buckets[i], false);
+    }
+  }
+  self->hand = NULL;
+}
+
+static size_t tc_cache_memory_usage(TCCache* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCCache));
+
+  size_t n = sizeof(TCCache) + sizeof(TCCacheEntry*) * self->n_buckets;
+  n += $(TCPool, self->entries, memory_usage, false);
+  for (TCCacheEntry* e = self->head; e != NULL; e = e->next) {
+    n += strlen(e->key) + 1;
+    if (deep) n += tc_memory_usage(e->value, true);
+  }
+  return n;
+}
+
+/*
+ * TCPersistentMapNode
+ */
+
+static TCPersistentMapNode* tc_persistent_map_node_constructor(TCPersistentMapNode* self, size_t cap);
+static void tc_persistent_map_node_destructor(TCPersistentMapNode* self);
+static void tc_persistent_map_node_init_vtable(TCPersistentMapNodeVTable* v);
+
+$mtable_define(TCPersistentMapNode, tc_persistent_map_node_constructor, tc_persistent_map_node_destructor, tc_persistent_map_node_init_vtable)
+$mtable_define_end(TCPersistentMapNode)
+
+$vtable_define(TCPersistentMapNode)
+$vtable_define_end(TCPersistentMapNode)
+
+#define TC_PMAP_BITS 5
+#define TC_PMAP_MASK 31u
+
+#if defined(__GNUC__)
+#define TC_POPCOUNT32(x) ((uint32_t) __builtin_popcount(x))
+#else
+static uint32_t tc_popcount32(uint32_t x) {
+  x = x - ((x >> 1) & 0x55555555u);
+  x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+  return (((x + (x >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+}
+#define TC_POPCOUNT32(x) tc_popcount32(x)
+#endif
+
+static TCPersistentMapNode* tc_persistent_map_node_constructor(TCPersistentMapNode* self, size_t cap) {
+  $init(TObject, self);
+  $setup(TCPersistentMapNode, self, tc_persistent_map_node_destructor);
+  $reg(TCPersistentMapNode, TObject);
+
+  self->bitmap = 0;
+  self->len = 0;
+  self->cap = (uint32_t) cap;
+  self->edit = 0;
+  self->allocator = tc_allocator_get_default();
+  self->borrowed = self->allocator->scoped;
+  self->slots = (cap > 0 ? (TCPersistentMapSlot*) TC_ALLOC(self->allocator, sizeof(TCPersistentMapSlot) * cap) : NULL);
+
+  return self;
+}
+
+static void tc_persistent_map_node_destructor(TCPersistentMapNode* self) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMapNode));
+
+  for (uint32_t i = 0; i < self->len; ++i) {
+    TCPersistentMapSlot* s = &self->slots[i];
+    if (s->key == NULL) {
+      TC_UNREF(s->child);
+    } else {
+      TC_UNREF(s->key);
+      if (s->value != NULL) TC_OWNED_UNREF(self, s->value);
+    }
+  }
+  if (self->slots != NULL) TC_FREE(self->allocator, self->slots, sizeof(TCPersistentMapSlot) * self->cap);
+
+  $destroy_parent(TObject, self);
+}
+
+static void tc_persistent_map_node_init_vtable(TCPersistentMapNodeVTable* v) {
+  $vtable_init(v, TCPersistentMapNode, TObject);
+}
+
+/*
+ * TCPersistentMap
+ */
+
+static TCPersistentMap* tc_persistent_map_constructor(TCPersistentMap* self);
+static void tc_persistent_map_destructor(TCPersistentMap* self);
+static void tc_persistent_map_init_vtable(TCPersistentMapVTable* v);
+static TObject* tc_persistent_map_get(TCPersistentMap* self, const char* key);
+static TCPersistentMap* tc_persistent_map_set(TCPersistentMap* self, const char* key, TObject* value);
+static TCPersistentMap* tc_persistent_map_remove(TCPersistentMap* self, const char* key);
+static TCPersistentMap* tc_persistent_map_edit(TCPersistentMap* self);
+static void tc_persistent_map_set_mut(TCPersistentMap* self, const char* key, TObject* value);
+static bool tc_persistent_map_remove_mut(TCPersistentMap* self, const char* key);
+static void tc_persistent_map_freeze(TCPersistentMap* self);
+static void tc_persistent_map_foreach(TCPersistentMap* self, TCPersistentMapIterator iter, void* userdata);
+static size_t tc_persistent_map_memory_usage(TCPersistentMap* self, bool deep);
+
+$mtable_define(TCPersistentMap, tc_persistent_map_constructor, tc_persistent_map_destructor, tc_persistent_map_init_vtable)
+  $mtable_define_method(TCPersistentMapGet, get, tc_persistent_map_get)
+  $mtable_define_method(TCPersistentMapSet, set, tc_persistent_map_set)
+  $mtable_define_method(TCPersistentMapRemove, remove, tc_persistent_map_remove)
+  $mtable_define_method(TCPersistentMapEdit, edit, tc_persistent_map_edit)
+  $mtable_define_method(TCPersistentMapSetMut, set_mut, tc_persistent_map_set_mut)
+  $mtable_define_method(TCPersistentMapRemoveMut, remove_mut, tc_persistent_map_remove_mut)
+  $mtable_define_method(TCPersistentMapFreeze, freeze, tc_persistent_map_freeze)
+  $mtable_define_method(TCPersistentMapForeach, foreach, tc_persistent_map_foreach)
+  $mtable_define_method(TCPersistentMapMemoryUsage, memory_usage, tc_persistent_map_memory_usage)
+$mtable_define_end(TCPersistentMap)
+
+$vtable_define(TCPersistentMap)
+$vtable_define_end(TCPersistentMap)
+
+/* Edit tokens are never reused, so a node tagged by a finished edit can
+ * no longer be changed in place by anyone. */
+#if defined(TC_THREADSAFE_REFCOUNT)
+static atomic_uint_fast64_t tc_persistent_map_edits = 1;
+
+static uint64_t tc_persistent_map_new_edit(void) {
+  return (uint64_t) atomic_fetch_add_explicit(&tc_persistent_map_edits, 1, memory_order_relaxed);
+}
+#else
+static uint64_t tc_persistent_map_edits = 1;
+
+static uint64_t tc_persistent_map_new_edit(void) {
+  return tc_persistent_map_edits++;
+}
+#endif
+
+static TCPersistentMap* tc_persistent_map_constructor(TCPersistentMap* self) {
+  $init(TObject, self);
+  $setup(TCPersistentMap, self, tc_persistent_map_destructor);
+  $reg(TCPersistentMap, TObject);
+
+  self->allocator = tc_allocator_get_default();
+  self->borrowed = self->allocator->scoped;
+  self->root = $new(TCPersistentMapNode, 0);
+  self->count = 0;
+  self->edit = 0;
+
+  return self;
+}
+
+static void tc_persistent_map_destructor(TCPersistentMap* self) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMap));
+
+  TC_UNREF(self->root);
+
+  $destroy_parent(TObject, self);
+}
+
+static void tc_persistent_map_init_vtable(TCPersistentMapVTable* v) {
+  $vtable_init(v, TCPersistentMap, TObject);
+}
+
+static uint64_t tc_persistent_map_hash(const char* key) {
+  return tc_mix64(tc_djb2(key));
+}
+
+static bool tc_persistent_map_slot_is(const TCPersistentMapSlot* s, uint64_t hash, const char* key) {
+  return s->key != NULL && s->hash == hash && strcmp(s->key->str, key) == 0;
+}
+
+static TCPersistentMapSlot* tc_persistent_map_lookup(TCPersistentMap* self, uint64_t hash, const char* key) {
+  TCPersistentMapNode* n = self->root;
+  for (unsigned shift = 0; shift < 64; shift += TC_PMAP_BITS) {
+    uint32_t bit = 1u << ((hash >> shift) & TC_PMAP_MASK);
+    if ((n->bitmap & bit) == 0) return NULL;
+    TCPersistentMapSlot* s = &n->slots[TC_POPCOUNT32(n->bitmap & (bit - 1))];
+    if (s->key != NULL) return (tc_persistent_map_slot_is(s, hash, key) ? s : NULL);
+    n = s->child;
+  }
+  for (uint32_t i = 0; i < n->len; ++i) {
+    if (tc_persistent_map_slot_is(&n->slots[i], hash, key)) return &n->slots[i];
+  }
+  return NULL;
+}
+
+/* Makes *link changeable by self's edit, copying it (and taking a
+ * reference on everything it holds) when another version may see it. */
+static TCPersistentMapNode* tc_persistent_map_own(TCPersistentMap* self, TCPersistentMapNode** link, uint32_t extra) {
+  TCPersistentMapNode* n = *link;
+  if (n->edit == self->edit && n->len + extra <= n->cap) return n;
+
+  TCPersistentMapNode* c = $new(TCPersistentMapNode, n->len + extra);
+  c->allocator = self->allocator;
+  c->borrowed = self->borrowed;
+  c->edit = self->edit;
+  c->bitmap = n->bitmap;
+  c->len = n->len;
+  if (n->len > 0) memcpy(c->slots, n->slots, sizeof(TCPersistentMapSlot) * n->len);
+  if (n->edit == self->edit) {
+    /* Only outgrown: the slots move over along with their references. */
+    n->len = 0;
+  } else {
+    for (uint32_t i = 0; i < c->len; ++i) {
+      TCPersistentMapSlot* s = &c->slots[i];
+      if (s->key == NULL) {
+        TC_REF(s->child);
+      } else {
+        TC_REF(s->key);
+        if (s->value != NULL) TC_OWNED_REF(self, s->value);
+      }
+    }
+  }
+  TC_UNREF(n);
+  *link = c;
+  return c;
+}
+
+static void tc_persistent_map_insert_slot(TCPersistentMapNode* n, uint32_t idx, const TCPersistentMapSlot* s) {
+  memmove(&n->slots[idx + 1], &n->slots[idx], sizeof(TCPersistentMapSlot) * (n->len - idx));
+  n->slots[idx] = *s;
+  ++n->len;
+}
+
+/* Builds the subtree below `shift` that holds both a and b. */
+static TCPersistentMapNode* tc_persistent_map_fork(TCPersistentMap* self, unsigned shift, const TCPersistentMapSlot* a, const TCPersistentMapSlot* b) {
+  TCPersistentMapNode* n = $new(TCPersistentMapNode, 2);
+  n->allocator = self->allocator;
+  n->borrowed = self->borrowed;
+  n->edit = self->edit;
+  if (shift >= 64) {
+    n->slots[0] = *a;
+    n->slots[1] = *b;
+    n->len = 2;
+    return n;
+  }
+
+  uint32_t da = (a->hash >> shift) & TC_PMAP_MASK;
+  uint32_t db = (b->hash >> shift) & TC_PMAP_MASK;
+  if (da == db) {
+    n->bitmap = 1u << da;
+    n->slots[0].key = NULL;
+    n->slots[0].value = NULL;
+    n->slots[0].hash = 0;
+    n->slots[0].child = tc_persistent_map_fork(self, shift + TC_PMAP_BITS, a, b);
+    n->len = 1;
+  } else {
+    n->bitmap = (1u << da) | (1u << db);
+    n->slots[da < db ? 0 : 1] = *a;
+    n->slots[da < db ? 1 : 0] = *b;
+    n->len = 2;
+  }
+  return n;
+}
+
+/* Stores `s` (whose key and value references it hands over) below *link;
+ * returns false when it replaced the value of an existing key. */
+static bool tc_persistent_map_assoc(TCPersistentMap* self, TCPersistentMapNode** link, unsigned shift, TCPersistentMapSlot* s) {
+  TCPersistentMapNode* n = *link;
+  if (shift >= 64) {
+    for (uint32_t i = 0; i < n->len; ++i) {
+      if (tc_persistent_map_slot_is(&n->slots[i], s->hash, s->key->str)) {
+        n = tc_persistent_map_own(self, link, 0);
+        TC_UNREF(s->key);
+        if (n->slots[i].value != NULL) TC_OWNED_UNREF(self, n->slots[i].value);
+        n->slots[i].value = s->value;
+        return false;
+      }
+    }
+    n = tc_persistent_map_own(self, link, 1);
+    n->slots[n->len++] = *s;
+    return true;
+  }
+
+  uint32_t bit = 1u << ((s->hash >> shift) & TC_PMAP_MASK);
+  uint32_t idx = TC_POPCOUNT32(n->bitmap & (bit - 1));
+  if ((n->bitmap & bit) == 0) {
+    n = tc_persistent_map_own(self, link, 1);
+    tc_persistent_map_insert_slot(n, idx, s);
+    n->bitmap |= bit;
+    return true;
+  }
+
+  n = tc_persistent_map_own(self, link, 0);
+  TCPersistentMapSlot* t = &n->slots[idx];
+  if (t->key == NULL) {
+    return tc_persistent_map_assoc(self, &t->child, shift + TC_PMAP_BITS, s);
+  }
+  if (tc_persistent_map_slot_is(t, s->hash, s->key->str)) {
+    TC_UNREF(s->key);
+    if (t->value != NULL) TC_OWNED_UNREF(self, t->value);
+    t->value = s->value;
+    return false;
+  }
+
+  TCPersistentMapSlot old = *t;
+  t->child = tc_persistent_map_fork(self, shift + TC_PMAP_BITS, &old, s);
+  t->key = NULL;
+  t->value = NULL;
+  t->hash = 0;
+  return true;
+}
+
+/* Removes a key known to be present below *link. */
+static void tc_persistent_map_dissoc(TCPersistentMap* self, TCPersistentMapNode** link, unsigned shift, uint64_t hash, const char* key) {
+  TCPersistentMapNode* n = tc_persistent_map_own(self, link, 0);
+  uint32_t idx = 0;
+  uint32_t bit = 0;
+  if (shift >= 64) {
+    while (!tc_persistent_map_slot_is(&n->slots[idx], hash, key)) ++idx;
+  } else {
+    bit = 1u << ((hash >> shift) & TC_PMAP_MASK);
+    idx = TC_POPCOUNT32(n->bitmap & (bit - 1));
+  }
+
+  TCPersistentMapSlot* t = &n->slots[idx];
+  if (t->key == NULL) {
+    tc_persistent_map_dissoc(self, &t->child, shift + TC_PMAP_BITS, hash, key);
+    TCPersistentMapNode* c = t->child;
+    if (c->len == 1 && c->slots[0].key != NULL) {
+      /* A lone key moves up in place of its node. */
+      *t = c->slots[0];
+      c->len = 0;
+      TC_UNREF(c);
+    }
+    return;
+  }
+
+  TC_UNREF(t->key);
+  if (t->value != NULL) TC_OWNED_UNREF(self, t->value);
+  memmove(t, t + 1, sizeof(TCPersistentMapSlot) * (n->len - idx - 1));
+  --n->len;
+  n->bitmap &= ~bit;
+}
+
+static TObject* tc_persistent_map_get(TCPersistentMap* self, const char* key) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMap));
+
+  TCPersistentMapSlot* s = tc_persistent_map_lookup(self, tc_persistent_map_hash(key), key);
+  if (s == NULL || s->value == NULL) return NULL;
+  TC_OWNED_REF(self, s->value);
+  return s->value;
+}
+
+static TCPersistentMap* tc_persistent_map_set(TCPersistentMap* self, const char* key, TObject* value) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMap));
+
+  TCPersistentMap* m = $(TCPersistentMap, self, edit);
+  $(TCPersistentMap, m, set_mut, key, value);
+  $(TCPersistentMap, m, freeze);
+  return m;
+}
+
+static TCPersistentMap* tc_persistent_map_remove(TCPersistentMap* self, const char* key) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMap));
+
+  TCPersistentMap* m = $(TCPersistentMap, self, edit);
+  $(TCPersistentMap, m, remove_mut, key);
+  $(TCPersistentMap, m, freeze);
+  return m;
+}
+
+static TCPersistentMap* tc_persistent_map_edit(TCPersistentMap* self) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMap));
+  assert(self->edit == 0);
+
+  TCPersistentMap* m = $new(TCPersistentMap);
+  TC_UNREF(m->root);
+  TC_REF(self->root);
+  m->root = self->root;
+  m->count = self->count;
+  m->allocator = self->allocator;
+  m->borrowed = self->borrowed;
+  m->edit = tc_persistent_map_new_edit();
+  return m;
+}
+
+static void tc_persistent_map_set_mut(TCPersistentMap* self, const char* key, TObject* value) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMap));
+  assert(self->edit != 0);
+
+  TCPersistentMapSlot s;
+  s.hash = tc_persistent_map_hash(key);
+  s.key = $str(key);
+  s.value = value;
+  s.child = NULL;
+  if (value != NULL) TC_OWNED_REF(self, value);
+  if (tc_persistent_map_assoc(self, &self->root, 0, &s)) ++self->count;
+}
+
+static bool tc_persistent_map_remove_mut(TCPersistentMap* self, const char* key) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMap));
+  assert(self->edit != 0);
+
+  uint64_t hash = tc_persistent_map_hash(key);
+  if (tc_persistent_map_lookup(self, hash, key) == NULL) return false;
+  tc_persistent_map_dissoc(self, &self->root, 0, hash, key);
+  --self->count;
+  return true;
+}
+
+static void tc_persistent_map_freeze(TCPersistentMap* self) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMap));
+
+  self->edit = 0;
+}
+
+static bool tc_persistent_map_walk(TCPersistentMap* self, TCPersistentMapNode* n, TCPersistentMapIterator iter, void* userdata) {
+  for (uint32_t i = 0; i < n->len; ++i) {
+    TCPersistentMapSlot* s = &n->slots[i];
+    bool c = (s->key == NULL ? tc_persistent_map_walk(self, s->child, iter, userdata)
+                             : iter(self, s->key->str, s->value, userdata));
+    if (!c) return false;
+  }
+  return true;
+}
+
+static void tc_persistent_map_foreach(TCPersistentMap* self, TCPersistentMapIterator iter, void* userdata) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMap));
+
+  tc_persistent_map_walk(self, self->root, iter, userdata);
+}
+
+static size_t tc_persistent_map_node_usage(TCPersistentMapNode* node, bool deep) {
+  size_t n = sizeof(TCPersistentMapNode) + sizeof(TCPersistentMapSlot) * node->cap;
+  for (uint32_t i = 0; i < node->len; ++i) {
+    TCPersistentMapSlot* s = &node->slots[i];
+    if (s->key == NULL) {
+      n += tc_persistent_map_node_usage(s->child, deep);
+    } else {
+      n += $(TCString, s->key, memory_usage, false);
+      if (deep) n += tc_memory_usage(s->value, true);
+    }
+  }
+  return n;
+}
+
+/* Nodes shared with other versions are counted in each of them. */
+static size_t tc_persistent_map_memory_usage(TCPersistentMap* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCPersistentMap));
+
+  size_t n = sizeof(TCPersistentMap);
+  if (self->root != NULL) n += tc_persistent_map_node_usage(self->root, deep);
+  return n;
+}
+
+/*
+ * TCFrozenMap
+ */
+
+static TCFrozenMap* tc_frozen_map_constructor(TCFrozenMap* self, TCMap* map);
+static void tc_frozen_map_destructor(TCFrozenMap* self);
+static void tc_frozen_map_init_vtable(TCFrozenMapVTable* v);
+static TObject* tc_frozen_map_get(TCFrozenMap* self, const char* key);
+static size_t tc_frozen_map_memory_usage(TCFrozenMap* self, bool deep);
+
+$mtable_define(TCFrozenMap, tc_frozen_map_constructor, tc_frozen_map_destructor, tc_frozen_map_init_vtable)
+  $mtable_define_method(TCFrozenMapGet, get, tc_frozen_map_get)
+  $mtable_define_method(TCFrozenMapMemoryUsage, memory_usage, tc_frozen_map_memory_usage)
+$mtable_define_end(TCFrozenMap)
+
+$vtable_define(TCFrozenMap)
+$vtable_define_end(TCFrozenMap)
+
+#define TC_FROZEN_MAP_BUCKET_SIZE 3
+
+/* FNV-1a over the key bytes with the seed folded into the basis. Keys
+ * that collide under one seed (such as a djb2 collision) get different
+ * hashes under the next, which reseeding relies on. */
+static uint64_t tc_frozen_map_hash(const char* key, uint64_t seed) {
+  uint64_t h = 0xCBF29CE484222325ull ^ tc_mix64(seed);
+  for (const unsigned char* c = (const unsigned char*) key; *c != '\0'; ++c) {
+    h = (h ^ *c) * 0x100000001B3ull;
+  }
+  return tc_mix64(h ^ seed);
+}
+
+static size_t tc_frozen_map_bucket(uint64_t hash, size_t n_buckets) {
+  return (size_t) (((hash >> 32) * (uint64_t) n_buckets) >> 32);
+}
+
+static size_t tc_frozen_map_slot(uint64_t hash, uint32_t pilot, size_t len) {
+  return (size_t) (tc_mix64(hash ^ ((uint64_t) pilot * 0x9E3779B97F4A7C15ull)) % len);
+}
+
+/* Sizes the arrays for `len` keys taking `keys_size` bytes in all. */
+static void tc_frozen_map_alloc(TCFrozenMap* self, size_t len, size_t n_buckets, size_t keys_size) {
+  self->len = len;
+  self->n_buckets = n_buckets;
+  self->keys_size = keys_size;
+  self->pilots = (uint32_t*) TC_ALLOC(self->allocator, sizeof(uint32_t) * n_buckets);
+  self->entries = (TCFrozenMapEntry*) TC_ALLOC(self->allocator, sizeof(TCFrozenMapEntry) * (len > 0 ? len : 1));
+  self->keys = (char*) TC_ALLOC(self->allocator, keys_size > 0 ? keys_size : 1);
+}
+
+/* Finds a pilot for every bucket, largest buckets first, and stores each
+ * key's slot in `slots`. Fails when two keys of a bucket share a hash,
+ * which no pilot can separate, or when some bucket runs out of pilots;
+ * the caller then retries with another seed. */
+static bool tc_frozen_map_place(TCFrozenMap* self, const uint64_t* hashes, size_t* slots) {
+  size_t n = self->len;
+  size_t nb = self->n_buckets;
+  size_t* start = (size_t*) calloc(nb + 1, sizeof(size_t));
+  size_t* members = (size_t*) malloc(sizeof(size_t) * n);
+  for (size_t i = 0; i < n; ++i) ++start[tc_frozen_map_bucket(hashes[i], nb) + 1];
+  size_t largest = 0;
+  for (size_t b = 0; b < nb; ++b) {
+    if (start[b + 1] > largest) largest = start[b + 1];
+    start[b + 1] += start[b];
+  }
+  size_t* fill = (size_t*) malloc(sizeof(size_t) * (nb + 1));
+  memcpy(fill, start, sizeof(size_t) * (nb + 1));
+  for (size_t i = 0; i < n; ++i) members[fill[tc_frozen_map_bucket(hashes[i], nb)]++] = i;
+
+  /* Buckets by size, largest first, with a counting sort. */
+  size_t* by_size = (size_t*) calloc(largest + 2, sizeof(size_t));
+  size_t* order = (size_t*) malloc(sizeof(size_t) * nb);
+  for (size_t b = 0; b < nb; ++b) ++by_size[largest - (start[b + 1] - start[b]) + 1];
+  for (size_t k = 0; k <= largest; ++k) by_size[k + 1] += by_size[k];
+  for (size_t b = 0; b < nb; ++b) order[by_size[largest - (start[b + 1] - start[b])]++] = b;
+
+  uint8_t* taken = (uint8_t*) calloc(n / 8 + 1, 1);
+  size_t* tried = (size_t*) malloc(sizeof(size_t) * (largest > 0 ? largest : 1));
+  bool ok = true;
+  for (size_t o = 0; o < nb && ok; ++o) {
+    size_t b = order[o];
+    size_t size = start[b + 1] - start[b];
+    self->pilots[b] = 0;
+    if (size == 0) continue;
+    for (size_t x = 0; x < size && ok; ++x) {
+      for (size_t y = x + 1; y < size && ok; ++y) {
+        ok = (hashes[members[start[b] + x]] != hashes[members[start[b] + y]]);
+      }
+    }
+    if (!ok) break;
+
+    for (uint64_t pilot = 0;; ++pilot) {
+      if (pilot > UINT32_MAX) {
+        ok = false;
+        break;
+      }
+      size_t k = 0;
+      for (; k < size; ++k) {
+        size_t s = tc_frozen_map_slot(hashes[members[start[b] + k]], (uint32_t) pilot, n);
+        if (taken[s / 8] & (1u << (s % 8))) break;
+        size_t j = 0;
+        while (j < k && tried[j] != s) ++j;
+        if (j < k) break;
+        tried[k] = s;
+      }
+      if (k < size) continue;
+
+      for (k = 0; k < size; ++k) {
+        taken[tried[k] / 8] |= (uint8_t) (1u << (tried[k] % 8));
+        slots[members[start[b] + k]] = tried[k];
+      }
+      self->pilots[b] = (uint32_t) pilot;
+      break;
+    }
+  }
+
+  free(tried);
+  free(taken);
+  free(order);
+  free(by_size);
+  free(fill);
+  free(members);
+  free(start);
+  return ok;
+}
+
+static TCFrozenMap* tc_frozen_map_constructor(TCFrozenMap* self, TCMap* map) {
+  $init(TObject, self);
+  $setup(TCFrozenMap, self, tc_frozen_map_destructor);
+  $reg(TCFrozenMap, TObject);
+
+  self->allocator = tc_allocator_get_default();
+  self->borrowed = self->allocator->scoped;
+  self->seed = 0;
+
+  size_t n = (map != NULL ? map->pairs->len : 0);
+  size_t keys_size = 0;
+  TCMapPair** pairs = (TCMapPair**) malloc(sizeof(TCMapPair*) * (n > 0 ? n : 1));
+  size_t i = 0;
+  if (map != NULL) {
+    for (TCIter it = tc_map_iter_begin(map); !tc_map_iter_done(&it); tc_map_iter_next(&it), ++i) {
+      pairs[i] = tc_map_iter_current(&it);
+      keys_size += strlen(pairs[i]->key) + 1;
+    }
+  }
+  tc_frozen_map_alloc(self, n, n / TC_FROZEN_MAP_BUCKET_SIZE + 1, keys_size);
+
+  uint64_t* hashes = (uint64_t*) malloc(sizeof(uint64_t) * (n > 0 ? n : 1));
+  size_t* slots = (size_t*) malloc(sizeof(size_t) * (n > 0 ? n : 1));
+  for (;;) {
+    for (i = 0; i < n; ++i) hashes[i] = tc_frozen_map_hash(pairs[i]->key, self->seed);
+    if (tc_frozen_map_place(self, hashes, slots)) break;
+    self->seed = tc_mix64(self->seed + 1);
+  }
+
+  char* k = self->keys;
+  for (i = 0; i < n; ++i) {
+    size_t len = strlen(pairs[i]->key) + 1;
+    memcpy(k, pairs[i]->key, len);
+    TCFrozenMapEntry* e = &self->entries[slots[i]];
+    e->hash = hashes[i];
+    e->key = k;
+    e->value = pairs[i]->value;
+    if (e->value != NULL) TC_OWNED_REF(self, e->value);
+    k += len;
+  }
+
+  free(slots);
+  free(hashes);
+  free(pairs);
+  return self;
+}
+
+static void tc_frozen_map_free(TCFrozenMap* self) {
+  for (size_t i = 0; i < self->len; ++i) {
+    if (self->entries[i].value != NULL) TC_OWNED_UNREF(self, self->entries[i].value);
+  }
+  TC_FREE(self->allocator, self->pilots, sizeof(uint32_t) * self->n_buckets);
+  TC_FREE(self->allocator, self->entries, sizeof(TCFrozenMapEntry) * (self->len > 0 ? self->len : 1));
+  TC_FREE(self->allocator, self->keys, self->keys_size > 0 ? self->keys_size : 1);
+}
+
+static void tc_frozen_map_destructor(TCFrozenMap* self) {
+  assert(self != NULL);
+  assert($is(self, TCFrozenMap));
+
+  tc_frozen_map_free(self);
+
+  $destroy_parent(TObject, self);
+}
+
+static void tc_frozen_map_init_vtable(TCFrozenMapVTable* v) {
+  $vtable_init(v, TCFrozenMap, TObject);
+}
+
+static TObject* tc_frozen_map_get(TCFrozenMap* self, const char* key) {
+  assert(self != NULL);
+  assert($is(self, TCFrozenMap));
+
+  if (self->len == 0) return NULL;
+  uint64_t hash = tc_frozen_map_hash(key, self->seed);
+  uint32_t pilot = self->pilots[tc_frozen_map_bucket(hash, self->n_buckets)];
+  TCFrozenMapEntry* e = &self->entries[tc_frozen_map_slot(hash, pilot, self->len)];
+  if (e->hash != hash || e->value == NULL || strcmp(e->key, key) != 0) return NULL;
+  TC_OWNED_REF(self, e->value);
+  return e->value;
+}
+
+static size_t tc_frozen_map_memory_usage(TCFrozenMap* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCFrozenMap));
+
+  size_t n = sizeof(TCFrozenMap) + sizeof(uint32_t) * self->n_buckets;
+  n += sizeof(TCFrozenMapEntry) * (self->len > 0 ? self->len : 1);
+  n += (self->keys_size > 0 ? self->keys_size : 1);
+  if (deep) {
+    for (size_t i = 0; i < self->len; ++i) n += tc_memory_usage(self->entries[i].value, true);
+  }
+  return n;
+}
+
+/*
+ * Serialization
+ */
+
+/* A file is an 8-byte preamble, the records, then a trailer. */
+static const char tc_serial_magic[8] = { 'T', 'C', '2', 'D', 'A', 'T', 'A', '\0' };
+
+#define TC_SERIAL_BYTE_ORDER 0x01020304u
+#define TC_SERIAL_MAX_DEPTH 1024
+
+typedef struct TCSerialTrailer {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t size;
+  uint64_t root;
+  uint64_t checksum;
+  uint64_t reserved[3];
+} TCSerialTrailer;
+
+/* Strings are followed by their bytes and a NUL, vectors by `len` item
+ * offsets, maps by a probe mask, `len` entries and a table of entry
+ * numbers (0 for empty slots), and frozen maps by their bucket count,
+ * seed, pilots and `len` entries in slot order; each record is padded
+ * to 8 bytes. */
+typedef struct TCSerialRecord {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t len;
+} TCSerialRecord;
+
+typedef struct TCSerialEntry {
+  uint64_t hash;
+  uint64_t key;
+  uint64_t value;
+} TCSerialEntry;
+
+static uint64_t tc_serial_checksum(uint64_t h, const uint8_t* p, size_t n) {
+  assert(n % 8 == 0);
+  for (size_t i = 0; i < n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    h = (h ^ tc_mix64(w)) * 0x9E3779B97F4A7C15ull;
+  }
+  return h;
+}
+
+static uint64_t tc_serial_hash(const char* key) {
+  return tc_mix64(tc_djb2(key));
+}
+
+static void tc_writer_flush(TCWriter* w) {
+  if (w->buffered == 0) return;
+  if (!w->failed && !w->sink(w->ctx, w->buf, w->buffered)) w->failed = true;
+  w->buffered = 0;
+}
+
+static void tc_writer_emit(TCWriter* w, const void* data, size_t len) {
+  const uint8_t* p = (const uint8_t*) data;
+  w->offset += len;
+  while (len > 0) {
+    size_t n = TC_WRITER_BUFFER - w->buffered;
+    if (n > len) n = len;
+    memcpy(w->buf + w->buffered, p, n);
+    w->buffered += n;
+    p += n;
+    len -= n;
+    if (w->buffered == TC_WRITER_BUFFER) {
+      w->checksum = tc_serial_checksum(w->checksum, w->buf, w->buffered);
+      tc_writer_flush(w);
+    }
+  }
+}
+
+static void tc_writer_pad(TCWriter* w) {
+  static const uint8_t zero[8] = { 0 };
+  if (w->offset % 8 != 0) tc_writer_emit(w, zero, 8 - w->offset % 8);
+}
+
+static uint64_t tc_writer_record(TCWriter* w, TCSerialType type, uint64_t len) {
+  uint64_t off = w->offset;
+  TCSerialRecord r = { (uint32_t) type, 0, len };
+  tc_writer_emit(w, &r, sizeof(r));
+  return off;
+}
+
+void tc_writer_init(TCWriter* w, TCWriterSink sink, void* ctx) {
+  assert(w != NULL && sink != NULL);
+
+  w->sink = sink;
+  w->ctx = ctx;
+  w->offset = 0;
+  w->checksum = 0;
+  w->failed = false;
+  w->buffered = 0;
+  /* The preamble is left out of the checksum. */
+  if (!sink(ctx, tc_serial_magic, sizeof(tc_serial_magic))) w->failed = true;
+  w->offset = sizeof(tc_serial_magic);
+}
+
+uint64_t tc_writer_put_string(TCWriter* w, const char* str, size_t len) {
+  assert(w != NULL && str != NULL);
+
+  uint64_t off = tc_writer_record(w, TC_SERIAL_STRING, len);
+  tc_writer_emit(w, str, len);
+  tc_writer_emit(w, "", 1);
+  tc_writer_pad(w);
+  return off;
+}
+
+uint64_t tc_writer_put_vector(TCWriter* w, const uint64_t* items, size_t n) {
+  assert(w != NULL && (n == 0 || items != NULL));
+
+  uint64_t off = tc_writer_record(w, TC_SERIAL_VECTOR, n);
+  tc_writer_emit(w, items, sizeof(uint64_t) * n);
+  return off;
+}
+
+uint64_t tc_writer_put_map(TCWriter* w, const char* const* keys, const uint64_t* values, size_t n) {
+  assert(w != NULL && (n == 0 || (keys != NULL && values != NULL)));
+  assert(n < UINT32_MAX);
+
+  uint64_t slots = 8;
+  while (slots < 2 * n) slots *= 2;
+  TCSerialEntry* entries = (TCSerialEntry*) malloc(sizeof(TCSerialEntry) * (n > 0 ? n : 1));
+  uint32_t* table = (uint32_t*) calloc(slots, sizeof(uint32_t));
+  for (size_t i = 0; i < n; ++i) {
+    entries[i].hash = tc_serial_hash(keys[i]);
+    entries[i].key = tc_writer_put_string(w, keys[i], strlen(keys[i]));
+    entries[i].value = values[i];
+    uint64_t s = entries[i].hash & (slots - 1);
+    while (table[s] != 0) s = (s + 1) & (slots - 1);
+    table[s] = (uint32_t) (i + 1);
+  }
+
+  uint64_t off = tc_writer_record(w, TC_SERIAL_MAP, n);
+  uint64_t mask = slots - 1;
+  tc_writer_emit(w, &mask, sizeof(mask));
+  tc_writer_emit(w, entries, sizeof(TCSerialEntry) * n);
+  tc_writer_emit(w, table, sizeof(uint32_t) * slots);
+  tc_writer_pad(w);
+
+  free(table);
+  free(entries);
+  return off;
+}
+
+uint64_t tc_writer_put(TCWriter* w, TObject* obj) {
+  assert(w != NULL);
+
+  if (obj == NULL || w->failed) return 0;
+
+  if ($is(obj, TCString)) {
+    TCString* s = (TCString*) obj;
+    return tc_writer_put_string(w, s->str != NULL ? s->str : "", s->len);
+  }
+
+  if ($is(obj, TCVector)) {
+    TCVector* v = (TCVector*) obj;
+    uint64_t* items = (uint64_t*) malloc(sizeof(uint64_t) * (v->len > 0 ? v->len : 1));
+    for (size_t i = 0; i < v->len; ++i) items[i] = tc_writer_put(w, v->arr[i]);
+    uint64_t off = tc_writer_put_vector(w, items, v->len);
+    free(items);
+    return off;
+  }
+
+  if ($is(obj, TCFrozenMap)) {
+    TCFrozenMap* f = (TCFrozenMap*) obj;
+    TCSerialEntry* entries = (TCSerialEntry*) malloc(sizeof(TCSerialEntry) * (f->len > 0 ? f->len : 1));
+    for (size_t i = 0; i < f->len; ++i) {
+      entries[i].hash = f->entries[i].hash;
+      entries[i].key = tc_writer_put_string(w, f->entries[i].key, strlen(f->entries[i].key));
+      entries[i].value = tc_writer_put(w, f->entries[i].value);
+    }
+    uint64_t off = tc_writer_record(w, TC_SERIAL_FROZEN_MAP, f->len);
+    uint64_t head[2] = { f->n_buckets, f->seed };
+    tc_writer_emit(w, head, sizeof(head));
+    tc_writer_emit(w, f->pilots, sizeof(uint32_t) * f->n_buckets);
+    tc_writer_pad(w);
+    tc_writer_emit(w, entries, sizeof(TCSerialEntry) * f->len);
+    free(entries);
+    return off;
+  }
+
+  if ($is(obj, TCMap)) {
+    TCMap* m = (TCMap*) obj;
+    size_t n = m->pairs->len;
+    const char** keys = (const char**) malloc(sizeof(char*) * (n > 0 ? n : 1));
+    uint64_t* values = (uint64_t*) malloc(sizeof(uint64_t) * (n > 0 ? n : 1));
+    size_t i = 0;
+    for (TCIter it = tc_map_iter_begin(m); !tc_map_iter_done(&it); tc_map_iter_next(&it), ++i) {
+      TCMapPair* p = tc_map_iter_current(&it);
+      keys[i] = p->key;
+      values[i] = tc_writer_put(w, p->value);
+    }
+    uint64_t off = tc_writer_put_map(w, keys, values, n);
+    free(values);
+    free(keys);
+    return off;
+  }
+
+  w->failed = true;
+  return 0;
+}
+
+bool tc_writer_finish(TCWriter* w, uint64_t root) {
+  assert(w != NULL);
+
+  assert(w->offset % 8 == 0);
+  w->checksum = tc_serial_checksum(w->checksum, w->buf, w->buffered);
+  TCSerialTrailer t;
+  memset(&t, 0, sizeof(t));
+  memcpy(t.magic, tc_serial_magic, sizeof(t.magic));
+  t.version = TC_SERIAL_VERSION;
+  t.byte_order = TC_SERIAL_BYTE_ORDER;
+  t.size = w->offset + sizeof(t);
+  t.root = root;
+  t.checksum = w->checksum;
+  tc_writer_flush(w);
+  if (!w->failed && !w->sink(w->ctx, &t, sizeof(t))) w->failed = true;
+  w->offset += sizeof(t);
+  return !w->failed;
+}
+
+static bool tc_serial_file_sink(void* ctx, const void* data, size_t len) {
+  return fwrite(data, 1, len, (FILE*) ctx) == len;
+}
+
+bool tc_serialize_file(const char* path, TObject* obj) {
+  FILE* f = fopen(path, "wb");
+  if (f == NULL) return false;
+
+  TCWriter* w = (TCWriter*) malloc(sizeof(TCWriter));
+  tc_writer_init(w, tc_serial_file_sink, f);
+  bool ok = tc_writer_finish(w, tc_writer_put(w, obj));
+  free(w);
+  if (fclose(f) != 0) ok = false;
+  return ok;
+}
+
+bool tc_mapped_open_memory(TCMapped* m, const void* data, size_t size, bool verify) {
+  assert(m != NULL);
+
+  m->data = (const uint8_t*) data;
+  m->size = size;
+  m->root = 0;
+  m->mapped = false;
+  m->owned = false;
+
+  TCSerialTrailer t;
+  if (data == NULL || (uintptr_t) data % 8 != 0 || size < sizeof(tc_serial_magic) + sizeof(t) || size % 8 != 0) {
+    return false;
+  }
+  memcpy(&t, m->data + size - sizeof(t), sizeof(t));
+  if (memcmp(m->data, tc_serial_magic, sizeof(tc_serial_magic)) != 0 ||
+      memcmp(t.magic, tc_serial_magic, sizeof(tc_serial_magic)) != 0 ||
+      t.version != TC_SERIAL_VERSION || t.byte_order != TC_SERIAL_BYTE_ORDER ||
+      t.size != size || t.root >= size - sizeof(t) || t.root % 8 != 0) {
+    return false;
+  }
+  if (verify) {
+    size_t body = size - sizeof(tc_serial_magic) - sizeof(t);
+    if (tc_serial_checksum(0, m->data + sizeof(tc_serial_magic), body) != t.checksum) return false;
+  }
+
+  m->root = t.root;
+  return true;
+}
+
+bool tc_mapped_open(TCMapped* m, const char* path, bool verify) {
+  assert(m != NULL && path != NULL);
+
+  m->data = NULL;
+  m->size = 0;
+#if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return false;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  void* data = (size > 0 ? malloc((size_t) size) : NULL);
+  bool read = (data != NULL && fread(data, 1, (size_t) size, f) == (size_t) size);
+  fclose(f);
+  if (!read || !tc_mapped_open_memory(m, data, (size_t) size, verify)) {
+    free(data);
+    return false;
+  }
+  m->owned = true;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return false;
+  if (!tc_mapped_open_memory(m, data, (size_t) st.st_size, verify)) {
+    munmap(data, (size_t) st.st_size);
+    return false;
+  }
+  m->mapped = true;
+#endif
+  return true;
+}
+
+void tc_mapped_close(TCMapped* m) {
+  assert(m != NULL);
+
+#if !(defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64))
+  if (m->mapped) munmap((void*) m->data, m->size);
+#endif
+  if (m->owned) free((void*) m->data);
+  m->data = NULL;
+  m->size = 0;
+  m->root = 0;
+  m->mapped = false;
+  m->owned = false;
+}
+
+/* Records are checked when they are read: an offset outside the records,
+ * a payload running past them, a string without its NUL or a map table
+ * without an empty slot all make the record read as missing. A corrupt
+ * file opened without `verify` is thus never read out of bounds. */
+static const TCSerialRecord* tc_mapped_record(const TCMapped* m, uint64_t off) {
+  assert(m != NULL && m->data != NULL);
+
+  uint64_t end = m->size - sizeof(TCSerialTrailer);
+  if (off % 8 != 0 || off < sizeof(tc_serial_magic) || off >= end || end - off < sizeof(TCSerialRecord)) return NULL;
+  const TCSerialRecord* r = (const TCSerialRecord*) (m->data + off);
+  const uint64_t* p = (const uint64_t*) (r + 1);
+  /* A multiple of 8, as are the record and the file. */
+  uint64_t avail = end - off - sizeof(TCSerialRecord);
+
+  switch (r->type) {
+  case TC_SERIAL_STRING:
+    return (r->len < avail && ((const char*) p)[r->len] == '\0' ? r : NULL);
+  case TC_SERIAL_VECTOR:
+    return (r->len <= avail / sizeof(uint64_t) ? r : NULL);
+  case TC_SERIAL_MAP: {
+    if (avail < sizeof(uint64_t)) return NULL;
+    avail -= sizeof(uint64_t);
+    uint64_t slots = p[0] + 1;
+    if (slots == 0 || (slots & (slots - 1)) != 0 || slots > avail / sizeof(uint32_t) || r->len >= slots) return NULL;
+    avail -= sizeof(uint32_t) * slots;
+    return (r->len <= avail / sizeof(TCSerialEntry) ? r : NULL);
+  }
+  case TC_SERIAL_FROZEN_MAP: {
+    if (avail < 2 * sizeof(uint64_t)) return NULL;
+    avail -= 2 * sizeof(uint64_t);
+    uint64_t buckets = p[0];
+    if (buckets > avail / sizeof(uint32_t) || (r->len > 0 && buckets == 0)) return NULL;
+    avail -= (sizeof(uint32_t) * buckets + 7) & ~(uint64_t) 7;
+    return (r->len <= avail / sizeof(TCSerialEntry) ? r : NULL);
+  }
+  default:
+    return NULL;
+  }
+}
+
+TCSerialType tc_mapped_type(const TCMapped* m, uint64_t off) {
+  const TCSerialRecord* r = (off != 0 ? tc_mapped_record(m, off) : NULL);
+  return (r != NULL ? (TCSerialType) r->type : TC_SERIAL_NONE);
+}
+
+const char* tc_mapped_string(const TCMapped* m, uint64_t off, size_t* len) {
+  const TCSerialRecord* r = tc_mapped_record(m, off);
+  if (r == NULL || r->type != TC_SERIAL_STRING) {
+    if (len != NULL) *len = 0;
+    return NULL;
+  }
+  if (len != NULL) *len = (size_t) r->len;
+  return (const char*) (r + 1);
+}
+
+size_t tc_mapped_len(const TCMapped* m, uint64_t off) {
+  const TCSerialRecord* r = tc_mapped_record(m, off);
+  return (r != NULL ? (size_t) r->len : 0);
+}
+
+uint64_t tc_mapped_vector_at(const TCMapped* m, uint64_t off, size_t idx) {
+  const TCSerialRecord* r = tc_mapped_record(m, off);
+  if (r == NULL || r->type != TC_SERIAL_VECTOR || idx >= r->len) return 0;
+  return ((const uint64_t*) (r + 1))[idx];
+}
+
+static const TCSerialEntry* tc_mapped_entries(const TCSerialRecord* r) {
+  const uint64_t* p = (const uint64_t*) (r + 1);
+  if (r->type == TC_SERIAL_MAP) return (const TCSerialEntry*) (p + 1);
+  return (const TCSerialEntry*) ((const uint8_t*) (p + 2) + ((sizeof(uint32_t) * p[0] + 7) & ~(size_t) 7));
+}
+
+uint64_t tc_mapped_map_get(const TCMapped* m, uint64_t off, const char* key) {
+  const TCSerialRecord* r = tc_mapped_record(m, off);
+  if (r == NULL || (r->type != TC_SERIAL_MAP && r->type != TC_SERIAL_FROZEN_MAP)) return 0;
+  const uint64_t* p = (const uint64_t*) (r + 1);
+  const TCSerialEntry* entries = tc_mapped_entries(r);
+
+  if (r->type == TC_SERIAL_FROZEN_MAP) {
+    if (r->len == 0) return 0;
+    uint64_t hash = tc_frozen_map_hash(key, p[1]);
+    uint32_t pilot = ((const uint32_t*) (p + 2))[tc_frozen_map_bucket(hash, (size_t) p[0])];
+    const TCSerialEntry* e = &entries[tc_frozen_map_slot(hash, pilot, (size_t) r->len)];
+    if (e->hash != hash) return 0;
+    const char* k = tc_mapped_string(m, e->key, NULL);
+    return (k != NULL && strcmp(k, key) == 0 ? e->value : 0);
+  }
+
+  uint64_t mask = p[0];
+  const uint32_t* table = (const uint32_t*) (entries + r->len);
+  uint64_t hash = tc_serial_hash(key);
+  /* Bounded by the table size in case a corrupt table has no empty slot. */
+  for (uint64_t s = hash & mask, i = 0; i <= mask && table[s] != 0; s = (s + 1) & mask, ++i) {
+    if (table[s] > r->len) return 0;
+    const TCSerialEntry* e = &entries[table[s] - 1];
+    if (e->hash != hash) continue;
+    const char* k = tc_mapped_string(m, e->key, NULL);
+    if (k != NULL && strcmp(k, key) == 0) return e->value;
+  }
+  return 0;
+}
+
+void tc_mapped_map_entry(const TCMapped* m, uint64_t off, size_t idx, uint64_t* key, uint64_t* value) {
+  const TCSerialRecord* r = tc_mapped_record(m, off);
+  const TCSerialEntry* e = NULL;
+  if (r != NULL && (r->type == TC_SERIAL_MAP || r->type == TC_SERIAL_FROZEN_MAP) && idx < r->len) {
+    e = tc_mapped_entries(r) + idx;
+  }
+  if (key != NULL) *key = (e != NULL ? e->key : 0);
+  if (value != NULL) *value = (e != NULL ? e->value : 0);
+}
+
+/* Children are always written before the records holding them, so a
+ * child offset that does not point back from its parent is corrupt; that
+ * also rules out cycles. `depth` stops a crafted file from nesting deeper
+ * than the stack allows. */
+static TObject* tc_mapped_load_record(const TCMapped* m, uint64_t off, uint64_t parent, size_t depth, bool* ok) {
+  if (off == 0) return NULL;
+  const TCSerialRecord* r = (off < parent && depth < TC_SERIAL_MAX_DEPTH ? tc_mapped_record(m, off) : NULL);
+  if (r == NULL) {
+    *ok = false;
+    return NULL;
+  }
+
+  switch (r->type) {
+  case TC_SERIAL_STRING:
+    return (TObject*) $new(TCString, (const char*) (r + 1));
+  case TC_SERIAL_VECTOR: {
+    const uint64_t* items = (const uint64_t*) (r + 1);
+    TCVector* v = $new(TCVector, (size_t) r->len, 0);
+    for (size_t i = 0; i < r->len && *ok; ++i) {
+      TObject* o = tc_mapped_load_record(m, items[i], off, depth + 1, ok);
+      $(TCVector, v, push_back, o);
+      if (o != NULL) TC_UNREF(o);
+    }
+    return (TObject*) v;
+  }
+  case TC_SERIAL_MAP: {
+    const TCSerialEntry* entries = tc_mapped_entries(r);
+    TCMap* map = $new(TCMap);
+    for (size_t i = 0; i < r->len && *ok; ++i) {
+      const char* key = tc_mapped_string(m, entries[i].key, NULL);
+      if (key == NULL) {
+        *ok = false;
+        break;
+      }
+      TObject* o = tc_mapped_load_record(m, entries[i].value, off, depth + 1, ok);
+      $(TCMap, map, set, key, o);
+      if (o != NULL) TC_UNREF(o);
+    }
+    return (TObject*) map;
+  }
+  case TC_SERIAL_FROZEN_MAP: {
+    const uint64_t* p = (const uint64_t*) (r + 1);
+    const TCSerialEntry* entries = tc_mapped_entries(r);
+    size_t keys_size = 0;
+    for (size_t i = 0; i < r->len; ++i) {
+      size_t len;
+      if (tc_mapped_string(m, entries[i].key, &len) == NULL) {
+        *ok = false;
+        return NULL;
+      }
+      keys_size += len + 1;
+    }
+
+    TCFrozenMap* f = $new(TCFrozenMap, NULL);
+    tc_frozen_map_free(f);
+    tc_frozen_map_alloc(f, (size_t) r->len, (size_t) p[0], keys_size);
+    f->seed = p[1];
+    memcpy(f->pilots, p + 2, sizeof(uint32_t) * f->n_buckets);
+    char* k = f->keys;
+    for (size_t i = 0; i < f->len; ++i) {
+      size_t len;
+      const char* key = tc_mapped_string(m, entries[i].key, &len);
+      memcpy(k, key, len + 1);
+      f->entries[i].hash = entries[i].hash;
+      f->entries[i].key = k;
+      f->entries[i].value = (*ok ? tc_mapped_load_record(m, entries[i].value, off, depth + 1, ok) : NULL);
+      k += len + 1;
+    }
+    return (TObject*) f;
+  }
+  default:
+    *ok = false;
+    return NULL;
+  }
+}
+
+TObject* tc_mapped_load(const TCMapped* m, uint64_t off) {
+  bool ok = true;
+  TObject* o = tc_mapped_load_record(m, off, m->size, 0, &ok);
+  if (!ok && o != NULL) {
+    TC_UNREF(o);
+    o = NULL;
+  }
+  return o;
+}
+
+/*
+ * TCJournal
+ */
+
+static TCJournal* tc_journal_constructor(TCJournal* self, const char* path);
+static void tc_journal_destructor(TCJournal* self);
+static void tc_journal_init_vtable(TCJournalVTable* v);
+static bool tc_journal_open(TCJournal* self, TObject* container);
+static bool tc_journal_commit(TCJournal* self);
+static bool tc_journal_compact(TCJournal* self);
+
+$mtable_define(TCJournal, tc_journal_constructor, tc_journal_destructor, tc_journal_init_vtable)
+  $mtable_define_method(TCJournalOpen, open, tc_journal_open)
+  $mtable_define_method(TCJournalCommit, commit, tc_journal_commit)
+  $mtable_define_method(TCJournalCompact, compact, tc_journal_compact)
+$mtable_define_end(TCJournal)
+
+$vtable_define(TCJournal)
+$vtable_define_end(TCJournal)
+
+#define TC_JOURNAL_COMMIT_EVERY 1024
+#define TC_JOURNAL_COMPACT_SIZE ((uint64_t) 64 << 20)
+#define TC_JOURNAL_BUFFER ((size_t) 64 << 10)
+
+enum {
+  TC_JOURNAL_SET = 1,
+  TC_JOURNAL_SET_HASH,
+  TC_JOURNAL_REMOVE,
+  TC_JOURNAL_RENAME,
+  TC_JOURNAL_CLEAR
+};
+
+enum {
+  TC_JOURNAL_NULL = 0,
+  TC_JOURNAL_STRING,
+  TC_JOURNAL_BLOB
+};
+
+/* A record is this header, the NUL-terminated key for SET and RENAME,
+ * then the value: a NUL-terminated string (the new key for RENAME) or a
+ * serialized file (see TCWriter) for other objects. `hash` is the key of
+ * SET_HASH and the key hash of REMOVE. The checksum covers everything
+ * after it, so a torn write at the end of the log is detected. */
+typedef struct TCJournalRecord {
+  uint32_t size;
+  uint32_t checksum;
+  uint64_t lsn;
+  uint64_t hash;
+  uint32_t key_len;
+  uint8_t op;
+  uint8_t kind;
+  uint16_t reserved;
+} TCJournalRecord;
+
+/* A snapshot being written out: the serialized container and the files
+ * it goes to, so the job touches nothing the journal keeps using. */
+typedef struct TCJournalCompaction {
+  uint8_t* data;
+  size_t size;
+  size_t cap;
+  char* snap;
+  char* tmp;
+  char* log;
+  char* next;
+  bool ok;
+#if defined(TC_THREADSAFE_REFCOUNT)
+  bool threaded;
+  thrd_t thread;
+#endif
+} TCJournalCompaction;
+
+static char* tc_journal_file(const char* path, const char* suffix) {
+  size_t a = strlen(path), b = strlen(suffix);
+  char* s = (char*) malloc(a + b + 1);
+  memcpy(s, path, a);
+  memcpy(s + a, suffix, b + 1);
+  return s;
+}
+
+static uint32_t tc_journal_checksum(const uint8_t* p, size_t n) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < n; ++i) h = (h ^ p[i]) * 0x100000001b3ull;
+  return (uint32_t) (h ^ (h >> 32));
+}
+
+static void tc_journal_grow(uint8_t** data, size_t* cap, size_t need) {
+  if (need <= *cap) return;
+  size_t n = (*cap > 0 ? *cap : 256);
+  while (n < need) n *= 2;
+  *data = (uint8_t*) realloc(*data, n);
+  *cap = n;
+}
+
+static bool tc_journal_sync(FILE* f) {
+  if (fflush(f) != 0) return false;
+#if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
+  return _commit(_fileno(f)) == 0;
+#else
+  return fsync(fileno(f)) == 0;
+#endif
+}
+
+/* Makes a rename durable. Windows has no directory handles to sync. */
+static bool tc_journal_sync_dir(const char* path) {
+#if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
+  return true;
+#else
+  const char* slash = strrchr(path, '/');
+  char* dir = tc_journal_file(slash != NULL ? path : ".", "");
+  if (slash != NULL) dir[slash - path + 1] = '\0';
+  int fd = open(dir, O_RDONLY);
+  free(dir);
+  if (fd < 0) return false;
+  bool ok = (fsync(fd) == 0);
+  close(fd);
+  return ok;
+#endif
+}
+
+static bool tc_journal_replace(const char* from, const char* to) {
+#if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
+  remove(to);
+#endif
+  return rename(from, to) == 0;
+}
+
+static bool tc_journal_truncate(const char* path, uint64_t size) {
+#if defined(_WIN32) || defined(WIN32) || defined(_WIN64) || defined(WIN64)
+  int fd = _open(path, _O_RDWR | _O_BINARY);
+  if (fd < 0) return false;
+  bool ok = (_chsize_s(fd, (__int64) size) == 0);
+  _close(fd);
+  return ok;
+#else
+  return truncate(path, (off_t) size) == 0;
+#endif
+}
+
+static bool tc_journal_buffer_sink(void* ctx, const void* data, size_t len) {
+  TCJournal* self = (TCJournal*) ctx;
+  tc_journal_grow(&self->buf, &self->buf_cap, self->buf_len + len);
+  memcpy(self->buf + self->buf_len, data, len);
+  self->buf_len += len;
+  return true;
+}
+
+static bool tc_journal_compaction_sink(void* ctx, const void* data, size_t len) {
+  TCJournalCompaction* job = (TCJournalCompaction*) ctx;
+  tc_journal_grow(&job->data, &job->cap, job->size + len);
+  memcpy(job->data + job->size, data, len);
+  job->size += len;
+  return true;
+}
+
+/* Writes the buffered records to the log without syncing it. */
+static void tc_journal_flush(TCJournal* self) {
+  if (self->buf_len == 0) return;
+  if (self->log == NULL || fwrite(self->buf, 1, self->buf_len, self->log) != self->buf_len) self->failed = true;
+  self->log_size += self->buf_len;
+  self->buf_len = 0;
+}
+
+static size_t tc_journal_begin(TCJournal* self, uint8_t op, uint64_t hash, const char* key) {
+  size_t start = self->buf_len;
+  TCJournalRecord r;
+  memset(&r, 0, sizeof(r));
+  r.lsn = ++self->lsn;
+  r.hash = hash;
+  r.op = op;
+  r.key_len = (key != NULL ? (uint32_t) strlen(key) : 0);
+  tc_journal_buffer_sink(self, &r, sizeof(r));
+  if (key != NULL) tc_journal_buffer_sink(self, key, r.key_len + 1);
+  return start;
+}
+
+static void tc_journal_end(TCJournal* self, size_t start, uint8_t kind) {
+  /* Records follow unpadded payloads, so the header is patched through a
+   * copy rather than in place. */
+  TCJournalRecord r;
+  memcpy(&r, self->buf + start, sizeof(r));
+  r.size = (uint32_t) (self->buf_len - start);
+  r.kind = kind;
+  memcpy(self->buf + start, &r, sizeof(r));
+  size_t skip = offsetof(TCJournalRecord, lsn);
+  r.checksum = tc_journal_checksum(self->buf + start + skip, r.size - skip);
+  memcpy(self->buf + start + offsetof(TCJournalRecord, checksum), &r.checksum, sizeof(r.checksum));
+
+  if (++self->pending >= self->commit_every) {
+    tc_journal_commit(self);
+  } else if (self->buf_len >= TC_JOURNAL_BUFFER) {
+    tc_journal_flush(self);
+  }
+}
+
+static void tc_journal_log_set(TCJournal* self, const char* key, uint64_t hash, TObject* value) {
+  size_t start = tc_journal_begin(self, key != NULL ? TC_JOURNAL_SET : TC_JOURNAL_SET_HASH, hash, key);
+  uint8_t kind = TC_JOURNAL_NULL;
+  if (value != NULL && $is(value, TCString)) {
+    TCString* s = (TCString*) value;
+    tc_journal_buffer_sink(self, s->str != NULL ? s->str : "", s->len + 1);
+    kind = TC_JOURNAL_STRING;
+  } else if (value != NULL) {
+    TCWriter* w = (TCWriter*) malloc(sizeof(TCWriter));
+    tc_writer_init(w, tc_journal_buffer_sink, self);
+    bool ok = tc_writer_finish(w, tc_writer_put(w, value));
+    free(w);
+    if (!ok) {
+      /* Not serializable: the record is dropped and the journal fails. */
+      self->buf_len = start;
+      --self->lsn;
+      self->failed = true;
+      return;
+    }
+    kind = TC_JOURNAL_BLOB;
+  }
+  tc_journal_end(self, start, kind);
+}
+
+/* A remove by key records the key, so replay removes that key rather than
+ * whichever key shares its hash. */
+static void tc_journal_log_remove(TCJournal* self, uint64_t hash, const char* key) {
+  tc_journal_end(self, tc_journal_begin(self, TC_JOURNAL_REMOVE, hash, key), key != NULL ? TC_JOURNAL_STRING : TC_JOURNAL_NULL);
+}
+
+static void tc_journal_log_rename(TCJournal* self, const char* old_key, const char* new_key) {
+  size_t start = tc_journal_begin(self, TC_JOURNAL_RENAME, 0, old_key);
+  tc_journal_buffer_sink(self, new_key, strlen(new_key) + 1);
+  tc_journal_end(self, start, TC_JOURNAL_STRING);
+}
+
+static void tc_journal_log_clear(TCJournal* self) {
+  tc_journal_end(self, tc_journal_begin(self, TC_JOURNAL_CLEAR, 0, NULL), TC_JOURNAL_NULL);
+}
+
+static TObject* tc_journal_load_value(const TCJournalRecord* r, const uint8_t* value, size_t len) {
+  if (r->kind == TC_JOURNAL_STRING) return (TObject*) $new(TCString, (const char*) value);
+  if (r->kind != TC_JOURNAL_BLOB) return NULL;
+
+  /* Copied out so the records it reads are aligned. */
+  void* data = malloc(len > 0 ? len : 1);
+  memcpy(data, value, len);
+  TCMapped m;
+  TObject* o = NULL;
+  if (tc_mapped_open_memory(&m, data, len, false)) o = tc_mapped_load(&m, m.root);
+  free(data);
+  return o;
+}
+
+static void tc_journal_apply(TCJournal* self, const TCJournalRecord* r, const uint8_t* payload) {
+  const char* key = (const char*) payload;
+  const uint8_t* value = payload + (r->op == TC_JOURNAL_SET || r->op == TC_JOURNAL_RENAME ? r->key_len + 1 : 0);
+  size_t len = (size_t) (payload + r->size - sizeof(*r) - value);
+
+  if ($is(self->container, TCMap)) {
+    TCMap* m = (TCMap*) self->container;
+    if (r->op == TC_JOURNAL_SET) {
+      TObject* o = tc_journal_load_value(r, value, len);
+      $(TCMap, m, set, key, o);
+      if (o != NULL) TC_UNREF(o);
+    } else if (r->op == TC_JOURNAL_REMOVE && r->kind == TC_JOURNAL_STRING) {
+      $(TCMap, m, remove, key);
+    } else if (r->op == TC_JOURNAL_REMOVE) {
+      $(TCMap, m, remove_by_hash, r->hash);
+    } else if (r->op == TC_JOURNAL_RENAME) {
+      $(TCMap, m, rename, key, (const char*) value);
+    }
+  } else {
+    TCHash* h = (TCHash*) self->container;
+    if (r->op == TC_JOURNAL_SET_HASH) {
+      TObject* o = tc_journal_load_value(r, value, len);
+      $(TCHash, h, set, r->hash, o);
+      if (o != NULL) TC_UNREF(o);
+    } else if (r->op == TC_JOURNAL_CLEAR) {
+      TCVector* empty = $new(TCVector, 0, 0);
+      $(TCHash, h, build_from_sorted, empty);
+      TC_UNREF(empty);
+    }
+  }
+}
+
+/* Applies the records of `path` newer than the container and returns
+ * the length of the intact prefix of the file, or -1 if there is none. */
+static int64_t tc_journal_replay(TCJournal* self, const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return -1;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t* data = (uint8_t*) malloc(size > 0 ? (size_t) size : 1);
+  size_t n = (size > 0 ? fread(data, 1, (size_t) size, f) : 0);
+  fclose(f);
+
+  size_t off = 0;
+  size_t skip = offsetof(TCJournalRecord, lsn);
+  while (off + sizeof(TCJournalRecord) <= n) {
+    TCJournalRecord r;
+    memcpy(&r, data + off, sizeof(r));
+    if (r.size < sizeof(r) || r.size > n - off) break;
+    if (tc_journal_checksum(data + off + skip, r.size - skip) != r.checksum) break;
+    if (r.lsn > self->lsn) {
+      tc_journal_apply(self, &r, data + off + sizeof(r));
+      self->lsn = r.lsn;
+    }
+    off += r.size;
+  }
+
+  free(data);
+  return (int64_t) off;
+}
+
+static uint64_t tc_journal_put_hash(TCWriter* w, TCHash* h) {
+  size_t n = h->size;
+  char** keys = (char**) malloc(sizeof(char*) * (n > 0 ? n : 1));
+  uint64_t* values = (uint64_t*) malloc(sizeof(uint64_t) * (n > 0 ? n : 1));
+  TCHashRBTree** stack = (TCHashRBTree**) malloc(sizeof(TCHashRBTree*) * (2 * 64 + 1));
+  size_t depth = 0, i = 0;
+  TCHashRBTree* node = h->root;
+  while (node != NULL || depth > 0) {
+    while (node != NULL) {
+      stack[depth++] = node;
+      node = node->left;
+    }
+    node = stack[--depth];
+    char key[24];
+    snprintf(key, sizeof(key), "%llu", (unsigned long long) node->hash);
+    keys[i] = tc_journal_file(key, "");
+    values[i++] = tc_writer_put(w, node->value);
+    node = node->right;
+  }
+  assert(i == n);
+  uint64_t off = tc_writer_put_map(w, (const char* const*) keys, values, n);
+  for (i = 0; i < n; ++i) free(keys[i]);
+  free(stack);
+  free(values);
+  free(keys);
+  return off;
+}
+
+/* Snapshots are a vector of the last lsn they include, as a decimal
+ * string, and a map of the container (TCHash keys in decimal). */
+static TCJournalCompaction* tc_journal_snapshot(TCJournal* self) {
+  TCJournalCompaction* job = (TCJournalCompaction*) calloc(1, sizeof(TCJournalCompaction));
+  job->snap = tc_journal_file(self->path, ".snap");
+  job->tmp = tc_journal_file(self->path, ".snap.tmp");
+  job->log = tc_journal_file(self->path, ".log");
+  job->next = tc_journal_file(self->path, ".log.new");
+
+  TCWriter* w = (TCWriter*) malloc(sizeof(TCWriter));
+  tc_writer_init(w, tc_journal_compaction_sink, job);
+  char lsn[24];
+  snprintf(lsn, sizeof(lsn), "%llu", (unsigned long long) self->lsn);
+  uint64_t items[2];
+  items[0] = tc_writer_put_string(w, lsn, strlen(lsn));
+  if ($is(self->container, TCMap)) {
+    items[1] = tc_writer_put(w, self->container);
+  } else {
+    items[1] = tc_journal_put_hash(w, (TCHash*) self->container);
+  }
+  job->ok = tc_writer_finish(w, tc_writer_put_vector(w, items, 2));
+  free(w);
+  return job;
+}
+
+/* Installs the snapshot, then retires the log it covers: the records
+ * since went to `next`, which takes the place of `log`. A crash at any
+ * point leaves a snapshot and logs that recover the same state. */
+static int tc_journal_compaction_run(void* arg) {
+  TCJournalCompaction* job = (TCJournalCompaction*) arg;
+  if (!job->ok) return 0;
+
+  FILE* f = fopen(job->tmp, "wb");
+  job->ok = (f != NULL && fwrite(job->data, 1, job->size, f) == job->size);
+  if (f != NULL) {
+    job->ok = tc_journal_sync(f) && job->ok;
+    job->ok = (fclose(f) == 0) && job->ok;
+  }
+  job->ok = job->ok && tc_journal_replace(job->tmp, job->snap) && tc_journal_sync_dir(job->snap);
+  job->ok = job->ok && tc_journal_replace(job->next, job->log) && tc_journal_sync_dir(job->log);
+  return 0;
+}
+
+static bool tc_journal_join(TCJournal* self) {
+  TCJournalCompaction* job = self->compaction;
+  if (job == NULL) return true;
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+  if (job->threaded) thrd_join(job->thread, NULL);
+#endif
+  bool ok = job->ok;
+  free(job->data);
+  free(job->snap);
+  free(job->tmp);
+  free(job->log);
+  free(job->next);
+  free(job);
+  self->compaction = NULL;
+  if (!ok) self->failed = true;
+  return ok;
+}
+
+static TCJournal* tc_journal_constructor(TCJournal* self, const char* path) {
+  $init(TObject, self);
+  $setup(TCJournal, self, tc_journal_destructor);
+  $reg(TCJournal, TObject);
+
+  assert(path != NULL);
+  self->path = tc_journal_file(path, "");
+  self->container = NULL;
+  self->log = NULL;
+  self->buf = NULL;
+  self->buf_len = 0;
+  self->buf_cap = 0;
+  self->lsn = 0;
+  self->committed_lsn = 0;
+  self->commit_every = TC_JOURNAL_COMMIT_EVERY;
+  self->pending = 0;
+  self->log_size = 0;
+  self->compact_size = TC_JOURNAL_COMPACT_SIZE;
+  self->compaction = NULL;
+  self->failed = false;
+
+  return self;
+}
+
+static void tc_journal_destructor(TCJournal* self) {
+  assert(self != NULL);
+  assert($is(self, TCJournal));
+
+  if (self->container != NULL) {
+    tc_journal_commit(self);
+    if ($is(self->container, TCMap)) {
+      ((TCMap*) self->container)->journal = NULL;
+    } else {
+      ((TCHash*) self->container)->journal = NULL;
+    }
+    TC_UNREF(self->container);
+  }
+  tc_journal_join(self);
+  if (self->log != NULL) fclose(self->log);
+  free(self->buf);
+  free(self->path);
+
+  $destroy_parent(TObject, self);
+}
+
+static void tc_journal_init_vtable(TCJournalVTable* v) {
+  $vtable_init(v, TCJournal, TObject);
+}
+
+static bool tc_journal_recover(TCJournal* self) {
+  char* snap = tc_journal_file(self->path, ".snap");
+  char* log = tc_journal_file(self->path, ".log");
+  char* next = tc_journal_file(self->path, ".log.new");
+  bool ok = true;
+
+  FILE* f = fopen(snap, "rb");
+  if (f != NULL) {
+    fclose(f);
+    TCMapped m;
+    ok = tc_mapped_open(&m, snap, true);
+    if (ok) {
+      self->lsn = strtoull(tc_mapped_string(&m, tc_mapped_vector_at(&m, m.root, 0), NULL), NULL, 10);
+      uint64_t map = tc_mapped_vector_at(&m, m.root, 1);
+      size_t n = tc_mapped_len(&m, map);
+      for (size_t i = 0; i < n; ++i) {
+        uint64_t k, v;
+        tc_mapped_map_entry(&m, map, i, &k, &v);
+        const char* key = tc_mapped_string(&m, k, NULL);
+        TObject* o = tc_mapped_load(&m, v);
+        if ($is(self->container, TCMap)) {
+          $(TCMap, (TCMap*) self->container, set, key, o);
+        } else {
+          $(TCHash, (TCHash*) self->container, set, strtoull(key, NULL, 10), o);
+        }
+        if (o != NULL) TC_UNREF(o);
+      }
+      tc_mapped_close(&m);
+    }
+  }
+
+  int64_t log_size = (ok ? tc_journal_replay(self, log) : -1);
+  int64_t next_size = (ok ? tc_journal_replay(self, next) : -1);
+  self->committed_lsn = self->lsn;
+
+  /* A torn record at the end is cut off before anything is appended. If
+   * a compaction was interrupted, it is finished here first. */
+  if (ok && next_size >= 0) {
+    ok = tc_journal_truncate(next, (uint64_t) next_size);
+    TCJournalCompaction* job = tc_journal_snapshot(self);
+    self->compaction = job;
+    tc_journal_compaction_run(job);
+    ok = tc_journal_join(self) && ok;
+    log_size = next_size;
+  } else if (ok && log_size >= 0) {
+    ok = tc_journal_truncate(log, (uint64_t) log_size);
+  }
+  if (ok) {
+    self->log = fopen(log, "ab");
+    ok = (self->log != NULL);
+  }
+  if (ok) {
+    setvbuf(self->log, NULL, _IONBF, 0);
+    self->log_size = (uint64_t) (log_size > 0 ? log_size : 0);
+  }
+
+  free(next);
+  free(log);
+  free(snap);
+  return ok;
+}
+
+static bool tc_journal_open(TCJournal* self, TObject* container) {
+  assert(self != NULL);
+  assert($is(self, TCJournal));
+  assert(self->container == NULL);
+  assert(container != NULL);
+  assert(($is(container, TCMap) && ((TCMap*) container)->journal == NULL && ((TCMap*) container)->pairs->len == 0) ||
+         ($is(container, TCHash) && ((TCHash*) container)->journal == NULL && ((TCHash*) container)->size == 0));
+
+  TC_REF(container);
+  self->container = container;
+  if (!tc_journal_recover(self)) {
+    self->failed = true;
+    self->container = NULL;
+    TC_UNREF(container);
+    return false;
+  }
+
+  if ($is(container, TCMap)) {
+    ((TCMap*) container)->journal = self;
+  } else {
+    ((TCHash*) container)->journal = self;
+  }
+  return true;
+}
+
+static bool tc_journal_commit(TCJournal* self) {
+  assert(self != NULL);
+  assert($is(self, TCJournal));
+
+  if (self->pending > 0 || self->buf_len > 0) {
+    tc_journal_flush(self);
+    if (self->log == NULL || !tc_journal_sync(self->log)) self->failed = true;
+    self->pending = 0;
+    if (!self->failed) self->committed_lsn = self->lsn;
+  }
+
+  if (!self->failed && self->compact_size > 0 && self->log_size >= self->compact_size) {
+    tc_journal_compact(self);
+  }
+  return !self->failed;
+}
+
+static bool tc_journal_compact(TCJournal* self) {
+  assert(self != NULL);
+  assert($is(self, TCJournal));
+  assert(self->container != NULL);
+
+  tc_journal_join(self);
+  uint64_t compact_size = self->compact_size;
+  self->compact_size = 0;
+  bool ok = tc_journal_commit(self);
+  self->compact_size = compact_size;
+  if (!ok) return false;
+
+  TCJournalCompaction* job = tc_journal_snapshot(self);
+  fclose(self->log);
+  self->log = fopen(job->next, "wb");
+  self->log_size = 0;
+  self->compaction = job;
+  if (self->log == NULL) {
+    job->ok = false;
+    return tc_journal_join(self);
+  }
+  setvbuf(self->log, NULL, _IONBF, 0);
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+  job->threaded = (thrd_create(&job->thread, tc_journal_compaction_run, job) == thrd_success);
+  if (job->threaded) return true;
+#endif
+  tc_journal_compaction_run(job);
+  return tc_journal_join(self);
+}
+
+/*
+ * TCConcurrentHash
+ */
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+
+typedef struct TCEpochRecord {
+  struct TCEpochRecord* next;
+  atomic_size_t epoch;
+  atomic_bool active;
+  atomic_bool claimed;
+} TCEpochRecord;
+
+static _Atomic(TCEpochRecord*) tc_epoch_records = NULL;
+static atomic_size_t tc_epoch_global = 0;
+static TC_THREAD_LOCAL TCEpochRecord* tc_epoch_self = NULL;
+static TC_THREAD_LOCAL unsigned tc_epoch_depth = 0;
+static tss_t tc_epoch_tss;
+static once_flag tc_epoch_once = ONCE_FLAG_INIT;
+
+static void tc_epoch_release_record(void* ptr) {
+  TCEpochRecord* rec = (TCEpochRecord*) ptr;
+  atomic_store(&rec->active, false);
+  atomic_store(&rec->claimed, false);
+}
+
+static void tc_epoch_init(void) {
+  tss_create(&tc_epoch_tss, tc_epoch_release_record);
+}
+
+static TCEpochRecord* tc_epoch_record(void) {
+  if (tc_epoch_self != NULL) return tc_epoch_self;
+  call_once(&tc_epoch_once, tc_epoch_init);
+
+  TCEpochRecord* rec;
+  for (rec = atomic_load(&tc_epoch_records); rec != NULL; rec = rec->next) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&rec->claimed, &expected, true)) break;
+  }
+  if (rec == NULL) {
+    rec = (TCEpochRecord*) malloc(sizeof(TCEpochRecord));
+    atomic_init(&rec->epoch, 0);
+    atomic_init(&rec->active, false);
+    atomic_init(&rec->claimed, true);
+    rec->next = atomic_load(&tc_epoch_records);
+    while (!atomic_compare_exchange_weak(&tc_epoch_records, &rec->next, rec));
+  }
+
+  tss_set(tc_epoch_tss, rec);
+  tc_epoch_self = rec;
+  return rec;
+}
+
+static void tc_epoch_enter(void) {
+  if (tc_epoch_depth++ > 0) return;
+
+  TCEpochRecord* rec = tc_epoch_record();
+  atomic_store(&rec->active, true);
+  atomic_store(&rec->epoch, atomic_load(&tc_epoch_global));
+}
+
+static void tc_epoch_exit(void) {
+  if (--tc_epoch_depth > 0) return;
+
+  atomic_store_explicit(&tc_epoch_self->active, false, memory_order_release);
+}
+
+static size_t tc_epoch_try_advance(void) {
+  size_t g = atomic_load(&tc_epoch_global);
+  for (TCEpochRecord* rec = atomic_load(&tc_epoch_records); rec != NULL; rec = rec->next) {
+    if (atomic_load(&rec->active) && atomic_load(&rec->epoch) != g) return g;
+  }
+  if (atomic_compare_exchange_strong(&tc_epoch_global, &g, g + 1)) return g + 1;
+  return g;
+}
+
+#define TC_CHASH_CACHE_LINE 64
+#define TC_CHASH_MIN_BUCKETS 16
+#define TC_CHASH_MIGRATE_STEP 8
+#define TC_CHASH_RECLAIM_EVERY 64
+
+typedef struct TCCHashNode {
+  _Atomic(struct TCCHashNode*) next;
+  uint64_t hash;
+  _Atomic(TObject*) value;
+  char key[];
+} TCCHashNode;
+
+typedef struct TCCHashTable {
+  size_t mask;
+  _Atomic(TCCHashNode*) buckets[];
+} TCCHashTable;
+
+typedef struct TCCHashRetired {
+  struct TCCHashRetired* next;
+  size_t epoch;
+  TCCHashNode* node;
+  TObject* value;
+  TCCHashTable* table;
+} TCCHashRetired;
+
+struct TCConcurrentHashShard {
+  _Alignas(TC_CHASH_CACHE_LINE) atomic_size_t seq;
+  atomic_int lock;
+  _Atomic(TCCHashTable*) table;
+  _Atomic(TCCHashTable*) old;
+  size_t migrated;
+  atomic_size_t count;
+  TCCHashRetired* retired;
+  size_t n_retired;
+};
+
+typedef struct TCConcurrentHashShard TCCHashShard;
+
+static TCConcurrentHash* tc_concurrent_hash_constructor(TCConcurrentHash* self, size_t shards);
+static void tc_concurrent_hash_destructor(TCConcurrentHash* self);
+static void tc_concurrent_hash_init_vtable(TCConcurrentHashVTable* v);
+static TObject* tc_concurrent_hash_get(TCConcurrentHash* self, const char* key);
+static bool tc_concurrent_hash_visit(TCConcurrentHash* self, const char* key, TCConcurrentHashVisitor fn, void* userdata);
+static void tc_concurrent_hash_put(TCConcurrentHash* self, const char* key, TObject* value);
+static bool tc_concurrent_hash_remove(TCConcurrentHash* self, const char* key);
+static TObject* tc_concurrent_hash_compute_if_absent(TCConcurrentHash* self, const char* key, TCConcurrentHashCompute fn, void* userdata);
+static size_t tc_concurrent_hash_size(TCConcurrentHash* self);
+static size_t tc_concurrent_hash_memory_usage(TCConcurrentHash* self, bool deep);
+
+$mtable_define(TCConcurrentHash, tc_concurrent_hash_constructor, tc_concurrent_hash_destructor, tc_concurrent_hash_init_vtable)
+  $mtable_define_method(TCConcurrentHashGet, get, tc_concurrent_hash_get)
+  $mtable_define_method(TCConcurrentHashVisit, visit, tc_concurrent_hash_visit)
+  $mtable_define_method(TCConcurrentHashPut, put, tc_concurrent_hash_put)
+  $mtable_define_method(TCConcurrentHashRemove, remove, tc_concurrent_hash_remove)
+  $mtable_define_method(TCConcurrentHashComputeIfAbsent, compute_if_absent, tc_concurrent_hash_compute_if_absent)
+  $mtable_define_method(TCConcurrentHashSize, size, tc_concurrent_hash_size)
+  $mtable_define_method(TCConcurrentHashMemoryUsage, memory_usage, tc_concurrent_hash_memory_usage)
+$mtable_define_end(TCConcurrentHash)
+
+$vtable_define(TCConcurrentHash)
+$vtable_define_end(TCConcurrentHash)
+
+static TCCHashTable* tc_chash_table_new(size_t n) {
+  TCCHashTable* t = (TCCHashTable*) malloc(sizeof(TCCHashTable) + sizeof(_Atomic(TCCHashNode*)) * n);
+  t->mask = n - 1;
+  for (size_t i = 0; i < n; ++i) {
+    atomic_init(&t->buckets[i], NULL);
+  }
+  return t;
+}
+
+static void tc_chash_node_free(TCCHashNode* n) {
+  tc_unref(atomic_load_explicit(&n->value, memory_order_relaxed));
+  free(n);
+}
+
+static TCConcurrentHash* tc_concurrent_hash_constructor(TCConcurrentHash* self, size_t shards) {
+  $init(TObject, self);
+  $setup(TCConcurrentHash, self, tc_concurrent_hash_destructor);
+  $reg(TCConcurrentHash, TObject);
+
+  if (shards == 0) shards = 64;
+  unsigned bits = 0;
+  while (((size_t) 1 << bits) < shards) ++bits;
+
+  self->n_shards = (size_t) 1 << bits;
+  self->shard_shift = 64 - bits;
+  self->shards = (TCCHashShard*) aligned_alloc(TC_CHASH_CACHE_LINE, sizeof(TCCHashShard) * self->n_shards);
+  for (size_t i = 0; i < self->n_shards; ++i) {
+    TCCHashShard* sh = &self->shards[i];
+    atomic_init(&sh->seq, 0);
+    atomic_init(&sh->lock, 0);
+    atomic_init(&sh->table, tc_chash_table_new(TC_CHASH_MIN_BUCKETS));
+    atomic_init(&sh->old, NULL);
+    sh->migrated = 0;
+    atomic_init(&sh->count, 0);
+    sh->retired = NULL;
+    sh->n_retired = 0;
+  }
+
+  return self;
+}
+
+static void tc_chash_table_free_nodes(TCCHashTable* t) {
+  for (size_t i = 0; i <= t->mask; ++i) {
+    TCCHashNode* n = atomic_load(&t->buckets[i]);
+    while (n != NULL) {
+      TCCHashNode* next = atomic_load(&n->next);
+      tc_chash_node_free(n);
+      n = next;
+    }
+  }
+  free(t);
+}
+
+static void tc_chash_reclaim(TCCHashShard* sh, size_t safe) {
+  TCCHashRetired** r = &sh->retired;
+  while (*r != NULL) {
+    TCCHashRetired* item = *r;
+    if (item->epoch + 2 <= safe) {
+      *r = item->next;
+      if (item->node != NULL) tc_chash_node_free(item->node);
+      if (item->value != NULL) tc_unref(item->value);
+      free(item->table);
+      free(item);
+      --sh->n_retired;
+    } else {
+      r = &item->next;
+    }
+  }
+}
+
+static void tc_concurrent_hash_destructor(TCConcurrentHash* self) {
+  assert(self != NULL);
+  assert($is(self, TCConcurrentHash));
+
+  for (size_t i = 0; i < self->n_shards; ++i) {
+    TCCHashShard* sh = &self->shards[i];
+    tc_chash_reclaim(sh, (size_t) -1);
+    TCCHashTable* old = atomic_load(&sh->old);
+    if (old != NULL) tc_chash_table_free_nodes(old);
+    tc_chash_table_free_nodes(atomic_load(&sh->table));
+  }
+  free(self->shards);
+
+  $destroy_parent(TObject, self);
+}
+
+static void tc_concurrent_hash_init_vtable(TCConcurrentHashVTable* v) {
+  $vtable_init(v, TCConcurrentHash, TObject);
+}
+
+static TCCHashShard* tc_chash_shard(TCConcurrentHash* self, uint64_t mixed) {
+  return &self->shards[self->n_shards > 1 ? mixed >> self->shard_shift : 0];
+}
+
+static void tc_chash_lock(TCCHashShard* sh) {
+  unsigned spins = 0;
+  for (;;) {
+    if (atomic_load_explicit(&sh->lock, memory_order_relaxed) == 0 &&
+        atomic_exchange_explicit(&sh->lock, 1, memory_order_acquire) == 0) {
+      return;
+    }
+    if (++spins >= 64) {
+      spins = 0;
+      thrd_yield();
+    }
+  }
+}
+
+static void tc_chash_unlock(TCCHashShard* sh) {
+  atomic_store_explicit(&sh->lock, 0, memory_order_release);
+}
+
+static void tc_chash_retire(TCCHashShard* sh, TCCHashNode* node, TObject* value, TCCHashTable* table) {
+  TCCHashRetired* item = (TCCHashRetired*) malloc(sizeof(TCCHashRetired));
+  item->epoch = atomic_load(&tc_epoch_global);
+  item->node = node;
+  item->value = value;
+  item->table = table;
+  item->next = sh->retired;
+  sh->retired = item;
+
+  if (++sh->n_retired % TC_CHASH_RECLAIM_EVERY == 0) {
+    tc_chash_reclaim(sh, tc_epoch_try_advance());
+  }
+}
+
+static _Atomic(TCCHashNode*)* tc_chash_find_link(TCCHashTable* t, uint64_t mixed, const char* key) {
+  _Atomic(TCCHashNode*)* link = &t->buckets[mixed & t->mask];
+  TCCHashNode* n;
+  while ((n = atomic_load_explicit(link, memory_order_acquire)) != NULL) {
+    if (n->hash == mixed && strcmp(n->key, key) == 0) return link;
+    link = &n->next;
+  }
+  return NULL;
+}
+
+static TCCHashNode* tc_chash_find(TCCHashTable* t, uint64_t mixed, const char* key) {
+  TCCHashNode* n = atomic_load_explicit(&t->buckets[mixed & t->mask], memory_order_acquire);
+  while (n != NULL && (n->hash != mixed || strcmp(n->key, key) != 0)) {
+    n = atomic_load_explicit(&n->next, memory_order_acquire);
+  }
+  return n;
+}
+
+static TObject* tc_chash_lookup(TCCHashShard* sh, uint64_t mixed, const char* key) {
+  for (;;) {
+    size_t seq = atomic_load_explicit(&sh->seq, memory_order_acquire);
+    if (seq & 1) {
+      thrd_yield();
+      continue;
+    }
+
+    TCCHashTable* t = atomic_load_explicit(&sh->table, memory_order_acquire);
+    TCCHashTable* old = atomic_load_explicit(&sh->old, memory_order_acquire);
+    TCCHashNode* n = tc_chash_find(t, mixed, key);
+    if (n == NULL && old != NULL) n = tc_chash_find(old, mixed, key);
+    TObject* value = (n != NULL ? atomic_load_explicit(&n->value, memory_order_acquire) : NULL);
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&sh->seq, memory_order_relaxed) == seq) return value;
+  }
+}
+
+static void tc_chash_migrate(TCCHashShard* sh, size_t steps) {
+  TCCHashTable* t = atomic_load_explicit(&sh->table, memory_order_relaxed);
+  TCCHashTable* old = atomic_load_explicit(&sh->old, memory_order_relaxed);
+
+  atomic_fetch_add(&sh->seq, 1);
+  while (steps-- > 0 && sh->migrated <= old->mask) {
+    TCCHashNode* n = atomic_load_explicit(&old->buckets[sh->migrated], memory_order_relaxed);
+    while (n != NULL) {
+      TCCHashNode* next = atomic_load_explicit(&n->next, memory_order_relaxed);
+      _Atomic(TCCHashNode*)* b = &t->buckets[n->hash & t->mask];
+      atomic_store_explicit(&n->next, atomic_load_explicit(b, memory_order_relaxed), memory_order_release);
+      atomic_store_explicit(b, n, memory_order_release);
+      n = next;
+    }
+    atomic_store_explicit(&old->buckets[sh->migrated], NULL, memory_order_release);
+    ++sh->migrated;
+  }
+  bool done = sh->migrated > old->mask;
+  if (done) atomic_store_explicit(&sh->old, NULL, memory_order_release);
+  atomic_fetch_add(&sh->seq, 1);
+
+  if (done) tc_chash_retire(sh, NULL, NULL, old);
+}
+
+static void tc_chash_maybe_grow(TCCHashShard* sh) {
+  TCCHashTable* t = atomic_load_explicit(&sh->table, memory_order_relaxed);
+  if (atomic_load_explicit(&sh->old, memory_order_relaxed) != NULL) return;
+  if (atomic_load_explicit(&sh->count, memory_order_relaxed) <= 2 * (t->mask + 1)) return;
+
+  atomic_fetch_add(&sh->seq, 1);
+  atomic_store_explicit(&sh->old, t, memory_order_release);
+  atomic_store_explicit(&sh->table, tc_chash_table_new(2 * (t->mask + 1)), memory_order_release);
+  sh->migrated = 0;
+  atomic_fetch_add(&sh->seq, 1);
+}
+
+static _Atomic(TCCHashNode*)* tc_chash_locked_find(TCCHashShard* sh, uint64_t mixed, const char* key) {
+  if (atomic_load_explicit(&sh->old, memory_order_relaxed) != NULL) {
+    tc_chash_migrate(sh, TC_CHASH_MIGRATE_STEP);
+  }
+
+  _Atomic(TCCHashNode*)* link = tc_chash_find_link(atomic_load_explicit(&sh->table, memory_order_relaxed), mixed, key);
+  TCCHashTable* old = atomic_load_explicit(&sh->old, memory_order_relaxed);
+  if (link == NULL && old != NULL) link = tc_chash_find_link(old, mixed, key);
+  return link;
+}
+
+static void tc_chash_insert(TCCHashShard* sh, uint64_t mixed, const char* key, TObject* value) {
+  size_t len = strlen(key);
+  TCCHashNode* n = (TCCHashNode*) malloc(sizeof(TCCHashNode) + len + 1);
+  memcpy(n->key, key, len + 1);
+  n->hash = mixed;
+  atomic_init(&n->value, value);
+
+  TCCHashTable* t = atomic_load_explicit(&sh->table, memory_order_relaxed);
+  _Atomic(TCCHashNode*)* b = &t->buckets[mixed & t->mask];
+  atomic_init(&n->next, atomic_load_explicit(b, memory_order_relaxed));
+  atomic_store_explicit(b, n, memory_order_release);
+
+  atomic_fetch_add_explicit(&sh->count, 1, memory_order_relaxed);
+  tc_chash_maybe_grow(sh);
+}
+
+static TObject* tc_concurrent_hash_get(TCConcurrentHash* self, const char* key) {
+  assert(self != NULL);
+  assert($is(self, TCConcurrentHash));
+
+  uint64_t mixed = tc_mix64(tc_djb2(key));
+
+  tc_epoch_enter();
+  TObject* value = tc_chash_lookup(tc_chash_shard(self, mixed), mixed, key);
+  if (value != NULL) tc_ref(value);
+  tc_epoch_exit();
+
+  return value;
+}
+
+static bool tc_concurrent_hash_visit(TCConcurrentHash* self, const char* key, TCConcurrentHashVisitor fn, void* userdata) {
+  assert(self != NULL);
+  assert($is(self, TCConcurrentHash));
+
+  uint64_t mixed = tc_mix64(tc_djb2(key));
+
+  tc_epoch_enter();
+  TObject* value = tc_chash_lookup(tc_chash_shard(self, mixed), mixed, key);
+  if (value != NULL) fn(value, userdata);
+  tc_epoch_exit();
+
+  return value != NULL;
+}
+
+static void tc_concurrent_hash_put(TCConcurrentHash* self, const char* key, TObject* value) {
+  assert(self != NULL);
+  assert($is(self, TCConcurrentHash));
+  assert(value != NULL);
+
+  uint64_t mixed = tc_mix64(tc_djb2(key));
+  TCCHashShard* sh = tc_chash_shard(self, mixed);
+
+  tc_ref(value);
+  tc_chash_lock(sh);
+  _Atomic(TCCHashNode*)* link = tc_chash_locked_find(sh, mixed, key);
+  if (link != NULL) {
+    TCCHashNode* n = atomic_load_explicit(link, memory_order_relaxed);
+    TObject* prev = atomic_exchange_explicit(&n->value, value, memory_order_acq_rel);
+    tc_chash_retire(sh, NULL, prev, NULL);
+  } else {
+    tc_chash_insert(sh, mixed, key, value);
+  }
+  tc_chash_unlock(sh);
+}
+
+static bool tc_concurrent_hash_remove(TCConcurrentHash* self, const char* key) {
+  assert(self != NULL);
+  assert($is(self, TCConcurrentHash));
+
+  uint64_t mixed = tc_mix64(tc_djb2(key));
+  TCCHashShard* sh = tc_chash_shard(self, mixed);
+
+  tc_chash_lock(sh);
+  _Atomic(TCCHashNode*)* link = tc_chash_locked_find(sh, mixed, key);
+  if (link != NULL) {
+    TCCHashNode* n = atomic_load_explicit(link, memory_order_relaxed);
+    atomic_store_explicit(link, atomic_load_explicit(&n->next, memory_order_relaxed), memory_order_release);
+    atomic_fetch_sub_explicit(&sh->count, 1, memory_order_relaxed);
+    tc_chash_retire(sh, n, NULL, NULL);
+  }
+  tc_chash_unlock(sh);
+
+  return link != NULL;
+}
+
+static TObject* tc_concurrent_hash_compute_if_absent(TCConcurrentHash* self, const char* key, TCConcurrentHashCompute fn, void* userdata) {
+  assert(self != NULL);
+  assert($is(self, TCConcurrentHash));
+
+  uint64_t mixed = tc_mix64(tc_djb2(key));
+  TCCHashShard* sh = tc_chash_shard(self, mixed);
+
+  tc_chash_lock(sh);
+  TObject* value = NULL;
+  _Atomic(TCCHashNode*)* link = tc_chash_locked_find(sh, mixed, key);
+  if (link != NULL) {
+    value = atomic_load_explicit(&atomic_load_explicit(link, memory_order_relaxed)->value, memory_order_relaxed);
+  } else {
+    value = fn(key, userdata);
+    if (value != NULL) tc_chash_insert(sh, mixed, key, value);
+  }
+  if (value != NULL) tc_ref(value);
+  tc_chash_unlock(sh);
+
+  return value;
+}
+
+static size_t tc_concurrent_hash_size(TCConcurrentHash* self) {
+  assert(self != NULL);
+  assert($is(self, TCConcurrentHash));
+
+  size_t n = 0;
+  for (size_t i = 0; i < self->n_shards; ++i) {
+    n += atomic_load_explicit(&self->shards[i].count, memory_order_relaxed);
+  }
+  return n;
+}
+
+static size_t tc_chash_table_usage(TCCHashTable* t, bool deep) {
+  size_t n = sizeof(TCCHashTable) + sizeof(_Atomic(TCCHashNode*)) * (t->mask + 1);
+  for (size_t i = 0; i <= t->mask; ++i) {
+    for (TCCHashNode* node = atomic_load(&t->buckets[i]); node != NULL; node = atomic_load(&node->next)) {
+      n += sizeof(TCCHashNode) + strlen(node->key) + 1;
+      if (deep) n += tc_memory_usage(atomic_load(&node->value), true);
+    }
+  }
+  return n;
+}
+
+/* Each shard is measured under its lock; entries retired but not yet
+ * reclaimed still count. Elements are only measured exactly while no
+ * other thread changes them. */
+static size_t tc_concurrent_hash_memory_usage(TCConcurrentHash* self, bool deep) {
+  assert(self != NULL);
+  assert($is(self, TCConcurrentHash));
+
+  size_t n = sizeof(TCConcurrentHash) + sizeof(TCCHashShard) * self->n_shards;
+  for (size_t i = 0; i < self->n_shards; ++i) {
+    TCCHashShard* sh = &self->shards[i];
+    tc_chash_lock(sh);
+    n += tc_chash_table_usage(atomic_load(&sh->table), deep);
+    TCCHashTable* old = atomic_load(&sh->old);
+    if (old != NULL) n += tc_chash_table_usage(old, deep);
+    for (TCCHashRetired* r = sh->retired; r != NULL; r = r->next) {
+      n += sizeof(TCCHashRetired);
+      if (r->node != NULL) n += sizeof(TCCHashNode) + strlen(r->node->key) + 1;
+      if (r->table != NULL) n += sizeof(TCCHashTable) + sizeof(_Atomic(TCCHashNode*)) * (r->table->mask + 1);
+    }
+    tc_chash_unlock(sh);
+  }
+  return n;
+}
+
+#endif
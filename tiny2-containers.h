@@ -1,15 +1,153 @@
 #pragma once
 
+#include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include <tiny2-object.h>
 
+#if defined(TC_STATS) && defined(TC_THREADSAFE_REFCOUNT) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 /* 
  * Utils
  */
 
 uint64_t tc_djb2(const char* str);
 
+/* Reference counting as performed by the containers. When the library is
+ * built with TC_THREADSAFE_REFCOUNT these serialize on a process-wide lock,
+ * and objects shared between threads must be ref'd through them rather
+ * than with $ref/$unref. */
+void tc_ref(void* obj);
+void tc_unref(void* obj);
+
+/* Batched variants: one lock acquisition for the whole array, and the
+ * objects a few slots ahead are prefetched while earlier ones are
+ * released. NULL slots are skipped. */
+void tc_ref_many(TObject* const* objs, size_t n);
+void tc_unref_many(TObject* const* objs, size_t n);
+
+/* Stack cursor used by the tc_<container>_iter_* functions:
+ *
+ *   for (TCIter it = tc_vector_iter_begin(v); !tc_vector_iter_done(&it); tc_vector_iter_next(&it)) {
+ *     TObject* o = tc_vector_iter_current(&it);
+ *   }
+ *
+ * Iteration neither allocates nor touches reference counts; the elements
+ * it yields are borrowed, and the container must not be changed during
+ * the walk. */
+typedef struct TCIter {
+  void* pos;
+  size_t idx;
+  size_t end;
+  size_t cap;
+} TCIter;
+
+/* Holder count of a buffer shared between copy-on-write snapshots. */
+struct TCShared;
+
+/*
+ * TCStats
+ */
+
+#define TC_STATS_HISTOGRAM 8
+
+/* Counters kept when the library is built with TC_STATS (code including
+ * the header must define it as well); without it none of them exist and
+ * nothing is counted. TCString, TCVector, TCMap and TCHash keep a `stats`
+ * of their own, and every count also goes to the process-wide totals.
+ *
+ * `allocs`/`frees` and the byte counts cover the storage a container
+ * allocates for itself: buffers, tables and nodes. `resizes` counts
+ * growing or shrinking that storage in place, with the old size counted
+ * as freed and the new one as allocated. `probes` is a histogram of the
+ * entries looked at per lookup: bucket 0 holds lookups that looked at
+ * none, bucket i those that looked at 2^(i-1) up to 2^i - 1, and the
+ * last bucket everything above. `collisions` counts insertions into an
+ * occupied TCMap bucket. Reference counting and iterator steps are only
+ * counted process-wide. */
+typedef struct TCStats {
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t bytes_allocated;
+  uint64_t bytes_freed;
+  uint64_t resizes;
+  uint64_t lookups;
+  uint64_t probes[TC_STATS_HISTOGRAM];
+  uint64_t collisions;
+  uint64_t refs;
+  uint64_t unrefs;
+  uint64_t iter_steps;
+} TCStats;
+
+#if defined(TC_STATS)
+extern TCStats tc_stats_global;
+
+/* The totals are shared between threads; they are only updated
+ * atomically when TC_THREADSAFE_REFCOUNT says threads share objects. */
+#if !defined(TC_THREADSAFE_REFCOUNT)
+#define TC_STATS_GLOBAL_ADD(field, n) ((void) (tc_stats_global.field += (n)))
+#elif defined(_MSC_VER)
+#define TC_STATS_GLOBAL_ADD(field, n) ((void) _InterlockedExchangeAdd64((volatile __int64*) &tc_stats_global.field, (__int64) (n)))
+#else
+#define TC_STATS_GLOBAL_ADD(field, n) ((void) __atomic_fetch_add(&tc_stats_global.field, (uint64_t) (n), __ATOMIC_RELAXED))
+#endif
+#else
+#define TC_STATS_GLOBAL_ADD(field, n) ((void) 0)
+#endif
+
+/* `container` is an instance keeping stats, or NULL for the process-wide
+ * totals; get returns NULL for objects that keep none. The dump is one
+ * JSON object with the counters and the type of `container`. */
+const TCStats* tc_stats_get(TObject* container);
+void tc_stats_reset(TObject* container);
+void tc_stats_dump(FILE* out, TObject* container);
+
+/*
+ * Memory usage
+ */
+
+/* Every container has a `memory_usage(self, deep)` method returning the
+ * bytes it occupies, counted from the sizes it allocated with: the object
+ * itself, spare capacity, nodes, tables, pool slabs and copied keys.
+ * `deep` adds the elements, measured the same way when they are
+ * containers and as a bare TObject otherwise; an element held several
+ * times, or a buffer shared between snapshots, is counted every time.
+ * Heap bookkeeping of the allocator is not included.
+ * tc_memory_usage measures any object, with 0 for NULL. */
+size_t tc_memory_usage(TObject* obj, bool deep);
+
+/*
+ * TCAllocator
+ */
+
+typedef void* (*TCAllocatorAlloc)(void* ctx, size_t size);
+typedef void* (*TCAllocatorRealloc)(void* ctx, void* ptr, size_t old_size, size_t new_size);
+typedef void (*TCAllocatorFree)(void* ctx, void* ptr, size_t size);
+
+/* Containers built while a scoped allocator is the default live no longer
+ * than it: TCString, TCVector, TCList and TCMap then borrow their elements
+ * instead of referencing them, skip reference counting entirely and hand
+ * out borrowed pointers that must not be unref'd. */
+typedef struct TCAllocator {
+  TCAllocatorAlloc alloc;
+  TCAllocatorRealloc realloc;
+  TCAllocatorFree free;
+  void* ctx;
+  bool scoped;
+} TCAllocator;
+
+extern const TCAllocator tc_malloc_allocator;
+
+/* Containers capture the calling thread's default allocator when they are
+ * constructed. Passing NULL restores tc_malloc_allocator. Returns the
+ * previous default. */
+const TCAllocator* tc_allocator_set_default(const TCAllocator* allocator);
+const TCAllocator* tc_allocator_get_default(void);
+
 /*
  * Decls
  */
@@ -23,6 +161,18 @@ $class_decl(TCMapPair)
 $class_decl(TCMap)
 $class_decl(TCHashRBTree)
 $class_decl(TCHash)
+$class_decl(TCPool)
+$class_decl(TCArena)
+$class_decl(TCIntrusiveList)
+$class_decl(TCChunkList)
+$class_decl(TCCache)
+$class_decl(TCPersistentMapNode)
+$class_decl(TCPersistentMap)
+$class_decl(TCFrozenMap)
+$class_decl(TCJournal)
+#if defined(TC_THREADSAFE_REFCOUNT)
+$class_decl(TCConcurrentHash)
+#endif
 
 /*
  * TCString
@@ -30,6 +180,7 @@ $class_decl(TCHash)
 
 typedef TCString* (*TCStringConstructor)(TCString* self, const char* str);
 typedef void (*TCStringInitVTable)(TCStringVTable* v);
+typedef size_t (*TCStringMemoryUsage)(TCString* self, bool deep);
 typedef char* (*TCStringStr)(TCString* self);
 typedef size_t (*TCStringSize)(TCString* self);
 typedef TCString* (*TCStringCopy)(TCString* self);
@@ -37,9 +188,21 @@ typedef void (*TCStringAppend)(TCString* self, TCString* other);
 typedef void (*TCStringAppendC)(TCString* self, const char* other);
 typedef void (*TCStringPrepend)(TCString* self, TCString* other);
 typedef void (*TCStringPrependC)(TCString* self, const char* other);
+typedef TCString* (*TCStringSnapshot)(TCString* self);
 
+/* `snapshot` returns, in O(1), a new string that shares self's buffer
+ * (`shared` counts its holders); the buffer is only copied by the first
+ * side that changes it afterwards, so `str` must not be written through
+ * while it is shared. */
 $class(TCString, TObject, _parent)
   $class_property(char*, str)
+  $class_property(size_t, len)
+  $class_property(struct TCShared*, shared)
+  $class_property(const TCAllocator*, allocator)
+  $class_property(bool, borrowed)
+#if defined(TC_STATS)
+  $class_property(TCStats, stats)
+#endif
 $class_end(TCString)
 
 $mtable(TCString)
@@ -50,6 +213,8 @@ $mtable(TCString)
   $mtable_method(TCStringAppendC, appendc)
   $mtable_method(TCStringPrepend, prepend)
   $mtable_method(TCStringPrependC, prependc)
+  $mtable_method(TCStringSnapshot, snapshot)
+  $mtable_method(TCStringMemoryUsage, memory_usage)
 $mtable_end(TCString)
 
 $vtable(TCString, TObject)
@@ -63,6 +228,19 @@ $vtable_end(TCString)
   #define $cstr(s) $(TCString, (s), str)
 #endif
 
+/* Borrowing fast paths: no dispatch, no reference counting, type checks
+ * only in debug builds. Results must not be unref'd. */
+
+static inline const char* tc_string_str_fast(TCString* self) {
+  assert(self != NULL && $is(self, TCString));
+  return self->str;
+}
+
+static inline size_t tc_string_len_fast(TCString* self) {
+  assert(self != NULL && $is(self, TCString));
+  return self->len;
+}
+
 /*
  * TCListNode
  */
@@ -78,6 +256,7 @@ $class(TCListNode, TObject, _parent)
   $class_property(TCListNode*, prev)
   $class_property(TCListNode*, next)
   $class_property(TCList*, list)
+  $class_property(bool, borrowed)
 $class_end(TCListNode)
 
 $mtable(TCListNode)
@@ -89,6 +268,39 @@ $mtable_end(TCListNode)
 $vtable(TCListNode, TObject)
 $vtable_end(TCListNode)
 
+static inline TObject* tc_list_node_obj_borrowed(TCListNode* self) {
+  assert(self != NULL && $is(self, TCListNode));
+  return self->obj;
+}
+
+static inline TCListNode* tc_list_node_next_borrowed(TCListNode* self) {
+  assert(self != NULL && $is(self, TCListNode));
+  return self->next;
+}
+
+static inline TCListNode* tc_list_node_prev_borrowed(TCListNode* self) {
+  assert(self != NULL && $is(self, TCListNode));
+  return self->prev;
+}
+
+static inline TCIter tc_list_node_iter_begin(TCListNode* head) {
+  TCIter it = { head, 0, 0, 0 };
+  return it;
+}
+
+static inline bool tc_list_node_iter_done(const TCIter* it) {
+  return it->pos == NULL;
+}
+
+static inline void tc_list_node_iter_next(TCIter* it) {
+  TC_STATS_GLOBAL_ADD(iter_steps, 1);
+  it->pos = ((TCListNode*) it->pos)->next;
+}
+
+static inline TCListNode* tc_list_node_iter_node(const TCIter* it) {
+  return (TCListNode*) it->pos;
+}
+
 #define TC_LIST_LINK_NODES(l, r) if (l != NULL) { l->next = r; }; if (r != NULL) { r->prev = l; }
 #define TC_LIST_LINK_3_NODES(l, c, r) TC_LIST_LINK_NODES(l, c); TC_LIST_LINK_NODES(c, r)
 #define TC_LIST_UNLINK_NODE(n) if (n != NULL) { if (n->prev != NULL) { n->prev->next = NULL; }; n->prev = NULL; if (n->next != NULL) { n->next->prev = NULL; }; n->next = NULL; }
@@ -110,15 +322,28 @@ $vtable_end(TCListNode)
 
 typedef TCList* (*TCListConstructor)(TCList* self);
 typedef void (*TCListInitVTable)(TCListVTable* v);
+typedef size_t (*TCListMemoryUsage)(TCList* self, bool deep);
 typedef void (*TCListAppend)(TCList* self, TObject* obj);
 typedef void (*TCListPrepend)(TCList* self, TObject* obj);
 typedef TCListNode* (*TCListRemove)(TCList* self, TCListNode* n);
 typedef bool (*TCListIterator)(TCList* list, TCListNode* node, TObject* userdata);
 typedef void (*TCListForeach)(TCList* self, TCListIterator iter, TObject* userdata);
+typedef void (*TCListSplice)(TCList* self, TCList* other, TCListNode* first, TCListNode* last);
+typedef TCList* (*TCListSplitAt)(TCList* self, TCListNode* n);
+typedef void (*TCListConcat)(TCList* self, TCList* other);
+typedef int (*TCListCompare)(TObject* a, TObject* b, void* userdata);
+typedef void (*TCListSort)(TCList* self, TCListCompare cmp, void* userdata);
 
+/* `splice` moves the run first..last of `other` to the end of this list,
+ * `concat` moves all of `other`, and `split_at` moves n..tail into a new
+ * list. Nodes are relinked, never copied or re-ref'd; the only per-node
+ * work is repointing their `list`. `sort` is a stable bottom-up merge
+ * sort that relinks nodes in place. */
 $class(TCList, TObject, _parent)
   $class_property(TCListNode*, head)
   $class_property(TCListNode*, tail)
+  $class_property(size_t, len)
+  $class_property(bool, borrowed)
 $class_end(TCList)
 
 $mtable(TCList)
@@ -126,33 +351,69 @@ $mtable(TCList)
   $mtable_method(TCListPrepend, prepend)
   $mtable_method(TCListRemove, remove)
   $mtable_method(TCListForeach, foreach)
+  $mtable_method(TCListSplice, splice)
+  $mtable_method(TCListSplitAt, split_at)
+  $mtable_method(TCListConcat, concat)
+  $mtable_method(TCListSort, sort)
+  $mtable_method(TCListMemoryUsage, memory_usage)
 $mtable_end(TCList)
 
 $vtable(TCList, TObject)
 $vtable_end(TCList)
 
+static inline TCIter tc_list_iter_begin(TCList* self) {
+  assert(self != NULL && $is(self, TCList));
+  return tc_list_node_iter_begin(self->head);
+}
+
+static inline bool tc_list_iter_done(const TCIter* it) {
+  return tc_list_node_iter_done(it);
+}
+
+static inline void tc_list_iter_next(TCIter* it) {
+  tc_list_node_iter_next(it);
+}
+
+static inline TObject* tc_list_iter_current(const TCIter* it) {
+  return ((TCListNode*) it->pos)->obj;
+}
+
 /*
  * TCVector
  */
 
 typedef TCVector* (*TCVectorConstructor)(TCVector* self, size_t prealloc, size_t step);
 typedef void (*TCVectorInitVTable)(TCVectorVTable* v);
+typedef size_t (*TCVectorMemoryUsage)(TCVector* self, bool deep);
 typedef void (*TCVectorPush)(TCVector* self, TObject* obj);
+typedef void (*TCVectorPushMany)(TCVector* self, TObject* const* objs, size_t n);
 typedef TObject* (*TCVectorPop)(TCVector* self);
 typedef void (*TCVectorInsert)(TCVector* self, TObject* obj, size_t idx);
 typedef TObject* (*TCVectorGet)(TCVector* self, size_t idx);
 typedef void (*TCVectorRemove)(TCVector* self, size_t idx);
 typedef void (*TCVectorClear)(TCVector* self);
+typedef TCVector* (*TCVectorSnapshot)(TCVector* self);
 
+/* `snapshot` returns, in O(1), a new vector that shares self's array and
+ * the element references it holds (`shared` counts its holders). The
+ * first side to change its contents afterwards copies the array for
+ * itself, so `arr` must not be written to directly while it is shared. */
 $class(TCVector, TObject, _parent)
   $class_property(size_t, alloc)
   $class_property(size_t, step)
   $class_property(size_t, len)
   $class_property(TObject**, arr)
+  $class_property(struct TCShared*, shared)
+  $class_property(const TCAllocator*, allocator)
+  $class_property(bool, borrowed)
+#if defined(TC_STATS)
+  $class_property(TCStats, stats)
+#endif
 $class_end(TCVector)
 
 $mtable(TCVector)
   $mtable_method(TCVectorPush, push_back)
+  $mtable_method(TCVectorPushMany, push_back_many)
   $mtable_method(TCVectorPush, push_front)
   $mtable_method(TCVectorPop, pop_back)
   $mtable_method(TCVectorPop, pop_front)
@@ -160,17 +421,50 @@ $mtable(TCVector)
   $mtable_method(TCVectorGet, get)
   $mtable_method(TCVectorRemove, remove)
   $mtable_method(TCVectorClear, clear)
+  $mtable_method(TCVectorSnapshot, snapshot)
+  $mtable_method(TCVectorMemoryUsage, memory_usage)
 $mtable_end(TCVector)
 
 $vtable(TCVector, TObject)
 $vtable_end(TCVector)
 
+static inline size_t tc_vector_len_fast(TCVector* self) {
+  assert(self != NULL && $is(self, TCVector));
+  return self->len;
+}
+
+static inline TObject* tc_vector_at_borrowed(TCVector* self, size_t idx) {
+  assert(self != NULL && $is(self, TCVector));
+  assert(idx < self->len);
+  return self->arr[idx];
+}
+
+static inline TCIter tc_vector_iter_begin(TCVector* self) {
+  assert(self != NULL && $is(self, TCVector));
+  TCIter it = { self->arr, 0, self->len, 0 };
+  return it;
+}
+
+static inline bool tc_vector_iter_done(const TCIter* it) {
+  return it->idx >= it->end;
+}
+
+static inline void tc_vector_iter_next(TCIter* it) {
+  TC_STATS_GLOBAL_ADD(iter_steps, 1);
+  ++it->idx;
+}
+
+static inline TObject* tc_vector_iter_current(const TCIter* it) {
+  return ((TObject**) it->pos)[it->idx];
+}
+
 /*
  * TCQueue
  */
 
 typedef TCQueue* (*TCQueueConstructor)(TCQueue* self, size_t alloc);
 typedef void (*TCQueueInitVTable)(TCQueueVTable* v);
+typedef size_t (*TCQueueMemoryUsage)(TCQueue* self, bool deep);
 typedef bool (*TCQueuePush)(TCQueue* self, TObject* obj);
 typedef TObject* (*TCQueuePop)(TCQueue* self);
 typedef TObject* (*TCQueuePeek)(TCQueue* self);
@@ -181,17 +475,45 @@ $class(TCQueue, TObject, _parent)
   $class_property(size_t, size)
   $class_property(size_t, head)
   $class_property(size_t, tail)
+  $class_property(const TCAllocator*, allocator)
 $class_end(TCQueue)
 
 $mtable(TCQueue)
   $mtable_method(TCQueuePush, push)
   $mtable_method(TCQueuePop, pop)
   $mtable_method(TCQueuePeek, peek)
+  $mtable_method(TCQueueMemoryUsage, memory_usage)
 $mtable_end(TCQueue)
 
 $vtable(TCQueue, TObject)
 $vtable_end(TCQueue)
 
+static inline TObject* tc_queue_peek_borrowed(TCQueue* self) {
+  assert(self != NULL && $is(self, TCQueue));
+  return (self->size > 0 ? self->arr[self->head] : NULL);
+}
+
+/* Walks from the head (next to be popped) to the tail. */
+static inline TCIter tc_queue_iter_begin(TCQueue* self) {
+  assert(self != NULL && $is(self, TCQueue));
+  TCIter it = { self->arr, self->head, self->size, self->alloc };
+  return it;
+}
+
+static inline bool tc_queue_iter_done(const TCIter* it) {
+  return it->end == 0;
+}
+
+static inline void tc_queue_iter_next(TCIter* it) {
+  TC_STATS_GLOBAL_ADD(iter_steps, 1);
+  --it->end;
+  if (++it->idx == it->cap) it->idx = 0;
+}
+
+static inline TObject* tc_queue_iter_current(const TCIter* it) {
+  return ((TObject**) it->pos)[it->idx];
+}
+
 /*
  * TCMapPair
  */
@@ -206,6 +528,9 @@ $class(TCMapPair, TObject, _parent)
   $class_property(char*, key)
   $class_property(uint64_t, hash)
   $class_property(TObject*, value)
+  $class_property(TCPool*, pool)
+  $class_property(const TCAllocator*, allocator)
+  $class_property(bool, borrowed)
 $class_end(TCMapPair)
 
 $mtable(TCMapPair)
@@ -217,21 +542,66 @@ $mtable_end(TCMapPair)
 $vtable(TCMapPair, TObject)
 $vtable_end(TCMapPair)
 
+static inline TObject* tc_map_pair_get_borrowed(TCMapPair* self) {
+  assert(self != NULL && $is(self, TCMapPair));
+  return self->value;
+}
+
 /*
  * TCMap
  */
 
 typedef TCMap* (*TCMapConstructor)(TCMap* self);
 typedef void (*TCMapInitVTable)(TCMapVTable* v);
+typedef size_t (*TCMapMemoryUsage)(TCMap* self, bool deep);
 typedef TObject* (*TCMapGet)(TCMap* self, const char* key);
 typedef TObject* (*TCMapGetByHash)(TCMap* self, uint64_t hash);
 typedef void (*TCMapSet)(TCMap* self, const char* key, TObject* value);
 typedef void (*TCMapRename)(TCMap* self, const char* old_key, const char* new_key);
 typedef void (*TCMapRemove)(TCMap* self, const char* key);
 typedef void (*TCMapRemoveByHash)(TCMap* self, uint64_t hash);
+typedef void (*TCMapGetMany)(TCMap* self, const char* const* keys, size_t n, TObject** out);
+typedef void (*TCMapSetMany)(TCMap* self, const char* const* keys, TObject* const* values, size_t n);
+typedef TCFrozenMap* (*TCMapFreeze)(TCMap* self);
 
+typedef struct TCMapSlot {
+  struct TCMapSlot* chain;
+  uint64_t hash;
+  TCListNode* node;
+} TCMapSlot;
+
+typedef struct TCMapTable {
+  size_t mask;
+  size_t migrated;
+  TCMapSlot* buckets[];
+} TCMapTable;
+
+/* Pairs are kept in insertion order in `pairs` and indexed by key hash in
+ * `table`; `set` replaces the value of an existing key. When the table
+ * grows it is normally rehashed in one go. With `incremental` set, the
+ * previous table stays in `old_table` instead and every get, set or
+ * remove moves a few of its buckets over (keys whose old bucket has not
+ * moved yet are still found there), so no single call pays for the whole
+ * rehash.
+ *
+ * `get_many` and `set_many` work on a batch of keys at once: every key is
+ * hashed and its bucket prefetched before any of them is resolved, so the
+ * cache misses of a batch overlap instead of being paid one after another.
+ * `get_many` stores a new reference (or NULL) in `out[i]` for `keys[i]`.
+ * `freeze` returns a read-only TCFrozenMap of the current contents. */
 $class(TCMap, TObject, _parent)
   $class_property(TCList*, pairs)
+  $class_property(TCPool*, keys)
+  $class_property(TCPool*, slots)
+  $class_property(TCMapTable*, table)
+  $class_property(TCMapTable*, old_table)
+  $class_property(bool, incremental)
+  $class_property(TCJournal*, journal)
+  $class_property(const TCAllocator*, allocator)
+  $class_property(bool, borrowed)
+#if defined(TC_STATS)
+  $class_property(TCStats, stats)
+#endif
 $class_end(TCMap)
 
 $mtable(TCMap)
@@ -241,11 +611,33 @@ $mtable(TCMap)
   $mtable_method(TCMapRename, rename)
   $mtable_method(TCMapRemove, remove)
   $mtable_method(TCMapRemoveByHash, remove_by_hash)
+  $mtable_method(TCMapGetMany, get_many)
+  $mtable_method(TCMapSetMany, set_many)
+  $mtable_method(TCMapFreeze, freeze)
+  $mtable_method(TCMapMemoryUsage, memory_usage)
 $mtable_end(TCMap)
 
 $vtable(TCMap, TObject)
 $vtable_end(TCMap)
 
+/* Yields the map's TCMapPair objects in insertion order. */
+static inline TCIter tc_map_iter_begin(TCMap* self) {
+  assert(self != NULL && $is(self, TCMap));
+  return tc_list_node_iter_begin(self->pairs->head);
+}
+
+static inline bool tc_map_iter_done(const TCIter* it) {
+  return tc_list_node_iter_done(it);
+}
+
+static inline void tc_map_iter_next(TCIter* it) {
+  tc_list_node_iter_next(it);
+}
+
+static inline TCMapPair* tc_map_iter_current(const TCIter* it) {
+  return (TCMapPair*) ((TCListNode*) it->pos)->obj;
+}
+
 /*
  * TCHashRBTree
  */
@@ -290,12 +682,770 @@ $vtable_end(TCHashRBTree)
 
 typedef TCHash* (*TCHashConstructor)(TCHash* self);
 typedef void (*TCHashInitVTable)(TCHashVTable* v);
+typedef size_t (*TCHashMemoryUsage)(TCHash* self, bool deep);
+typedef TObject* (*TCHashGet)(TCHash* self, uint64_t hash);
+typedef void (*TCHashSet)(TCHash* self, uint64_t hash, TObject* value);
+typedef void (*TCHashBuildFromSorted)(TCHash* self, TCVector* sorted);
 
 $class(TCHash, TObject, _parent)
+  $class_property(TCHashRBTree*, root)
+  $class_property(size_t, size)
+  $class_property(TCJournal*, journal)
+#if defined(TC_STATS)
+  $class_property(TCStats, stats)
+#endif
 $class_end(TCHash)
 
 $mtable(TCHash)
+  $mtable_method(TCHashGet, get)
+  $mtable_method(TCHashSet, set)
+  $mtable_method(TCHashBuildFromSorted, build_from_sorted)
+  $mtable_method(TCHashMemoryUsage, memory_usage)
 $mtable_end(TCHash)
 
 $vtable(TCHash, TObject)
-$vtable_end(TCHash)
\ No newline at end of file
+$vtable_end(TCHash)
+
+/* Yields the tree nodes in ascending hash order. */
+static inline TCIter tc_hash_iter_begin(TCHash* self) {
+  assert(self != NULL && $is(self, TCHash));
+  TCHashRBTree* n = self->root;
+  while (n != NULL && n->left != NULL) n = n->left;
+  TCIter it = { n, 0, 0, 0 };
+  return it;
+}
+
+static inline bool tc_hash_iter_done(const TCIter* it) {
+  return it->pos == NULL;
+}
+
+static inline void tc_hash_iter_next(TCIter* it) {
+  TC_STATS_GLOBAL_ADD(iter_steps, 1);
+  TCHashRBTree* n = (TCHashRBTree*) it->pos;
+  if (n->right != NULL) {
+    n = n->right;
+    while (n->left != NULL) n = n->left;
+  } else {
+    while (n->top != NULL && n->top->right == n) n = n->top;
+    n = n->top;
+  }
+  it->pos = n;
+}
+
+static inline TCHashRBTree* tc_hash_iter_current(const TCIter* it) {
+  return (TCHashRBTree*) it->pos;
+}
+
+/*
+ * TCPool
+ */
+
+typedef TCPool* (*TCPoolConstructor)(TCPool* self, size_t block_size, size_t slab_blocks);
+typedef void (*TCPoolInitVTable)(TCPoolVTable* v);
+typedef size_t (*TCPoolMemoryUsage)(TCPool* self, bool deep);
+typedef void* (*TCPoolAlloc)(TCPool* self);
+typedef void (*TCPoolFree)(TCPool* self, void* block);
+typedef void (*TCPoolClear)(TCPool* self);
+
+$class(TCPool, TObject, _parent)
+  $class_property(size_t, block_size)
+  $class_property(size_t, slab_blocks)
+  $class_property(size_t, used)
+  $class_property(void*, slabs)
+  $class_property(void*, free_list)
+  $class_property(char*, cursor)
+  $class_property(char*, end)
+  $class_property(const TCAllocator*, allocator)
+$class_end(TCPool)
+
+$mtable(TCPool)
+  $mtable_method(TCPoolAlloc, alloc)
+  $mtable_method(TCPoolFree, free)
+  $mtable_method(TCPoolClear, clear)
+  $mtable_method(TCPoolMemoryUsage, memory_usage)
+$mtable_end(TCPool)
+
+$vtable(TCPool, TObject)
+$vtable_end(TCPool)
+
+/*
+ * TCArena
+ */
+
+typedef TCArena* (*TCArenaConstructor)(TCArena* self, size_t chunk_size);
+typedef void (*TCArenaInitVTable)(TCArenaVTable* v);
+typedef size_t (*TCArenaMemoryUsage)(TCArena* self, bool deep);
+typedef void* (*TCArenaAlloc)(TCArena* self, size_t size);
+typedef void (*TCArenaReset)(TCArena* self);
+
+$class(TCArena, TObject, _parent)
+  $class_property(size_t, chunk_size)
+  $class_property(void*, chunks)
+  $class_property(void*, current)
+  $class_property(char*, cursor)
+  $class_property(char*, end)
+  $class_property(char*, last)
+  $class_property(TCAllocator, allocator)
+$class_end(TCArena)
+
+$mtable(TCArena)
+  $mtable_method(TCArenaAlloc, alloc)
+  $mtable_method(TCArenaReset, reset)
+  $mtable_method(TCArenaMemoryUsage, memory_usage)
+$mtable_end(TCArena)
+
+$vtable(TCArena, TObject)
+$vtable_end(TCArena)
+
+/*
+ * TCIntrusiveList
+ */
+
+typedef struct TCListLink {
+  struct TCListLink* prev;
+  struct TCListLink* next;
+  TCIntrusiveList* list;
+} TCListLink;
+
+#define TC_LIST_LINK_INIT(l) do { (l)->prev = NULL; (l)->next = NULL; (l)->list = NULL; } while (0)
+#define TC_LIST_ENTRY(link, type, member) ((type*) ((char*) (link) - offsetof(type, member)))
+
+#ifndef TINY2C_NO_SHORTCUT
+  #define $LIST_LINK_INIT TC_LIST_LINK_INIT
+  #define $list_link_init TC_LIST_LINK_INIT
+
+  #define $LIST_ENTRY TC_LIST_ENTRY
+  #define $list_entry TC_LIST_ENTRY
+#endif
+
+typedef TCIntrusiveList* (*TCIntrusiveListConstructor)(TCIntrusiveList* self, size_t offset);
+typedef void (*TCIntrusiveListInitVTable)(TCIntrusiveListVTable* v);
+typedef size_t (*TCIntrusiveListMemoryUsage)(TCIntrusiveList* self, bool deep);
+typedef void (*TCIntrusiveListAppend)(TCIntrusiveList* self, TObject* obj);
+typedef void (*TCIntrusiveListPrepend)(TCIntrusiveList* self, TObject* obj);
+typedef bool (*TCIntrusiveListRemove)(TCIntrusiveList* self, TObject* obj);
+typedef bool (*TCIntrusiveListContains)(TCIntrusiveList* self, TObject* obj);
+typedef bool (*TCIntrusiveListIterator)(TCIntrusiveList* list, TObject* obj, void* userdata);
+typedef void (*TCIntrusiveListForeach)(TCIntrusiveList* self, TCIntrusiveListIterator iter, void* userdata);
+
+/* Links objects through a TCListLink embedded at `offset` bytes into each
+ * element (see TC_LIST_ENTRY), so an object can sit on several lists at
+ * once without a node allocation per membership. */
+$class(TCIntrusiveList, TObject, _parent)
+  $class_property(TCListLink*, head)
+  $class_property(TCListLink*, tail)
+  $class_property(size_t, offset)
+  $class_property(size_t, len)
+  $class_property(bool, borrowed)
+$class_end(TCIntrusiveList)
+
+$mtable(TCIntrusiveList)
+  $mtable_method(TCIntrusiveListAppend, append)
+  $mtable_method(TCIntrusiveListPrepend, prepend)
+  $mtable_method(TCIntrusiveListRemove, remove)
+  $mtable_method(TCIntrusiveListContains, contains)
+  $mtable_method(TCIntrusiveListForeach, foreach)
+  $mtable_method(TCIntrusiveListMemoryUsage, memory_usage)
+$mtable_end(TCIntrusiveList)
+
+$vtable(TCIntrusiveList, TObject)
+$vtable_end(TCIntrusiveList)
+
+static inline TObject* tc_intrusive_list_obj(TCIntrusiveList* self, TCListLink* link) {
+  assert(self != NULL && $is(self, TCIntrusiveList));
+  return (link != NULL ? (TObject*) ((char*) link - self->offset) : NULL);
+}
+
+static inline TCIter tc_intrusive_list_iter_begin(TCIntrusiveList* self) {
+  assert(self != NULL && $is(self, TCIntrusiveList));
+  TCIter it = { self->head, 0, self->offset, 0 };
+  return it;
+}
+
+static inline bool tc_intrusive_list_iter_done(const TCIter* it) {
+  return it->pos == NULL;
+}
+
+static inline void tc_intrusive_list_iter_next(TCIter* it) {
+  TC_STATS_GLOBAL_ADD(iter_steps, 1);
+  it->pos = ((TCListLink*) it->pos)->next;
+}
+
+static inline TObject* tc_intrusive_list_iter_current(const TCIter* it) {
+  return (TObject*) ((char*) it->pos - it->end);
+}
+
+/*
+ * TCChunkList
+ */
+
+#ifndef TC_CHUNK_LIST_K
+#define TC_CHUNK_LIST_K 30
+#endif
+
+typedef struct TCChunk {
+  struct TCChunk* prev;
+  struct TCChunk* next;
+  size_t len;
+  TObject* items[TC_CHUNK_LIST_K];
+} TCChunk;
+
+typedef TCChunkList* (*TCChunkListConstructor)(TCChunkList* self);
+typedef void (*TCChunkListInitVTable)(TCChunkListVTable* v);
+typedef size_t (*TCChunkListMemoryUsage)(TCChunkList* self, bool deep);
+typedef void (*TCChunkListAppend)(TCChunkList* self, TObject* obj);
+typedef void (*TCChunkListPrepend)(TCChunkList* self, TObject* obj);
+typedef TCChunk* (*TCChunkListRemove)(TCChunkList* self, TCChunk* chunk, size_t idx);
+typedef bool (*TCChunkListIterator)(TCChunkList* list, TObject* obj, void* userdata);
+typedef size_t (*TCChunkListRemoveIf)(TCChunkList* self, TCChunkListIterator pred, void* userdata);
+typedef void (*TCChunkListForeach)(TCChunkList* self, TCChunkListIterator iter, void* userdata);
+
+/* Unrolled list: up to TC_CHUNK_LIST_K element pointers per pooled chunk.
+ * Chunks merge with their successor once they drop below half full, so
+ * `remove` returns the chunk in which the following element now sits at
+ * `idx` (or, when `idx` reaches its len, at the start of the next chunk). */
+$class(TCChunkList, TObject, _parent)
+  $class_property(TCChunk*, head)
+  $class_property(TCChunk*, tail)
+  $class_property(size_t, len)
+  $class_property(TCPool*, chunks)
+  $class_property(bool, borrowed)
+$class_end(TCChunkList)
+
+$mtable(TCChunkList)
+  $mtable_method(TCChunkListAppend, append)
+  $mtable_method(TCChunkListPrepend, prepend)
+  $mtable_method(TCChunkListRemove, remove)
+  $mtable_method(TCChunkListRemoveIf, remove_if)
+  $mtable_method(TCChunkListForeach, foreach)
+  $mtable_method(TCChunkListMemoryUsage, memory_usage)
+$mtable_end(TCChunkList)
+
+$vtable(TCChunkList, TObject)
+$vtable_end(TCChunkList)
+
+static inline TCIter tc_chunk_list_iter_begin(TCChunkList* self) {
+  assert(self != NULL && $is(self, TCChunkList));
+  TCIter it = { self->head, 0, 0, 0 };
+  return it;
+}
+
+static inline bool tc_chunk_list_iter_done(const TCIter* it) {
+  return it->pos == NULL;
+}
+
+static inline void tc_chunk_list_iter_next(TCIter* it) {
+  TC_STATS_GLOBAL_ADD(iter_steps, 1);
+  TCChunk* c = (TCChunk*) it->pos;
+  if (++it->idx == c->len) {
+    it->pos = c->next;
+    it->idx = 0;
+  }
+}
+
+static inline TObject* tc_chunk_list_iter_current(const TCIter* it) {
+  return ((TCChunk*) it->pos)->items[it->idx];
+}
+
+/*
+ * TCPipe
+ */
+
+#ifndef TC_PIPE_MAX_STAGES
+#define TC_PIPE_MAX_STAGES 8
+#endif
+
+#ifndef TC_PIPE_MAX_SOURCES
+#define TC_PIPE_MAX_SOURCES 4
+#endif
+
+typedef bool (*TCPipePred)(TObject* obj, void* userdata);
+typedef TObject* (*TCPipeMap)(TObject* obj, void* userdata);
+typedef TObject* (*TCPipeZip)(TObject* a, TObject* b, void* userdata);
+typedef void (*TCPipeReduce)(void* acc, TObject* obj);
+
+typedef struct TCPipeSource {
+  TCIter it;
+  bool (*done)(const TCIter* it);
+  void (*next)(TCIter* it);
+  TObject* (*current)(const TCIter* it);
+} TCPipeSource;
+
+TCPipeSource tc_pipe_source_vector(TCVector* v);
+TCPipeSource tc_pipe_source_list(TCList* l);
+TCPipeSource tc_pipe_source_queue(TCQueue* q);
+TCPipeSource tc_pipe_source_map(TCMap* m);
+TCPipeSource tc_pipe_source_hash(TCHash* h);
+TCPipeSource tc_pipe_source_intrusive_list(TCIntrusiveList* l);
+TCPipeSource tc_pipe_source_chunk_list(TCChunkList* l);
+
+typedef enum TCPipeOp {
+  TC_PIPE_FILTER,
+  TC_PIPE_MAP,
+  TC_PIPE_TAKE,
+  TC_PIPE_SKIP,
+  TC_PIPE_ZIP
+} TCPipeOp;
+
+typedef struct TCPipeStage {
+  TCPipeOp op;
+  union {
+    TCPipePred pred;
+    TCPipeMap map;
+    TCPipeZip zip;
+  } fn;
+  void* userdata;
+  size_t n;
+  bool owned;
+  TCPipeSource other;
+} TCPipeStage;
+
+/* A lazy pipeline over container cursors. Stages run fused, one element at
+ * a time, and nothing is materialized between them:
+ *
+ *   TCPipe p;
+ *   tc_pipe_init(&p, tc_pipe_source_vector(v));
+ *   tc_pipe_collect_into(tc_pipe_map(tc_pipe_filter(&p, keep, NULL), render, NULL, true), out);
+ *
+ * Elements are borrowed from the sources. A map or zip stage marked `owned`
+ * returns a new reference, which the pipeline drops once the element has
+ * left it. Elements handed out by tc_pipe_next stay valid until the next
+ * tc_pipe_next or tc_pipe_end call. Sources added with tc_pipe_chain are
+ * walked one after another and must be added before any stage. */
+typedef struct TCPipe {
+  TCPipeSource sources[TC_PIPE_MAX_SOURCES];
+  size_t n_sources;
+  size_t cur_source;
+  TCPipeStage stages[TC_PIPE_MAX_STAGES];
+  size_t n_stages;
+  TObject* held[TC_PIPE_MAX_STAGES];
+  size_t n_held;
+  bool done;
+} TCPipe;
+
+TCPipe* tc_pipe_init(TCPipe* p, TCPipeSource src);
+TCPipe* tc_pipe_chain(TCPipe* p, TCPipeSource src);
+TCPipe* tc_pipe_filter(TCPipe* p, TCPipePred fn, void* userdata);
+TCPipe* tc_pipe_map(TCPipe* p, TCPipeMap fn, void* userdata, bool owned);
+TCPipe* tc_pipe_take(TCPipe* p, size_t n);
+TCPipe* tc_pipe_skip(TCPipe* p, size_t n);
+TCPipe* tc_pipe_zip(TCPipe* p, TCPipeSource other, TCPipeZip fn, void* userdata, bool owned);
+
+bool tc_pipe_next(TCPipe* p, TObject** out);
+void tc_pipe_end(TCPipe* p);
+
+/* Terminal operations; each drains the pipeline and ends it. */
+size_t tc_pipe_collect_into(TCPipe* p, TCVector* dst);
+void tc_pipe_reduce(TCPipe* p, TCPipeReduce fn, void* acc);
+size_t tc_pipe_count(TCPipe* p);
+
+/* Splits a single vector source across `threads` workers when every stage
+ * is a filter or map, and appends the results to `dst` in source order.
+ * Stage callbacks then run concurrently and must not create objects. It
+ * falls back to tc_pipe_collect_into for other pipelines, and when the
+ * library is built without TC_THREADSAFE_REFCOUNT. */
+size_t tc_pipe_collect_into_parallel(TCPipe* p, TCVector* dst, size_t threads);
+
+/*
+ * TCCache
+ */
+
+typedef enum TCCachePolicy {
+  TC_CACHE_LRU,
+  TC_CACHE_SIEVE
+} TCCachePolicy;
+
+typedef struct TCCacheEntry {
+  struct TCCacheEntry* chain;
+  struct TCCacheEntry* prev;
+  struct TCCacheEntry* next;
+  uint64_t hash;
+  char* key;
+  TObject* value;
+  size_t cost;
+  bool visited;
+} TCCacheEntry;
+
+typedef size_t (*TCCacheCost)(TObject* value, void* userdata);
+typedef void (*TCCacheEvict)(TCCache* cache, const char* key, TObject* value, void* userdata);
+
+typedef TCCache* (*TCCacheConstructor)(TCCache* self, TCCachePolicy policy, size_t capacity);
+typedef void (*TCCacheInitVTable)(TCCacheVTable* v);
+typedef size_t (*TCCacheMemoryUsage)(TCCache* self, bool deep);
+typedef TObject* (*TCCacheGet)(TCCache* self, const char* key);
+typedef bool (*TCCachePut)(TCCache* self, const char* key, TObject* value);
+typedef bool (*TCCacheRemove)(TCCache* self, const char* key);
+typedef void (*TCCacheClear)(TCCache* self);
+
+/* Bounded key/value cache. `capacity` is a number of entries, or a budget
+ * in whatever unit `cost` returns when it is set (set `cost` and
+ * `on_evict` before the first put). LRU evicts the least recently used
+ * entry; SIEVE, a CLOCK variant, only marks entries on a hit and sweeps a
+ * hand from the oldest insert, so hits never relink. `put` returns false
+ * when a single entry costs more than the whole capacity; any entry
+ * already under that key is removed. */
+$class(TCCache, TObject, _parent)
+  $class_property(TCCachePolicy, policy)
+  $class_property(size_t, capacity)
+  $class_property(size_t, used)
+  $class_property(size_t, size)
+  $class_property(TCCacheEntry**, buckets)
+  $class_property(size_t, n_buckets)
+  $class_property(unsigned, shift)
+  $class_property(TCCacheEntry*, head)
+  $class_property(TCCacheEntry*, tail)
+  $class_property(TCCacheEntry*, hand)
+  $class_property(TCPool*, entries)
+  $class_property(TCCacheCost, cost)
+  $class_property(void*, cost_userdata)
+  $class_property(TCCacheEvict, on_evict)
+  $class_property(void*, evict_userdata)
+  $class_property(size_t, hits)
+  $class_property(size_t, misses)
+  $class_property(size_t, evictions)
+  $class_property(const TCAllocator*, allocator)
+  $class_property(bool, borrowed)
+$class_end(TCCache)
+
+$mtable(TCCache)
+  $mtable_method(TCCacheGet, get)
+  $mtable_method(TCCachePut, put)
+  $mtable_method(TCCacheRemove, remove)
+  $mtable_method(TCCacheClear, clear)
+  $mtable_method(TCCacheMemoryUsage, memory_usage)
+$mtable_end(TCCache)
+
+$vtable(TCCache, TObject)
+$vtable_end(TCCache)
+
+/*
+ * TCPersistentMapNode
+ */
+
+/* A slot holds either a key and its value or, with `key` NULL, a child. */
+typedef struct TCPersistentMapSlot {
+  uint64_t hash;
+  TCString* key;
+  TObject* value;
+  TCPersistentMapNode* child;
+} TCPersistentMapSlot;
+
+typedef TCPersistentMapNode* (*TCPersistentMapNodeConstructor)(TCPersistentMapNode* self, size_t cap);
+typedef void (*TCPersistentMapNodeInitVTable)(TCPersistentMapNodeVTable* v);
+
+/* One level of a TCPersistentMap trie. `bitmap` has a bit set for every
+ * 5-bit hash digit present at this level and `slots` holds them in digit
+ * order; below the last digit, nodes keep colliding keys unordered. Nodes
+ * are shared between map versions, and only the edit that created one
+ * (`edit`) may change it in place. */
+$class(TCPersistentMapNode, TObject, _parent)
+  $class_property(uint32_t, bitmap)
+  $class_property(uint32_t, len)
+  $class_property(uint32_t, cap)
+  $class_property(uint64_t, edit)
+  $class_property(TCPersistentMapSlot*, slots)
+  $class_property(const TCAllocator*, allocator)
+  $class_property(bool, borrowed)
+$class_end(TCPersistentMapNode)
+
+$mtable(TCPersistentMapNode)
+$mtable_end(TCPersistentMapNode)
+
+$vtable(TCPersistentMapNode, TObject)
+$vtable_end(TCPersistentMapNode)
+
+/*
+ * TCPersistentMap
+ */
+
+typedef bool (*TCPersistentMapIterator)(TCPersistentMap* map, const char* key, TObject* value, void* userdata);
+
+typedef TCPersistentMap* (*TCPersistentMapConstructor)(TCPersistentMap* self);
+typedef void (*TCPersistentMapInitVTable)(TCPersistentMapVTable* v);
+typedef size_t (*TCPersistentMapMemoryUsage)(TCPersistentMap* self, bool deep);
+typedef TObject* (*TCPersistentMapGet)(TCPersistentMap* self, const char* key);
+typedef TCPersistentMap* (*TCPersistentMapSet)(TCPersistentMap* self, const char* key, TObject* value);
+typedef TCPersistentMap* (*TCPersistentMapRemove)(TCPersistentMap* self, const char* key);
+typedef TCPersistentMap* (*TCPersistentMapEdit)(TCPersistentMap* self);
+typedef void (*TCPersistentMapSetMut)(TCPersistentMap* self, const char* key, TObject* value);
+typedef bool (*TCPersistentMapRemoveMut)(TCPersistentMap* self, const char* key);
+typedef void (*TCPersistentMapFreeze)(TCPersistentMap* self);
+typedef void (*TCPersistentMapForeach)(TCPersistentMap* self, TCPersistentMapIterator iter, void* userdata);
+
+/* Immutable string-keyed map, a hash array mapped trie. `set` and
+ * `remove` leave self untouched and return a new version (a new
+ * reference) that copies only the O(log32 n) nodes on the key's path and
+ * shares every other node, key and value with self through reference
+ * counts; a version is never changed once published, so readers only
+ * need their own reference to it.
+ *
+ * For bulk building, `edit` returns a transient copy: `set_mut` and
+ * `remove_mut` change it in place, copying a shared node only the first
+ * time the edit touches it, and `freeze` turns it into an ordinary
+ * immutable version. `get` and `foreach` work on a transient; `set`,
+ * `remove` and `edit` need a frozen map. */
+$class(TCPersistentMap, TObject, _parent)
+  $class_property(TCPersistentMapNode*, root)
+  $class_property(size_t, count)
+  $class_property(uint64_t, edit)
+  $class_property(const TCAllocator*, allocator)
+  $class_property(bool, borrowed)
+$class_end(TCPersistentMap)
+
+$mtable(TCPersistentMap)
+  $mtable_method(TCPersistentMapGet, get)
+  $mtable_method(TCPersistentMapSet, set)
+  $mtable_method(TCPersistentMapRemove, remove)
+  $mtable_method(TCPersistentMapEdit, edit)
+  $mtable_method(TCPersistentMapSetMut, set_mut)
+  $mtable_method(TCPersistentMapRemoveMut, remove_mut)
+  $mtable_method(TCPersistentMapFreeze, freeze)
+  $mtable_method(TCPersistentMapForeach, foreach)
+  $mtable_method(TCPersistentMapMemoryUsage, memory_usage)
+$mtable_end(TCPersistentMap)
+
+$vtable(TCPersistentMap, TObject)
+$vtable_end(TCPersistentMap)
+
+/*
+ * TCFrozenMap
+ */
+
+typedef struct TCFrozenMapEntry {
+  uint64_t hash;
+  TObject* value;
+  const char* key;
+} TCFrozenMapEntry;
+
+typedef TCFrozenMap* (*TCFrozenMapConstructor)(TCFrozenMap* self, TCMap* map);
+typedef void (*TCFrozenMapInitVTable)(TCFrozenMapVTable* v);
+typedef size_t (*TCFrozenMapMemoryUsage)(TCFrozenMap* self, bool deep);
+typedef TObject* (*TCFrozenMapGet)(TCFrozenMap* self, const char* key);
+
+/* Read-only map built from a TCMap, indexed by a minimal perfect hash
+ * (CHD, hash and displace): keys are hashed into `n_buckets` buckets of
+ * about three, and each bucket's `pilots` entry picks the displacement
+ * that sends its keys to distinct, unused slots of `entries`, which has
+ * exactly `len` slots. A lookup reads one pilot and one entry and
+ * compares the stored key, so a key that was never added returns NULL.
+ * Keys live in one `keys` block; values are referenced as in the source
+ * map. */
+$class(TCFrozenMap, TObject, _parent)
+  $class_property(size_t, len)
+  $class_property(size_t, n_buckets)
+  $class_property(uint64_t, seed)
+  $class_property(uint32_t*, pilots)
+  $class_property(TCFrozenMapEntry*, entries)
+  $class_property(char*, keys)
+  $class_property(size_t, keys_size)
+  $class_property(const TCAllocator*, allocator)
+  $class_property(bool, borrowed)
+$class_end(TCFrozenMap)
+
+$mtable(TCFrozenMap)
+  $mtable_method(TCFrozenMapGet, get)
+  $mtable_method(TCFrozenMapMemoryUsage, memory_usage)
+$mtable_end(TCFrozenMap)
+
+$vtable(TCFrozenMap, TObject)
+$vtable_end(TCFrozenMap)
+
+/*
+ * Serialization
+ */
+
+#define TC_SERIAL_VERSION 2
+#define TC_WRITER_BUFFER 4096
+
+typedef enum TCSerialType {
+  TC_SERIAL_NONE,
+  TC_SERIAL_STRING,
+  TC_SERIAL_VECTOR,
+  TC_SERIAL_MAP,
+  TC_SERIAL_FROZEN_MAP
+} TCSerialType;
+
+/* Receives the writer's output in order; returns false to abort. */
+typedef bool (*TCWriterSink)(void* ctx, const void* data, size_t len);
+
+/* Streaming writer for the binary container format. Records go out as
+ * they are put, children before the records that refer to them, so
+ * nothing but the current buffer is held in memory and the sink never
+ * has to seek. Every put returns the record's offset in the output (0
+ * stands for NULL), which later vectors and maps refer to; the format is
+ * finished by a trailer naming the root record and a checksum of all
+ * records. Records are 8-byte aligned and offsets are native-endian, so
+ * a file is only loadable on a machine with the writer's byte order.
+ *
+ *   TCWriter w;
+ *   tc_writer_init(&w, sink, ctx);
+ *   uint64_t root = tc_writer_put(&w, (TObject*) map);
+ *   bool ok = tc_writer_finish(&w, root);
+ */
+typedef struct TCWriter {
+  TCWriterSink sink;
+  void* ctx;
+  uint64_t offset;
+  uint64_t checksum;
+  bool failed;
+  size_t buffered;
+  uint8_t buf[TC_WRITER_BUFFER];
+} TCWriter;
+
+void tc_writer_init(TCWriter* w, TCWriterSink sink, void* ctx);
+uint64_t tc_writer_put_string(TCWriter* w, const char* str, size_t len);
+uint64_t tc_writer_put_vector(TCWriter* w, const uint64_t* items, size_t n);
+/* `values` are offsets of records already put; the keys are written here. */
+uint64_t tc_writer_put_map(TCWriter* w, const char* const* keys, const uint64_t* values, size_t n);
+/* Puts a TCString, or a TCVector, TCMap or TCFrozenMap together with
+ * everything it holds. Fails the writer on elements of any other type. A
+ * TCFrozenMap is stored with its perfect hash, so loading it back or
+ * looking keys up in the mapping needs no rebuild. */
+uint64_t tc_writer_put(TCWriter* w, TObject* obj);
+bool tc_writer_finish(TCWriter* w, uint64_t root);
+bool tc_serialize_file(const char* path, TObject* obj);
+
+/* Read-only view of a serialized file. `tc_mapped_open` maps the file
+ * (reading it in where mmap is unavailable) and the tc_mapped_* accessors
+ * work on record offsets directly over its bytes: nothing is allocated
+ * per element, and strings point into the mapping. `verify` also checks
+ * the checksum, which reads the whole file. `tc_mapped_load` builds
+ * ordinary containers from a record when they are needed. `data` must be
+ * 8-byte aligned. Accessors bounds-check every record they read, so an
+ * offset that is out of range or points at a corrupt record reads as
+ * missing (0, NULL or TC_SERIAL_NONE), and `tc_mapped_load` returns NULL
+ * when anything under the record is corrupt. */
+typedef struct TCMapped {
+  const uint8_t* data;
+  size_t size;
+  uint64_t root;
+  bool mapped;
+  bool owned;
+} TCMapped;
+
+bool tc_mapped_open(TCMapped* m, const char* path, bool verify);
+bool tc_mapped_open_memory(TCMapped* m, const void* data, size_t size, bool verify);
+void tc_mapped_close(TCMapped* m);
+TCSerialType tc_mapped_type(const TCMapped* m, uint64_t off);
+const char* tc_mapped_string(const TCMapped* m, uint64_t off, size_t* len);
+size_t tc_mapped_len(const TCMapped* m, uint64_t off);
+uint64_t tc_mapped_vector_at(const TCMapped* m, uint64_t off, size_t idx);
+/* Works on maps and frozen maps. Returns the value's offset, or 0 when
+ * the key is absent. */
+uint64_t tc_mapped_map_get(const TCMapped* m, uint64_t off, const char* key);
+/* Entries are kept in the order the map was written in; a frozen map's
+ * are in slot order. */
+void tc_mapped_map_entry(const TCMapped* m, uint64_t off, size_t idx, uint64_t* key, uint64_t* value);
+TObject* tc_mapped_load(const TCMapped* m, uint64_t off);
+
+/*
+ * TCJournal
+ */
+
+struct TCJournalCompaction;
+
+typedef TCJournal* (*TCJournalConstructor)(TCJournal* self, const char* path);
+typedef void (*TCJournalInitVTable)(TCJournalVTable* v);
+typedef bool (*TCJournalOpen)(TCJournal* self, TObject* container);
+typedef bool (*TCJournalCommit)(TCJournal* self);
+typedef bool (*TCJournalCompact)(TCJournal* self);
+
+/* Write-ahead log that makes a TCMap or TCHash durable. `open` loads the
+ * last snapshot (`<path>.snap`) and replays the log (`<path>.log`) into
+ * an empty container, then attaches itself: from then on every set,
+ * remove and rename the container performs is appended as a record with
+ * a sequence number (`lsn`) and a checksum.
+ *
+ * Records are buffered and written out with a single fsync per
+ * `commit_every` records (group commit) or whenever `commit` is called;
+ * a mutation is durable once `committed_lsn` has reached its lsn. When
+ * the log outgrows `compact_size` bytes (0 turns this off), or on
+ * `compact`, the container is serialized in memory and new records go to
+ * a fresh log, while the snapshot is written and swapped in - on a
+ * background thread when built with TC_THREADSAFE_REFCOUNT. Snapshots
+ * record the lsn they cover, so a crash at any step recovers to the last
+ * committed record. Values are recorded as they are when set and must
+ * be NULL or serializable (see TCWriter); a value that is not, or a
+ * failed write, sets `failed` and makes `commit` return false. TCHash
+ * keys are recorded as numbers. The journal keeps its container alive
+ * until it is released. */
+$class(TCJournal, TObject, _parent)
+  $class_property(char*, path)
+  $class_property(TObject*, container)
+  $class_property(FILE*, log)
+  $class_property(uint8_t*, buf)
+  $class_property(size_t, buf_len)
+  $class_property(size_t, buf_cap)
+  $class_property(uint64_t, lsn)
+  $class_property(uint64_t, committed_lsn)
+  $class_property(size_t, commit_every)
+  $class_property(size_t, pending)
+  $class_property(uint64_t, log_size)
+  $class_property(uint64_t, compact_size)
+  $class_property(struct TCJournalCompaction*, compaction)
+  $class_property(bool, failed)
+$class_end(TCJournal)
+
+$mtable(TCJournal)
+  $mtable_method(TCJournalOpen, open)
+  $mtable_method(TCJournalCommit, commit)
+  $mtable_method(TCJournalCompact, compact)
+$mtable_end(TCJournal)
+
+$vtable(TCJournal, TObject)
+$vtable_end(TCJournal)
+
+/*
+ * TCConcurrentHash
+ */
+
+#if defined(TC_THREADSAFE_REFCOUNT)
+
+struct TCConcurrentHashShard;
+
+typedef TObject* (*TCConcurrentHashCompute)(const char* key, void* userdata);
+typedef void (*TCConcurrentHashVisitor)(TObject* value, void* userdata);
+
+typedef TCConcurrentHash* (*TCConcurrentHashConstructor)(TCConcurrentHash* self, size_t shards);
+typedef void (*TCConcurrentHashInitVTable)(TCConcurrentHashVTable* v);
+typedef size_t (*TCConcurrentHashMemoryUsage)(TCConcurrentHash* self, bool deep);
+typedef TObject* (*TCConcurrentHashGet)(TCConcurrentHash* self, const char* key);
+typedef bool (*TCConcurrentHashVisit)(TCConcurrentHash* self, const char* key, TCConcurrentHashVisitor fn, void* userdata);
+typedef void (*TCConcurrentHashPut)(TCConcurrentHash* self, const char* key, TObject* value);
+typedef bool (*TCConcurrentHashRemove)(TCConcurrentHash* self, const char* key);
+typedef TObject* (*TCConcurrentHashComputeIfAbsent)(TCConcurrentHash* self, const char* key, TCConcurrentHashCompute fn, void* userdata);
+typedef size_t (*TCConcurrentHashSize)(TCConcurrentHash* self);
+
+/* Hash map that any number of threads may use at once. Keys are hashed to
+ * one of `n_shards` shards, each with its own bucket table and spinlock;
+ * writers take only their shard's lock. Readers take no lock: they walk
+ * the chains under an epoch guard, retrying when a resize step moved
+ * nodes underneath them, and unlinked nodes and replaced values are only
+ * released once no reader can still see them. A shard that outgrows its
+ * table migrates a few buckets on every write instead of all at once.
+ *
+ * `get` and `compute_if_absent` return a new reference; `visit` runs `fn`
+ * on the borrowed value without touching refcounts, which is the cheaper
+ * read. `compute_if_absent` calls `fn` under the shard lock, and `fn`
+ * returns a new reference that the map adopts. Memory comes from malloc,
+ * not from the default TCAllocator. */
+$class(TCConcurrentHash, TObject, _parent)
+  $class_property(struct TCConcurrentHashShard*, shards)
+  $class_property(size_t, n_shards)
+  $class_property(unsigned, shard_shift)
+$class_end(TCConcurrentHash)
+
+$mtable(TCConcurrentHash)
+  $mtable_method(TCConcurrentHashGet, get)
+  $mtable_method(TCConcurrentHashVisit, visit)
+  $mtable_method(TCConcurrentHashPut, put)
+  $mtable_method(TCConcurrentHashRemove, remove)
+  $mtable_method(TCConcurrentHashComputeIfAbsent, compute_if_absent)
+  $mtable_method(TCConcurrentHashSize, size)
+  $mtable_method(TCConcurrentHashMemoryUsage, memory_usage)
+$mtable_end(TCConcurrentHash)
+
+$vtable(TCConcurrentHash, TObject)
+$vtable_end(TCConcurrentHash)
+
+#endif